@@ -0,0 +1,314 @@
+/*
+ * ctokenize.c
+ *
+ * libctokenize: reentrant lossless C lexer (see ctokenize.h).
+ * We do minimal C lexing: identifiers/keywords, numbers, strings, chars,
+ * preprocessor lines (with backslash continuations), comments, whitespace,
+ * newlines, and punctuators/operators (longest-match).
+ */
+#include "ctokenize.h"
+
+#include <string.h>
+#include <ctype.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CT_SSE2 1
+#endif
+
+/* ---------- Keyword table (C11) ---------- */
+static const char *C_KEYWORDS[] = {
+    "auto","break","case","char","const","continue","default","do","double",
+    "else","enum","extern","float","for","goto","if","inline","int","long",
+    "register","restrict","return","short","signed","sizeof","static","struct",
+    "switch","typedef","union","unsigned","void","volatile","while","_Alignas",
+    "_Alignof","_Atomic","_Bool","_Complex","_Generic","_Imaginary","_Noreturn",
+    "_Static_assert","_Thread_local"
+};
+int ct_is_keyword(const char *s, size_t n) {
+    for (size_t i=0;i<sizeof(C_KEYWORDS)/sizeof(C_KEYWORDS[0]);++i) {
+        const char *k = C_KEYWORDS[i];
+        if (strlen(k)==n && memcmp(k,s,n)==0) return 1;
+    }
+    return 0;
+}
+
+/* ---------- Token kinds ---------- */
+const char *ct_kind_name(CtKind k) {
+    switch (k) {
+        case CT_WS: return "WS";
+        case CT_NEWLINE: return "NEWLINE";
+        case CT_LINE_COMMENT: return "LINE_COMMENT";
+        case CT_BLOCK_COMMENT: return "BLOCK_COMMENT";
+        case CT_PREPROC: return "PREPROC";
+        case CT_IDENT: return "IDENT";
+        case CT_KEYWORD: return "KEYWORD";
+        case CT_NUMBER: return "NUMBER";
+        case CT_STRING: return "STRING";
+        case CT_CHAR: return "CHAR";
+        case CT_PUNCT: return "PUNCT";
+    }
+    return "UNK";
+}
+
+/* ---------- Punctuator matching ---------- */
+static int is_punct_char(int c) {
+    const char *p = "{}[]()#;,:?~!%^&*-+=|<>./";
+    return (c && strchr(p, c)!=NULL);
+}
+static size_t match_punct(const unsigned char *s, size_t n) {
+    if (n==0) return 0;
+    /* Try 3-char punctuators */
+    if (n>=3) {
+        if (!memcmp(s,"<<=",3) || !memcmp(s,">>=",3) || !memcmp(s,"...",3) || !memcmp(s,"##",2) /* check later */) {
+            if (!memcmp(s,"##",2)) return 2;
+            return 3;
+        }
+    }
+    /* Try 2-char */
+    if (n>=2) {
+        const char *twos[] = {"->","++","--","<<",">>","<=",">=","==","!=","&&","||",
+                              "+=","-=","*=","/=","%=","&=","|=","^=","::",".*","->*","##"};
+        for (size_t i=0;i<sizeof(twos)/sizeof(twos[0]);++i) {
+            if (!memcmp(s, twos[i], strlen(twos[i]))) return strlen(twos[i]);
+        }
+    }
+    /* Single char */
+    if (is_punct_char(s[0])) return 1;
+    return 0;
+}
+
+/* ---------- Lexer ---------- */
+void ct_lexer_init(CtLexer *lx, const void *buf, size_t len) {
+    lx->p = (const unsigned char*)buf;
+    lx->n = len;
+    lx->i = 0;
+}
+
+static int tok(CtLexer *lx, CtToken *t, CtKind k, size_t start) {
+    t->kind = k;
+    t->off = start;
+    t->len = lx->i - start;
+    return 1;
+}
+
+int ct_next(CtLexer *lx, CtToken *t) {
+    if (lx->i >= lx->n) return 0;
+    size_t start = lx->i;
+    unsigned char c = lx->p[lx->i];
+
+    /* Newline(s): handle CRLF and LF */
+    if (c == '\r') {
+        size_t j = lx->i;
+        if (j+1 < lx->n && lx->p[j+1]=='\n') lx->i += 2;
+        else lx->i += 1;
+        return tok(lx, t, CT_NEWLINE, start);
+    }
+    if (c == '\n') {
+        lx->i += 1;
+        return tok(lx, t, CT_NEWLINE, start);
+    }
+
+    /* Whitespace run (excluding newlines) */
+    if (c==' ' || c=='\t' || c=='\v' || c=='\f') {
+        size_t j = lx->i+1;
+        while (j<lx->n) {
+            unsigned char d = lx->p[j];
+            if (d==' '||d=='\t'||d=='\v'||d=='\f') j++;
+            else break;
+        }
+        lx->i = j;
+        return tok(lx, t, CT_WS, start);
+    }
+
+    /* Preprocessor line starting with '#' at column 1 (only a newline token
+       ends in a newline byte, so this is "first token of a line") */
+    if (c=='#' && (start==0 || lx->p[start-1]=='\n' || lx->p[start-1]=='\r')) {
+        size_t j = lx->i+1;
+        /* continuation handled inline; no flag needed */
+        while (j < lx->n) {
+            unsigned char d = lx->p[j];
+            if (d=='\r') {
+                /* Check CRLF; treat as newline; stop if not continued */
+                if (j>start && lx->p[j-1]=='\\') { /* continued */
+                    if (j+1 < lx->n && lx->p[j+1]=='\n') { j+=2; continue; }
+                    else { j+=1; continue; }
+                }
+                break;
+            } else if (d=='\n') {
+                if (j>start && lx->p[j-1]=='\\') { j++; continue; }
+                break;
+            } else {
+                j++;
+            }
+        }
+        lx->i = j;
+        return tok(lx, t, CT_PREPROC, start);
+    }
+
+    /* Comments */
+    if (c=='/' && lx->i+1<lx->n) {
+        unsigned char n1 = lx->p[lx->i+1];
+        if (n1=='/') {
+            size_t j = lx->i+2;
+            while (j<lx->n && lx->p[j] != '\n' && lx->p[j] != '\r') j++;
+            lx->i = j;
+            return tok(lx, t, CT_LINE_COMMENT, start);
+        } else if (n1=='*') {
+            size_t j = lx->i+2;
+            while (j+1<lx->n && !(lx->p[j]=='*' && lx->p[j+1]=='/')) j++;
+            if (j+1 < lx->n) j+=2; /* include closing */
+            lx->i = j;
+            return tok(lx, t, CT_BLOCK_COMMENT, start);
+        }
+    }
+
+    /* String / char literal */
+    if (c=='\"' || c=='\'') {
+        size_t j = lx->i+1;
+        while (j<lx->n) {
+            unsigned char d = lx->p[j++];
+            if (d=='\\') {
+                if (j<lx->n) j++; /* skip escaped char */
+            } else if (d==c) {
+                break;
+            }
+        }
+        lx->i = j;
+        return tok(lx, t, c=='\"' ? CT_STRING : CT_CHAR, start);
+    }
+
+    /* Identifier / keyword (C identifier rules) */
+    if (isalpha(c) || c=='_') {
+        size_t j = lx->i+1;
+        while (j<lx->n) {
+            unsigned char d = lx->p[j];
+            if (isalnum(d) || d=='_') j++; else break;
+        }
+        size_t len = j - start;
+        CtKind k = ct_is_keyword((const char*)lx->p+start, len) ? CT_KEYWORD : CT_IDENT;
+        lx->i = j;
+        return tok(lx, t, k, start);
+    }
+
+    /* Number literal (simple, accepts hex/dec/octal/floats/suffixes) */
+    if (isdigit(c) || (c=='.' && lx->i+1<lx->n && isdigit(lx->p[lx->i+1]))) {
+        size_t j = lx->i;
+        const unsigned char *p = lx->p; size_t n = lx->n;
+        if (p[j]=='0' && j+1<n && (p[j+1]=='x'||p[j+1]=='X')) {
+            j+=2;
+            while (j<n && (isxdigit(p[j]) || p[j]=='\'')) j++;
+        } else {
+            while (j<n && (isdigit(p[j]) || p[j]=='\'')) j++;
+            if (j<n && p[j]=='.') { j++; while (j<n && (isdigit(p[j])||p[j]=='\'')) j++; }
+            if (j<n && (p[j]=='e'||p[j]=='E'||p[j]=='p'||p[j]=='P')) {
+                j++;
+                if (j<n && (p[j]=='+'||p[j]=='-')) j++;
+                while (j<n && isxdigit(p[j])) j++;
+            }
+        }
+        /* Suffixes */
+        while (j<n && (isalpha(p[j]) || p[j]=='_')) j++;
+        lx->i = j;
+        return tok(lx, t, CT_NUMBER, start);
+    }
+
+    /* Punctuators/operators */
+    size_t plen = match_punct(lx->p + lx->i, lx->n - lx->i);
+    if (plen > 0) {
+        lx->i += plen;
+        return tok(lx, t, CT_PUNCT, start);
+    }
+
+    /* Fallback: unknown byte, emit as PUNCT to preserve */
+    lx->i += 1;
+    return tok(lx, t, CT_PUNCT, start);
+}
+
+int ct_lex_batch(const void *buf, size_t len, CtBatchFn fn, void *ud) {
+    CtLexer lx;
+    CtToken toks[CT_BATCH];
+    size_t n = 0;
+    ct_lexer_init(&lx, buf, len);
+    while (ct_next(&lx, &toks[n])) {
+        if (++n == CT_BATCH) {
+            int rc = fn(ud, toks, n);
+            if (rc) return rc;
+            n = 0;
+        }
+    }
+    return n ? fn(ud, toks, n) : 0;
+}
+
+/* ---------- Line-start table ---------- */
+/* Record the line that starts after the newline byte at i (a CR directly
+   followed by LF is left to the LF). */
+#define CT_LINE_AT(i) do { \
+        if (p[i] == '\n' || (i)+1 >= len || p[(i)+1] != '\n') { \
+            if (n < cap) starts[n] = (i)+1; \
+            n++; \
+        } \
+    } while (0)
+
+#ifdef CT_SSE2
+static unsigned ct_ctz(unsigned m) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(m);
+#else
+    unsigned b = 0;
+    while (!(m & 1u)) { m >>= 1; b++; }
+    return b;
+#endif
+}
+#endif
+
+size_t ct_line_starts(const void *buf, size_t len, size_t *starts, size_t cap) {
+    const unsigned char *p = (const unsigned char*)buf;
+    size_t n = 1, i = 0;
+    if (cap) starts[0] = 0;
+#ifdef CT_SSE2
+    /* Most 16-byte blocks hold no newline and cost one compare pair */
+    const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+        while (m) {
+            size_t j = i + ct_ctz(m);
+            m &= m - 1;
+            CT_LINE_AT(j);
+        }
+    }
+#endif
+    for (; i < len; ++i)
+        if (p[i] == '\n' || p[i] == '\r') CT_LINE_AT(i);
+    return n;
+}
+#undef CT_LINE_AT
+
+void ct_line_col(const size_t *starts, size_t nlines, size_t off, size_t *line, size_t *col) {
+    /* Last start <= off; starts[0] == 0 */
+    size_t lo = 0, hi = nlines;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (starts[mid] <= off) lo = mid; else hi = mid;
+    }
+    *line = lo + 1;
+    *col = off - starts[lo] + 1;
+}
+
+void ct_line_cursor_init(CtLineCursor *c, const size_t *starts, size_t nlines) {
+    c->starts = starts;
+    c->n = nlines;
+    c->i = 0;
+}
+
+void ct_line_cursor_seek(CtLineCursor *c, size_t off, size_t *line, size_t *col) {
+    if (c->starts[c->i] > off) {
+        /* Moved backwards: fall back to a search */
+        ct_line_col(c->starts, c->n, off, line, col);
+        c->i = *line - 1;
+        return;
+    }
+    while (c->i + 1 < c->n && c->starts[c->i + 1] <= off) c->i++;
+    *line = c->i + 1;
+    *col = off - c->starts[c->i] + 1;
+}
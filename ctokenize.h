@@ -0,0 +1,85 @@
+/*
+ * ctokenize.h
+ *
+ * libctokenize: the lossless C lexer behind ctokenize_v2, as an embeddable,
+ * reentrant library. All state lives in a caller-owned CtLexer; there are no
+ * globals, no allocation and no stdio. Tokens reference the caller's buffer
+ * (off/len), so concatenating every token's bytes in order reproduces the
+ * input exactly.
+ *
+ * Iterator:
+ *   CtLexer lx; CtToken t;
+ *   ct_lexer_init(&lx, buf, len);
+ *   while (ct_next(&lx, &t)) use(buf + t.off, t.len, t.kind);
+ *
+ * Batch callback:
+ *   ct_lex_batch(buf, len, fn, ud) calls fn(ud, toks, n) with up to
+ *   CT_BATCH tokens at a time; a nonzero return from fn stops lexing and is
+ *   returned to the caller.
+ *
+ * Line and column:
+ *   Tokens carry only byte offsets; the lexer does no per-token line
+ *   bookkeeping. Positions come from a line-start table built in one
+ *   vectorized pass over the buffer (LF, CRLF and a lone CR each end a line):
+ *     size_t n = ct_line_starts(buf, len, starts, cap);   (n > cap: retry larger)
+ *     ct_line_col(starts, n, off, &line, &col);           (binary search)
+ *   A CtLineCursor answers non-decreasing offsets, as when walking tokens in
+ *   order, in amortized O(1). Lines and columns are 1-based; columns count
+ *   bytes.
+ *
+ * Build:
+ *   cc -std=c99 -O2 -fPIC -shared -o libctokenize.so ctokenize.c
+ */
+#ifndef CTOKENIZE_H
+#define CTOKENIZE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    CT_WS, CT_NEWLINE, CT_LINE_COMMENT, CT_BLOCK_COMMENT, CT_PREPROC,
+    CT_IDENT, CT_KEYWORD, CT_NUMBER, CT_STRING, CT_CHAR, CT_PUNCT
+} CtKind;
+#define CT_NKINDS 11
+
+typedef struct {
+    CtKind kind;
+    size_t off, len;   /* byte range in the input buffer */
+} CtToken;
+
+typedef struct {
+    const unsigned char *p;
+    size_t n, i;
+} CtLexer;
+
+#define CT_BATCH 256
+typedef int (*CtBatchFn)(void *ud, const CtToken *toks, size_t n);
+
+void ct_lexer_init(CtLexer *lx, const void *buf, size_t len);
+int ct_next(CtLexer *lx, CtToken *tok);  /* 1 with *tok filled, 0 at end of input */
+int ct_lex_batch(const void *buf, size_t len, CtBatchFn fn, void *ud);
+
+/* Offsets of the first byte of every line: starts[0] = 0, then one entry
+   after each newline. Fills at most cap entries; returns the line count. */
+size_t ct_line_starts(const void *buf, size_t len, size_t *starts, size_t cap);
+/* 1-based line and column of byte off, from a complete line-start table. */
+void ct_line_col(const size_t *starts, size_t nlines, size_t off, size_t *line, size_t *col);
+
+typedef struct {
+    const size_t *starts;
+    size_t n, i;
+} CtLineCursor;
+void ct_line_cursor_init(CtLineCursor *c, const size_t *starts, size_t nlines);
+void ct_line_cursor_seek(CtLineCursor *c, size_t off, size_t *line, size_t *col);
+
+const char *ct_kind_name(CtKind k);
+int ct_is_keyword(const char *s, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CTOKENIZE_H */
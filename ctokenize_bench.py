@@ -0,0 +1,294 @@
+"""Reproducible ctokenize_v2 benchmarks over synthetic C corpora.
+
+    python ctokenize_bench.py --json results.json
+    python ctokenize_bench.py --baseline results.json --tolerance 0.10
+
+Corpora are generated deterministically from --seed into --workdir (and
+reused when the parameters match): comment-heavy, string-heavy, minified,
+CRLF, one huge file, and many tiny files. Each corpus is run through
+stream, stats, vocab and reassemble; every run reports MB/s, tokens/s,
+peak RSS and allocation counts. The binary is built with -DCT_ALLOC_STATS
+so allocation counts and peak RSS come from the tool itself.
+
+With --baseline, MB/s drops and RSS/allocation growth beyond --tolerance
+are flagged and the exit status is 1.
+"""
+from __future__ import annotations
+
+import argparse
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+from typing import Dict, List
+
+ROOT = Path(__file__).resolve().parent
+MODES = ("stream", "stats", "vocab", "reassemble")
+CORPORA = ("comment_heavy", "string_heavy", "minified", "crlf", "huge", "tiny")
+
+WORDS = ("count", "node", "buf", "len", "idx", "next", "value", "state", "ctx", "item",
+         "table", "hash", "size", "data", "flags", "entry", "tree", "left", "right", "key")
+TYPES = ("int", "long", "size_t", "char *", "unsigned", "double", "uint64_t", "void *")
+
+
+# ---------- synthetic C ----------
+class Gen:
+    def __init__(self, rng: random.Random, comments: float, strings: float):
+        self.rng = rng
+        self.comments = comments
+        self.strings = strings
+
+    def ident(self) -> str:
+        r = self.rng
+        return "_".join(r.choice(WORDS) for _ in range(r.randint(1, 3))) + str(r.randint(0, 99))
+
+    def string(self) -> str:
+        r = self.rng
+        body = " ".join(r.choice(WORDS) for _ in range(r.randint(2, 12)))
+        if r.random() < 0.5:
+            body += r.choice(("\\n", "\\t", "\\\"", "\\\\", "%d", "%s"))
+        return '"' + body + '"'
+
+    def expr(self, depth: int = 0) -> str:
+        r = self.rng
+        if depth > 2 or r.random() < 0.3:
+            x = r.random()
+            if x < self.strings:
+                return self.string()
+            if x < self.strings + 0.2:
+                return str(r.choice((r.randint(0, 1000), hex(r.randint(0, 1 << 20)), "1.5e3", "'a'", "0x7fu")))
+            return self.ident()
+        op = r.choice(("+", "-", "*", "/", "<<", "&&", "||", "==", "!=", "->", "."))
+        if op in ("->", "."):
+            return self.expr(depth + 1) + op + self.ident()
+        return "(" + self.expr(depth + 1) + " " + op + " " + self.expr(depth + 1) + ")"
+
+    def comment(self) -> str:
+        r = self.rng
+        text = " ".join(r.choice(WORDS) for _ in range(r.randint(4, 20)))
+        return "// " + text if r.random() < 0.5 else "/* " + text + "\n * " + text + " */"
+
+    def function(self) -> str:
+        r = self.rng
+        out: List[str] = []
+        if r.random() < self.comments:
+            out.append(self.comment())
+        args = ", ".join(f"{r.choice(TYPES)} {self.ident()}" for _ in range(r.randint(0, 4)))
+        out.append(f"static {r.choice(TYPES)} {self.ident()}({args or 'void'}) {{")
+        for _ in range(r.randint(3, 15)):
+            while r.random() < self.comments:
+                out.append("    " + self.comment())
+            kind = r.random()
+            if kind < 0.15:
+                out.append(f"    if ({self.expr()}) {{ return {self.expr()}; }}")
+            elif kind < 0.25:
+                out.append(f"    for (int i = 0; i < {self.ident()}; ++i) {self.ident()}[i] = {self.expr()};")
+            elif kind < 0.35:
+                out.append(f"    printf({self.string()}, {self.expr()});")
+            else:
+                out.append(f"    {r.choice(TYPES)} {self.ident()} = {self.expr()};")
+        out.append("    return 0;")
+        out.append("}")
+        return "\n".join(out) + "\n\n"
+
+    def file(self, target_bytes: int) -> str:
+        parts = ["#include <stdio.h>\n#include \"local.h\"\n#define MAX(a,b) \\\n    ((a)>(b)?(a):(b))\n\n"]
+        n = len(parts[0])
+        while n < target_bytes:
+            f = self.function()
+            parts.append(f)
+            n += len(f)
+        return "".join(parts)
+
+
+def minify(src: str) -> str:
+    # Keep preprocessor lines (and their backslash continuations) on their own
+    # lines, squash everything else onto one line. Line comments become block
+    # comments first, or they would swallow the rest of the joined line.
+    keep, code = [], []
+    directive = False
+    for line in src.splitlines():
+        if directive or line.startswith("#"):
+            keep.append(line)
+            directive = line.endswith("\\")
+            continue
+        line = line.strip()
+        if line.startswith("//"):
+            line = "/*" + line[2:] + " */"
+        code.append(line)
+    return "\n".join(keep) + "\n" + " ".join(c for c in code if c) + "\n"
+
+
+def generate(kind: str, root: Path, size: int, tiny_files: int, huge: int, seed: int) -> List[Path]:
+    rng = random.Random(f"{seed}:{kind}")
+    root.mkdir(parents=True, exist_ok=True)
+    files: List[Path] = []
+
+    def write(name: str, text: str, newline: str = "\n") -> None:
+        p = root / name
+        p.parent.mkdir(parents=True, exist_ok=True)
+        with open(p, "w", encoding="utf-8", newline=newline) as f:
+            f.write(text)
+        files.append(p)
+
+    per_file = 64 << 10
+    if kind == "tiny":
+        g = Gen(rng, 0.2, 0.1)
+        for i in range(tiny_files):
+            write(f"d{i // 1000:04d}/t{i:07d}.c", g.file(96))
+    elif kind == "huge":
+        write("huge.c", Gen(rng, 0.2, 0.15).file(huge))
+    else:
+        comments, strings = {"comment_heavy": (0.7, 0.1), "string_heavy": (0.1, 0.6)}.get(kind, (0.2, 0.15))
+        g = Gen(rng, comments, strings)
+        for i in range(max(1, size // per_file)):
+            text = g.file(per_file)
+            if kind == "minified":
+                write(f"m{i:05d}.c", minify(text))
+            elif kind == "crlf":
+                write(f"w{i:05d}.c", text, newline="\r\n")
+            else:
+                write(f"f{i:05d}.c", text)
+    return files
+
+
+def corpus(args, kind: str) -> Path:
+    """Return the directory's file list, regenerating only when parameters change."""
+    root = Path(args.workdir) / "corpora" / kind
+    stamp = root / ".params"
+    params = json.dumps({"seed": args.seed, "size": args.size_mb, "tiny": args.tiny_files,
+                         "huge": args.huge_mb, "v": 2}, sort_keys=True)
+    listing = root.with_suffix(".list")
+    if not (stamp.exists() and stamp.read_text() == params and listing.exists()):
+        shutil.rmtree(root, ignore_errors=True)
+        files = generate(kind, root, args.size_mb << 20, args.tiny_files, args.huge_mb << 20, args.seed)
+        listing.write_text("".join(f"{p}\n" for p in files))
+        stamp.write_text(params)
+    return listing
+
+
+# ---------- running ----------
+def build(args) -> Path:
+    if args.binary:
+        return Path(args.binary)
+    exe = Path(args.workdir) / "ctokenize_v2_bench"
+    cc = shutil.which(os.environ.get("CC", "cc")) or "cc"
+    cmd = [cc, "-std=c99", "-O2", "-pthread", "-DCT_ALLOC_STATS", "-o", str(exe),
+           str(ROOT / "ctokenize_v2.c"), str(ROOT / "ctokenize.c")]
+    subprocess.run(cmd, check=True)
+    return exe
+
+
+def run(cmd: List[str]) -> Dict[str, float]:
+    with tempfile.TemporaryFile() as errf:
+        t0 = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=errf)
+        _, status, ru = os.wait4(proc.pid, 0)
+        wall = time.perf_counter() - t0
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        errf.seek(0)
+        err = errf.read().decode("utf-8", "replace")
+    if proc.returncode:
+        raise RuntimeError(f"{' '.join(cmd)} failed ({proc.returncode}):\n{err}")
+    # ru_maxrss survives exec, so it includes this Python process; prefer the
+    # tool's own VmHWM report when it has one.
+    rss_kb = ru.ru_maxrss if sys.platform != "darwin" else ru.ru_maxrss // 1024
+    res = {"wall_s": wall, "peak_rss_kb": rss_kb, "allocs": 0, "alloc_bytes": 0}
+    for line in err.splitlines():
+        if line.startswith('{"allocs"'):
+            rep = json.loads(line)
+            res.update({k: v for k, v in rep.items() if v or k != "peak_rss_kb"})
+    return res
+
+
+def bench_corpus(args, exe: Path, kind: str) -> Dict[str, Dict[str, float]]:
+    listing = corpus(args, kind)
+    out = Path(args.workdir) / "out" / kind
+    shutil.rmtree(out, ignore_errors=True)
+    out.mkdir(parents=True)
+    nbytes = sum(os.path.getsize(p) for p in listing.read_text().split("\n") if p)
+    stats_json = out / "stats.json"
+    subprocess.run([str(exe), "stats", "--threads", "1", "--files-from", str(listing),
+                    "--out", str(stats_json)], check=True, stderr=subprocess.DEVNULL)
+    tokens = json.loads(stats_json.read_text())["tokens"]
+    threads = ["--threads", str(args.threads)]
+    cmds = {
+        "stream": [str(exe), "stream", *threads, "--files-from", str(listing), "--out", str(out / "s.jsonl")],
+        "stats": [str(exe), "stats", *threads, "--files-from", str(listing), "--out", str(out / "st.json")],
+        "vocab": [str(exe), "vocab", *threads, "--files-from", str(listing), "--out", str(out / "v.tsv")],
+        "reassemble": [str(exe), "reassemble", "--in", str(out / "s.jsonl"), "--outdir", str(out / "recon")],
+    }
+    res: Dict[str, Dict[str, float]] = {}
+    for mode in MODES:
+        best = None
+        for _ in range(args.repeat):
+            if mode == "reassemble":
+                shutil.rmtree(out / "recon", ignore_errors=True)
+            r = run(cmds[mode])
+            if best is None or r["wall_s"] < best["wall_s"]:
+                best = r
+        best["mb_s"] = nbytes / (1 << 20) / best["wall_s"]
+        best["tokens_s"] = tokens / best["wall_s"]
+        best["bytes"] = nbytes
+        best["tokens"] = tokens
+        res[mode] = best
+        print(f"{kind:14s} {mode:10s} {best['mb_s']:9.1f} MB/s {best['tokens_s'] / 1e6:8.2f} Mtok/s "
+              f"{best['peak_rss_kb'] / 1024:8.1f} MB RSS {best['allocs']:>10} allocs", flush=True)
+    shutil.rmtree(out, ignore_errors=True)
+    return res
+
+
+def compare(results: Dict, baseline: Dict, tol: float) -> List[str]:
+    flagged = []
+    for kind, modes in results["corpora"].items():
+        for mode, r in modes.items():
+            b = baseline.get("corpora", {}).get(kind, {}).get(mode)
+            if not b:
+                continue
+            if r["mb_s"] < b["mb_s"] * (1 - tol):
+                flagged.append(f"{kind}/{mode}: MB/s {b['mb_s']:.1f} -> {r['mb_s']:.1f}")
+            for key in ("peak_rss_kb", "allocs"):
+                if b[key] and r[key] > b[key] * (1 + tol):
+                    flagged.append(f"{kind}/{mode}: {key} {b[key]} -> {r[key]}")
+    return flagged
+
+
+def main() -> int:
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--workdir", default="bench_work")
+    ap.add_argument("--binary", help="use this ctokenize_v2 instead of building one")
+    ap.add_argument("--corpus", action="append", choices=CORPORA, help="run only these corpora")
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--size-mb", type=int, default=32, help="size of each multi-file corpus")
+    ap.add_argument("--huge-mb", type=int, default=128, help="size of the single huge file")
+    ap.add_argument("--tiny-files", type=int, default=100000, help="file count of the tiny-file corpus")
+    ap.add_argument("--threads", type=int, default=os.cpu_count() or 1)
+    ap.add_argument("--repeat", type=int, default=3, help="runs per measurement (best is kept)")
+    ap.add_argument("--json", help="write results here")
+    ap.add_argument("--baseline", help="compare against a previous --json result")
+    ap.add_argument("--tolerance", type=float, default=0.10)
+    args = ap.parse_args()
+
+    Path(args.workdir).mkdir(parents=True, exist_ok=True)
+    exe = build(args)
+    results = {"params": {k: getattr(args, k) for k in ("seed", "size_mb", "huge_mb", "tiny_files", "threads")},
+               "corpora": {}}
+    for kind in args.corpus or CORPORA:
+        results["corpora"][kind] = bench_corpus(args, exe, kind)
+    if args.json:
+        Path(args.json).write_text(json.dumps(results, indent=2) + "\n")
+    if args.baseline:
+        flagged = compare(results, json.loads(Path(args.baseline).read_text()), args.tolerance)
+        for f in flagged:
+            print("REGRESSION", f)
+        return 1 if flagged else 0
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -8,32 +8,236 @@
  *
  * Modes (subcommands):
  *   stream     Tokenize files to a per-token JSONL stream (lossless).
- *              Usage: ctokenize_v2 stream [--out out.jsonl] [--stdin NAME] [files...]
+ *              Usage: ctokenize_v2 stream [--out out.jsonl] [--stdin NAME]
+ *                       [--compress gzip|zstd] [--level N] [--frame-size BYTES]
+ *                       [--threads N] [--shards N | --shard-size BYTES] [files...]
  *              If no files are given, reads stdin (binary) and uses NAME or "stdin".
+ *              With --compress the output is a sequence of independent frames
+ *              (valid multi-member gzip / multi-frame zstd), compressed on a
+ *              thread pool, plus a seek table OUT.seek mapping files to frames.
+ *              --shards N splits the files over OUT-00000.ext .. OUT-<N-1>.ext,
+ *              balanced by source size and written by parallel writers;
+ *              --shard-size caps the uncompressed stream bytes per shard
+ *              (files kept in input order). Files are never split across
+ *              shards; OUT.manifest.jsonl lists every shard and file with
+ *              token counts and FNV-1a hashes. Both assignments depend only
+ *              on the file list, so reruns produce identical shards.
  *
  *   stats      Emit JSON with counts per token kind and other measurables.
- *              Usage: ctokenize_v2 stats [--out out.json] [files...]
+ *              Usage: ctokenize_v2 stats [--out out.json] [--threads N] [--partial]
+ *                       [--ngrams N [--ngram-top K=100]] [files...]
+ *              --ngrams N adds an "ngrams" object: counts of every kind
+ *              n-gram of orders 2..N (N <= 5) over code tokens (whitespace
+ *              and comments skipped, never across files), and per order the
+ *              number of distinct lexeme n-grams with the K most frequent
+ *              (0 = all) as {"ngram":[lexemes],"count"}.
+ *              --per-file PATH also writes one JSONL record per file, in
+ *              input order: file, bytes (file size), tokens, lines,
+ *              bytes_comments, bytes_whitespace, comment_ratio,
+ *              max_line_len, kinds, and token_len_hist / line_len_hist,
+ *              13 log2 buckets each (0, 1, 2-3, 4-7, ..., 1024-2047, 2048+).
  *
  *   vocab      Emit TSV of identifier/keyword frequencies.
- *              Usage: ctokenize_v2 vocab [--out out.tsv] [files...]
+ *              Usage: ctokenize_v2 vocab [--out out.tsv] [--threads N] [--partial] [files...]
+ *              --partial (stats and vocab) writes an exactly mergeable partial
+ *              instead of the final output; vocab partials are sorted by lexeme.
+ *
+ *              stream (unsharded, with --out), stats and vocab also take
+ *              --checkpoint PATH [--checkpoint-interval SECS] [--resume]:
+ *              progress is recorded every SECS (default 60) at a file
+ *              boundary, and --resume continues a killed run from PATH,
+ *              truncating the stream output back to the checkpoint. The
+ *              checkpoint is removed when the run completes.
+ *
+ *   merge      Combine stats or vocab partials (e.g. one per node) into the
+ *              final output, or into another partial with --partial.
+ *              Usage: ctokenize_v2 merge [--out OUT] [--partial] partial1 partial2 ...
+ *              Vocab partials are combined with a streaming k-way merge, in
+ *              rounds of at most 256 open inputs.
  *
  *   reassemble Rebuild original files from a stream JSONL.
- *              Usage: ctokenize_v2 reassemble --in stream.jsonl [--outdir DIR]
+ *              Usage: ctokenize_v2 reassemble --in stream.jsonl [--outdir DIR] [--file NAME]...
+ *                       [--patch PATCH]
  *              Writes each reconstructed file to DIR/<file>.recon (default DIR=".").
+ *              --file restricts output to the named files; on a compressed stream
+ *              only the frames holding those files are read and decompressed.
+ *              --patch PATCH (from diff) rebuilds the new tree instead: files
+ *              under OLD are written as NEW/<path>, edited, renamed or dropped,
+ *              and added files are written from the patch.
+ *
+ *   verify     Check a stream losslessly without writing anything: per-file
+ *              FNV-1a of the concatenated lexemes against the source files
+ *              (hashed in parallel, paths relative to --root) or against the
+ *              hashes in a shard manifest.
+ *              Usage: ctokenize_v2 verify --in STREAM [--manifest M | --root DIR]
+ *                       [--out REPORT] [--threads N] [--file NAME]...
+ *              Writes one JSONL record per failing file (missing, offset_gap,
+ *              corrupt_frame, unreadable, not_in_manifest, wrong_shard,
+ *              size_mismatch or hash_mismatch) and a summary line; exits 1 on
+ *              any failure.
+ *
+ *   index      Build an inverted index from every identifier to the (file,
+ *              byte offset) of each occurrence, delta+varint encoded.
+ *              Usage: ctokenize_v2 index --out INDEX [--threads N] [files...]
+ *
+ *   query      Look identifiers up in an index (mmap + binary search).
+ *              Usage: ctokenize_v2 query --index INDEX [--count] [--out OUT] NAME...
+ *              Prints NAME<TAB>FILE<TAB>OFFSET per occurrence, or
+ *              NAME<TAB>COUNT with --count.
+ *
+ *   dedup      Find near-duplicate files: MinHash over k-token shingles of the
+ *              code tokens (whitespace and comments dropped), LSH banding for
+ *              candidates, estimated Jaccard >= T to confirm.
+ *              Usage: ctokenize_v2 dedup [--out OUT.jsonl] [--threads N]
+ *                       [--shingle K=5] [--perms P=128] [--bands B=16]
+ *                       [--threshold T=0.8] [--normalize-idents] [files...]
+ *              Writes one {"cluster","size","files":[...]} line per group of
+ *              two or more files; --normalize-idents treats all identifiers as
+ *              equal so renamed copies match.
+ *
+ *   clones     Report exactly repeated runs of at least W code tokens
+ *              (whitespace and comments ignored) across all files.
+ *              Usage: ctokenize_v2 clones [--out OUT.jsonl] [--threads N]
+ *                       [--window W=50] [--normalize] [files...]
+ *              One {"clone","tokens","occurrences":[{"file","start","end"}]}
+ *              line per maximal clone, with byte ranges into each file;
+ *              --normalize matches identifiers and literals by kind only.
+ *
+ *   bpe-train  Learn byte-level BPE merges from the exact lexeme frequencies;
+ *              each lexeme is a word, so merges never cross token boundaries.
+ *              Usage: ctokenize_v2 bpe-train --merges MERGES --vocab VOCAB
+ *                       [--vocab-size N=8192] [--min-frequency F=2]
+ *                       [--threads N] [files...]
+ *              MERGES lists "A B" id pairs in rank order (merge i is id 256+i);
+ *              VOCAB lists ID<TAB>bytes, escaped as in the stream's strings.
+ *
+ *   encode     Encode every lexeme with bpe-train merges into packed ids.
+ *              Usage: ctokenize_v2 encode --merges MERGES --out OUT.bin
+ *                       [--dtype u16|u32] [--shard-size BYTES] [--threads N] [files...]
+ *              OUT.bin holds little-endian ids (u16 when the vocab fits,
+ *              else u32); OUT.bin.idx holds nfiles+1 u64 token offsets, one
+ *              document per input file. --shard-size caps the id bytes per
+ *              shard (OUT-00000.bin, ...), never splitting a file.
+ *
+ *   normalize  Strip comments, collapse whitespace and drop blank lines;
+ *              optionally rename identifiers to v0, v1, ... per file.
+ *              Usage: ctokenize_v2 normalize --outdir DIR [--rename-idents]
+ *                       [--threads N] [files...]
+ *              Writes DIR/<file> plus DIR/<file>.map, little-endian u64
+ *              (out_off, src_off) pairs mapping output bytes to the source.
+ *
+ *   includes   Build the #include graph: quoted and angle includes resolved
+ *              against the includer's directory and -I paths, discovered
+ *              headers scanned in turn.
+ *              Usage: ctokenize_v2 includes [--out OUT.jsonl] [-I DIR]...
+ *                       [--threads N] [files...]
+ *              One {"id","file","includes":[ids],"unresolved":[names],
+ *              "closure","dependents"} line per file or header; closure and
+ *              dependents are transitive counts.
+ *
+ *   diff       Token-level diff of two trees into a binary patch that
+ *              reassemble --patch applies to a stream of the old tree.
+ *              Usage: ctokenize_v2 diff [--out PATCH] [--threads N] OLD NEW
+ *              Files pair by relative path (identical ones are skipped), then
+ *              by content hash (renames); changed pairs get a Myers diff over
+ *              per-token hashes. The old stream's file names must be
+ *              OLD/<relative path> (as from "find OLD -type f").
+ *
+ *   serve      Long-running tokenizer daemon on a Unix domain socket.
+ *              Usage: ctokenize_v2 serve --socket PATH [--threads N]
+ *                       [--max-request BYTES]
+ *              Framed binary requests ("CTQ1", mode, id, length, source) get
+ *              token columns (mode 1) or stats JSON (mode 2) back in order;
+ *              clients may pipeline. See the serve section for the layout.
+ *
+ *   loadgen    Drive a serve daemon and report throughput and latency.
+ *              Usage: ctokenize_v2 loadgen --socket PATH [--connections C]
+ *                       [--depth D] [--requests N] [--mode tokens|stats]
+ *                       [--out OUT.json] [--files-from LIST] [files...]
+ *              Sends the files round-robin with up to D requests in flight
+ *              per connection; prints p50/p99/max latency in microseconds.
+ *
+ *   watch      Keep per-file token streams, stats and vocab of a live tree
+ *              up to date (inotify; Linux).
+ *              Usage: ctokenize_v2 watch --outdir DIR [--threads N]
+ *                       [--debounce MS] [--once] ROOT
+ *              Writes DIR/streams/<file>.jsonl, DIR/stats.json and
+ *              DIR/vocab.tsv (sorted by lexeme), each replaced atomically.
+ *              A changed file's old counts are subtracted before its new ones
+ *              are added. --once does the initial pass and exits.
+ *
+ *   classify   Histogram of the isomorphic forms (see generate_E.c) that
+ *              occur in real code.
+ *              Usage: ctokenize_v2 classify [--out OUT.jsonl] [--window W=11]
+ *                       [--map KIND=TYPE]... [--top K] [--threads N] [files...]
+ *              Token kinds map to types (default: IDENT object_1, NUMBER
+ *              object_2, STRING and CHAR object_3, PUNCT relation_4, KEYWORD
+ *              relation_5, PREPROC relation_6; whitespace and comments
+ *              skipped; --map KIND=- skips a kind). Every window of W mapped
+ *              tokens in a file is one form: its type counts and its rank
+ *              among the orderings of those counts, in type-name order.
+ *              Writes one {"form":"E<rank+1>","counts","rank","sequence",
+ *              "count"} line per form, most frequent first (K of them).
+ *
+ *   match      Count every occurrence of many token-kind or token-type
+ *              patterns in one pass (Aho-Corasick).
+ *              Usage: ctokenize_v2 match --patterns FILE [--out OUT.jsonl]
+ *                       [--positions POS.jsonl] [--all-kinds | --types |
+ *                       --map KIND=TYPE...] [--threads N] [files...]
+ *              FILE holds one pattern per line, "[NAME:] SYM SYM ...";
+ *              blank lines and '#' lines are skipped. SYMs are token kinds
+ *              (whitespace, newlines and comments dropped from the stream
+ *              unless --all-kinds), or with --types classify's types, so
+ *              generate_E output works as is; --map KIND=TYPE adjusts the
+ *              types as in classify and implies --types. Writes one
+ *              {"id","name","symbols","count","files"} line per pattern in
+ *              FILE order; --positions also writes one {"id","file","off",
+ *              "line","col"} line per match (its first token), in file
+ *              order and by offset within a file.
  *
  * Build:
- *   cc -std=c99 -O2 -Wall -Wextra -o ctokenize_v2 ctokenize_v2.c
+ *   cc -std=c99 -O2 -Wall -Wextra -pthread -o ctokenize_v2 ctokenize_v2.c ctokenize.c
+ *   Optional codecs: add -DCT_WITH_ZLIB -lz and/or -DCT_WITH_ZSTD -lzstd.
+ *
+ *   The file-list modes (stream, stats, vocab, index, dedup, clones,
+ *   bpe-train, encode, normalize, includes, classify, match) also accept --files-from LIST
+ *   (one path per line, "-" for stdin) for corpora too large for the
+ *   command line, and --profile:
+ *   per-phase wall/CPU time (read_file, lex_file, json_escape_write, vmap_add,
+ *   fwrite, compress) plus, on Linux, cycles, instructions, branch-misses and
+ *   cache-misses from perf_event_open, and a "memory" object with the arena
+ *   and pool counters. stats embeds it as a "profile" object; the other modes
+ *   print {"profile":{...}} to stderr.
+ *
+ * Benchmarks: ctokenize_bench.py (synthetic corpora, JSON results, baseline
+ *   comparison). Building with -DCT_ALLOC_STATS makes every run print
+ *   {"allocs":N,"alloc_bytes":N,"peak_rss_kb":N} to stderr at exit.
  *
  * Notes:
  *  - The stream format is JSONL with fields:
  *      file, off (byte offset), line, col, kind, lexeme
  *    Concatenating lexemes per file in order reproduces the exact bytes.
- *  - We do minimal C lexing: identifiers/keywords, numbers, strings, chars,
- *    preprocessor lines (with backslash continuations), comments, whitespace,
- *    newlines, and punctuators/operators (longest-match).
+ *    line/col are the physical 1-based position of off (LF, CRLF and lone
+ *    CR end lines; col counts bytes), from the file's line-start table;
+ *    modes that do not print them never compute them.
+ *  - Per-file buffers come from a per-thread scratch arena reset after each
+ *    file; vocab entries and reassemble's per-line copies use arenas and
+ *    pools too (see "Arenas and slab pools").
+ *  - Lexing lives in libctokenize (ctokenize.h / ctokenize.c); this file is
+ *    the CLI client: file I/O, output formats, aggregation and threading.
  *  - For JSON escaping we emit \n, \r, \t, \\, \", and \u00XX for other ASCII controls.
  *  - Reassembler parses only the fields we generate.
+ *  - Seek table (OUT.seek) is text: a "ctseek 1 CODEC NFRAMES NFILES" header,
+ *    one "frame COFF CLEN ULEN" line per frame, then one
+ *    "file FIRST_FRAME LAST_FRAME NAME" line per file (file id = line order).
+ *    Frames always end on a token (line) boundary.
  */
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifdef __linux__
+#define _DEFAULT_SOURCE /* syscall(), for perf_event_open */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,47 +249,194 @@
 #define MKDIR(p) _mkdir(p)
 #else
 #include <sys/stat.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 #define MKDIR(p) mkdir((p), 0777)
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+
+#include "ctokenize.h"
 
 
 #ifdef _MSC_VER
 #define strcasecmp _stricmp
 #endif
 
-#define MAX(a,b) ((a)>(b)?(a):(b))
-#define MIN(a,b) ((a)<(b)?(a):(b))
-
-/* ---------- Keyword table (C11) ---------- */
-static const char *C_KEYWORDS[] = {
-    "auto","break","case","char","const","continue","default","do","double",
-    "else","enum","extern","float","for","goto","if","inline","int","long",
-    "register","restrict","return","short","signed","sizeof","static","struct",
-    "switch","typedef","union","unsigned","void","volatile","while","_Alignas",
-    "_Alignof","_Atomic","_Bool","_Complex","_Generic","_Imaginary","_Noreturn",
-    "_Static_assert","_Thread_local"
-};
-static int is_keyword(const char *s, size_t n) {
-    for (size_t i=0;i<sizeof(C_KEYWORDS)/sizeof(C_KEYWORDS[0]);++i) {
-        const char *k = C_KEYWORDS[i];
-        if (strlen(k)==n && memcmp(k,s,n)==0) return 1;
+/* ---------- Allocation counters (benchmark builds: -DCT_ALLOC_STATS) ---------- */
+#ifdef CT_ALLOC_STATS
+static unsigned long long ct_nalloc, ct_alloc_bytes;
+static void *ct_counted_malloc(size_t n) {
+    __sync_fetch_and_add(&ct_nalloc, 1ULL); __sync_fetch_and_add(&ct_alloc_bytes, (unsigned long long)n);
+    return malloc(n);
+}
+static void *ct_counted_calloc(size_t n, size_t sz) {
+    __sync_fetch_and_add(&ct_nalloc, 1ULL); __sync_fetch_and_add(&ct_alloc_bytes, (unsigned long long)(n*sz));
+    return calloc(n, sz);
+}
+static void *ct_counted_realloc(void *p, size_t n) {
+    __sync_fetch_and_add(&ct_nalloc, 1ULL); __sync_fetch_and_add(&ct_alloc_bytes, (unsigned long long)n);
+    return realloc(p, n);
+}
+static void ct_alloc_report(void) {
+    /* Peak RSS of this image; getrusage() would also count the pre-exec parent */
+    unsigned long long hwm = 0;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) if (sscanf(line, "VmHWM: %llu", &hwm) == 1) break;
+        fclose(f);
     }
-    return 0;
+    fprintf(stderr, "{\"allocs\":%llu,\"alloc_bytes\":%llu,\"peak_rss_kb\":%llu}\n",
+            ct_nalloc, ct_alloc_bytes, hwm);
 }
+#define malloc(n) ct_counted_malloc(n)
+#define calloc(n,sz) ct_counted_calloc((n),(sz))
+#define realloc(p,n) ct_counted_realloc((p),(n))
+#endif
+
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#define MIN(a,b) ((a)<(b)?(a):(b))
 
 /* ---------- Hash (FNV-1a 64-bit) ---------- */
-static uint64_t fnv1a64(const void *data, size_t len) {
+#define FNV1A64_INIT 1469598103934665603ULL
+static uint64_t fnv1a64_update(uint64_t h, const void *data, size_t len) {
     const unsigned char *p = (const unsigned char*)data;
-    uint64_t h = 1469598103934665603ULL;
     for (size_t i=0;i<len;++i) {
         h ^= p[i];
         h *= 1099511628211ULL;
     }
     return h;
 }
+static uint64_t fnv1a64(const void *data, size_t len) {
+    return fnv1a64_update(FNV1A64_INIT, data, len);
+}
+
+/* ---------- Arenas and slab pools ----------
+ * Transient allocations are carved from large blocks instead of taking one
+ * malloc each. An Arena bump-allocates 16-byte aligned slices; arena_reset
+ * rewinds it and keeps the blocks for reuse, arena_free returns them. A Pool
+ * hands out fixed-size records from its arena and recycles freed ones
+ * through a free list. Every thread has a scratch arena (tls_scratch) for
+ * per-file buffers, reset once the file is done. Counters live in the arena
+ * and are added to the --profile report on reset and free. */
+#if defined(_MSC_VER)
+#define CT_TLS __declspec(thread)
+#else
+#define CT_TLS __thread
+#endif
+#define ARENA_BLOCK ((size_t)64<<10)
+#define ARENA_ALIGN 16
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t cap, used;
+} ArenaBlock;
+#define ARENA_HDR ((sizeof(ArenaBlock) + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+
+typedef struct {
+    ArenaBlock *head, *cur;   /* blocks before cur are full */
+    uint64_t allocs, bytes, reuses, blocks, block_bytes;  /* not yet reported */
+} Arena;
+
+typedef struct {
+    Arena a;
+    size_t size;
+    void *free;               /* recycled records, linked through their first word */
+} Pool;
+
+static CT_TLS Arena tls_scratch;
+/* Line-start table (line_table): grows to the largest file a thread has seen
+   and is kept across files; par_worker frees it with the scratch arena. */
+static CT_TLS size_t *tls_line_starts;
+static CT_TLS size_t tls_line_cap;
+
+static void arena_count(Arena *a);
+
+/* Insert b after the current block and make it current. */
+static void arena_link(Arena *a, ArenaBlock *b) {
+    if (a->cur) { b->next = a->cur->next; a->cur->next = b; }
+    else { b->next = a->head; a->head = b; }
+    a->cur = b;
+    a->blocks++; a->block_bytes += ARENA_HDR + b->cap;
+}
+
+static void *arena_alloc(Arena *a, size_t n) {
+    n = (n + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+    ArenaBlock *b = a->cur;
+    while (b && b->cap - b->used < n) b = b->next;
+    if (!b) {
+        size_t cap = MAX(ARENA_BLOCK, n);
+        b = (ArenaBlock*)malloc(ARENA_HDR + cap);
+        if (!b) { fprintf(stderr,"OOM\n"); exit(1); }
+        b->cap = cap; b->used = 0;
+        arena_link(a, b);
+    }
+    a->cur = b;
+    void *p = (unsigned char*)b + ARENA_HDR + b->used;
+    b->used += n;
+    a->allocs++; a->bytes += n;
+    return p;
+}
+static char *arena_strndup(Arena *a, const char *s, size_t n) {
+    char *d = (char*)arena_alloc(a, n+1);
+    memcpy(d, s, n); d[n] = '\0';
+    return d;
+}
+/* Forget every allocation but keep the blocks. */
+static void arena_reset(Arena *a) {
+    for (ArenaBlock *b=a->head; b; b=b->next) b->used = 0;
+    a->cur = a->head;
+    arena_count(a);
+}
+static void arena_free(Arena *a) {
+    for (ArenaBlock *b=a->head; b;) { ArenaBlock *n=b->next; free(b); b=n; }
+    a->head = a->cur = NULL;
+    arena_count(a);
+}
+/* Move src's blocks (and counters) to dst, e.g. when merging per-thread maps. */
+static void arena_adopt(Arena *dst, Arena *src) {
+    if (!src->head) return;
+    ArenaBlock **tail = &dst->head;
+    while (*tail) tail = &(*tail)->next;
+    *tail = src->head;
+    if (!dst->cur) dst->cur = src->head;
+    dst->allocs += src->allocs; dst->bytes += src->bytes; dst->reuses += src->reuses;
+    dst->blocks += src->blocks; dst->block_bytes += src->block_bytes;
+    memset(src, 0, sizeof(*src));
+}
+
+static void pool_init(Pool *p, size_t size) {
+    memset(p, 0, sizeof(*p));
+    p->size = MAX(size, sizeof(void*));
+}
+static void *pool_alloc(Pool *p) {
+    void *r = p->free;
+    if (!r) return arena_alloc(&p->a, p->size);
+    p->free = *(void**)r;
+    p->a.reuses++;
+    return r;
+}
+static void pool_put(Pool *p, void *r) {
+    *(void**)r = p->free;
+    p->free = r;
+}
+static void pool_adopt(Pool *dst, Pool *src) {
+    arena_adopt(&dst->a, &src->a);
+    while (src->free) { void *r = src->free; src->free = *(void**)r; pool_put(dst, r); }
+}
+static void pool_free(Pool *p) {
+    arena_free(&p->a);
+    p->free = NULL;
+}
 
 /* ---------- Identifier vocabulary map ---------- */
 typedef struct VEntry {
@@ -96,15 +447,28 @@ typedef struct VEntry {
     struct VEntry *next;
 } VEntry;
 
+/* Entries come from a pool and their strings from its arena. A removed
+   entry's record is recycled; its string is dead until vmap_sub compacts. */
 typedef struct {
     VEntry **bkt;
     size_t nbkt;
     uint64_t nitem;
+    Pool mem;
+    uint64_t dead;          /* arena bytes of removed strings */
 } VMap;
 
+static VEntry *vmap_new_entry(VMap *m, uint64_t h, const char *s, size_t len, uint64_t count) {
+    VEntry *e = (VEntry*)pool_alloc(&m->mem);
+    e->s = arena_strndup(&m->mem.a, s, len);
+    e->len = len; e->h = h; e->count = count;
+    e->next = m->bkt[h % m->nbkt]; m->bkt[h % m->nbkt] = e; m->nitem++;
+    return e;
+}
 static void vmap_init(VMap *m, size_t nbkt) {
     m->nbkt = nbkt;
     m->nitem = 0;
+    m->dead = 0;
+    pool_init(&m->mem, sizeof(VEntry));
     m->bkt = (VEntry**)calloc(nbkt, sizeof(VEntry*));
     if (!m->bkt) { fprintf(stderr, "OOM\n"); exit(1); }
 }
@@ -117,19 +481,93 @@ static void vmap_add(VMap *m, const char *s, size_t len) {
             return;
         }
     }
-    VEntry *e = (VEntry*)malloc(sizeof(VEntry));
-    if (!e) { fprintf(stderr, "OOM\n"); exit(1); }
-    e->s = (char*)malloc(len+1);
-    if (!e->s) { fprintf(stderr, "OOM\n"); exit(1); }
-    memcpy(e->s, s, len); e->s[len]='\0';
-    e->len = len; e->h = h; e->count = 1;
-    e->next = m->bkt[idx]; m->bkt[idx] = e; m->nitem++;
+    vmap_new_entry(m, h, s, len, 1);
 }
-static void vmap_free(VMap *m) {
+/* Rebucket into nbkt chains, for maps whose size is not known up front. */
+static void vmap_rehash(VMap *m, size_t nbkt) {
+    VEntry **bkt = (VEntry**)calloc(nbkt, sizeof(VEntry*));
+    if (!bkt) { fprintf(stderr, "OOM\n"); exit(1); }
     for (size_t i=0;i<m->nbkt;++i) {
         VEntry *e = m->bkt[i];
-        while (e) { VEntry *n=e->next; free(e->s); free(e); e=n; }
+        while (e) { VEntry *n = e->next; e->next = bkt[e->h % nbkt]; bkt[e->h % nbkt] = e; e = n; }
+    }
+    free(m->bkt);
+    m->bkt = bkt; m->nbkt = nbkt;
+}
+/* Move every entry of src into dst (summing duplicates); src is left empty. */
+static void vmap_merge(VMap *dst, VMap *src) {
+    /* size dst for no shared keys, with the same load bound as vmap_rehash's
+       other callers, so merging many large maps keeps chains short */
+    size_t nbkt = dst->nbkt;
+    while (dst->nitem + src->nitem > 2 * (uint64_t)nbkt) nbkt *= 4;
+    if (nbkt != dst->nbkt) vmap_rehash(dst, nbkt);
+    pool_adopt(&dst->mem, &src->mem);
+    dst->dead += src->dead; src->dead = 0;
+    for (size_t i=0;i<src->nbkt;++i) {
+        VEntry *e = src->bkt[i];
+        while (e) {
+            VEntry *n = e->next;
+            size_t idx = (size_t)(e->h % dst->nbkt);
+            VEntry *d = dst->bkt[idx];
+            while (d && !(d->h==e->h && d->len==e->len && memcmp(d->s, e->s, e->len)==0)) d = d->next;
+            if (d) { d->count += e->count; pool_put(&dst->mem, e); }
+            else { e->next = dst->bkt[idx]; dst->bkt[idx] = e; dst->nitem++; }
+            e = n;
+        }
+        src->bkt[i] = NULL;
     }
+    src->nitem = 0;
+}
+static VEntry **vmap_find(VMap *m, uint64_t h, const char *s, size_t len) {
+    VEntry **pp = &m->bkt[h % m->nbkt];
+    while (*pp && !((*pp)->h==h && (*pp)->len==len && memcmp((*pp)->s, s, len)==0)) pp = &(*pp)->next;
+    return pp;
+}
+/* Add count occurrences of one lexeme. */
+static void vmap_add_n(VMap *m, const char *s, size_t len, uint64_t count) {
+    uint64_t h = fnv1a64(s, len);
+    VEntry **pp = vmap_find(m, h, s, len);
+    if (*pp) { (*pp)->count += count; return; }
+    vmap_new_entry(m, h, s, len, count);
+}
+/* Add every count of src to dst; src is left unchanged. */
+static void vmap_add_all(VMap *dst, const VMap *src) {
+    for (size_t i=0;i<src->nbkt;++i)
+        for (const VEntry *e=src->bkt[i]; e; e=e->next) vmap_add_n(dst, e->s, e->len, e->count);
+}
+/* Copy the live entries into a fresh pool and drop the old one. */
+static void vmap_compact(VMap *m) {
+    Pool mem;
+    pool_init(&mem, sizeof(VEntry));
+    for (size_t i=0;i<m->nbkt;++i)
+        for (VEntry **pp=&m->bkt[i]; *pp; pp=&(*pp)->next) {
+            VEntry *e = (VEntry*)pool_alloc(&mem);
+            *e = **pp;
+            e->s = arena_strndup(&mem.a, e->s, e->len);
+            *pp = e;
+        }
+    pool_free(&m->mem);
+    m->mem = mem;
+    m->dead = 0;
+}
+/* Subtract every count of src (previously added) from dst; entries that drop
+   to zero are removed. */
+static void vmap_sub(VMap *dst, const VMap *src) {
+    for (size_t i=0;i<src->nbkt;++i)
+        for (const VEntry *e=src->bkt[i]; e; e=e->next) {
+            VEntry **pp = vmap_find(dst, e->h, e->s, e->len);
+            VEntry *d = *pp;
+            if (!d) continue;
+            if (d->count > e->count) { d->count -= e->count; continue; }
+            *pp = d->next;
+            dst->dead += d->len + 1;
+            pool_put(&dst->mem, d);
+            dst->nitem--;
+        }
+    if (dst->dead > ARENA_BLOCK && dst->dead > dst->mem.a.bytes / 2) vmap_compact(dst);
+}
+static void vmap_free(VMap *m) {
+    pool_free(&m->mem);
     free(m->bkt);
 }
 
@@ -139,34 +577,43 @@ typedef struct {
     size_t n;
 } Buf;
 
-static int read_file(const char *path, Buf *b) {
+/* Read path ("-" for stdin) into b: from arena a when given, else malloc. */
+static int read_whole_file(const char *path, Buf *b, Arena *a) {
     FILE *f = NULL;
     if (strcmp(path,"-")==0) f = stdin;
     else f = fopen(path, "rb");
     if (!f) { fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno)); return -1; }
     if (f==stdin) {
-        /* Read stdin to dynamic buffer */
-        size_t cap = 1<<20;
-        b->p = (unsigned char*)malloc(cap);
-        if (!b->p) { fprintf(stderr,"OOM\n"); return -1; }
+        /* Read stdin to dynamic buffer; with an arena the buffer is grown
+           as an arena block and linked in, so it is never copied. */
+        size_t hdr = a ? ARENA_HDR : 0, cap = 1<<20;
+        unsigned char *blk = (unsigned char*)malloc(hdr + cap);
+        if (!blk) { fprintf(stderr,"OOM\n"); return -1; }
         b->n = 0;
         for (;;) {
             if (b->n + (1<<16) > cap) {
                 cap *= 2;
-                unsigned char *np = (unsigned char*)realloc(b->p, cap);
-                if (!np) { fprintf(stderr,"OOM\n"); free(b->p); return -1; }
-                b->p = np;
+                unsigned char *np = (unsigned char*)realloc(blk, hdr + cap);
+                if (!np) { fprintf(stderr,"OOM\n"); free(blk); return -1; }
+                blk = np;
             }
-            size_t r = fread(b->p + b->n, 1, (1<<16), f);
+            size_t r = fread(blk + hdr + b->n, 1, (1<<16), f);
             b->n += r;
             if (r==0) break;
         }
+        b->p = blk + hdr;
+        if (a) {
+            ArenaBlock *ab = (ArenaBlock*)blk;
+            ab->cap = ab->used = cap;
+            arena_link(a, ab);
+            a->allocs++; a->bytes += cap;
+        }
     } else {
         fseek(f, 0, SEEK_END);
         long sz = ftell(f);
         if (sz < 0) { fprintf(stderr,"ftell failed\n"); fclose(f); return -1; }
         fseek(f, 0, SEEK_SET);
-        b->p = (unsigned char*)malloc((size_t)sz);
+        b->p = a ? (unsigned char*)arena_alloc(a, (size_t)sz) : (unsigned char*)malloc((size_t)sz);
         if (!b->p) { fprintf(stderr,"OOM\n"); fclose(f); return -1; }
         b->n = fread(b->p, 1, (size_t)sz, f);
         fclose(f);
@@ -174,29 +621,427 @@ static int read_file(const char *path, Buf *b) {
     return 0;
 }
 
+/* ---------- Threads (pthreads, or Win32 on _WIN32) ---------- */
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE ct_thread;
+typedef CRITICAL_SECTION ct_mutex;
+typedef CONDITION_VARIABLE ct_cond;
+typedef struct { void *(*fn)(void*); void *arg; } CtThreadStart;
+static DWORD WINAPI ct_thread_tramp(LPVOID p) {
+    CtThreadStart st = *(CtThreadStart*)p;
+    free(p);
+    st.fn(st.arg);
+    return 0;
+}
+static int ct_thread_start(ct_thread *t, void *(*fn)(void*), void *arg) {
+    CtThreadStart *st = (CtThreadStart*)malloc(sizeof(*st));
+    if (!st) return -1;
+    st->fn = fn; st->arg = arg;
+    *t = CreateThread(NULL, 0, ct_thread_tramp, st, 0, NULL);
+    if (!*t) { free(st); return -1; }
+    return 0;
+}
+static void ct_thread_join(ct_thread t) { WaitForSingleObject(t, INFINITE); CloseHandle(t); }
+static void ct_mutex_init(ct_mutex *m) { InitializeCriticalSection(m); }
+static void ct_mutex_lock(ct_mutex *m) { EnterCriticalSection(m); }
+static void ct_mutex_unlock(ct_mutex *m) { LeaveCriticalSection(m); }
+static void ct_mutex_destroy(ct_mutex *m) { DeleteCriticalSection(m); }
+static void ct_cond_init(ct_cond *c) { InitializeConditionVariable(c); }
+static void ct_cond_wait(ct_cond *c, ct_mutex *m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void ct_cond_broadcast(ct_cond *c) { WakeAllConditionVariable(c); }
+static void ct_cond_destroy(ct_cond *c) { (void)c; }
+static int ct_ncpu(void) { SYSTEM_INFO si; GetSystemInfo(&si); return (int)si.dwNumberOfProcessors; }
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+typedef pthread_t ct_thread;
+typedef pthread_mutex_t ct_mutex;
+typedef pthread_cond_t ct_cond;
+static int ct_thread_start(ct_thread *t, void *(*fn)(void*), void *arg) { return pthread_create(t, NULL, fn, arg) ? -1 : 0; }
+static void ct_thread_join(ct_thread t) { pthread_join(t, NULL); }
+static void ct_mutex_init(ct_mutex *m) { pthread_mutex_init(m, NULL); }
+static void ct_mutex_lock(ct_mutex *m) { pthread_mutex_lock(m); }
+static void ct_mutex_unlock(ct_mutex *m) { pthread_mutex_unlock(m); }
+static void ct_mutex_destroy(ct_mutex *m) { pthread_mutex_destroy(m); }
+static void ct_cond_init(ct_cond *c) { pthread_cond_init(c, NULL); }
+static void ct_cond_wait(ct_cond *c, ct_mutex *m) { pthread_cond_wait(c, m); }
+static void ct_cond_broadcast(ct_cond *c) { pthread_cond_broadcast(c); }
+static void ct_cond_destroy(ct_cond *c) { pthread_cond_destroy(c); }
+static int ct_ncpu(void) { long n = sysconf(_SC_NPROCESSORS_ONLN); return n > 0 ? (int)n : 1; }
+#endif
+
+/* ---------- Profiler (--profile) ----------
+ * Per-phase wall time from the TSC (monotonic clock off x86), thread CPU time
+ * and, on Linux, perf_event_open hardware counters read at phase boundaries.
+ * Coarse phases (read_file, lex_file, fwrite, compress) are measured on every
+ * call. The per-token phases (json_escape_write, vmap_add) time one call in
+ * PROF_SAMPLE with the TSC only, and the total is extrapolated. Phases nest:
+ * json_escape_write, vmap_add and stream-mode fwrite run inside lex_file.
+ * Every hook starts with a NULL check of g_prof, so runs without --profile
+ * skip all of this. Each thread accumulates into its own ProfThread, found
+ * via thread-local storage and registered once; the report sums them. */
+enum { PH_READ_FILE, PH_LEX_FILE, PH_JSON_ESCAPE, PH_VMAP_ADD, PH_FWRITE, PH_COMPRESS, PH_N };
+static const char *PH_NAMES[PH_N] = {
+    "read_file", "lex_file", "json_escape_write", "vmap_add", "fwrite", "compress"
+};
+enum { HW_CYCLES, HW_INSTRUCTIONS, HW_BRANCH_MISSES, HW_CACHE_MISSES, HW_N };
+static const char *HW_NAMES[HW_N] = { "cycles", "instructions", "branch_misses", "cache_misses" };
+enum { MEM_ALLOCS, MEM_BYTES, MEM_REUSES, MEM_BLOCKS, MEM_BLOCK_BYTES, MEM_N };
+static const char *MEM_NAMES[MEM_N] = { "arena_allocs", "arena_bytes", "pool_reuses", "blocks", "block_bytes" };
+#define PROF_SAMPLE 64
+
+typedef struct {
+    uint64_t calls, timed;  /* calls seen, calls measured (differ for sampled phases) */
+    uint64_t ticks, cpu_ns;
+    uint64_t hw[HW_N];
+} ProfPhase;
+
+typedef struct ProfThread {
+    ProfPhase ph[PH_N];
+    uint64_t mem[MEM_N];    /* arena counters, see arena_count */
+    int hw_fd[HW_N];        /* perf group, hw_fd[0] leads; -1 when unavailable */
+    struct ProfThread *next;
+} ProfThread;
+
+typedef struct {
+    ct_mutex mu;
+    ProfThread *threads;
+    uint64_t t0_ticks, t0_ns;
+    int hw;                 /* counters opened on at least one thread */
+} Profiler;
+
+typedef struct { uint64_t ticks, cpu_ns, hw[HW_N]; } ProfMark;
+
+static Profiler *g_prof;
+
+static CT_TLS ProfThread *tls_prof;
+
+#ifdef _WIN32
+static uint64_t prof_ns(void) {
+    LARGE_INTEGER c, f;
+    QueryPerformanceCounter(&c); QueryPerformanceFrequency(&f);
+    return (uint64_t)((double)c.QuadPart * 1e9 / (double)f.QuadPart);
+}
+static uint64_t prof_cpu_ns(void) {
+    FILETIME cr, ex, k, u;
+    if (!GetThreadTimes(GetCurrentThread(), &cr, &ex, &k, &u)) return 0;
+    return ((((uint64_t)k.dwHighDateTime<<32) | k.dwLowDateTime) +
+            (((uint64_t)u.dwHighDateTime<<32) | u.dwLowDateTime)) * 100;
+}
+#else
+static uint64_t prof_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+static uint64_t prof_cpu_ns(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define PROF_TIMER "tsc"
+static uint64_t prof_ticks(void) { return (uint64_t)__rdtsc(); }
+#else
+#define PROF_TIMER "clock"
+static uint64_t prof_ticks(void) { return prof_ns(); }
+#endif
+
+#ifdef __linux__
+static void prof_hw_open(ProfThread *pt) {
+    static const uint64_t cfg[HW_N] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES
+    };
+    for (int i=0;i<HW_N;++i) {
+        struct perf_event_attr a;
+        memset(&a, 0, sizeof(a));
+        a.type = PERF_TYPE_HARDWARE; a.size = sizeof(a); a.config = cfg[i];
+        a.exclude_kernel = 1; a.exclude_hv = 1;
+        a.read_format = PERF_FORMAT_GROUP;
+        /* this thread only, any CPU */
+        pt->hw_fd[i] = (int)syscall(SYS_perf_event_open, &a, 0, -1, i ? pt->hw_fd[0] : -1, 0UL);
+        if (pt->hw_fd[i] < 0) {
+            while (i-- > 0) close(pt->hw_fd[i]);
+            pt->hw_fd[0] = -1;
+            return;
+        }
+    }
+    g_prof->hw = 1;
+}
+static void prof_hw_read(const ProfThread *pt, uint64_t *hw) {
+    uint64_t v[1 + HW_N];
+    if (read(pt->hw_fd[0], v, sizeof(v)) == (ssize_t)sizeof(v)) memcpy(hw, v + 1, sizeof(uint64_t) * HW_N);
+    else memset(hw, 0, sizeof(uint64_t) * HW_N);
+}
+static void prof_hw_close(ProfThread *pt) {
+    if (pt->hw_fd[0] < 0) return;
+    for (int i=0;i<HW_N;++i) close(pt->hw_fd[i]);
+    pt->hw_fd[0] = -1;
+}
+#else
+static void prof_hw_open(ProfThread *pt) { pt->hw_fd[0] = -1; }
+static void prof_hw_read(const ProfThread *pt, uint64_t *hw) { (void)pt; memset(hw, 0, sizeof(uint64_t) * HW_N); }
+static void prof_hw_close(ProfThread *pt) { (void)pt; }
+#endif
+
+static void prof_start(void) {
+    g_prof = (Profiler*)calloc(1, sizeof(Profiler));
+    if (!g_prof) { fprintf(stderr,"OOM\n"); exit(1); }
+    ct_mutex_init(&g_prof->mu);
+    g_prof->t0_ns = prof_ns();
+    g_prof->t0_ticks = prof_ticks();
+}
+
+/* The calling thread's accumulator, created and registered on first use. */
+static ProfThread *prof_thread(void) {
+    if (tls_prof) return tls_prof;
+    ProfThread *pt = (ProfThread*)calloc(1, sizeof(ProfThread));
+    if (!pt) { fprintf(stderr,"OOM\n"); exit(1); }
+    prof_hw_open(pt);
+    ct_mutex_lock(&g_prof->mu);
+    pt->next = g_prof->threads; g_prof->threads = pt;
+    ct_mutex_unlock(&g_prof->mu);
+    tls_prof = pt;
+    return pt;
+}
+
+/* Worker threads call this before exiting; totals stay registered. */
+static void prof_thread_exit(void) {
+    if (!g_prof || !tls_prof) return;
+    prof_hw_close(tls_prof);
+    tls_prof = NULL;
+}
+
+static void prof_begin(ProfMark *m) {
+    if (!g_prof) return;
+    ProfThread *pt = prof_thread();
+    if (pt->hw_fd[0] >= 0) prof_hw_read(pt, m->hw);
+    m->cpu_ns = prof_cpu_ns();
+    m->ticks = prof_ticks();
+}
+static void prof_end(const ProfMark *m, int ph) {
+    if (!g_prof) return;
+    uint64_t ticks = prof_ticks();
+    ProfThread *pt = tls_prof;
+    ProfPhase *p = &pt->ph[ph];
+    p->ticks += ticks - m->ticks;
+    p->cpu_ns += prof_cpu_ns() - m->cpu_ns;
+    if (pt->hw_fd[0] >= 0) {
+        uint64_t hw[HW_N];
+        prof_hw_read(pt, hw);
+        for (int i=0;i<HW_N;++i) p->hw[i] += hw[i] - m->hw[i];
+    }
+    p->calls++; p->timed++;
+}
+
+/* Add an arena's counters to this thread's report and clear them. */
+static void arena_count(Arena *a) {
+    if (g_prof) {
+        uint64_t *m = prof_thread()->mem;
+        m[MEM_ALLOCS] += a->allocs; m[MEM_BYTES] += a->bytes; m[MEM_REUSES] += a->reuses;
+        m[MEM_BLOCKS] += a->blocks; m[MEM_BLOCK_BYTES] += a->block_bytes;
+    }
+    a->allocs = a->bytes = a->reuses = a->blocks = a->block_bytes = 0;
+}
+
+/* Per-token phases: count every call, time one in PROF_SAMPLE. */
+static int prof_sample(ProfThread *pt, int ph) {
+    return (pt->ph[ph].calls++ % PROF_SAMPLE) == 0;
+}
+static void prof_sampled(ProfThread *pt, int ph, uint64_t t0) {
+    pt->ph[ph].ticks += prof_ticks() - t0;
+    pt->ph[ph].timed++;
+}
+
+static void prof_write_json(FILE *out) {
+    ProfPhase tot[PH_N];
+    uint64_t mem[MEM_N];
+    int nthreads = 0;
+    memset(tot, 0, sizeof(tot));
+    memset(mem, 0, sizeof(mem));
+    prof_thread_exit();
+    ct_mutex_lock(&g_prof->mu);
+    for (ProfThread *pt=g_prof->threads; pt; pt=pt->next) {
+        nthreads++;
+        for (int ph=0;ph<PH_N;++ph) {
+            tot[ph].calls += pt->ph[ph].calls; tot[ph].timed += pt->ph[ph].timed;
+            tot[ph].ticks += pt->ph[ph].ticks; tot[ph].cpu_ns += pt->ph[ph].cpu_ns;
+            for (int i=0;i<HW_N;++i) tot[ph].hw[i] += pt->ph[ph].hw[i];
+        }
+        for (int i=0;i<MEM_N;++i) mem[i] += pt->mem[i];
+    }
+    ct_mutex_unlock(&g_prof->mu);
+    uint64_t wall_ns = prof_ns() - g_prof->t0_ns, ticks = prof_ticks() - g_prof->t0_ticks;
+    double tick_ns = ticks ? (double)wall_ns / (double)ticks : 1.0;
+    fprintf(out, "{\"timer\":\"%s\",\"wall_ms\":%.3f,\"threads\":%d,\"sample_every\":%d,\"hw_counters\":%s,\"phases\":{",
+            PROF_TIMER, (double)wall_ns / 1e6, nthreads, PROF_SAMPLE, g_prof->hw ? "true" : "false");
+    for (int ph=0;ph<PH_N;++ph) {
+        const ProfPhase *p = &tot[ph];
+        int sampled = (ph == PH_JSON_ESCAPE || ph == PH_VMAP_ADD);
+        double ms = (double)p->ticks * tick_ns / 1e6;
+        if (sampled && p->timed) ms *= (double)p->calls / (double)p->timed;
+        fprintf(out, "%s\"%s\":{\"calls\":%llu,\"wall_ms\":%.3f", ph ? "," : "", PH_NAMES[ph],
+                (unsigned long long)p->calls, ms);
+        if (sampled) {
+            fprintf(out, ",\"timed\":%llu", (unsigned long long)p->timed);
+        } else {
+            fprintf(out, ",\"cpu_ms\":%.3f", (double)p->cpu_ns / 1e6);
+            if (g_prof->hw)
+                for (int i=0;i<HW_N;++i) fprintf(out, ",\"%s\":%llu", HW_NAMES[i], (unsigned long long)p->hw[i]);
+        }
+        fputc('}', out);
+    }
+    fprintf(out, "},\"memory\":{");
+    for (int i=0;i<MEM_N;++i) fprintf(out, "%s\"%s\":%llu", i ? "," : "", MEM_NAMES[i], (unsigned long long)mem[i]);
+    fprintf(out, "}}");
+}
+
+/* Modes without a JSON document of their own report on stderr. */
+static void prof_report_stderr(void) {
+    if (!g_prof) return;
+    fprintf(stderr, "{\"profile\":");
+    prof_write_json(stderr);
+    fprintf(stderr, "}\n");
+}
+
+static int read_file(const char *path, Buf *b) {
+    ProfMark pm;
+    prof_begin(&pm);
+    int rc = read_whole_file(path, b, NULL);
+    prof_end(&pm, PH_READ_FILE);
+    return rc;
+}
+/* read_file into this thread's scratch arena; arena_reset(&tls_scratch)
+   instead of free(b->p) once the file is done. */
+static int read_file_scratch(const char *path, Buf *b) {
+    ProfMark pm;
+    prof_begin(&pm);
+    int rc = read_whole_file(path, b, &tls_scratch);
+    prof_end(&pm, PH_READ_FILE);
+    return rc;
+}
+
+/* ---------- Parallel for (dynamic scheduling over [0,n)) ---------- */
+typedef void (*ParFn)(void *ctx, size_t i, int tid);
+
+typedef struct {
+    ParFn fn;
+    void *ctx;
+    size_t n, next;
+    ct_mutex mu;
+} ParJob;
+typedef struct { ParJob *job; int tid; } ParArg;
+
+static void par_run(ParJob *j, int tid) {
+    for (;;) {
+        ct_mutex_lock(&j->mu);
+        size_t i = j->next < j->n ? j->next++ : j->n;
+        ct_mutex_unlock(&j->mu);
+        if (i >= j->n) break;
+        j->fn(j->ctx, i, tid);
+    }
+}
+static void *par_worker(void *arg) {
+    ParArg *pa = (ParArg*)arg;
+    par_run(pa->job, pa->tid);
+    arena_free(&tls_scratch);
+    free(tls_line_starts);
+    tls_line_starts = NULL; tls_line_cap = 0;
+    prof_thread_exit();
+    return NULL;
+}
+/* Run fn(ctx, i, tid) for every i in [0,n) on up to nthreads threads; tid < nthreads. */
+static void par_for(size_t n, int nthreads, ParFn fn, void *ctx) {
+    if ((size_t)nthreads > n) nthreads = (int)n;
+    if (nthreads <= 1) {
+        for (size_t i=0;i<n;++i) fn(ctx, i, 0);
+        return;
+    }
+    ParJob job; job.fn = fn; job.ctx = ctx; job.n = n; job.next = 0;
+    ct_mutex_init(&job.mu);
+    ct_thread *th = (ct_thread*)calloc((size_t)nthreads, sizeof(ct_thread));
+    ParArg *args = (ParArg*)calloc((size_t)nthreads, sizeof(ParArg));
+    if (!th || !args) { fprintf(stderr,"OOM\n"); exit(1); }
+    int started = 0;
+    for (int t=1;t<nthreads;++t) {
+        args[t].job = &job; args[t].tid = t;
+        if (ct_thread_start(&th[t], par_worker, &args[t]) != 0) break;
+        started = t;
+    }
+    par_run(&job, 0);
+    for (int t=1;t<=started;++t) ct_thread_join(th[t]);
+    ct_mutex_destroy(&job.mu);
+    free(th); free(args);
+}
+
+/* ---------- Output buffer ---------- */
+typedef struct {
+    unsigned char *p;
+    size_t n, cap;
+} OBuf;
+
+static void ob_reserve(OBuf *b, size_t extra) {
+    if (b->n + extra <= b->cap) return;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->n + extra) cap *= 2;
+    unsigned char *np = (unsigned char*)realloc(b->p, cap);
+    if (!np) { fprintf(stderr,"OOM\n"); exit(1); }
+    b->p = np; b->cap = cap;
+}
+static void ob_write(OBuf *b, const void *s, size_t len) {
+    ob_reserve(b, len);
+    memcpy(b->p + b->n, s, len); b->n += len;
+}
+static void ob_putc(OBuf *b, int c) {
+    ob_reserve(b, 1);
+    b->p[b->n++] = (unsigned char)c;
+}
+static void ob_puts(OBuf *b, const char *s) { ob_write(b, s, strlen(s)); }
+static void ob_u64(OBuf *b, uint64_t v) {
+    char t[20]; int k = 0;
+    do { t[k++] = (char)('0' + v%10); v /= 10; } while (v);
+    ob_reserve(b, (size_t)k);
+    while (k) b->p[b->n++] = (unsigned char)t[--k];
+}
+static void ob_free(OBuf *b) { free(b->p); b->p = NULL; b->n = b->cap = 0; }
+
 /* ---------- JSON escaping ---------- */
-static void json_escape_write(const unsigned char *s, size_t len, FILE *out) {
+static void json_escape_write(const unsigned char *s, size_t len, OBuf *out) {
+    ob_reserve(out, len*6);
+    unsigned char *o = out->p + out->n;
     for (size_t i=0;i<len;++i) {
         unsigned char c = s[i];
         if (c == '\"' || c == '\\') {
-            fputc('\\', out);
-            fputc(c, out);
+            *o++ = '\\';
+            *o++ = c;
         } else if (c == '\n') {
-            fputs("\\n", out);
+            *o++ = '\\'; *o++ = 'n';
         } else if (c == '\r') {
-            fputs("\\r", out);
+            *o++ = '\\'; *o++ = 'r';
         } else if (c == '\t') {
-            fputs("\\t", out);
+            *o++ = '\\'; *o++ = 't';
         } else if (c < 0x20 || c == 0x7f) {
             /* Other ASCII control chars -> \u00XX */
             static const char *hex="0123456789ABCDEF";
-            fputs("\\u00", out);
-            fputc(hex[(c>>4)&0xF], out);
-            fputc(hex[c&0xF], out);
+            memcpy(o, "\\u00", 4); o += 4;
+            *o++ = (unsigned char)hex[(c>>4)&0xF];
+            *o++ = (unsigned char)hex[c&0xF];
         } else {
-            fputc(c, out);
+            *o++ = c;
         }
     }
+    out->n = (size_t)(o - out->p);
 }
 
 /* ---------- Minimal JSON string unescape (for reassemble) ---------- */
@@ -206,10 +1051,8 @@ static int hexval(char c) {
     if (c>='A'&&c<='F') return 10 + (c-'A');
     return -1;
 }
-static unsigned char *json_unescape_alloc(const char *s, size_t *out_len) {
-    size_t n = strlen(s);
-    unsigned char *buf = (unsigned char*)malloc(n+1);
-    if (!buf) return NULL;
+/* Unescape s[0..n) into buf (at least n bytes); returns the decoded length. */
+static size_t json_unescape_to(const char *s, size_t n, unsigned char *buf) {
     size_t j=0;
     for (size_t i=0;i<n;) {
         char c = s[i++];
@@ -252,36 +1095,12 @@ static unsigned char *json_unescape_alloc(const char *s, size_t *out_len) {
             default: buf[j++]=(unsigned char)e; break;
         }
     }
-    buf[j]=0;
-    if (out_len) *out_len = j;
-    return buf;
-}
-
-/* ---------- Token kinds ---------- */
-typedef enum {
-    TK_WS, TK_NEWLINE, TK_LINE_COMMENT, TK_BLOCK_COMMENT, TK_PREPROC,
-    TK_IDENT, TK_KEYWORD, TK_NUMBER, TK_STRING, TK_CHAR, TK_PUNCT
-} TokKind;
-static const char *kind_name(TokKind k) {
-    switch (k) {
-        case TK_WS: return "WS";
-        case TK_NEWLINE: return "NEWLINE";
-        case TK_LINE_COMMENT: return "LINE_COMMENT";
-        case TK_BLOCK_COMMENT: return "BLOCK_COMMENT";
-        case TK_PREPROC: return "PREPROC";
-        case TK_IDENT: return "IDENT";
-        case TK_KEYWORD: return "KEYWORD";
-        case TK_NUMBER: return "NUMBER";
-        case TK_STRING: return "STRING";
-        case TK_CHAR: return "CHAR";
-        case TK_PUNCT: return "PUNCT";
-    }
-    return "UNK";
+    return j;
 }
 
 /* ---------- Metrics ---------- */
 typedef struct {
-    uint64_t counts[16]; /* by TokKind index */
+    uint64_t counts[16]; /* by CtKind index */
     uint64_t tokens_total;
     uint64_t bytes_total;
     uint64_t bytes_comments;
@@ -289,245 +1108,635 @@ typedef struct {
     uint64_t lines;
 } Metrics;
 
-/* ---------- Emit JSONL token ---------- */
-static void emit_json_token(FILE *out, const char *fname, size_t off, size_t line, size_t col,
-                            TokKind kind, const unsigned char *lex, size_t len) {
-    fputs("{\"file\":\"", out); fputs(fname, out); fputs("\",", out);
-    fprintf(out, "\"off\":%zu,\"line\":%zu,\"col\":%zu,", off, line, col);
-    fputs("\"kind\":\"", out); fputs(kind_name(kind), out); fputs("\",\"lexeme\":\"", out);
-    json_escape_write(lex, len, out);
-    fputs("\"}\n", out);
-}
+/* ---------- Frame codecs (gzip via zlib, zstd) ---------- */
+#ifdef CT_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CT_WITH_ZSTD
+#include <zstd.h>
+#endif
 
-/* ---------- Punctuator matching ---------- */
-static int is_punct_char(int c) {
-    const char *p = "{}[]()#;,:?~!%^&*-+=|<>./";
-    return (c && strchr(p, c)!=NULL);
-}
-static size_t match_punct(const unsigned char *s, size_t n) {
-    if (n==0) return 0;
-    /* Try 3-char punctuators */
-    if (n>=3) {
-        if (!memcmp(s,"<<=",3) || !memcmp(s,">>=",3) || !memcmp(s,"...",3) || !memcmp(s,"##",2) /* check later */) {
-            if (!memcmp(s,"##",2)) return 2;
-            return 3;
-        }
+enum { CZ_NONE, CZ_GZIP, CZ_ZSTD };
+
+static const char *cz_name(int c) {
+    switch (c) {
+        case CZ_GZIP: return "gzip";
+        case CZ_ZSTD: return "zstd";
     }
-    /* Try 2-char */
-    if (n>=2) {
-        const char *twos[] = {"->","++","--","<<",">>","<=",">=","==","!=","&&","||",
-                              "+=","-=","*=","/=","%=","&=","|=","^=","::",".*","->*","##"};
-        for (size_t i=0;i<sizeof(twos)/sizeof(twos[0]);++i) {
-            if (!memcmp(s, twos[i], strlen(twos[i]))) return strlen(twos[i]);
-        }
+    return "none";
+}
+static int cz_parse(const char *s) {
+    if (strcmp(s,"none")==0) return CZ_NONE;
+    if (strcmp(s,"gzip")==0 || strcmp(s,"gz")==0) return CZ_GZIP;
+    if (strcmp(s,"zstd")==0 || strcmp(s,"zst")==0) return CZ_ZSTD;
+    return -1;
+}
+static int cz_available(int c) {
+    switch (c) {
+        case CZ_NONE: return 1;
+#ifdef CT_WITH_ZLIB
+        case CZ_GZIP: return 1;
+#endif
+#ifdef CT_WITH_ZSTD
+        case CZ_ZSTD: return 1;
+#endif
     }
-    /* Single char */
-    if (is_punct_char(s[0])) return 1;
     return 0;
 }
-
-/* ---------- Tokenize one file ---------- */
-typedef struct {
-    const unsigned char *p;
-    size_t n, i;
-    size_t line, col;
-    const char *fname;
-    FILE *out_stream;
-    Metrics *mx;
-    VMap *vmap; /* for identifiers and keywords */
-} Lexer;
-
-static void metrics_add(Metrics *mx, TokKind k, size_t len) {
-    if ((int)k < 16) mx->counts[(int)k]++;
-    mx->tokens_total++;
-    mx->bytes_total += len;
-    if (k==TK_LINE_COMMENT || k==TK_BLOCK_COMMENT) mx->bytes_comments += len;
-    if (k==TK_WS || k==TK_NEWLINE) mx->bytes_whitespace += len;
-    if (k==TK_NEWLINE) mx->lines++;
+/* Detect a compressed stream by its leading magic bytes. */
+static int cz_sniff(const unsigned char *m, size_t n) {
+    if (n>=2 && m[0]==0x1f && m[1]==0x8b) return CZ_GZIP;
+    if (n>=4 && m[0]==0x28 && m[1]==0xb5 && m[2]==0x2f && m[3]==0xfd) return CZ_ZSTD;
+    return CZ_NONE;
 }
 
-static void emit(Lexer *lx, TokKind k, const unsigned char *s, size_t len, size_t start_off, size_t start_line, size_t start_col) {
-    if (lx->out_stream) {
-        emit_json_token(lx->out_stream, lx->fname, start_off, start_line, start_col, k, s, len);
-    }
-    metrics_add(lx->mx, k, len);
-    if (lx->vmap && (k==TK_IDENT || k==TK_KEYWORD)) {
-        vmap_add(lx->vmap, (const char*)s, len);
+/* Compress one self-contained frame, replacing out's contents. 0 on success. */
+static int cz_compress(int c, int level, const unsigned char *in, size_t n, OBuf *out) {
+    out->n = 0;
+    (void)level; (void)in; (void)n;
+    switch (c) {
+#ifdef CT_WITH_ZLIB
+        case CZ_GZIP: {
+            z_stream zs; memset(&zs, 0, sizeof(zs));
+            if (deflateInit2(&zs, level < 0 ? 6 : level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+            ob_reserve(out, deflateBound(&zs, (uLong)n) + 32);
+            zs.next_in = (Bytef*)in; zs.avail_in = (uInt)n;
+            zs.next_out = out->p; zs.avail_out = (uInt)out->cap;
+            int rc = deflate(&zs, Z_FINISH);
+            out->n = zs.total_out;
+            deflateEnd(&zs);
+            return rc == Z_STREAM_END ? 0 : -1;
+        }
+#endif
+#ifdef CT_WITH_ZSTD
+        case CZ_ZSTD: {
+            ob_reserve(out, ZSTD_compressBound(n));
+            size_t r = ZSTD_compress(out->p, out->cap, in, n, level < 0 ? 3 : level);
+            if (ZSTD_isError(r)) return -1;
+            out->n = r;
+            return 0;
+        }
+#endif
     }
+    return -1;
 }
 
-static void lex_file(Buf *b, const char *fname, FILE *out_stream, Metrics *mx, VMap *vmap) {
-    Lexer lx = { b->p, b->n, 0, 1, 1, fname, out_stream, mx, vmap };
-    while (lx.i < lx.n) {
-        size_t start = lx.i, start_line = lx.line, start_col = lx.col;
-        unsigned char c = lx.p[lx.i];
-
-        /* Newline(s): handle CRLF and LF */
-        if (c == '\r') {
-            size_t j = lx.i;
-            if (j+1 < lx.n && lx.p[j+1]=='\n') {
-                lx.i += 2; lx.line++; lx.col = 1;
-                emit(&lx, TK_NEWLINE, lx.p+start, 2, start, start_line, start_col);
-            } else {
-                lx.i += 1; lx.line++; lx.col = 1;
-                emit(&lx, TK_NEWLINE, lx.p+start, 1, start, start_line, start_col);
-            }
-            continue;
+/* Decompress one frame whose uncompressed size is known (from the seek table). */
+static int cz_decompress(int c, const unsigned char *in, size_t n, size_t ulen, OBuf *out) {
+    out->n = 0;
+    ob_reserve(out, ulen + 1);
+    (void)in; (void)n;
+    switch (c) {
+#ifdef CT_WITH_ZLIB
+        case CZ_GZIP: {
+            z_stream zs; memset(&zs, 0, sizeof(zs));
+            if (inflateInit2(&zs, 15+16) != Z_OK) return -1;
+            zs.next_in = (Bytef*)in; zs.avail_in = (uInt)n;
+            zs.next_out = out->p; zs.avail_out = (uInt)out->cap;
+            int rc = inflate(&zs, Z_FINISH);
+            out->n = zs.total_out;
+            inflateEnd(&zs);
+            return (rc == Z_STREAM_END && out->n == ulen) ? 0 : -1;
         }
-        if (c == '\n') {
-            lx.i += 1; lx.line++; lx.col = 1;
-            emit(&lx, TK_NEWLINE, lx.p+start, 1, start, start_line, start_col);
-            continue;
+#endif
+#ifdef CT_WITH_ZSTD
+        case CZ_ZSTD: {
+            size_t r = ZSTD_decompress(out->p, out->cap, in, n);
+            if (ZSTD_isError(r) || r != ulen) return -1;
+            out->n = r;
+            return 0;
         }
+#endif
+    }
+    return -1;
+}
 
-        /* Whitespace run (excluding newlines) */
-        if (c==' ' || c=='\t' || c=='\v' || c=='\f') {
-            size_t j = lx.i+1;
-            while (j<lx.n) {
-                unsigned char d = lx.p[j];
-                if (d==' '||d=='\t'||d=='\v'||d=='\f') j++;
-                else break;
-            }
-            lx.i = j; lx.col += (j-start);
-            emit(&lx, TK_WS, lx.p+start, j-start, start, start_line, start_col);
-            continue;
-        }
+/* ---------- Frame pool: compress frames on worker threads, emit in order ---------- */
+enum { FR_FREE, FR_QUEUED, FR_BUSY, FR_DONE };
 
-        /* Preprocessor line starting with '#' at column 1 */
-        if (c=='#' && lx.col==1) {
-            size_t j = lx.i+1;
-            /* continuation handled inline; no flag needed */
-            while (j < lx.n) {
-                unsigned char d = lx.p[j];
-                if (d=='\r') {
-                    /* Check CRLF; treat as newline; stop if not continued */
-                    if (j>start && lx.p[j-1]=='\\') { /* continued */
-                        if (j+1 < lx.n && lx.p[j+1]=='\n') { j+=2; continue; }
-                        else { j+=1; continue; }
-                    }
-                    break;
-                } else if (d=='\n') {
-                    if (j>start && lx.p[j-1]=='\\') { j++; continue; }
-                    break;
-                } else {
-                    j++;
-                }
-            }
-            size_t len = j - start;
-            lx.i = j; lx.col += len;
-            emit(&lx, TK_PREPROC, lx.p+start, len, start, start_line, start_col);
-            continue;
-        }
+typedef struct {
+    OBuf in, out;
+    int state;
+    int err;
+} Frame;
 
-        /* Comments */
-        if (c=='/' && lx.i+1<lx.n) {
-            unsigned char n1 = lx.p[lx.i+1];
-            if (n1=='/') {
-                size_t j = lx.i+2;
-                while (j<lx.n && lx.p[j] != '\n' && lx.p[j] != '\r') j++;
-                lx.i = j; lx.col += (j-start);
-                emit(&lx, TK_LINE_COMMENT, lx.p+start, j-start, start, start_line, start_col);
-                continue;
-            } else if (n1=='*') {
-                size_t j = lx.i+2;
-                while (j+1<lx.n && !(lx.p[j]=='*' && lx.p[j+1]=='/')) j++;
-                if (j+1 < lx.n) j+=2; /* include closing */ 
-                lx.i = j; lx.col += (j-start);
-                emit(&lx, TK_BLOCK_COMMENT, lx.p+start, j-start, start, start_line, start_col);
-                continue;
-            }
-        }
+typedef struct {
+    Frame *slots;
+    size_t nslots;
+    size_t head, next, tail;  /* oldest unwritten, next to compress, next free */
+    int compress, level, stop;
+    ct_mutex mu;
+    ct_cond cv;
+    ct_thread *th;
+    int nth;
+} FramePool;
 
-        /* String literal */
-        if (c=='\"') {
-            size_t j = lx.i+1;
-            
-            while (j<lx.n) {
-                unsigned char d = lx.p[j++];
-                if (d=='\\') {
-                    if (j<lx.n) j++; /* skip escaped char */
-                } else if (d=='\"') {
-                    break;
-                }
-            }
-            size_t len = j - start;
-            lx.i = j; lx.col += len;
-            emit(&lx, TK_STRING, lx.p+start, len, start, start_line, start_col);
-            continue;
-        }
+static void *frame_worker(void *arg) {
+    FramePool *fp = (FramePool*)arg;
+    ct_mutex_lock(&fp->mu);
+    for (;;) {
+        while (!fp->stop && fp->next == fp->tail) ct_cond_wait(&fp->cv, &fp->mu);
+        if (fp->next == fp->tail) break;
+        Frame *f = &fp->slots[fp->next % fp->nslots];
+        fp->next++;
+        f->state = FR_BUSY;
+        ct_mutex_unlock(&fp->mu);
+        ProfMark pm;
+        prof_begin(&pm);
+        f->err = cz_compress(fp->compress, fp->level, f->in.p, f->in.n, &f->out);
+        prof_end(&pm, PH_COMPRESS);
+        ct_mutex_lock(&fp->mu);
+        f->state = FR_DONE;
+        ct_cond_broadcast(&fp->cv);
+    }
+    ct_mutex_unlock(&fp->mu);
+    prof_thread_exit();
+    return NULL;
+}
 
-        /* Char literal */
-        if (c=='\'') {
-            size_t j = lx.i+1;
-            
-            while (j<lx.n) {
-                unsigned char d = lx.p[j++];
-                if (d=='\\') {
-                    if (j<lx.n) j++; /* skip escaped char */
-                } else if (d=='\'') {
-                    break;
-                }
-            }
-            size_t len = j - start;
-            lx.i = j; lx.col += len;
-            emit(&lx, TK_CHAR, lx.p+start, len, start, start_line, start_col);
-            continue;
-        }
+static FramePool *frame_pool_new(int nth, int compress, int level) {
+    FramePool *fp = (FramePool*)calloc(1, sizeof(FramePool));
+    if (!fp) { fprintf(stderr,"OOM\n"); exit(1); }
+    fp->nslots = (size_t)nth * 2;
+    fp->slots = (Frame*)calloc(fp->nslots, sizeof(Frame));
+    fp->th = (ct_thread*)calloc((size_t)nth, sizeof(ct_thread));
+    if (!fp->slots || !fp->th) { fprintf(stderr,"OOM\n"); exit(1); }
+    fp->compress = compress; fp->level = level;
+    ct_mutex_init(&fp->mu);
+    ct_cond_init(&fp->cv);
+    for (int t=0;t<nth;++t) {
+        if (ct_thread_start(&fp->th[t], frame_worker, fp) != 0) { fprintf(stderr,"Failed to start thread\n"); exit(1); }
+        fp->nth++;
+    }
+    return fp;
+}
+static void frame_pool_free(FramePool *fp) {
+    ct_mutex_lock(&fp->mu);
+    fp->stop = 1;
+    ct_cond_broadcast(&fp->cv);
+    ct_mutex_unlock(&fp->mu);
+    for (int t=0;t<fp->nth;++t) ct_thread_join(fp->th[t]);
+    for (size_t i=0;i<fp->nslots;++i) { ob_free(&fp->slots[i].in); ob_free(&fp->slots[i].out); }
+    ct_cond_destroy(&fp->cv);
+    ct_mutex_destroy(&fp->mu);
+    free(fp->slots); free(fp->th); free(fp);
+}
 
-        /* Identifier / keyword (C identifier rules) */
-        if (isalpha(c) || c=='_') {
-            size_t j = lx.i+1;
-            while (j<lx.n) {
-                unsigned char d = lx.p[j];
-                if (isalnum(d) || d=='_') j++; else break;
-            }
-            size_t len = j - start;
-            TokKind k = is_keyword((const char*)lx.p+start, len) ? TK_KEYWORD : TK_IDENT;
-            lx.i = j; lx.col += len;
-            emit(&lx, k, lx.p+start, len, start, start_line, start_col);
-            continue;
-        }
+/* ---------- Stream writer (plain or framed/compressed, with seek table) ---------- */
+typedef struct { uint64_t coff, clen, ulen; } SeekFrame;
+typedef struct { char *name; uint64_t first_frame, last_frame; } SeekFile;
 
-        /* Number literal (simple, accepts hex/dec/octal/floats/suffixes) */
-        if (isdigit(c) || (c=='.' && lx.i+1<lx.n && isdigit(lx.p[lx.i+1]))) {
-            size_t j = lx.i;
-            
-            if (lx.p[j]=='0' && j+1<lx.n && (lx.p[j+1]=='x'||lx.p[j+1]=='X')) {
-                j+=2;
-                while (j<lx.n && (isxdigit(lx.p[j]) || lx.p[j]=='\'')) j++;
-            } else {
-                while (j<lx.n && (isdigit(lx.p[j]) || lx.p[j]=='\'')) j++;
-                if (j<lx.n && lx.p[j]=='.') { j++; while (j<lx.n && (isdigit(lx.p[j])||lx.p[j]=='\'')) j++; }
-                if (j<lx.n && (lx.p[j]=='e'||lx.p[j]=='E'||lx.p[j]=='p'||lx.p[j]=='P')) {
-                    j++;
-                    if (j<lx.n && (lx.p[j]=='+'||lx.p[j]=='-')) j++;
-                    while (j<lx.n && isxdigit(lx.p[j])) j++;
-                }
-            }
-            /* Suffixes */
-            while (j<lx.n && (isalpha(lx.p[j]) || lx.p[j]=='_')) j++;
-            size_t len = j - start;
-            lx.i = j; lx.col += len;
-            emit(&lx, TK_NUMBER, lx.p+start, len, start, start_line, start_col);
-            continue;
-        }
+typedef struct {
+    FILE *f;
+    const char *path;
+    int compress, level;
+    size_t frame_size;
+    OBuf cur;              /* uncompressed bytes of the frame being filled */
+    OBuf zbuf;             /* scratch for inline compression */
+    uint64_t out_off;
+    uint64_t ubytes;       /* uncompressed bytes written */
+    uint64_t hash;         /* FNV-1a over every byte written to f */
+    SeekFrame *frames; size_t nframes, cap_frames;
+    SeekFile *files; size_t nfiles, cap_files;
+    FramePool *pool;       /* NULL: compress inline on the calling thread */
+} StreamWriter;
 
-        /* Punctuators/operators */
-        size_t plen = match_punct(lx.p + lx.i, lx.n - lx.i);
-        if (plen > 0) {
-            lx.i += plen; lx.col += plen;
-            emit(&lx, TK_PUNCT, lx.p+start, plen, start, start_line, start_col);
-            continue;
-        }
+static void sw_init(StreamWriter *sw, FILE *f, const char *path, int compress, int level,
+                    size_t frame_size, int nthreads) {
+    memset(sw, 0, sizeof(*sw));
+    sw->f = f; sw->path = path;
+    sw->compress = compress; sw->level = level;
+    sw->frame_size = frame_size ? frame_size : ((size_t)4<<20);
+    sw->hash = FNV1A64_INIT;
+    if (compress != CZ_NONE && nthreads > 1) sw->pool = frame_pool_new(nthreads, compress, level);
+}
 
-        /* Fallback: unknown byte, emit as PUNCT to preserve */
-        lx.i += 1; lx.col += 1;
-        emit(&lx, TK_PUNCT, lx.p+start, 1, start, start_line, start_col);
+static void sw_push_frame(StreamWriter *sw, uint64_t coff, uint64_t clen, uint64_t ulen) {
+    if (sw->nframes == sw->cap_frames) {
+        sw->cap_frames = sw->cap_frames ? sw->cap_frames*2 : 64;
+        sw->frames = (SeekFrame*)realloc(sw->frames, sw->cap_frames*sizeof(SeekFrame));
+        if (!sw->frames) { fprintf(stderr,"OOM\n"); exit(1); }
     }
+    SeekFrame *fr = &sw->frames[sw->nframes++];
+    fr->coff = coff; fr->clen = clen; fr->ulen = ulen;
 }
 
-/* ---------- Output helpers ---------- */
-/* ---------- Portable line reader (no POSIX getline dependency) ---------- */
+static void sw_put(StreamWriter *sw, const unsigned char *p, size_t n, uint64_t ulen) {
+    ProfMark pm;
+    prof_begin(&pm);
+    if (n && fwrite(p, 1, n, sw->f) != n) { fprintf(stderr,"Write failed: %s\n", strerror(errno)); exit(1); }
+    prof_end(&pm, PH_FWRITE);
+    sw->hash = fnv1a64_update(sw->hash, p, n);
+    sw->ubytes += ulen;
+    if (sw->compress != CZ_NONE) sw_push_frame(sw, sw->out_off, n, ulen);
+    sw->out_off += n;
+}
+
+/* Write the oldest finished frame; caller holds the pool lock. */
+static void sw_pop_frame(StreamWriter *sw) {
+    FramePool *fp = sw->pool;
+    Frame *f = &fp->slots[fp->head % fp->nslots];
+    while (f->state != FR_DONE) ct_cond_wait(&fp->cv, &fp->mu);
+    ct_mutex_unlock(&fp->mu);
+    if (f->err) { fprintf(stderr,"%s compression failed\n", cz_name(sw->compress)); exit(1); }
+    sw_put(sw, f->out.p, f->out.n, f->in.n);
+    ct_mutex_lock(&fp->mu);
+    f->state = FR_FREE;
+    fp->head++;
+}
+
+static void sw_flush_frame(StreamWriter *sw) {
+    if (sw->cur.n == 0) return;
+    if (sw->compress == CZ_NONE) {
+        sw_put(sw, sw->cur.p, sw->cur.n, sw->cur.n);
+    } else if (!sw->pool) {
+        ProfMark pm;
+        prof_begin(&pm);
+        if (cz_compress(sw->compress, sw->level, sw->cur.p, sw->cur.n, &sw->zbuf) != 0) {
+            fprintf(stderr,"%s compression failed\n", cz_name(sw->compress)); exit(1);
+        }
+        prof_end(&pm, PH_COMPRESS);
+        sw_put(sw, sw->zbuf.p, sw->zbuf.n, sw->cur.n);
+    } else {
+        FramePool *fp = sw->pool;
+        ct_mutex_lock(&fp->mu);
+        if (fp->tail - fp->head == fp->nslots) sw_pop_frame(sw);
+        Frame *f = &fp->slots[fp->tail % fp->nslots];
+        /* Swap buffers so both sides keep their allocations */
+        OBuf t = f->in; f->in = sw->cur; sw->cur = t;
+        f->state = FR_QUEUED;
+        fp->tail++;
+        ct_cond_broadcast(&fp->cv);
+        ct_mutex_unlock(&fp->mu);
+    }
+    sw->cur.n = 0;
+}
+
+/* Called between tokens: cut a frame once it reaches the target size. */
+static void sw_maybe_flush(StreamWriter *sw) {
+    if (sw->cur.n >= sw->frame_size) sw_flush_frame(sw);
+}
+
+static void sw_begin_file(StreamWriter *sw, const char *name) {
+    if (sw->compress == CZ_NONE) return;
+    if (sw->nfiles == sw->cap_files) {
+        sw->cap_files = sw->cap_files ? sw->cap_files*2 : 64;
+        sw->files = (SeekFile*)realloc(sw->files, sw->cap_files*sizeof(SeekFile));
+        if (!sw->files) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    SeekFile *sf = &sw->files[sw->nfiles++];
+    size_t n = strlen(name);
+    sf->name = (char*)malloc(n+1);
+    if (!sf->name) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(sf->name, name, n+1);
+    /* Frames are numbered in submission order, which is also write order */
+    sf->first_frame = sw->nframes + (sw->pool ? sw->pool->tail - sw->pool->head : 0);
+}
+
+static void sw_end_file(StreamWriter *sw) {
+    if (sw->compress != CZ_NONE && sw->nfiles) {
+        SeekFile *sf = &sw->files[sw->nfiles-1];
+        uint64_t cur = sw->nframes + (sw->pool ? sw->pool->tail - sw->pool->head : 0);
+        /* An empty file, or one ending exactly on a cut, lives in the previous frame */
+        sf->last_frame = sw->cur.n ? cur : (cur ? cur-1 : 0);
+        if (sf->first_frame > sf->last_frame) sf->first_frame = sf->last_frame;
+    }
+    sw_maybe_flush(sw);
+}
+
+static void sw_write_seek_table(StreamWriter *sw) {
+    size_t n = strlen(sw->path);
+    char *sp = (char*)malloc(n + 6);
+    if (!sp) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(sp, sw->path, n); memcpy(sp+n, ".seek", 6);
+    FILE *f = fopen(sp, "wb");
+    if (!f) { fprintf(stderr, "Failed to open %s for write: %s\n", sp, strerror(errno)); exit(1); }
+    fprintf(f, "ctseek 1 %s %llu %llu\n", cz_name(sw->compress),
+            (unsigned long long)sw->nframes, (unsigned long long)sw->nfiles);
+    for (size_t i=0;i<sw->nframes;++i)
+        fprintf(f, "frame %llu %llu %llu\n", (unsigned long long)sw->frames[i].coff,
+                (unsigned long long)sw->frames[i].clen, (unsigned long long)sw->frames[i].ulen);
+    for (size_t i=0;i<sw->nfiles;++i)
+        fprintf(f, "file %llu %llu %s\n", (unsigned long long)sw->files[i].first_frame,
+                (unsigned long long)sw->files[i].last_frame, sw->files[i].name);
+    fclose(f);
+    free(sp);
+}
+
+static void sw_close(StreamWriter *sw) {
+    sw_flush_frame(sw);
+    if (sw->pool) {
+        ct_mutex_lock(&sw->pool->mu);
+        while (sw->pool->head != sw->pool->tail) sw_pop_frame(sw);
+        ct_mutex_unlock(&sw->pool->mu);
+        frame_pool_free(sw->pool);
+    }
+    if (sw->compress != CZ_NONE) sw_write_seek_table(sw);
+    for (size_t i=0;i<sw->nfiles;++i) free(sw->files[i].name);
+    free(sw->files); free(sw->frames);
+    ob_free(&sw->cur); ob_free(&sw->zbuf);
+}
+
+/* ---------- Emit JSONL token ---------- */
+static void emit_json_token(OBuf *out, const char *fname, size_t off, size_t line, size_t col,
+                            CtKind kind, const unsigned char *lex, size_t len) {
+    ob_puts(out, "{\"file\":\""); ob_puts(out, fname); ob_puts(out, "\",");
+    ob_puts(out, "\"off\":"); ob_u64(out, off);
+    ob_puts(out, ",\"line\":"); ob_u64(out, line);
+    ob_puts(out, ",\"col\":"); ob_u64(out, col); ob_putc(out, ',');
+    ob_puts(out, "\"kind\":\""); ob_puts(out, ct_kind_name(kind)); ob_puts(out, "\",\"lexeme\":\"");
+    json_escape_write(lex, len, out);
+    ob_puts(out, "\"}\n");
+}
+
+/* ---------- Token n-grams (stats --ngrams N) ----------
+ * Counts the n-grams of orders 2..N over each file's code tokens (whitespace
+ * and comments skipped; never across files). Kind n-grams of order k go in a
+ * dense array of CT_NKINDS^k counters indexed by the kinds as base-CT_NKINDS
+ * digits. Lexeme n-grams go in a VMap per order, keyed by the lexemes each
+ * prefixed with its varint length; an order-k key is the last k tokens'
+ * suffix of the order-N key, so one key is built per token. Threads count
+ * into their own NGrams, merged exactly afterwards. */
+#define NGRAM_MAX 5
+
+typedef struct {
+    int n;                          /* highest order, 2..NGRAM_MAX */
+    size_t top;                     /* lexeme n-grams reported per order, 0 = all */
+    uint64_t *kinds[NGRAM_MAX+1];   /* [k]: nkinds[k] = CT_NKINDS^k counters */
+    size_t nkinds[NGRAM_MAX+1];
+    VMap lex[NGRAM_MAX+1];
+    OBuf key;                       /* scratch for the current key */
+} NGrams;
+
+/* The last n code tokens of the file being lexed. */
+typedef struct {
+    const unsigned char *p;
+    size_t off[NGRAM_MAX], len[NGRAM_MAX];
+    size_t idx[NGRAM_MAX+1];        /* [k]: kind index of the last k tokens */
+    uint64_t seen;
+} NGramWin;
+
+static int is_code_token(CtKind k) {
+    return !(k==CT_WS || k==CT_NEWLINE || k==CT_LINE_COMMENT || k==CT_BLOCK_COMMENT);
+}
+
+static void ngram_init(NGrams *ng, int n, size_t top) {
+    memset(ng, 0, sizeof(*ng));
+    ng->n = n; ng->top = top;
+    size_t nk = 1;
+    for (int k=1;k<=n;++k) {
+        nk *= CT_NKINDS;
+        if (k < 2) continue;
+        ng->nkinds[k] = nk;
+        ng->kinds[k] = (uint64_t*)calloc(nk, sizeof(uint64_t));
+        if (!ng->kinds[k]) { fprintf(stderr,"OOM\n"); exit(1); }
+        vmap_init(&ng->lex[k], 1<<12);
+    }
+}
+static void ngram_free(NGrams *ng) {
+    for (int k=2;k<=ng->n;++k) { free(ng->kinds[k]); vmap_free(&ng->lex[k]); }
+    ob_free(&ng->key);
+}
+/* Add src's counts to dst; src's lexeme maps are left empty. */
+static void ngram_merge(NGrams *dst, NGrams *src) {
+    for (int k=2;k<=dst->n;++k) {
+        for (size_t i=0;i<dst->nkinds[k];++i) dst->kinds[k][i] += src->kinds[k][i];
+        memset(src->kinds[k], 0, src->nkinds[k] * sizeof(uint64_t));
+        vmap_merge(&dst->lex[k], &src->lex[k]);
+    }
+}
+
+static void ngram_token(NGrams *ng, NGramWin *w, const CtToken *t) {
+    if (!is_code_token(t->kind)) return;
+    int n = ng->n;
+    w->off[w->seen % (uint64_t)n] = t->off;
+    w->len[w->seen % (uint64_t)n] = t->len;
+    w->seen++;
+    int have = w->seen < (uint64_t)n ? (int)w->seen : n;
+    size_t start[NGRAM_MAX+1];
+    OBuf *key = &ng->key;
+    key->n = 0;
+    for (int j=have;j>=1;--j) {
+        size_t s = (size_t)((w->seen - (uint64_t)j) % (uint64_t)n), len = w->len[s];
+        start[j] = key->n;
+        ob_reserve(key, len + 10);
+        while (len >= 0x80) { key->p[key->n++] = (unsigned char)((len & 0x7F) | 0x80); len >>= 7; }
+        key->p[key->n++] = (unsigned char)len;
+        ob_write(key, w->p + w->off[s], w->len[s]);
+    }
+    for (int k=2;k<=n;++k) {
+        w->idx[k] = (w->idx[k] * CT_NKINDS + (size_t)t->kind) % ng->nkinds[k];
+        if (k > have) continue;
+        ng->kinds[k][w->idx[k]]++;
+        VMap *m = &ng->lex[k];
+        vmap_add(m, (const char*)key->p + start[k], key->n - start[k]);
+        if (m->nitem > 2 * (uint64_t)m->nbkt) vmap_rehash(m, m->nbkt * 4);
+    }
+}
+
+/* Most frequent first, ties by key bytes. */
+static int cmp_ngram(const void *a, const void *b) {
+    const VEntry *x = *(const VEntry* const*)a, *y = *(const VEntry* const*)b;
+    if (x->count != y->count) return x->count > y->count ? -1 : 1;
+    int c = memcmp(x->s, y->s, MIN(x->len, y->len));
+    if (c) return c;
+    return x->len < y->len ? -1 : (x->len > y->len);
+}
+
+/* ,"ngrams":{"n":N,"kinds":{"2":{"IDENT PUNCT":C,...},...},
+   "lexemes":{"2":{"distinct":D,"top":[{"ngram":[...],"count":C},...]},...}} */
+static void ngram_write_json(FILE *out, const NGrams *ng) {
+    OBuf o = {0};
+    ob_puts(&o, ",\"ngrams\":{\"n\":"); ob_u64(&o, (uint64_t)ng->n);
+    ob_puts(&o, ",\"kinds\":{");
+    for (int k=2;k<=ng->n;++k) {
+        if (k > 2) ob_putc(&o, ',');
+        ob_putc(&o, '"'); ob_u64(&o, (uint64_t)k); ob_puts(&o, "\":{");
+        int first = 1;
+        for (size_t i=0;i<ng->nkinds[k];++i) {
+            if (!ng->kinds[k][i]) continue;
+            if (!first) ob_putc(&o, ',');
+            first = 0;
+            ob_putc(&o, '"');
+            for (size_t d=ng->nkinds[k]/CT_NKINDS; d; d/=CT_NKINDS) {
+                ob_puts(&o, ct_kind_name((CtKind)(i / d % CT_NKINDS)));
+                if (d > 1) ob_putc(&o, ' ');
+            }
+            ob_puts(&o, "\":"); ob_u64(&o, ng->kinds[k][i]);
+        }
+        ob_putc(&o, '}');
+    }
+    ob_puts(&o, "},\"lexemes\":{");
+    for (int k=2;k<=ng->n;++k) {
+        const VMap *m = &ng->lex[k];
+        VEntry **v = (VEntry**)malloc((size_t)(m->nitem + 1) * sizeof(VEntry*));
+        if (!v) { fprintf(stderr,"OOM\n"); exit(1); }
+        size_t nv = 0;
+        for (size_t i=0;i<m->nbkt;++i)
+            for (VEntry *e=m->bkt[i]; e; e=e->next) v[nv++] = e;
+        qsort(v, nv, sizeof(VEntry*), cmp_ngram);
+        if (k > 2) ob_putc(&o, ',');
+        ob_putc(&o, '"'); ob_u64(&o, (uint64_t)k); ob_puts(&o, "\":{\"distinct\":"); ob_u64(&o, m->nitem);
+        ob_puts(&o, ",\"top\":[");
+        size_t ntop = ng->top && ng->top < nv ? ng->top : nv;
+        for (size_t i=0;i<ntop;++i) {
+            const unsigned char *s = (const unsigned char*)v[i]->s, *end = s + v[i]->len;
+            ob_puts(&o, i ? ",{\"ngram\":[" : "{\"ngram\":[");
+            while (s < end) {
+                size_t len = 0;
+                for (int sh=0; ; sh+=7) { len |= (size_t)(*s & 0x7F) << sh; if (!(*s++ & 0x80)) break; }
+                ob_putc(&o, '"'); json_escape_write(s, len, &o); ob_putc(&o, '"');
+                s += len;
+                if (s < end) ob_putc(&o, ',');
+            }
+            ob_puts(&o, "],\"count\":"); ob_u64(&o, v[i]->count); ob_putc(&o, '}');
+            if (o.n > ((size_t)1<<20)) { fwrite(o.p, 1, o.n, out); o.n = 0; }
+        }
+        ob_puts(&o, "]}");
+        free(v);
+    }
+    ob_puts(&o, "}}");
+    fwrite(o.p, 1, o.n, out);
+    ob_free(&o);
+}
+
+/* ---------- Per-file records (stats --per-file) ----------
+ * Token and line lengths go in log2 buckets: bucket 0 is length 0, bucket i
+ * (1..SHAPE_HIST-2) is [2^(i-1), 2^i), the last is everything longer. Token
+ * lengths are counted as tokens are emitted; line lengths (terminator
+ * excluded) come from the line-start table after lexing. */
+#define SHAPE_HIST 13
+
+typedef struct {
+    uint64_t tok_hist[SHAPE_HIST], line_hist[SHAPE_HIST];
+    uint64_t max_line;
+} FileShape;
+
+static int shape_bucket(uint64_t v) {
+    int k = 0;
+    while (v && k < SHAPE_HIST-1) { v >>= 1; k++; }
+    return k;
+}
+
+static void shape_lines(FileShape *fs, const Buf *b, const size_t *starts, size_t nlines) {
+    for (size_t i=0;i<nlines;++i) {
+        size_t s = starts[i], e = i+1 < nlines ? starts[i+1] : b->n;
+        if (i+1 == nlines && s == e) break;  /* nothing after the final newline */
+        if (e > s && b->p[e-1] == '\n') e--;
+        if (e > s && b->p[e-1] == '\r') e--;
+        uint64_t len = (uint64_t)(e - s);
+        fs->line_hist[shape_bucket(len)]++;
+        if (len > fs->max_line) fs->max_line = len;
+    }
+}
+
+static void ob_hist(OBuf *o, const uint64_t *h) {
+    ob_putc(o, '[');
+    for (int i=0;i<SHAPE_HIST;++i) { if (i) ob_putc(o, ','); ob_u64(o, h[i]); }
+    ob_putc(o, ']');
+}
+
+/* One JSONL record; bytes is the file size and comment_ratio is relative
+   to it. */
+static void write_file_record(OBuf *o, const char *fname, uint64_t size, const Metrics *mx,
+                              const FileShape *fs) {
+    char ratio[32];
+    snprintf(ratio, sizeof(ratio), "%.6f", size ? (double)mx->bytes_comments / (double)size : 0.0);
+    ob_puts(o, "{\"file\":\"");
+    json_escape_write((const unsigned char*)fname, strlen(fname), o);
+    ob_puts(o, "\",\"bytes\":"); ob_u64(o, size);
+    ob_puts(o, ",\"tokens\":"); ob_u64(o, mx->tokens_total);
+    ob_puts(o, ",\"lines\":"); ob_u64(o, mx->lines);
+    ob_puts(o, ",\"bytes_comments\":"); ob_u64(o, mx->bytes_comments);
+    ob_puts(o, ",\"bytes_whitespace\":"); ob_u64(o, mx->bytes_whitespace);
+    ob_puts(o, ",\"comment_ratio\":"); ob_puts(o, ratio);
+    ob_puts(o, ",\"max_line_len\":"); ob_u64(o, fs->max_line);
+    ob_puts(o, ",\"kinds\":{");
+    for (int k=0;k<=CT_PUNCT;++k) {
+        if (k) ob_putc(o, ',');
+        ob_putc(o, '"'); ob_puts(o, ct_kind_name((CtKind)k)); ob_puts(o, "\":"); ob_u64(o, mx->counts[k]);
+    }
+    ob_puts(o, "},\"token_len_hist\":"); ob_hist(o, fs->tok_hist);
+    ob_puts(o, ",\"line_len_hist\":"); ob_hist(o, fs->line_hist);
+    ob_puts(o, "}\n");
+}
+
+/* ---------- Tokenize one file ---------- */
+typedef struct {
+    const unsigned char *p;
+    const char *fname;
+    StreamWriter *out_stream;
+    Metrics *mx;
+    VMap *vmap; /* for identifiers and keywords */
+    ProfThread *prof; /* NULL unless --profile */
+    CtLineCursor *lines; /* set with out_stream: line/col from the line table */
+    NGrams *ng; NGramWin *win; /* stats --ngrams */
+    FileShape *shape;          /* stats --per-file */
+} Sink;
+
+static void metrics_add(Metrics *mx, CtKind k, size_t len) {
+    if ((int)k < 16) mx->counts[(int)k]++;
+    mx->tokens_total++;
+    mx->bytes_total += len;
+    if (k==CT_LINE_COMMENT || k==CT_BLOCK_COMMENT) mx->bytes_comments += len;
+    if (k==CT_WS || k==CT_NEWLINE) mx->bytes_whitespace += len;
+    if (k==CT_NEWLINE) mx->lines++;
+}
+
+static void emit(Sink *sk, const CtToken *t) {
+    const unsigned char *s = sk->p + t->off;
+    if (sk->out_stream) {
+        uint64_t t0 = sk->prof && prof_sample(sk->prof, PH_JSON_ESCAPE) ? prof_ticks() : 0;
+        size_t line, col;
+        ct_line_cursor_seek(sk->lines, t->off, &line, &col);
+        emit_json_token(&sk->out_stream->cur, sk->fname, t->off, line, col, t->kind, s, t->len);
+        if (t0) prof_sampled(sk->prof, PH_JSON_ESCAPE, t0);
+        sw_maybe_flush(sk->out_stream);
+    }
+    metrics_add(sk->mx, t->kind, t->len);
+    if (sk->vmap && (t->kind==CT_IDENT || t->kind==CT_KEYWORD)) {
+        uint64_t t0 = sk->prof && prof_sample(sk->prof, PH_VMAP_ADD) ? prof_ticks() : 0;
+        vmap_add(sk->vmap, (const char*)s, t->len);
+        if (t0) prof_sampled(sk->prof, PH_VMAP_ADD, t0);
+    }
+    if (sk->ng) ngram_token(sk->ng, sk->win, t);
+    if (sk->shape) sk->shape->tok_hist[shape_bucket(t->len)]++;
+}
+
+/* Line-start table for b, in a per-thread buffer reused across files. */
+static size_t line_table(const Buf *b) {
+    size_t n = ct_line_starts(b->p, b->n, tls_line_starts, tls_line_cap);
+    if (n > tls_line_cap) {
+        free(tls_line_starts);
+        tls_line_cap = n + n/4;
+        tls_line_starts = (size_t*)malloc(tls_line_cap * sizeof(size_t));
+        if (!tls_line_starts) { fprintf(stderr,"OOM\n"); exit(1); }
+        ct_line_starts(b->p, b->n, tls_line_starts, tls_line_cap);
+    }
+    return n;
+}
+
+static void lex_file(Buf *b, const char *fname, StreamWriter *out_stream, Metrics *mx, VMap *vmap,
+                     NGrams *ng, FileShape *shape) {
+    CtLineCursor lc;
+    NGramWin win;
+    Sink sk = { b->p, fname, out_stream, mx, vmap, g_prof ? prof_thread() : NULL, NULL, ng, &win, shape };
+    if (ng) { memset(&win, 0, sizeof(win)); win.p = b->p; }
+    CtLexer lx; CtToken t;
+    ProfMark pm;
+    size_t nlines = 0;
+    prof_begin(&pm);
+    /* Only the stream output and --per-file need the line table; other modes never pay for it */
+    if (out_stream || shape) nlines = line_table(b);
+    if (out_stream) { ct_line_cursor_init(&lc, tls_line_starts, nlines); sk.lines = &lc; }
+    ct_lexer_init(&lx, b->p, b->n);
+    while (ct_next(&lx, &t)) emit(&sk, &t);
+    if (shape) shape_lines(shape, b, tls_line_starts, nlines);
+    prof_end(&pm, PH_LEX_FILE);
+}
+
+/* ---------- Output helpers ---------- */
+/* ---------- Portable line reader (no POSIX getline dependency) ---------- */
 static long read_line(FILE *in, char **line, size_t *cap) {
     if (!*line || *cap == 0) {
         *cap = 4096;
@@ -558,14 +1767,86 @@ static FILE *open_out(const char *path) {
     return f;
 }
 
+/* --files-from LIST: one path per line (LIST "-" is stdin), followed by any
+   positional files. Without a list the positional files are used in place. */
+static char **collect_files(char **argv_files, int nargv, const char *list_path, int *nfiles) {
+    *nfiles = nargv;
+    if (!list_path) return nargv > 0 ? argv_files : NULL;
+    FILE *f = strcmp(list_path,"-")==0 ? stdin : fopen(list_path, "rb");
+    if (!f) { fprintf(stderr,"Failed to open %s: %s\n", list_path, strerror(errno)); exit(1); }
+    size_t n = 0, cap = 1024;
+    char **v = (char**)malloc(cap*sizeof(char*));
+    char *line = NULL; size_t lcap = 0; long r;
+    if (!v) { fprintf(stderr,"OOM\n"); exit(1); }
+    while ((r = read_line(f, &line, &lcap)) >= 0) {
+        while (r > 0 && (line[r-1]=='\n' || line[r-1]=='\r')) line[--r] = 0;
+        if (r == 0) continue;
+        if (n + (size_t)nargv + 1 >= cap) {
+            cap *= 2;
+            v = (char**)realloc(v, cap*sizeof(char*));
+            if (!v) { fprintf(stderr,"OOM\n"); exit(1); }
+        }
+        v[n] = (char*)malloc((size_t)r + 1);
+        if (!v[n]) { fprintf(stderr,"OOM\n"); exit(1); }
+        memcpy(v[n], line, (size_t)r + 1);
+        n++;
+    }
+    free(line);
+    if (f != stdin) fclose(f);
+    for (int i=0;i<nargv;++i) v[n++] = argv_files[i];
+    *nfiles = (int)n;
+    return v;
+}
+
 /* ---------- CLI parsing ---------- */
+/* "4096", "64K", "512M", "1G" (binary multiples). */
+static uint64_t parse_size(const char *s) {
+    char *end = NULL;
+    uint64_t v = (uint64_t)strtoull(s, &end, 10);
+    switch (end ? *end : 0) {
+        case 'k': case 'K': v <<= 10; break;
+        case 'm': case 'M': v <<= 20; break;
+        case 'g': case 'G': v <<= 30; break;
+    }
+    return v;
+}
+
 static void die_usage(void) {
     fprintf(stderr,
         "Usage:\n"
-        "  ctokenize_v2 stream [--out OUT.jsonl] [--stdin NAME] [files...]\n"
-        "  ctokenize_v2 stats  [--out OUT.json]  [files...]\n"
-        "  ctokenize_v2 vocab  [--out OUT.tsv]   [files...]\n"
-        "  ctokenize_v2 reassemble --in STREAM.jsonl [--outdir DIR]\n"
+        "  ctokenize_v2 stream [--out OUT.jsonl] [--stdin NAME] [--compress gzip|zstd]\n"
+        "                      [--level N] [--frame-size BYTES] [--threads N]\n"
+        "                      [--shards N | --shard-size BYTES] [--files-from LIST] [--profile] [files...]\n"
+        "  ctokenize_v2 stats  [--out OUT.json]  [--threads N] [--partial] [--files-from LIST] [--profile]\n"
+        "                      [--ngrams N [--ngram-top K]] [--per-file OUT.jsonl] [files...]\n"
+        "  ctokenize_v2 vocab  [--out OUT.tsv]   [--threads N] [--partial] [--files-from LIST] [--profile] [files...]\n"
+        "      (stream, stats, vocab: [--checkpoint PATH [--checkpoint-interval SECS] [--resume]])\n"
+        "  ctokenize_v2 merge  [--out OUT] [--partial] PARTIAL...\n"
+        "  ctokenize_v2 reassemble --in STREAM.jsonl [--outdir DIR] [--file NAME]... [--patch PATCH]\n"
+        "  ctokenize_v2 index --out INDEX [--threads N] [--files-from LIST] [--profile] [files...]\n"
+        "  ctokenize_v2 query --index INDEX [--count] [--out OUT] NAME...\n"
+        "  ctokenize_v2 dedup [--out OUT.jsonl] [--threads N] [--shingle K] [--perms P] [--bands B]\n"
+        "                     [--threshold T] [--normalize-idents] [--files-from LIST] [files...]\n"
+        "  ctokenize_v2 clones [--out OUT.jsonl] [--threads N] [--window W] [--normalize]\n"
+        "                      [--files-from LIST] [files...]\n"
+        "  ctokenize_v2 bpe-train --merges MERGES --vocab VOCAB [--vocab-size N] [--min-frequency F]\n"
+        "                      [--threads N] [--files-from LIST] [files...]\n"
+        "  ctokenize_v2 encode --merges MERGES --out OUT.bin [--dtype u16|u32] [--shard-size BYTES]\n"
+        "                      [--threads N] [--files-from LIST] [files...]\n"
+        "  ctokenize_v2 normalize --outdir DIR [--rename-idents] [--threads N] [--files-from LIST] [files...]\n"
+        "  ctokenize_v2 includes [--out OUT.jsonl] [-I DIR]... [--threads N] [--files-from LIST] [files...]\n"
+        "  ctokenize_v2 diff [--out PATCH] [--threads N] OLD NEW\n"
+        "  ctokenize_v2 serve --socket PATH [--threads N] [--max-request BYTES]\n"
+        "  ctokenize_v2 loadgen --socket PATH [--connections C] [--depth D] [--requests N]\n"
+        "                      [--mode tokens|stats] [--out OUT.json] [--files-from LIST] [files...]\n"
+        "  ctokenize_v2 watch --outdir DIR [--threads N] [--debounce MS] [--once] ROOT\n"
+        "  ctokenize_v2 classify [--out OUT.jsonl] [--window W] [--map KIND=TYPE]... [--top K]\n"
+        "                      [--threads N] [--files-from LIST] [--profile] [files...]\n"
+        "  ctokenize_v2 match --patterns FILE [--out OUT.jsonl] [--positions POS.jsonl]\n"
+        "                   [--all-kinds | --types | --map KIND=TYPE...]\n"
+        "                   [--threads N] [--files-from LIST] [--profile] [files...]\n"
+        "  ctokenize_v2 verify --in STREAM.jsonl [--manifest M | --root DIR] [--out REPORT]\n"
+        "                      [--threads N] [--file NAME]...\n"
     );
     exit(2);
 }
@@ -587,67 +1868,650 @@ static void agg_add(Agg *a, const Metrics *m) {
     a->m.lines += m->lines;
 }
 
+/* Inverse of agg_add, for a file whose earlier metrics are being replaced. */
+static void agg_sub(Agg *a, const Metrics *m) {
+    for (int i=0;i<16;++i) a->m.counts[i] -= m->counts[i];
+    a->m.tokens_total -= m->tokens_total;
+    a->m.bytes_total  -= m->bytes_total;
+    a->m.bytes_comments -= m->bytes_comments;
+    a->m.bytes_whitespace -= m->bytes_whitespace;
+    a->m.lines -= m->lines;
+}
+
+static void agg_merge(Agg *a, const Agg *b) {
+    agg_add(a, &b->m);
+    a->total_files += b->total_files;
+}
+
+static void write_stats_json(FILE *out_stats, const Agg *agg, const NGrams *ng) {
+    fprintf(out_stats, "{");
+    fprintf(out_stats, "\"files\":%llu,", (unsigned long long)agg->total_files);
+    fprintf(out_stats, "\"tokens\":%llu,", (unsigned long long)agg->m.tokens_total);
+    fprintf(out_stats, "\"bytes\":%llu,", (unsigned long long)agg->m.bytes_total);
+    fprintf(out_stats, "\"lines\":%llu,", (unsigned long long)agg->m.lines);
+    fprintf(out_stats, "\"bytes_comments\":%llu,", (unsigned long long)agg->m.bytes_comments);
+    fprintf(out_stats, "\"bytes_whitespace\":%llu,", (unsigned long long)agg->m.bytes_whitespace);
+    fprintf(out_stats, "\"kinds\":{");
+    for (int k=0;k<=CT_PUNCT;++k) {
+        fprintf(out_stats, "\"%s\":%llu", ct_kind_name((CtKind)k), (unsigned long long)agg->m.counts[k]);
+        if (k!=CT_PUNCT) fputc(',', out_stats);
+    }
+    fprintf(out_stats, "}");
+    if (ng) ngram_write_json(out_stats, ng);
+    if (g_prof) { fprintf(out_stats, ",\"profile\":"); prof_write_json(out_stats); }
+    fprintf(out_stats, "}\n");
+}
+
+/* ---------- Partials (exactly mergeable stats / vocab) ----------
+ * stats partial:  "ctpartial 1 stats", then "files N", "tokens N", "bytes N",
+ *                 "lines N", "bytes_comments N", "bytes_whitespace N" and one
+ *                 "kind NAME N" line per token kind.
+ * vocab partial:  "ctpartial 1 vocab", then "lexeme<TAB>count" lines sorted by
+ *                 lexeme bytes, so any number of partials merge in one pass. */
+static void write_stats_partial(FILE *out, const Agg *agg) {
+    fprintf(out, "ctpartial 1 stats\n");
+    fprintf(out, "files %llu\n", (unsigned long long)agg->total_files);
+    fprintf(out, "tokens %llu\n", (unsigned long long)agg->m.tokens_total);
+    fprintf(out, "bytes %llu\n", (unsigned long long)agg->m.bytes_total);
+    fprintf(out, "lines %llu\n", (unsigned long long)agg->m.lines);
+    fprintf(out, "bytes_comments %llu\n", (unsigned long long)agg->m.bytes_comments);
+    fprintf(out, "bytes_whitespace %llu\n", (unsigned long long)agg->m.bytes_whitespace);
+    for (int k=0;k<=CT_PUNCT;++k)
+        fprintf(out, "kind %s %llu\n", ct_kind_name((CtKind)k), (unsigned long long)agg->m.counts[k]);
+}
+
+static int cmp_lexeme(const char *a, size_t na, const char *b, size_t nb) {
+    int c = memcmp(a, b, MIN(na, nb));
+    if (c) return c;
+    return na < nb ? -1 : (na > nb);
+}
+static int cmp_ventry(const void *a, const void *b) {
+    const VEntry *x = *(const VEntry* const*)a, *y = *(const VEntry* const*)b;
+    return cmp_lexeme(x->s, x->len, y->s, y->len);
+}
+static void write_vocab_partial(FILE *out, VMap *m) {
+    VEntry **v = (VEntry**)malloc((size_t)(m->nitem + 1) * sizeof(VEntry*));
+    if (!v) { fprintf(stderr,"OOM\n"); exit(1); }
+    size_t n = 0;
+    for (size_t i=0;i<m->nbkt;++i)
+        for (VEntry *e=m->bkt[i]; e; e=e->next) v[n++] = e;
+    qsort(v, n, sizeof(VEntry*), cmp_ventry);
+    fprintf(out, "ctpartial 1 vocab\n");
+    for (size_t i=0;i<n;++i) fprintf(out, "%s\t%llu\n", v[i]->s, (unsigned long long)v[i]->count);
+    free(v);
+}
+
+/* ---------- Checkpoint / resume (stream, stats, vocab) ----------
+ * With --checkpoint PATH a run records its progress every
+ * --checkpoint-interval seconds, at a file boundary. PATH is a text header:
+ *   "ctckpt 1", "mode M", "codec C", "gen G", "files_done N", "list_hash H",
+ *   "out_off N", "out_hash H", "ubytes N", "frames K" and K
+ *   "frame COFF CLEN ULEN" lines, "seekfiles K" and K
+ *   "file FIRST LAST NAME" lines.
+ * Stats and vocab state go to PATH.G.stats / PATH.G.vocab, ordinary partials
+ * (so merge reads them too). The new generation's partials are written
+ * first and the header is renamed over PATH last, so PATH always names a
+ * complete generation; the previous one is then removed. Stream output is
+ * drained and synced to out_off before the header is written. --resume
+ * reloads the state, truncates the output to out_off and continues with
+ * file files_done; the input list must be unchanged (list_hash). A finished
+ * run removes its checkpoint. */
+#ifdef _WIN32
+#include <io.h>
+#define FSEEK64(f,o) _fseeki64((f),(__int64)(o),SEEK_SET)
+#else
+#define FSEEK64(f,o) fseeko((f),(off_t)(o),SEEK_SET)
+#endif
+
+typedef struct {
+    const char *path;
+    const char *mode;       /* "stream", "stats" or "vocab" */
+    int codec;
+    int resume;
+    uint64_t interval_ns, last_ns;
+    uint64_t gen;
+    size_t done;            /* input files completed before this run resumed */
+    uint64_t list_hash;
+} Ckpt;
+
+#define CKPT_DEFAULT(mode) { NULL, (mode), CZ_NONE, 0, 60ull * 1000000000ull, 0, 0, 0, 0 }
+
+static int partial_header(FILE *f);
+static int stats_partial_read(FILE *f, Agg *a);
+
+/* --checkpoint PATH, --checkpoint-interval SECS, --resume */
+static int ckpt_option(int argc, char **argv, int *i, Ckpt *ck) {
+    if (strcmp(argv[*i],"--checkpoint")==0 && *i+1<argc) { ck->path = argv[++*i]; return 1; }
+    if (strcmp(argv[*i],"--checkpoint-interval")==0 && *i+1<argc) {
+        double secs = atof(argv[++*i]);
+        ck->interval_ns = secs > 0 ? (uint64_t)(secs * 1e9) : 0;
+        return 1;
+    }
+    if (strcmp(argv[*i],"--resume")==0) { ck->resume = 1; return 1; }
+    return 0;
+}
+
+/* The checkpoint to use, or NULL without --checkpoint. */
+static Ckpt *ckpt_check(Ckpt *ck, const char *out_path, int nfiles) {
+    if (!ck->path) {
+        if (ck->resume) { fprintf(stderr,"--resume requires --checkpoint\n"); exit(2); }
+        return NULL;
+    }
+    if (nfiles == 0) { fprintf(stderr,"--checkpoint requires input files\n"); exit(2); }
+    if (strcmp(ck->mode, "stream") == 0 && (!out_path || strcmp(out_path,"-")==0)) {
+        fprintf(stderr,"--checkpoint requires --out for stream (the output is truncated on resume)\n");
+        exit(2);
+    }
+    return ck;
+}
+
+static uint64_t ckpt_list_hash(char **files, int nfiles) {
+    uint64_t h = FNV1A64_INIT;
+    for (int i=0;i<nfiles;++i) h = fnv1a64_update(h, files[i], strlen(files[i]) + 1);
+    return h;
+}
+
+static char *ckpt_side_path(const Ckpt *ck, uint64_t gen, const char *ext) {
+    size_t n = strlen(ck->path) + strlen(ext) + 32;
+    char *p = (char*)malloc(n);
+    if (!p) { fprintf(stderr,"OOM\n"); exit(1); }
+    snprintf(p, n, "%s.%llu.%s", ck->path, (unsigned long long)gen, ext);
+    return p;
+}
+
+static FILE *ckpt_create(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) { fprintf(stderr,"Failed to open %s for write: %s\n", path, strerror(errno)); exit(1); }
+    return f;
+}
+
+/* Flush f through to the disk; a checkpoint must not point past durable data. */
+static void ckpt_sync(FILE *f, const char *path) {
+    int rc = fflush(f);
+#ifdef _WIN32
+    if (rc == 0) rc = _commit(_fileno(f));
+#else
+    if (rc == 0) rc = fsync(fileno(f));
+#endif
+    if (rc != 0) { fprintf(stderr,"Failed to sync %s: %s\n", path, strerror(errno)); exit(1); }
+}
+
+static void ckpt_close(FILE *f, const char *path) {
+    ckpt_sync(f, path);
+    if (fclose(f) != 0) { fprintf(stderr,"Write failed: %s\n", path); exit(1); }
+}
+
+static int ckpt_due(const Ckpt *ck) {
+    return ck && prof_ns() - ck->last_ns >= ck->interval_ns;
+}
+
+/* Write every finished frame of sw to its file and sync it. */
+static void sw_sync(StreamWriter *sw) {
+    sw_flush_frame(sw);
+    if (sw->pool) {
+        ct_mutex_lock(&sw->pool->mu);
+        while (sw->pool->head != sw->pool->tail) sw_pop_frame(sw);
+        ct_mutex_unlock(&sw->pool->mu);
+    }
+    ckpt_sync(sw->f, sw->path);
+}
+
+static void ckpt_write(Ckpt *ck, size_t done, StreamWriter *sw, const Agg *agg, VMap *vmap) {
+    uint64_t gen = ck->gen + 1;
+    if (sw) sw_sync(sw);
+    if (strcmp(ck->mode, "stats") == 0) {
+        char *sp = ckpt_side_path(ck, gen, "stats");
+        FILE *f = ckpt_create(sp);
+        write_stats_partial(f, agg);
+        ckpt_close(f, sp);
+        free(sp);
+    }
+    if (vmap) {
+        char *vp = ckpt_side_path(ck, gen, "vocab");
+        FILE *f = ckpt_create(vp);
+        write_vocab_partial(f, vmap);
+        ckpt_close(f, vp);
+        free(vp);
+    }
+    size_t n = strlen(ck->path);
+    char *tmp = (char*)malloc(n + 5);
+    if (!tmp) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(tmp, ck->path, n); memcpy(tmp + n, ".tmp", 5);
+    FILE *f = ckpt_create(tmp);
+    fprintf(f, "ctckpt 1\nmode %s\ncodec %s\ngen %llu\nfiles_done %llu\nlist_hash %016llx\n",
+            ck->mode, cz_name(ck->codec), (unsigned long long)gen, (unsigned long long)done,
+            (unsigned long long)ck->list_hash);
+    fprintf(f, "out_off %llu\nout_hash %016llx\nubytes %llu\n",
+            (unsigned long long)(sw ? sw->out_off : 0), (unsigned long long)(sw ? sw->hash : 0),
+            (unsigned long long)(sw ? sw->ubytes : 0));
+    fprintf(f, "frames %llu\n", (unsigned long long)(sw ? sw->nframes : 0));
+    for (size_t i=0; sw && i<sw->nframes; ++i)
+        fprintf(f, "frame %llu %llu %llu\n", (unsigned long long)sw->frames[i].coff,
+                (unsigned long long)sw->frames[i].clen, (unsigned long long)sw->frames[i].ulen);
+    fprintf(f, "seekfiles %llu\n", (unsigned long long)(sw ? sw->nfiles : 0));
+    for (size_t i=0; sw && i<sw->nfiles; ++i)
+        fprintf(f, "file %llu %llu %s\n", (unsigned long long)sw->files[i].first_frame,
+                (unsigned long long)sw->files[i].last_frame, sw->files[i].name);
+    ckpt_close(f, tmp);
+    if (rename(tmp, ck->path) != 0) { fprintf(stderr,"Failed to rename %s: %s\n", tmp, strerror(errno)); exit(1); }
+    free(tmp);
+    if (ck->gen) {
+        char *sp = ckpt_side_path(ck, ck->gen, "stats"), *vp = ckpt_side_path(ck, ck->gen, "vocab");
+        remove(sp); remove(vp);
+        free(sp); free(vp);
+    }
+    ck->gen = gen;
+    ck->last_ns = prof_ns();
+}
+
+/* The run finished: its outputs are complete, so the checkpoint goes. */
+static void ckpt_finish(Ckpt *ck) {
+    if (!ck) return;
+    if (ck->gen) {
+        char *sp = ckpt_side_path(ck, ck->gen, "stats"), *vp = ckpt_side_path(ck, ck->gen, "vocab");
+        remove(sp); remove(vp);
+        free(sp); free(vp);
+    }
+    remove(ck->path);
+}
+
+static void ckpt_bad(const Ckpt *ck, const char *why) {
+    fprintf(stderr,"Cannot resume from %s: %s\n", ck->path, why);
+    exit(1);
+}
+
+/* Restore a checkpoint into sw / agg / vmap. Returns 0 when there is none
+   (the run starts from the beginning). ck->list_hash must be set. */
+static int ckpt_resume(Ckpt *ck, int nfiles, StreamWriter *sw, Agg *agg, VMap *vmap) {
+    FILE *f = fopen(ck->path, "rb");
+    if (!f) {
+        if (errno != ENOENT) { fprintf(stderr,"Failed to open %s: %s\n", ck->path, strerror(errno)); exit(1); }
+        fprintf(stderr,"No checkpoint at %s; starting from the beginning\n", ck->path);
+        return 0;
+    }
+    char mode[32], codec[32];
+    unsigned long long gen, done, lh, off, oh, ub, nfr, nsf;
+    if (fscanf(f, "ctckpt 1 mode %31s codec %31s gen %llu files_done %llu list_hash %llx "
+                  "out_off %llu out_hash %llx ubytes %llu frames %llu",
+               mode, codec, &gen, &done, &lh, &off, &oh, &ub, &nfr) != 9) ckpt_bad(ck, "malformed header");
+    if (strcmp(mode, ck->mode) != 0) ckpt_bad(ck, "written by a different mode");
+    if (cz_parse(codec) != ck->codec) ckpt_bad(ck, "written with a different --compress");
+    if (lh != ck->list_hash || done > (unsigned long long)nfiles) ckpt_bad(ck, "the input file list changed");
+    if (sw) {
+        sw->out_off = off; sw->hash = oh; sw->ubytes = ub;
+        for (unsigned long long i=0;i<nfr;++i) {
+            unsigned long long co, cl, ul;
+            if (fscanf(f, " frame %llu %llu %llu", &co, &cl, &ul) != 3) ckpt_bad(ck, "malformed frame line");
+            sw_push_frame(sw, co, cl, ul);
+        }
+    }
+    if (fscanf(f, " seekfiles %llu", &nsf) != 1) ckpt_bad(ck, "malformed header");
+    if (sw) {
+        char *line = NULL; size_t cap = 0;
+        read_line(f, &line, &cap);      /* rest of the "seekfiles" line */
+        for (unsigned long long i=0;i<nsf;++i) {
+            unsigned long long first, last;
+            int pos = 0;
+            long r = read_line(f, &line, &cap);
+            if (r <= 0 || sscanf(line, "file %llu %llu %n", &first, &last, &pos) != 2 || !pos) ckpt_bad(ck, "malformed file line");
+            while (r > 0 && (line[r-1]=='\n' || line[r-1]=='\r')) line[--r] = 0;
+            sw_begin_file(sw, line + pos);
+            sw->files[sw->nfiles-1].first_frame = first;
+            sw->files[sw->nfiles-1].last_frame = last;
+        }
+        free(line);
+        /* Drop whatever the killed run wrote after the checkpoint */
+        struct stat st;
+        if (stat(sw->path, &st) != 0 || (unsigned long long)st.st_size < off) ckpt_bad(ck, "the output is shorter than the checkpoint");
+        ckpt_sync(sw->f, sw->path);
+#ifdef _WIN32
+        int rc = _chsize_s(_fileno(sw->f), (__int64)off);
+#else
+        int rc = ftruncate(fileno(sw->f), (off_t)off);
+#endif
+        if (rc != 0 || FSEEK64(sw->f, off) != 0) ckpt_bad(ck, "cannot truncate the output");
+    }
+    fclose(f);
+    if (strcmp(ck->mode, "stats") == 0) {
+        char *sp = ckpt_side_path(ck, gen, "stats");
+        FILE *pf = fopen(sp, "rb");
+        if (!pf || partial_header(pf) != 1 || stats_partial_read(pf, agg) != 0) ckpt_bad(ck, "missing or corrupt stats partial");
+        fclose(pf);
+        free(sp);
+    }
+    if (vmap) {
+        char *vp = ckpt_side_path(ck, gen, "vocab");
+        FILE *pf = fopen(vp, "rb");
+        if (!pf || partial_header(pf) != 2) ckpt_bad(ck, "missing or corrupt vocab partial");
+        char *line = NULL; size_t cap = 0; long r;
+        while ((r = read_line(pf, &line, &cap)) > 0) {
+            char *tab = strchr(line, '\t');
+            if (!tab) ckpt_bad(ck, "corrupt vocab partial");
+            vmap_add_n(vmap, line, (size_t)(tab - line), (uint64_t)strtoull(tab + 1, NULL, 10));
+        }
+        free(line);
+        fclose(pf);
+        free(vp);
+    }
+    ck->gen = gen;
+    ck->done = (size_t)done;
+    fprintf(stderr,"Resuming from %s: %llu of %d files done\n", ck->path, done, nfiles);
+    return 1;
+}
+
 /* ---------- stream/stats/vocab drivers ---------- */
+typedef struct {
+    char **files;
+    Agg *aggs;    /* one per thread */
+    VMap *vmaps;  /* one per thread, or NULL */
+    NGrams *ngs;  /* one per thread, or NULL */
+    OBuf *recs;   /* --per-file: one record per file of the round, or NULL */
+} ScanCtx;
+
+static void scan_worker(void *ctx, size_t fi, int tid) {
+    ScanCtx *c = (ScanCtx*)ctx;
+    Buf b = {0};
+    if (read_file_scratch(c->files[fi], &b) != 0) exit(1);
+    Metrics mx = {0};
+    FileShape fs;
+    mx.bytes_total = b.n;
+    if (c->recs) memset(&fs, 0, sizeof(fs));
+    lex_file(&b, c->files[fi], NULL, &mx, c->vmaps ? &c->vmaps[tid] : NULL, c->ngs ? &c->ngs[tid] : NULL,
+             c->recs ? &fs : NULL);
+    if (c->recs) write_file_record(&c->recs[fi], c->files[fi], b.n, &mx, &fs);
+    agg_add(&c->aggs[tid], &mx);
+    c->aggs[tid].total_files++;
+    arena_reset(&tls_scratch);
+}
+
+/* Files per par_for round when checkpointing, per thread: a checkpoint can
+   only record a completed prefix of the file list. */
+#define CKPT_CHUNK 256
+
 static void process_files_stream_stats_vocab(char **files, int nfiles, const char *stdin_name,
-                                             FILE *out_stream, int do_stats, FILE *out_stats,
-                                             int do_vocab, FILE *out_vocab) {
+                                             StreamWriter *out_stream, int do_stats, FILE *out_stats,
+                                             int do_vocab, FILE *out_vocab, int nthreads, int partial,
+                                             Ckpt *ck, NGrams *ng, FILE *per_file) {
     Agg agg = {0};
     VMap vmap; VMap *vmap_p = NULL;
     if (do_vocab) { vmap_init(&vmap, 1<<15); vmap_p = &vmap; }
+    int start = 0;
+    if (ck) {
+        ck->list_hash = ckpt_list_hash(files, nfiles);
+        if (ck->resume) ckpt_resume(ck, nfiles, out_stream, &agg, vmap_p);
+        ck->last_ns = prof_ns();
+        start = (int)ck->done;
+    }
 
-    for (int fi=0; fi<nfiles || (nfiles==0 && fi==0); ++fi) {
-        const char *fname = NULL;
-        Buf b={0};
-        if (nfiles==0) {
-            fname = stdin_name ? stdin_name : "stdin";
-            if (read_file("-", &b) != 0) exit(1);
-        } else {
-            fname = files[fi];
-            if (read_file(fname, &b) != 0) exit(1);
+    if (!out_stream && nfiles - start > 1 && nthreads > 1) {
+        /* Files are independent: per-thread Agg/VMap, merged exactly afterwards */
+        int nt = nthreads < nfiles - start ? nthreads : nfiles - start;
+        ScanCtx c = { files, NULL, NULL, NULL, NULL };
+        c.aggs = (Agg*)calloc((size_t)nt, sizeof(Agg));
+        if (!c.aggs) { fprintf(stderr,"OOM\n"); exit(1); }
+        if (do_vocab) {
+            c.vmaps = (VMap*)calloc((size_t)nt, sizeof(VMap));
+            if (!c.vmaps) { fprintf(stderr,"OOM\n"); exit(1); }
+            for (int t=0;t<nt;++t) vmap_init(&c.vmaps[t], 1<<15);
+        }
+        if (ng) {
+            c.ngs = (NGrams*)calloc((size_t)nt, sizeof(NGrams));
+            if (!c.ngs) { fprintf(stderr,"OOM\n"); exit(1); }
+            for (int t=0;t<nt;++t) ngram_init(&c.ngs[t], ng->n, ng->top);
+        }
+        if (per_file) {
+            /* records are kept per round and written in input order */
+            c.recs = (OBuf*)calloc((size_t)nt * CKPT_CHUNK, sizeof(OBuf));
+            if (!c.recs) { fprintf(stderr,"OOM\n"); exit(1); }
+        }
+        for (int lo=start, hi; lo<nfiles; lo=hi) {
+            hi = (ck || per_file) && nfiles - lo > nt * CKPT_CHUNK ? lo + nt * CKPT_CHUNK : nfiles;
+            c.files = files + lo;
+            par_for((size_t)(hi - lo), nt, scan_worker, &c);
+            if (per_file)
+                for (int k=0;k<hi-lo;++k) { fwrite(c.recs[k].p, 1, c.recs[k].n, per_file); c.recs[k].n = 0; }
+            for (int t=0;t<nt;++t) {
+                agg_merge(&agg, &c.aggs[t]);
+                memset(&c.aggs[t], 0, sizeof(Agg));
+                if (do_vocab) vmap_merge(&vmap, &c.vmaps[t]);
+                if (ng) ngram_merge(ng, &c.ngs[t]);
+            }
+            if (hi < nfiles && ckpt_due(ck)) ckpt_write(ck, (size_t)hi, NULL, &agg, vmap_p);
         }
+        if (do_vocab) for (int t=0;t<nt;++t) vmap_free(&c.vmaps[t]);
+        if (ng) for (int t=0;t<nt;++t) ngram_free(&c.ngs[t]);
+        if (per_file) for (int k=0;k<nt * CKPT_CHUNK;++k) ob_free(&c.recs[k]);
+        free(c.aggs); free(c.vmaps); free(c.ngs); free(c.recs);
+    } else {
+        OBuf recs = {0};
+        for (int fi=start; fi<nfiles || (nfiles==0 && fi==0); ++fi) {
+            const char *fname = NULL;
+            Buf b={0};
+            if (nfiles==0) {
+                fname = stdin_name ? stdin_name : "stdin";
+                if (read_file_scratch("-", &b) != 0) exit(1);
+            } else {
+                fname = files[fi];
+                if (read_file_scratch(fname, &b) != 0) exit(1);
+            }
 
-        Metrics mx = {0};
-        mx.bytes_total = b.n;
-        if (out_stream) {
-            /* Optionally emit a file-start marker (comment) for readability (not required) */
-            /* fprintf(out_stream, "{\"file\":\"%s\",\"off\":0,\"line\":1,\"col\":1,\"kind\":\"META\",\"lexeme\":\"BEGIN\"}\n", fname); */
+            Metrics mx = {0};
+            FileShape fs;
+            mx.bytes_total = b.n;
+            if (per_file) memset(&fs, 0, sizeof(fs));
+            if (out_stream) {
+                sw_begin_file(out_stream, fname);
+                /* Optionally emit a file-start marker (comment) for readability (not required) */
+                /* fprintf(out_stream, "{\"file\":\"%s\",\"off\":0,\"line\":1,\"col\":1,\"kind\":\"META\",\"lexeme\":\"BEGIN\"}\n", fname); */
+            }
+            lex_file(&b, fname, out_stream, &mx, vmap_p, ng, per_file ? &fs : NULL);
+            if (out_stream) sw_end_file(out_stream);
+            if (per_file) {
+                write_file_record(&recs, fname, b.n, &mx, &fs);
+                if (recs.n >= ((size_t)1<<20)) { fwrite(recs.p, 1, recs.n, per_file); recs.n = 0; }
+            }
+            agg_add(&agg, &mx);
+            agg.total_files++;
+            arena_reset(&tls_scratch);
+            if (fi + 1 < nfiles && ckpt_due(ck)) ckpt_write(ck, (size_t)fi + 1, out_stream, &agg, vmap_p);
         }
-        lex_file(&b, fname, out_stream, &mx, vmap_p);
-        agg_add(&agg, &mx);
-        agg.total_files++;
-        free(b.p);
+        if (per_file) fwrite(recs.p, 1, recs.n, per_file);
+        ob_free(&recs);
     }
 
     /* Stats output */
     if (do_stats) {
-        fprintf(out_stats, "{");
-        fprintf(out_stats, "\"files\":%llu,", (unsigned long long)agg.total_files);
-        fprintf(out_stats, "\"tokens\":%llu,", (unsigned long long)agg.m.tokens_total);
-        fprintf(out_stats, "\"bytes\":%llu,", (unsigned long long)agg.m.bytes_total);
-        fprintf(out_stats, "\"lines\":%llu,", (unsigned long long)agg.m.lines);
-        fprintf(out_stats, "\"bytes_comments\":%llu,", (unsigned long long)agg.m.bytes_comments);
-        fprintf(out_stats, "\"bytes_whitespace\":%llu,", (unsigned long long)agg.m.bytes_whitespace);
-        fprintf(out_stats, "\"kinds\":{");
-        for (int k=0;k<=TK_PUNCT;++k) {
-            fprintf(out_stats, "\"%s\":%llu", kind_name((TokKind)k), (unsigned long long)agg.m.counts[k]);
-            if (k!=TK_PUNCT) fputc(',', out_stats);
-        }
-        fprintf(out_stats, "}");
-        fprintf(out_stats, "}\n");
+        if (partial) write_stats_partial(out_stats, &agg);
+        else write_stats_json(out_stats, &agg, ng);
     }
 
     /* Vocab output (identifiers+keywords) */
     if (do_vocab) {
-        /* Dump unsorted; downstream can sort by count */
-        for (size_t i=0;i<vmap.nbkt;++i) {
-            for (VEntry *e=vmap.bkt[i]; e; e=e->next) {
-                fprintf(out_vocab, "%s\t%llu\n", e->s, (unsigned long long)e->count);
+        if (partial) {
+            write_vocab_partial(out_vocab, &vmap);
+        } else {
+            /* Dump unsorted; downstream can sort by count */
+            for (size_t i=0;i<vmap.nbkt;++i) {
+                for (VEntry *e=vmap.bkt[i]; e; e=e->next) {
+                    fprintf(out_vocab, "%s\t%llu\n", e->s, (unsigned long long)e->count);
+                }
             }
         }
         vmap_free(&vmap);
     }
 }
 
+/* ---------- merge: combine partials with a streaming k-way merge ---------- */
+#define MERGE_FANIN 256
+
+static int kind_from_name(const char *s) {
+    for (int k=0;k<=CT_PUNCT;++k) if (strcmp(ct_kind_name((CtKind)k), s)==0) return k;
+    return -1;
+}
+
+/* Returns 1 for stats, 2 for vocab, 0 if f is not a partial. Consumes the header. */
+static int partial_header(FILE *f) {
+    char hdr[64];
+    if (!fgets(hdr, sizeof(hdr), f)) return 0;
+    if (strcmp(hdr, "ctpartial 1 stats\n")==0) return 1;
+    if (strcmp(hdr, "ctpartial 1 vocab\n")==0) return 2;
+    return 0;
+}
+
+static int stats_partial_read(FILE *f, Agg *a) {
+    char key[64], name[64]; unsigned long long v;
+    char *line = NULL; size_t cap = 0;
+    int ok = 1;
+    while (ok && read_line(f, &line, &cap) > 0) {
+        if (sscanf(line, "kind %63s %llu", name, &v) == 2) {
+            int k = kind_from_name(name);
+            if (k < 0) ok = 0; else a->m.counts[k] += v;
+        } else if (sscanf(line, "%63s %llu", key, &v) == 2) {
+            if (strcmp(key,"files")==0) a->total_files += v;
+            else if (strcmp(key,"tokens")==0) a->m.tokens_total += v;
+            else if (strcmp(key,"bytes")==0) a->m.bytes_total += v;
+            else if (strcmp(key,"lines")==0) a->m.lines += v;
+            else if (strcmp(key,"bytes_comments")==0) a->m.bytes_comments += v;
+            else if (strcmp(key,"bytes_whitespace")==0) a->m.bytes_whitespace += v;
+            else ok = 0;
+        } else {
+            ok = 0;
+        }
+    }
+    free(line);
+    return ok ? 0 : -1;
+}
+
+typedef struct {
+    FILE *f;
+    char *line; size_t cap;
+    size_t klen;
+    uint64_t count;
+} PartReader;
+
+/* Advance to the next "lexeme\tcount" record; 0 at end of input. */
+static int part_next(PartReader *r) {
+    long n = read_line(r->f, &r->line, &r->cap);
+    if (n <= 0) return 0;
+    char *tab = strchr(r->line, '\t');
+    if (!tab) { fprintf(stderr,"Malformed vocab partial line: %s", r->line); exit(1); }
+    r->klen = (size_t)(tab - r->line);
+    r->count = (uint64_t)strtoull(tab+1, NULL, 10);
+    return 1;
+}
+
+static int part_less(const PartReader *a, const PartReader *b) {
+    return cmp_lexeme(a->line, a->klen, b->line, b->klen) < 0;
+}
+
+/* Merge up to MERGE_FANIN sorted vocab partials (headers already consumed). */
+static void vocab_kway_merge(FILE **in, size_t n, FILE *out, int partial) {
+    PartReader *rd = (PartReader*)calloc(n, sizeof(PartReader));
+    size_t *heap = (size_t*)malloc(n*sizeof(size_t)); size_t hn = 0;
+    if (!rd || !heap) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t i=0;i<n;++i) {
+        rd[i].f = in[i];
+        if (!part_next(&rd[i])) continue;
+        /* sift up */
+        size_t h = hn++; heap[h] = i;
+        while (h && part_less(&rd[heap[h]], &rd[heap[(h-1)/2]])) {
+            size_t t = heap[h]; heap[h] = heap[(h-1)/2]; heap[(h-1)/2] = t; h = (h-1)/2;
+        }
+    }
+    if (partial) fprintf(out, "ctpartial 1 vocab\n");
+    char *key = NULL; size_t kcap = 0, klen = 0; uint64_t sum = 0; int have = 0;
+    while (hn) {
+        PartReader *top = &rd[heap[0]];
+        if (have && (klen != top->klen || memcmp(key, top->line, klen) != 0)) {
+            fwrite(key, 1, klen, out); fprintf(out, "\t%llu\n", (unsigned long long)sum);
+            have = 0;
+        }
+        if (!have) {
+            if (top->klen + 1 > kcap) {
+                kcap = top->klen + 64;
+                key = (char*)realloc(key, kcap);
+                if (!key) { fprintf(stderr,"OOM\n"); exit(1); }
+            }
+            memcpy(key, top->line, top->klen); klen = top->klen; sum = 0; have = 1;
+        }
+        sum += top->count;
+        if (!part_next(top)) heap[0] = heap[--hn];
+        /* sift down */
+        size_t h = 0;
+        for (;;) {
+            size_t l = 2*h+1, r = l+1, m = h;
+            if (l<hn && part_less(&rd[heap[l]], &rd[heap[m]])) m = l;
+            if (r<hn && part_less(&rd[heap[r]], &rd[heap[m]])) m = r;
+            if (m == h) break;
+            size_t t = heap[h]; heap[h] = heap[m]; heap[m] = t; h = m;
+        }
+    }
+    if (have) { fwrite(key, 1, klen, out); fprintf(out, "\t%llu\n", (unsigned long long)sum); }
+    for (size_t i=0;i<n;++i) free(rd[i].line);
+    free(rd); free(heap); free(key);
+}
+
+static FILE *open_partial(const char *path, int *kind) {
+    FILE *f = fopen(path, "rb");
+    if (!f) { fprintf(stderr,"Failed to open %s: %s\n", path, strerror(errno)); exit(1); }
+    *kind = partial_header(f);
+    if (!*kind) { fprintf(stderr,"%s is not a ctokenize_v2 partial\n", path); exit(1); }
+    return f;
+}
+
+static void merge_partials(char **paths, int npaths, FILE *out, int partial) {
+    int kind = 0;
+    FILE *first = open_partial(paths[0], &kind);
+    fclose(first);
+    if (kind == 1) {
+        Agg agg = {0};
+        for (int i=0;i<npaths;++i) {
+            int k; FILE *f = open_partial(paths[i], &k);
+            if (k != 1 || stats_partial_read(f, &agg) != 0) { fprintf(stderr,"Bad stats partial %s\n", paths[i]); exit(1); }
+            fclose(f);
+        }
+        if (partial) write_stats_partial(out, &agg);
+        else write_stats_json(out, &agg, NULL);
+        return;
+    }
+    /* Vocab: merge in groups of MERGE_FANIN into temporary partials until one
+       group remains, which keeps the number of open files bounded. */
+    size_t n = (size_t)npaths;
+    FILE **level = (FILE**)calloc(n, sizeof(FILE*));
+    if (!level) { fprintf(stderr,"OOM\n"); exit(1); }
+    int from_paths = 1; /* first level reads paths[], later ones tmpfiles */
+    while (n > MERGE_FANIN) {
+        size_t nout = (n + MERGE_FANIN - 1) / MERGE_FANIN;
+        for (size_t g=0; g<nout; ++g) {
+            size_t lo = g*MERGE_FANIN, hi = MIN(n, lo + MERGE_FANIN);
+            FILE *grp[MERGE_FANIN];
+            for (size_t i=lo;i<hi;++i) {
+                int k;
+                grp[i-lo] = from_paths ? open_partial(paths[i], &k) : level[i];
+                if (from_paths && k != 2) { fprintf(stderr,"Mixed partial kinds (%s)\n", paths[i]); exit(1); }
+            }
+            FILE *tmp = tmpfile();
+            if (!tmp) { fprintf(stderr,"tmpfile failed: %s\n", strerror(errno)); exit(1); }
+            vocab_kway_merge(grp, hi-lo, tmp, 1);
+            for (size_t i=lo;i<hi;++i) fclose(grp[i-lo]);
+            rewind(tmp);
+            if (partial_header(tmp) != 2) { fprintf(stderr,"Temporary partial corrupted\n"); exit(1); }
+            level[g] = tmp;
+        }
+        n = nout; from_paths = 0;
+    }
+    for (size_t i=0;i<n;++i) {
+        if (from_paths) {
+            int k;
+            level[i] = open_partial(paths[i], &k);
+            if (k != 2) { fprintf(stderr,"Mixed partial kinds (%s)\n", paths[i]); exit(1); }
+        }
+    }
+    vocab_kway_merge(level, n, out, partial);
+    for (size_t i=0;i<n;++i) fclose(level[i]);
+    free(level);
+}
+
 
 /* ----- Path utilities for reassemble (handle Windows drive letters, make dirs) ----- */
 static char *str_dup(const char *s) {
@@ -697,32 +2561,410 @@ static const char *basename_pos(const char *path) {
     return m ? m+1 : path;
 }
 
-/* ---------- Reassembler ---------- */
-typedef struct OutFile {
-    char *name;
-    FILE *f;
-    struct OutFile *next;
-} OutFile;
+/* ---------- Sharded stream output ---------- */
+typedef struct {
+    uint64_t bytes, tokens, hash;  /* source bytes, tokens, FNV-1a of source */
+} ShardFile;
 
+typedef struct {
+    char *path;
+    size_t *files; size_t nfiles, cap;  /* indices into the input list, in input order */
+    uint64_t ubytes, tokens;            /* uncompressed stream bytes, tokens */
+    uint64_t bytes, hash;               /* bytes written to path and their FNV-1a */
+} Shard;
 
-static OutFile *of_find_or_open(OutFile **head, const char *name, const char *outdir) {
-    /* Build a safe output path.
-       If outdir is provided: outdir + '/' + sanitized relative path + '.recon'
-       Else: basename(name) + '.recon' in CWD. */
-    char *rel = sanitize_relpath(name);
-    const char *base = basename_pos(rel);
-    char *rel_or_base = NULL;
-    if (outdir && outdir[0]) {
-        rel_or_base = rel; /* keep subdirs under outdir */
-    } else {
-        rel_or_base = (char*)base; /* just filename */
-    }
+typedef struct {
+    char **names;
+    ShardFile *recs;
+    Shard *shards; size_t nshards, cap_shards;
+    const char *out_path;
+    int compress, level, nthreads;
+    size_t frame_size;
+} ShardRun;
 
-    size_t n_outdir = (outdir && outdir[0]) ? strlen(outdir) : 0;
+/* OUT "dir/name.jsonl.gz" -> "dir/name-00007.jsonl.gz" */
+static char *shard_path(const char *out, size_t k) {
+    const char *base = basename_pos(out);
+    const char *dot = strchr(base, '.');
+    size_t pre = dot ? (size_t)(dot - out) : strlen(out);
+    size_t n = strlen(out) + 32;
+    char *p = (char*)malloc(n);
+    if (!p) { fprintf(stderr,"OOM\n"); exit(1); }
+    snprintf(p, n, "%.*s-%05zu%s", (int)pre, out, k, dot ? dot : "");
+    return p;
+}
+
+static Shard *shard_new(ShardRun *run) {
+    if (run->nshards == run->cap_shards) {
+        run->cap_shards = run->cap_shards ? run->cap_shards*2 : 16;
+        run->shards = (Shard*)realloc(run->shards, run->cap_shards*sizeof(Shard));
+        if (!run->shards) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    Shard *sh = &run->shards[run->nshards];
+    memset(sh, 0, sizeof(*sh));
+    sh->path = shard_path(run->out_path, run->nshards);
+    run->nshards++;
+    return sh;
+}
+static void shard_push_file(Shard *sh, size_t idx) {
+    if (sh->nfiles == sh->cap) {
+        sh->cap = sh->cap ? sh->cap*2 : 64;
+        sh->files = (size_t*)realloc(sh->files, sh->cap*sizeof(size_t));
+        if (!sh->files) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    sh->files[sh->nfiles++] = idx;
+}
+
+/* Lex one input file into sw, filling its manifest record. */
+static void stream_file_into(StreamWriter *sw, const char *fname, ShardFile *rec) {
+    Buf b = {0};
+    if (read_file_scratch(fname, &b) != 0) exit(1);
+    Metrics mx = {0};
+    rec->bytes = b.n;
+    rec->hash = fnv1a64(b.p, b.n);
+    sw_begin_file(sw, fname);
+    lex_file(&b, fname, sw, &mx, NULL, NULL, NULL);
+    sw_end_file(sw);
+    rec->tokens = mx.tokens_total;
+    arena_reset(&tls_scratch);
+}
+
+/* --shards N: every shard is written start to finish by one worker. */
+static void shard_write_worker(void *ctx, size_t k, int tid) {
+    ShardRun *run = (ShardRun*)ctx;
+    Shard *sh = &run->shards[k];
+    int per = run->nthreads / (int)run->nshards;
+    (void)tid;
+    FILE *f = open_out(sh->path);
+    StreamWriter sw;
+    sw_init(&sw, f, sh->path, run->compress, run->level, run->frame_size, per > 1 ? per : 1);
+    for (size_t i=0;i<sh->nfiles;++i) {
+        size_t fi = sh->files[i];
+        stream_file_into(&sw, run->names[fi], &run->recs[fi]);
+        sh->tokens += run->recs[fi].tokens;
+    }
+    sw_close(&sw);
+    sh->ubytes = sw.ubytes; sh->bytes = sw.out_off; sh->hash = sw.hash;
+    fclose(f);
+}
+
+typedef struct { uint64_t size; size_t idx; } SizeIdx;
+static int cmp_size_desc(const void *a, const void *b) {
+    const SizeIdx *x = (const SizeIdx*)a, *y = (const SizeIdx*)b;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    return x->idx < y->idx ? -1 : (x->idx > y->idx);
+}
+
+/* Deterministic size balancing (largest file first onto the lightest shard,
+   ties by input position / shard index). Depends only on the file list. */
+static void shard_assign_balanced(ShardRun *run, size_t nfiles, size_t nshards) {
+    SizeIdx *si = (SizeIdx*)malloc((nfiles+1)*sizeof(SizeIdx));
+    size_t *owner = (size_t*)malloc((nfiles+1)*sizeof(size_t));
+    SizeIdx *heap = (SizeIdx*)malloc(nshards*sizeof(SizeIdx)); /* (load, shard) min-heap */
+    if (!si || !owner || !heap) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t i=0;i<nfiles;++i) {
+        struct stat st;
+        if (stat(run->names[i], &st) != 0) { fprintf(stderr,"Failed to stat %s: %s\n", run->names[i], strerror(errno)); exit(1); }
+        si[i].size = (uint64_t)st.st_size; si[i].idx = i;
+    }
+    qsort(si, nfiles, sizeof(SizeIdx), cmp_size_desc);
+    for (size_t k=0;k<nshards;++k) { heap[k].size = 0; heap[k].idx = k; shard_new(run); }
+    for (size_t i=0;i<nfiles;++i) {
+        owner[si[i].idx] = heap[0].idx;
+        heap[0].size += si[i].size;
+        /* sift down */
+        size_t h = 0;
+        for (;;) {
+            size_t l = 2*h+1, r = l+1, m = h;
+            if (l<nshards && (heap[l].size < heap[m].size || (heap[l].size == heap[m].size && heap[l].idx < heap[m].idx))) m = l;
+            if (r<nshards && (heap[r].size < heap[m].size || (heap[r].size == heap[m].size && heap[r].idx < heap[m].idx))) m = r;
+            if (m == h) break;
+            SizeIdx t = heap[h]; heap[h] = heap[m]; heap[m] = t; h = m;
+        }
+    }
+    for (size_t i=0;i<nfiles;++i) shard_push_file(&run->shards[owner[i]], i);
+    free(si); free(owner); free(heap);
+}
+
+/* --shard-size: files are lexed ahead in parallel batches, then appended in
+   input order; a new shard starts when the next file would exceed the cap. */
+typedef struct { ShardRun *run; size_t base; OBuf *bufs; } AheadCtx;
+static void lex_ahead_worker(void *ctx, size_t i, int tid) {
+    AheadCtx *a = (AheadCtx*)ctx;
+    size_t fi = a->base + i;
+    StreamWriter tmp;
+    (void)tid;
+    sw_init(&tmp, NULL, NULL, CZ_NONE, 0, (size_t)-1, 1);
+    tmp.cur = a->bufs[i]; tmp.cur.n = 0;
+    stream_file_into(&tmp, a->run->names[fi], &a->run->recs[fi]);
+    a->bufs[i] = tmp.cur;
+}
+
+static void shard_write_capped(ShardRun *run, size_t nfiles, uint64_t cap) {
+    size_t batch = (size_t)run->nthreads * 4;
+    OBuf *bufs = (OBuf*)calloc(batch, sizeof(OBuf));
+    if (!bufs) { fprintf(stderr,"OOM\n"); exit(1); }
+    Shard *sh = NULL; FILE *f = NULL; StreamWriter sw;
+    for (size_t base=0; base<nfiles; base+=batch) {
+        size_t n = MIN(batch, nfiles - base);
+        AheadCtx a = { run, base, bufs };
+        par_for(n, run->nthreads, lex_ahead_worker, &a);
+        for (size_t i=0;i<n;++i) {
+            size_t fi = base + i, len = bufs[i].n;
+            if (!sh || (sh->nfiles && sh->ubytes + len > cap)) {
+                if (sh) {
+                    sw_close(&sw);
+                    sh->bytes = sw.out_off; sh->hash = sw.hash;
+                    fclose(f);
+                }
+                sh = shard_new(run);
+                f = open_out(sh->path);
+                sw_init(&sw, f, sh->path, run->compress, run->level, run->frame_size, run->nthreads);
+            }
+            sw_begin_file(&sw, run->names[fi]);
+            ob_write(&sw.cur, bufs[i].p, len);
+            sw_end_file(&sw);
+            shard_push_file(sh, fi);
+            sh->ubytes += len;
+            sh->tokens += run->recs[fi].tokens;
+        }
+    }
+    if (sh) {
+        sw_close(&sw);
+        sh->bytes = sw.out_off; sh->hash = sw.hash;
+        fclose(f);
+    }
+    for (size_t i=0;i<batch;++i) ob_free(&bufs[i]);
+    free(bufs);
+}
+
+static void shard_write_manifest(ShardRun *run) {
+    size_t n = strlen(run->out_path);
+    char *mp = (char*)malloc(n + 16);
+    if (!mp) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(mp, run->out_path, n); memcpy(mp+n, ".manifest.jsonl", 16);
+    FILE *f = open_out(mp);
+    OBuf esc = {0};     /* paths escaped as in the stream's "file" */
+    for (size_t k=0;k<run->nshards;++k) {
+        const Shard *sh = &run->shards[k];
+        esc.n = 0;
+        json_escape_write((const unsigned char*)sh->path, strlen(sh->path), &esc);
+        fprintf(f, "{\"shard\":%zu,\"path\":\"%.*s\",\"files\":%zu,\"tokens\":%llu,\"stream_bytes\":%llu,\"bytes\":%llu,\"hash\":\"%016llx\"}\n",
+                k, (int)esc.n, (const char*)esc.p, sh->nfiles, (unsigned long long)sh->tokens, (unsigned long long)sh->ubytes,
+                (unsigned long long)sh->bytes, (unsigned long long)sh->hash);
+        for (size_t i=0;i<sh->nfiles;++i) {
+            const ShardFile *r = &run->recs[sh->files[i]];
+            const char *name = run->names[sh->files[i]];
+            esc.n = 0;
+            json_escape_write((const unsigned char*)name, strlen(name), &esc);
+            fprintf(f, "{\"shard\":%zu,\"file\":\"%.*s\",\"bytes\":%llu,\"tokens\":%llu,\"hash\":\"%016llx\"}\n",
+                    k, (int)esc.n, (const char*)esc.p, (unsigned long long)r->bytes,
+                    (unsigned long long)r->tokens, (unsigned long long)r->hash);
+        }
+    }
+    ob_free(&esc);
+    fclose(f);
+    free(mp);
+}
+
+static void process_files_sharded(char **files, int nfiles, const char *out_path, size_t nshards,
+                                  uint64_t shard_size, int compress, int level, size_t frame_size,
+                                  int nthreads) {
+    ShardRun run;
+    memset(&run, 0, sizeof(run));
+    run.names = files; run.out_path = out_path;
+    run.compress = compress; run.level = level; run.frame_size = frame_size; run.nthreads = nthreads;
+    run.recs = (ShardFile*)calloc((size_t)nfiles + 1, sizeof(ShardFile));
+    if (!run.recs) { fprintf(stderr,"OOM\n"); exit(1); }
+    if (nshards) {
+        shard_assign_balanced(&run, (size_t)nfiles, nshards);
+        par_for(run.nshards, nthreads, shard_write_worker, &run);
+    } else {
+        shard_write_capped(&run, (size_t)nfiles, shard_size);
+    }
+    shard_write_manifest(&run);
+    for (size_t k=0;k<run.nshards;++k) { free(run.shards[k].path); free(run.shards[k].files); }
+    free(run.shards); free(run.recs);
+}
+
+/* ---------- Token patches (diff output, applied by reassemble --patch) ----------
+ * "CTPATCH1", then varint-prefixed OLD and NEW roots, a varint record count
+ * and the records, each starting with an op byte:
+ *   PATCH_MODIFY  rel, old token count, edit count, edits
+ *   PATCH_RENAME  old rel, new rel (same content)
+ *   PATCH_DELETE  old rel
+ *   PATCH_ADD     new rel, byte count, bytes
+ * An edit is (keep, del, nins, nins x (len, bytes)): copy keep old tokens,
+ * skip del, then insert the lexemes. Strings are varint length + bytes. A
+ * stream file named OLD/rel is written as NEW/<rel or its new rel>; files
+ * outside OLD pass through unchanged. */
+enum { PATCH_MODIFY = 1, PATCH_RENAME, PATCH_DELETE, PATCH_ADD };
+
+typedef struct {
+    int op, seen;
+    char *old_rel, *new_rel;
+    uint64_t old_tokens, nedit;
+    const unsigned char *edits, *end;     /* MODIFY: encoded edits; ADD: content */
+} PatchFile;
+
+typedef struct {
+    Buf raw;
+    char *old_root, *new_root;
+    PatchFile *f; size_t n;
+    PatchFile **by_old; size_t nold;      /* sorted by old_rel */
+} Patch;
+
+static uint64_t ix_get_varint(const unsigned char **p, const unsigned char *end);
+
+static char *path_join(const char *a, const char *b) {
+    size_t na = strlen(a), nb = strlen(b);
+    char *p = (char*)malloc(na + nb + 2);
+    if (!p) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(p, a, na); p[na] = '/'; memcpy(p + na + 1, b, nb + 1);
+    return p;
+}
+
+static char *patch_str(const unsigned char **p, const unsigned char *end) {
+    uint64_t n = ix_get_varint(p, end);
+    if (n > (uint64_t)(end - *p)) return NULL;
+    char *s = (char*)malloc((size_t)n + 1);
+    if (!s) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(s, *p, (size_t)n); s[n] = 0;
+    *p += n;
+    return s;
+}
+/* Step over one edit; 0 if it runs past end. */
+static int patch_skip_edit(const unsigned char **p, const unsigned char *end) {
+    ix_get_varint(p, end); ix_get_varint(p, end);
+    uint64_t nins = ix_get_varint(p, end);
+    for (uint64_t i=0;i<nins;++i) {
+        uint64_t n = ix_get_varint(p, end);
+        if (*p > end || n > (uint64_t)(end - *p)) return 0;
+        *p += n;
+    }
+    return *p <= end;
+}
+static int cmp_patch_old(const void *a, const void *b) {
+    return strcmp((*(PatchFile* const*)a)->old_rel, (*(PatchFile* const*)b)->old_rel);
+}
+
+static void patch_load(const char *path, Patch *pt) {
+    memset(pt, 0, sizeof(*pt));
+    if (read_file(path, &pt->raw) != 0) exit(1);
+    const unsigned char *p = pt->raw.p, *end = p + pt->raw.n;
+    if (pt->raw.n < 8 || memcmp(p, "CTPATCH1", 8) != 0) { fprintf(stderr,"%s: not a ctokenize patch\n", path); exit(1); }
+    p += 8;
+    pt->old_root = patch_str(&p, end);
+    pt->new_root = patch_str(&p, end);
+    uint64_t n = ix_get_varint(&p, end);
+    if (!pt->old_root || !pt->new_root || n > pt->raw.n) goto bad;
+    pt->f = (PatchFile*)calloc((size_t)n + 1, sizeof(PatchFile));
+    pt->by_old = (PatchFile**)calloc((size_t)n + 1, sizeof(PatchFile*));
+    if (!pt->f || !pt->by_old) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (; pt->n < n; pt->n++) {
+        PatchFile *f = &pt->f[pt->n];
+        if (p >= end) goto bad;
+        f->op = *p++;
+        switch (f->op) {
+        case PATCH_MODIFY:
+            if (!(f->old_rel = patch_str(&p, end))) goto bad;
+            f->new_rel = str_dup(f->old_rel);
+            f->old_tokens = ix_get_varint(&p, end);
+            f->nedit = ix_get_varint(&p, end);
+            f->edits = p;
+            for (uint64_t e=0;e<f->nedit;++e) if (!patch_skip_edit(&p, end)) goto bad;
+            f->end = p;
+            break;
+        case PATCH_RENAME:
+            if (!(f->old_rel = patch_str(&p, end)) || !(f->new_rel = patch_str(&p, end))) goto bad;
+            break;
+        case PATCH_DELETE:
+            if (!(f->old_rel = patch_str(&p, end))) goto bad;
+            break;
+        case PATCH_ADD: {
+            if (!(f->new_rel = patch_str(&p, end))) goto bad;
+            uint64_t len = ix_get_varint(&p, end);
+            if (len > (uint64_t)(end - p)) goto bad;
+            f->edits = p; f->end = p + len; p += len;
+            break;
+        }
+        default: goto bad;
+        }
+        if (f->old_rel) pt->by_old[pt->nold++] = f;
+    }
+    qsort(pt->by_old, pt->nold, sizeof(PatchFile*), cmp_patch_old);
+    return;
+bad:
+    fprintf(stderr,"%s: malformed patch (record %zu)\n", path, pt->n);
+    exit(1);
+}
+static void patch_free(Patch *pt) {
+    for (size_t i=0;i<pt->n;++i) { free(pt->f[i].old_rel); free(pt->f[i].new_rel); }
+    free(pt->f); free(pt->by_old); free(pt->old_root); free(pt->new_root); free(pt->raw.p);
+}
+
+/* Output name for stream file fname (malloc'd), or NULL if the patch deletes
+   it; *pf is set for modified files. */
+static char *patch_map_name(Patch *pt, const char *fname, PatchFile **pf) {
+    size_t nr = strlen(pt->old_root);
+    *pf = NULL;
+    if (strncmp(fname, pt->old_root, nr) != 0 || fname[nr] != '/') return str_dup(fname);
+    const char *rel = fname + nr + 1;
+    const char *new_rel = rel;
+    size_t lo = 0, hi = pt->nold;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(pt->by_old[mid]->old_rel, rel);
+        if (c == 0) { lo = mid; hi = mid + 1; break; }
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    if (lo < hi && strcmp(pt->by_old[lo]->old_rel, rel) == 0) {
+        PatchFile *f = pt->by_old[lo];
+        f->seen = 1;
+        if (f->op == PATCH_DELETE) return NULL;
+        if (f->op == PATCH_MODIFY) *pf = f;
+        new_rel = f->new_rel;
+    }
+    return path_join(pt->new_root, new_rel);
+}
+
+/* ---------- Reassembler ---------- */
+typedef struct OutFile {
+    char *name;
+    FILE *f;
+    struct OutFile *next;
+    PatchFile *pf;                        /* --patch: edits for this file */
+    const unsigned char *ep, *ins;        /* next edit, pending inserts */
+    uint64_t edits_left, keep, del, nins, tok;
+} OutFile;
+
+/* Open outputs, plus a table from stream file name to output so the path is
+   only built (and its directories made) the first time a name is seen. */
+typedef struct {
+    OutFile *head;
+    struct OutName { uint64_t h; const char *name; OutFile *of; } *slot;
+    size_t nslot, n;          /* open addressing; name==NULL is empty */
+    Arena mem;                /* OutFile records, names and paths */
+    Arena line;               /* one stream line's copies, reset after it */
+} OutSet;
+
+static OutFile *of_open_path(OutSet *os, const char *name, const char *outdir) {
+    /* Build a safe output path.
+       If outdir is provided: outdir + '/' + sanitized relative path + '.recon'
+       Else: basename(name) + '.recon' in CWD. */
+    char *rel = sanitize_relpath(name);
+    const char *base = basename_pos(rel);
+    char *rel_or_base = NULL;
+    if (outdir && outdir[0]) {
+        rel_or_base = rel; /* keep subdirs under outdir */
+    } else {
+        rel_or_base = (char*)base; /* just filename */
+    }
+
+    size_t n_outdir = (outdir && outdir[0]) ? strlen(outdir) : 0;
     size_t n_rel = strlen(rel_or_base);
     size_t need = n_outdir + (n_outdir?1:0) + n_rel + 6 /* .recon */ + 1;
-    char *full = (char*)malloc(need);
-    if (!full) { fprintf(stderr,"OOM\n"); exit(1); }
+    char *full = (char*)arena_alloc(&os->mem, need);
     if (n_outdir) {
         memcpy(full, outdir, n_outdir);
         full[n_outdir] = '/';
@@ -733,135 +2975,4770 @@ static OutFile *of_find_or_open(OutFile **head, const char *name, const char *ou
         memcpy(full + n_rel, ".recon", 6+1);
     }
 
-    /* Ensure directories exist */
-    mkdir_p_for_file(full);
+    /* Ensure directories exist */
+    mkdir_p_for_file(full);
+
+    /* Different stream names can sanitize to the same path */
+    for (OutFile *p=os->head; p; p=p->next) if (strcmp(p->name,full)==0) { free(rel); return p; }
+
+    OutFile *n = (OutFile*)arena_alloc(&os->mem, sizeof(OutFile));
+    memset(n, 0, sizeof(*n));
+    n->name = full;
+    n->f = fopen(n->name, "wb");
+    if (!n->f) { fprintf(stderr,"Failed to open %s: %s\n", n->name, strerror(errno)); exit(1); }
+    n->next = os->head; os->head = n;
+    free(rel);
+    return n;
+}
+
+static OutFile *of_find_or_open(OutSet *os, const char *name, const char *outdir) {
+    uint64_t h = fnv1a64(name, strlen(name));
+    size_t k = os->nslot ? (size_t)(h & (os->nslot-1)) : 0;
+    if (os->nslot)
+        for (; os->slot[k].name; k = (k+1) & (os->nslot-1))
+            if (os->slot[k].h == h && strcmp(os->slot[k].name, name) == 0) return os->slot[k].of;
+    if (os->n * 2 >= os->nslot) {
+        size_t ns = os->nslot ? os->nslot*2 : 256;
+        struct OutName *sl = (struct OutName*)calloc(ns, sizeof(*sl));
+        if (!sl) { fprintf(stderr,"OOM\n"); exit(1); }
+        for (size_t i=0;i<os->nslot;++i) {
+            if (!os->slot[i].name) continue;
+            size_t j = (size_t)(os->slot[i].h & (ns-1));
+            while (sl[j].name) j = (j+1) & (ns-1);
+            sl[j] = os->slot[i];
+        }
+        free(os->slot); os->slot = sl; os->nslot = ns;
+        k = (size_t)(h & (ns-1));
+        while (sl[k].name) k = (k+1) & (ns-1);
+    }
+    OutFile *of = of_open_path(os, name, outdir);
+    os->slot[k].h = h;
+    os->slot[k].name = arena_strndup(&os->mem, name, strlen(name));
+    os->slot[k].of = of;
+    os->n++;
+    return of;
+}
+
+static int name_selected(const char *fname, char **only, int nonly) {
+    if (nonly == 0) return 1;
+    for (int k=0;k<nonly;++k) if (strcmp(only[k], fname)==0) return 1;
+    return 0;
+}
+
+static void of_patch_inserts(OutFile *of) {
+    const unsigned char *end = of->pf->end;
+    for (; of->nins; of->nins--) {
+        uint64_t n = ix_get_varint(&of->ins, end);
+        fwrite(of->ins, 1, (size_t)n, of->f);
+        of->ins += n;
+    }
+}
+/* Load the next edit of a patched file; 0 when none are left. */
+static int of_patch_next(OutFile *of) {
+    if (!of->edits_left) return 0;
+    const unsigned char *end = of->pf->end;
+    of->keep = ix_get_varint(&of->ep, end);
+    of->del = ix_get_varint(&of->ep, end);
+    of->nins = ix_get_varint(&of->ep, end);
+    of->ins = of->ep;
+    for (uint64_t i=0;i<of->nins;++i) { uint64_t n = ix_get_varint(&of->ep, end); of->ep += n; }
+    of->edits_left--;
+    return 1;
+}
+static void of_patch_token(OutFile *of, const unsigned char *lex, size_t n) {
+    for (;;) {
+        if (of->keep) { fwrite(lex, 1, n, of->f); of->keep--; break; }
+        if (of->del) { of->del--; break; }
+        of_patch_inserts(of);
+        if (!of_patch_next(of)) {
+            fprintf(stderr,"Patch does not match stream: %s has more than %llu tokens\n",
+                    of->pf->old_rel, (unsigned long long)of->pf->old_tokens);
+            exit(1);
+        }
+    }
+    of->tok++;
+}
+static void of_patch_finish(OutFile *of) {
+    do {
+        if (of->keep || of->del) break;
+        of_patch_inserts(of);
+    } while (of_patch_next(of));
+    if (of->keep || of->del || of->tok != of->pf->old_tokens) {
+        fprintf(stderr,"Patch does not match stream: %s has %llu tokens, patch expects %llu\n",
+                of->pf->old_rel, (unsigned long long)of->tok, (unsigned long long)of->pf->old_tokens);
+        exit(1);
+    }
+}
+
+/* Reassemble one NUL-terminated stream line of length r. */
+static void reassemble_line(const char *line, size_t r, OutSet *files, const char *outdir,
+                            char **only, int nonly, Patch *patch) {
+    /* Find "file":"..."," and "lexeme":"..." */
+    const char *p = strstr(line, "\"file\":\"");
+    if (!p) return;
+    p += 8;
+    const char *q = strchr(p, '\"');
+    if (!q) return;
+    size_t fname_len = (size_t)(q - p);
+    char *fname = arena_strndup(&files->line, p, fname_len);
+    if (!name_selected(fname, only, nonly)) { arena_reset(&files->line); return; }
+
+    const char *lx = strstr(q, "\"lexeme\":\"");
+    if (!lx) { arena_reset(&files->line); return; }
+    lx += 10;
+    /* Extract JSON string until closing quote not escaped */
+    char *raw = (char*)arena_alloc(&files->line, r);
+    size_t j=0;
+    for (const char *s=lx; *s; ++s) {
+        char ch = *s;
+        if (ch=='\"') {
+            /* Check if escaped */
+            size_t back=0; const char *t=s-1;
+            while (t>=lx && *t=='\\') { back++; t--; }
+            if ((back % 2)==0) { /* not escaped */
+                break;
+            }
+        }
+        raw[j++] = ch;
+    }
+    raw[j]=0;
+    unsigned char *lex = (unsigned char*)arena_alloc(&files->line, j+1);
+    size_t lex_len = json_unescape_to(raw, j, lex);
+
+    if (patch) {
+        PatchFile *pf;
+        char *oname = patch_map_name(patch, fname, &pf);
+        if (oname) {
+            OutFile *of = of_find_or_open(files, oname, outdir);
+            if (pf && !of->pf) { of->pf = pf; of->ep = pf->edits; of->edits_left = pf->nedit; }
+            if (of->pf) of_patch_token(of, lex, lex_len);
+            else fwrite(lex, 1, lex_len, of->f);
+            free(oname);
+        }
+    } else {
+        OutFile *of = of_find_or_open(files, fname, outdir);
+        fwrite(lex, 1, lex_len, of->f);
+    }
+
+    arena_reset(&files->line);
+}
+
+/* ---------- Seek table reader (for compressed streams) ---------- */
+
+typedef struct {
+    int codec;
+    SeekFrame *frames; size_t nframes;
+    SeekFile *files; size_t nfiles;
+} SeekTable;
+
+static int seek_table_load(const char *stream_path, SeekTable *st) {
+    size_t n = strlen(stream_path);
+    char *sp = (char*)malloc(n + 6);
+    if (!sp) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(sp, stream_path, n); memcpy(sp+n, ".seek", 6);
+    FILE *f = fopen(sp, "rb");
+    if (!f) { fprintf(stderr,"Failed to open seek table %s: %s\n", sp, strerror(errno)); free(sp); return -1; }
+    memset(st, 0, sizeof(*st));
+    char *line = NULL; size_t cap = 0;
+    char codec[16]; unsigned long long nfr=0, nfi=0;
+    int ok = read_line(f, &line, &cap) > 0 && sscanf(line, "ctseek 1 %15s %llu %llu", codec, &nfr, &nfi) == 3;
+    if (ok) {
+        st->codec = cz_parse(codec);
+        st->frames = (SeekFrame*)calloc((size_t)nfr + 1, sizeof(SeekFrame));
+        st->files = (SeekFile*)calloc((size_t)nfi + 1, sizeof(SeekFile));
+        if (!st->frames || !st->files) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    while (ok) {
+        long r = read_line(f, &line, &cap);
+        if (r < 0) break;
+        while (r > 0 && (line[r-1]=='\n' || line[r-1]=='\r')) line[--r] = 0;
+        unsigned long long a=0, b=0, c=0; int used=0;
+        if (strncmp(line, "frame ", 6)==0 && st->nframes < nfr &&
+            sscanf(line+6, "%llu %llu %llu", &a, &b, &c) == 3) {
+            SeekFrame *fr = &st->frames[st->nframes++];
+            fr->coff = a; fr->clen = b; fr->ulen = c;
+        } else if (strncmp(line, "file ", 5)==0 && st->nfiles < nfi &&
+                   sscanf(line+5, "%llu %llu %n", &a, &b, &used) == 2 && used > 0) {
+            SeekFile *sf = &st->files[st->nfiles++];
+            sf->first_frame = a; sf->last_frame = b;
+            sf->name = str_dup(line + 5 + used);
+        } else {
+            ok = 0;
+        }
+    }
+    free(line);
+    fclose(f);
+    if (!ok || st->codec < 0 || st->nframes != nfr || st->nfiles != nfi) {
+        fprintf(stderr,"Malformed seek table %s\n", sp);
+        free(sp);
+        return -1;
+    }
+    free(sp);
+    return 0;
+}
+static void seek_table_free(SeekTable *st) {
+    for (size_t i=0;i<st->nfiles;++i) free(st->files[i].name);
+    free(st->files); free(st->frames);
+}
+
+/* Decompress only the frames holding selected files and reassemble their lines. */
+static void reassemble_framed(FILE *in, const char *in_path, int codec, OutSet *files,
+                              const char *outdir, char **only, int nonly, Patch *patch) {
+    SeekTable st;
+    if (seek_table_load(in_path, &st) != 0) exit(1);
+    if (st.codec != codec) { fprintf(stderr,"Seek table codec does not match %s\n", in_path); exit(1); }
+    if (!cz_available(codec)) { fprintf(stderr,"Built without %s support\n", cz_name(codec)); exit(1); }
+    unsigned char *want = (unsigned char*)calloc(st.nframes + 1, 1);
+    if (!want) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t i=0;i<st.nfiles;++i) {
+        if (!name_selected(st.files[i].name, only, nonly)) continue;
+        for (uint64_t k=st.files[i].first_frame; k<=st.files[i].last_frame && k<st.nframes; ++k) want[k] = 1;
+    }
+    OBuf z = {0}, u = {0};
+    for (size_t k=0;k<st.nframes;++k) {
+        if (!want[k]) continue;
+        const SeekFrame *fr = &st.frames[k];
+        z.n = 0; ob_reserve(&z, (size_t)fr->clen);
+        if (FSEEK64(in, fr->coff) != 0 || fread(z.p, 1, (size_t)fr->clen, in) != fr->clen) {
+            fprintf(stderr,"Short read in %s (frame %zu)\n", in_path, k); exit(1);
+        }
+        if (cz_decompress(codec, z.p, (size_t)fr->clen, (size_t)fr->ulen, &u) != 0) {
+            fprintf(stderr,"Corrupt frame %zu in %s\n", k, in_path); exit(1);
+        }
+        /* Frames end on line boundaries; terminate each line in place */
+        char *s = (char*)u.p, *end = (char*)u.p + u.n;
+        while (s < end) {
+            char *nl = (char*)memchr(s, '\n', (size_t)(end - s));
+            char *e = nl ? nl : end;
+            *e = 0;
+            reassemble_line(s, (size_t)(e - s) + 1, files, outdir, only, nonly, patch);
+            s = e + 1;
+        }
+    }
+    ob_free(&z); ob_free(&u);
+    free(want);
+    seek_table_free(&st);
+}
+
+static void reassemble(const char *in_path, const char *outdir, char **only, int nonly, const char *patch_path) {
+    FILE *in = strcmp(in_path,"-")==0 ? stdin : fopen(in_path,"rb");
+    if (!in) { fprintf(stderr,"Failed to open %s: %s\n", in_path, strerror(errno)); exit(1); }
+    OutSet files;
+    memset(&files, 0, sizeof(files));
+    int codec = CZ_NONE;
+    Patch patch, *pt = NULL;
+    if (patch_path) { patch_load(patch_path, &patch); pt = &patch; }
+    if (in != stdin) {
+        unsigned char magic[4];
+        size_t m = fread(magic, 1, sizeof(magic), in);
+        codec = cz_sniff(magic, m);
+        rewind(in);
+    }
+    if (codec != CZ_NONE) {
+        reassemble_framed(in, in_path, codec, &files, outdir, only, nonly, pt);
+    } else {
+        char *line = NULL; size_t cap=0;
+        while (1) {
+            long r = read_line(in, &line, &cap);
+            if (r < 0) break;
+            reassemble_line(line, (size_t)r, &files, outdir, only, nonly, pt);
+        }
+        free(line);
+    }
+    if (pt) {
+        for (OutFile *p=files.head; p; p=p->next) if (p->pf) of_patch_finish(p);
+        for (size_t i=0;i<pt->n;++i) {
+            PatchFile *f = &pt->f[i];
+            if (f->op == PATCH_MODIFY && !f->seen && f->old_tokens == 0) {
+                /* an empty old file has no stream lines; build it from the inserts */
+                char *oname = path_join(pt->new_root, f->new_rel);
+                if (name_selected(oname, only, nonly)) {
+                    OutFile *of = of_find_or_open(&files, oname, outdir);
+                    of->pf = f; of->ep = f->edits; of->edits_left = f->nedit;
+                    of_patch_finish(of);
+                }
+                free(oname);
+                continue;
+            }
+            if (f->op != PATCH_ADD) {
+                if (!f->seen && nonly == 0) {
+                    fprintf(stderr,"Patch does not match stream: %s/%s is not in it\n", pt->old_root, f->old_rel);
+                    exit(1);
+                }
+                continue;
+            }
+            char *oname = path_join(pt->new_root, f->new_rel);
+            if (name_selected(oname, only, nonly)) {
+                OutFile *of = of_find_or_open(&files, oname, outdir);
+                fwrite(f->edits, 1, (size_t)(f->end - f->edits), of->f);
+            }
+            free(oname);
+        }
+        patch_free(pt);
+    }
+    /* close */
+    for (OutFile *p=files.head; p; p=p->next) fclose(p->f);
+    free(files.slot);
+    arena_free(&files.mem); arena_free(&files.line);
+    if (in!=stdin) fclose(in);
+}
+
+/* ---------- Verifier: check a stream against sources or a manifest ----------
+ * The stream is cut into chunks (plain: ~4 MiB blocks ending on a line;
+ * compressed: one frame each) that are decoded and parsed in parallel into
+ * runs of lexeme bytes per file. The runs are then folded in stream order
+ * into a per-file FNV-1a, so nothing is reconstructed on disk. Token offsets
+ * must be contiguous, which catches dropped or duplicated lines even where
+ * the expected hash is unknown. */
+#define VERIFY_BLOCK ((size_t)4<<20)
+
+typedef struct VFile {
+    char *name;
+    uint64_t h;                      /* name hash */
+    uint64_t bytes, tokens, hash;    /* rebuilt from the stream */
+    uint64_t want_bytes, want_hash;  /* from the manifest or the source file */
+    long shard;                      /* manifest shard, -1 if unknown */
+    int seen, expected, gap, bad_frame, unreadable;
+} VFile;
+
+typedef struct {
+    VFile **v; size_t n, cap;        /* first-seen order */
+    size_t *slot; size_t nslot;      /* open addressing: index+1, 0 = empty */
+} VFileTab;
+
+static VFile *vft_get(VFileTab *t, const char *name, size_t len) {
+    uint64_t h = fnv1a64(name, len);
+    if (t->n * 2 >= t->nslot) {
+        size_t ns = t->nslot ? t->nslot*2 : 1024;
+        size_t *sl = (size_t*)calloc(ns, sizeof(size_t));
+        if (!sl) { fprintf(stderr,"OOM\n"); exit(1); }
+        for (size_t i=0;i<t->n;++i) {
+            size_t k = (size_t)(t->v[i]->h & (ns-1));
+            while (sl[k]) k = (k+1) & (ns-1);
+            sl[k] = i+1;
+        }
+        free(t->slot); t->slot = sl; t->nslot = ns;
+    }
+    size_t k = (size_t)(h & (t->nslot-1));
+    for (; t->slot[k]; k = (k+1) & (t->nslot-1)) {
+        VFile *f = t->v[t->slot[k]-1];
+        if (f->h == h && strlen(f->name) == len && memcmp(f->name, name, len) == 0) return f;
+    }
+    if (t->n == t->cap) {
+        t->cap = t->cap ? t->cap*2 : 256;
+        t->v = (VFile**)realloc(t->v, t->cap*sizeof(VFile*));
+        if (!t->v) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    VFile *f = (VFile*)calloc(1, sizeof(VFile));
+    if (!f) { fprintf(stderr,"OOM\n"); exit(1); }
+    f->name = (char*)malloc(len+1);
+    if (!f->name) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(f->name, name, len); f->name[len] = 0;
+    f->h = h; f->hash = FNV1A64_INIT; f->shard = -1;
+    t->v[t->n++] = f;
+    t->slot[k] = t->n;
+    return f;
+}
+
+/* Consecutive tokens of one file within a chunk. */
+typedef struct {
+    const char *name; size_t nlen;   /* points into the chunk text */
+    uint64_t first_off;
+    size_t dstart, dlen;             /* lexeme bytes in VChunk.data */
+    uint64_t tokens;
+    int gap;
+} VRun;
+
+typedef struct {
+    OBuf text;                       /* JSONL lines (decompressed for frames) */
+    OBuf z;                          /* compressed frame */
+    size_t frame; uint64_t ulen;
+    OBuf data;                       /* unescaped lexemes */
+    VRun *runs; size_t nruns, cap;
+    uint64_t malformed;
+    int bad_frame;
+} VChunk;
+
+typedef struct {
+    VChunk *chunks;
+    int codec;
+    char **only; int nonly;
+} VerifyCtx;
+
+/* Parse one generated line; fills name and off, returns the lexeme span. */
+static int verify_parse_line(const char *s, const char *end, const char **name, size_t *nlen,
+                             uint64_t *off, const char **lex, size_t *llen) {
+    if ((size_t)(end - s) < 9 || memcmp(s, "{\"file\":\"", 9) != 0) return -1;
+    s += 9;
+    const char *q = (const char*)memchr(s, '\"', (size_t)(end - s));
+    if (!q || end - q < 8 || memcmp(q, "\",\"off\":", 8) != 0) return -1;
+    *name = s; *nlen = (size_t)(q - s);
+    s = q + 8;
+    uint64_t v = 0;
+    if (s >= end || !isdigit((unsigned char)*s)) return -1;
+    while (s < end && isdigit((unsigned char)*s)) v = v*10 + (uint64_t)(*s++ - '0');
+    *off = v;
+    for (; s + 10 <= end; ++s) if (*s == '\"' && memcmp(s, "\"lexeme\":\"", 10) == 0) break;
+    if (s + 10 > end) return -1;
+    s += 10;
+    const char *e = s;
+    while (e < end && *e != '\"') e += (*e == '\\') ? 2 : 1;
+    if (e >= end) return -1;
+    *lex = s; *llen = (size_t)(e - s);
+    return 0;
+}
+
+static void verify_parse_chunk(VChunk *c, char **only, int nonly) {
+    const char *s = (const char*)c->text.p, *end = s + c->text.n;
+    VRun *run = NULL;
+    c->data.n = 0; c->nruns = 0; c->malformed = 0;
+    while (s < end) {
+        const char *nl = (const char*)memchr(s, '\n', (size_t)(end - s));
+        const char *e = nl ? nl : end;
+        const char *name, *lex; size_t nlen, llen; uint64_t off;
+        if (e > s && verify_parse_line(s, e, &name, &nlen, &off, &lex, &llen) == 0) {
+            if (!run || run->nlen != nlen || memcmp(run->name, name, nlen) != 0) {
+                run = NULL;
+                if (nonly) {
+                    char *tmp = (char*)malloc(nlen+1);
+                    if (!tmp) { fprintf(stderr,"OOM\n"); exit(1); }
+                    memcpy(tmp, name, nlen); tmp[nlen] = 0;
+                    int sel = name_selected(tmp, only, nonly);
+                    free(tmp);
+                    if (!sel) { s = e + 1; continue; }
+                }
+                if (c->nruns == c->cap) {
+                    c->cap = c->cap ? c->cap*2 : 64;
+                    c->runs = (VRun*)realloc(c->runs, c->cap*sizeof(VRun));
+                    if (!c->runs) { fprintf(stderr,"OOM\n"); exit(1); }
+                }
+                run = &c->runs[c->nruns++];
+                run->name = name; run->nlen = nlen; run->first_off = off;
+                run->dstart = c->data.n; run->dlen = 0; run->tokens = 0; run->gap = 0;
+            }
+            if (off != run->first_off + run->dlen) run->gap = 1;
+            ob_reserve(&c->data, llen);
+            size_t d = json_unescape_to(lex, llen, c->data.p + c->data.n);
+            c->data.n += d; run->dlen += d; run->tokens++;
+        } else if (e > s) {
+            c->malformed++;
+        }
+        s = e + 1;
+    }
+}
+
+static void verify_chunk_worker(void *ctx, size_t i, int tid) {
+    VerifyCtx *v = (VerifyCtx*)ctx;
+    VChunk *c = &v->chunks[i];
+    (void)tid;
+    if (v->codec != CZ_NONE) {
+        c->text.n = 0;
+        c->bad_frame = cz_decompress(v->codec, c->z.p, c->z.n, (size_t)c->ulen, &c->text) != 0;
+        if (c->bad_frame) { c->nruns = 0; return; }
+    }
+    verify_parse_chunk(c, v->only, v->nonly);
+}
+
+static void verify_fold(VFileTab *t, VChunk *c, uint64_t *malformed) {
+    for (size_t r=0;r<c->nruns;++r) {
+        const VRun *run = &c->runs[r];
+        VFile *f = vft_get(t, run->name, run->nlen);
+        if (run->gap || run->first_off != f->bytes) f->gap = 1;
+        f->seen = 1;
+        f->hash = fnv1a64_update(f->hash, c->data.p + run->dstart, run->dlen);
+        f->bytes += run->dlen;
+        f->tokens += run->tokens;
+    }
+    *malformed += c->malformed;
+}
+
+/* Plain JSONL: read blocks cut after the last newline, nthreads*2 at a time. */
+static void verify_plain(FILE *in, VFileTab *t, int nthreads, char **only, int nonly, uint64_t *malformed) {
+    size_t batch = (size_t)nthreads * 2;
+    VerifyCtx v = { (VChunk*)calloc(batch, sizeof(VChunk)), CZ_NONE, only, nonly };
+    OBuf carry = {0};
+    if (!v.chunks) { fprintf(stderr,"OOM\n"); exit(1); }
+    int eof = 0;
+    while (!eof) {
+        size_t n = 0;
+        while (n < batch && !eof) {
+            OBuf *tx = &v.chunks[n].text;
+            tx->n = 0;
+            ob_write(tx, carry.p, carry.n);
+            carry.n = 0;
+            ob_reserve(tx, VERIFY_BLOCK);
+            size_t r = fread(tx->p + tx->n, 1, VERIFY_BLOCK, in);
+            tx->n += r;
+            if (r == 0) { eof = 1; if (tx->n) n++; break; }
+            unsigned char *nl = tx->p + tx->n;
+            while (nl > tx->p && nl[-1] != '\n') nl--;
+            /* A line longer than the block goes back to carry until it ends */
+            ob_write(&carry, nl, (size_t)(tx->p + tx->n - nl));
+            tx->n = (size_t)(nl - tx->p);
+            if (tx->n) n++;
+        }
+        par_for(n, nthreads, verify_chunk_worker, &v);
+        for (size_t i=0;i<n;++i) verify_fold(t, &v.chunks[i], malformed);
+    }
+    for (size_t i=0;i<batch;++i) {
+        ob_free(&v.chunks[i].text); ob_free(&v.chunks[i].data); free(v.chunks[i].runs);
+    }
+    free(v.chunks);
+    ob_free(&carry);
+}
+
+/* Compressed: frames from the seek table, decompressed and parsed in parallel.
+   Every file listed in the table is expected, including empty ones. */
+static void verify_framed(FILE *in, const char *in_path, int codec, VFileTab *t, int nthreads,
+                          char **only, int nonly, uint64_t *malformed) {
+    SeekTable st;
+    if (seek_table_load(in_path, &st) != 0) exit(1);
+    if (st.codec != codec) { fprintf(stderr,"Seek table codec does not match %s\n", in_path); exit(1); }
+    if (!cz_available(codec)) { fprintf(stderr,"Built without %s support\n", cz_name(codec)); exit(1); }
+    unsigned char *want = (unsigned char*)calloc(st.nframes + 1, 1);
+    if (!want) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t i=0;i<st.nfiles;++i) {
+        if (!name_selected(st.files[i].name, only, nonly)) continue;
+        VFile *f = vft_get(t, st.files[i].name, strlen(st.files[i].name));
+        f->seen = 1;
+        for (uint64_t k=st.files[i].first_frame; k<=st.files[i].last_frame && k<st.nframes; ++k) want[k] = 1;
+    }
+    size_t batch = (size_t)nthreads * 2;
+    VerifyCtx v = { (VChunk*)calloc(batch, sizeof(VChunk)), codec, only, nonly };
+    if (!v.chunks) { fprintf(stderr,"OOM\n"); exit(1); }
+    size_t k = 0;
+    while (k < st.nframes) {
+        size_t n = 0;
+        for (; n<batch && k<st.nframes; ++k) {
+            if (!want[k]) continue;
+            const SeekFrame *fr = &st.frames[k];
+            VChunk *c = &v.chunks[n++];
+            c->frame = k; c->ulen = fr->ulen;
+            c->z.n = 0; ob_reserve(&c->z, (size_t)fr->clen);
+            if (FSEEK64(in, fr->coff) != 0 || fread(c->z.p, 1, (size_t)fr->clen, in) != fr->clen) {
+                fprintf(stderr,"Short read in %s (frame %zu)\n", in_path, k); exit(1);
+            }
+            c->z.n = (size_t)fr->clen;
+        }
+        par_for(n, nthreads, verify_chunk_worker, &v);
+        for (size_t i=0;i<n;++i) {
+            VChunk *c = &v.chunks[i];
+            if (c->bad_frame) {
+                for (size_t j=0;j<st.nfiles;++j)
+                    if (st.files[j].first_frame <= c->frame && c->frame <= st.files[j].last_frame &&
+                        name_selected(st.files[j].name, only, nonly))
+                        vft_get(t, st.files[j].name, strlen(st.files[j].name))->bad_frame = 1;
+                continue;
+            }
+            verify_fold(t, c, malformed);
+        }
+    }
+    for (size_t i=0;i<batch;++i) {
+        ob_free(&v.chunks[i].text); ob_free(&v.chunks[i].z); ob_free(&v.chunks[i].data); free(v.chunks[i].runs);
+    }
+    free(v.chunks);
+    free(want);
+    seek_table_free(&st);
+}
+
+/* End of a manifest string value (the closing quote), skipping escapes. */
+static const char *manifest_str_end(const char *p) {
+    while (*p && *p != '\"') p += (*p == '\\' && p[1]) ? 2 : 1;
+    return p;
+}
+
+/* Load expected sizes/hashes; returns the shard whose path matches in_path, or -1. */
+static long verify_load_manifest(const char *path, const char *in_path, VFileTab *t) {
+    FILE *f = fopen(path, "rb");
+    if (!f) { fprintf(stderr,"Failed to open %s: %s\n", path, strerror(errno)); exit(1); }
+    char *line = NULL; size_t cap = 0;
+    long mine = -1;
+    while (read_line(f, &line, &cap) > 0) {
+        long shard = -1;
+        const char *p;
+        if ((p = strstr(line, "\"shard\":"))) shard = strtol(p + 8, NULL, 10);
+        if ((p = strstr(line, "\"path\":\""))) {
+            p += 8;
+            const char *q = manifest_str_end(p);
+            if (!*q) continue;
+            char *sp = (char*)malloc((size_t)(q - p) + 1);
+            if (!sp) { fprintf(stderr,"OOM\n"); exit(1); }
+            sp[json_unescape_to(p, (size_t)(q - p), (unsigned char*)sp)] = 0;
+            if (strcmp(sp, in_path) == 0 || strcmp(basename_pos(sp), basename_pos(in_path)) == 0) mine = shard;
+            free(sp);
+            continue;
+        }
+        if (!(p = strstr(line, "\"file\":\""))) continue;
+        p += 8;
+        const char *q = manifest_str_end(p);
+        const char *b = *q ? strstr(q, "\"bytes\":") : NULL, *h = b ? strstr(b, "\"hash\":\"") : NULL;
+        if (!b || !h) { fprintf(stderr,"Malformed manifest line in %s\n", path); exit(1); }
+        char *fn = (char*)malloc((size_t)(q - p) + 1);
+        if (!fn) { fprintf(stderr,"OOM\n"); exit(1); }
+        size_t fl = json_unescape_to(p, (size_t)(q - p), (unsigned char*)fn);
+        VFile *vf = vft_get(t, fn, fl);
+        free(fn);
+        vf->expected = 1; vf->shard = shard;
+        vf->want_bytes = strtoull(b + 8, NULL, 10);
+        vf->want_hash = strtoull(h + 8, NULL, 16);
+    }
+    free(line);
+    fclose(f);
+    return mine;
+}
+
+typedef struct { VFileTab *t; const char *root; } SourceCtx;
+static void verify_source_worker(void *ctx, size_t i, int tid) {
+    SourceCtx *s = (SourceCtx*)ctx;
+    VFile *f = s->t->v[i];
+    char *path = f->name;
+    Buf b = {0};
+    (void)tid;
+    if (!f->seen) return;
+    if (s->root) {
+        size_t nr = strlen(s->root), nn = strlen(f->name);
+        path = (char*)malloc(nr + nn + 2);
+        if (!path) { fprintf(stderr,"OOM\n"); exit(1); }
+        memcpy(path, s->root, nr); path[nr] = '/'; memcpy(path + nr + 1, f->name, nn + 1);
+    }
+    if (read_file_scratch(path, &b) != 0) f->unreadable = 1;
+    else { f->expected = 1; f->want_bytes = b.n; f->want_hash = fnv1a64(b.p, b.n); }
+    arena_reset(&tls_scratch);
+    if (path != f->name) free(path);
+}
+
+/* One JSONL record per failing file, then a summary; returns the failure count. */
+static uint64_t verify_report(FILE *out, VFileTab *t, int have_manifest, long mine, uint64_t malformed,
+                              char **only, int nonly) {
+    uint64_t nfiles = 0, failed = 0;
+    for (size_t i=0;i<t->n;++i) {
+        VFile *f = t->v[i];
+        const char *status = NULL;
+        if (!f->seen) {
+            /* manifest-only entry: expected here only if it belongs to this shard */
+            if (mine < 0 || f->shard != mine || !name_selected(f->name, only, nonly)) continue;
+            if (f->want_bytes || f->want_hash != FNV1A64_INIT) status = "missing";
+        } else if (f->bad_frame) status = "corrupt_frame";
+        else if (f->gap) status = "offset_gap";
+        else if (f->unreadable) status = "unreadable";
+        else if (!f->expected) status = have_manifest ? "not_in_manifest" : "unreadable";
+        else if (mine >= 0 && f->shard != mine) status = "wrong_shard";
+        else if (f->bytes != f->want_bytes) status = "size_mismatch";
+        else if (f->hash != f->want_hash) status = "hash_mismatch";
+        nfiles++;
+        if (!status) continue;
+        failed++;
+        fprintf(out, "{\"file\":\"%s\",\"status\":\"%s\",\"bytes\":%llu,\"expected_bytes\":%llu,"
+                "\"hash\":\"%016llx\",\"expected_hash\":\"%016llx\"}\n",
+                f->name, status, (unsigned long long)f->bytes, (unsigned long long)f->want_bytes,
+                (unsigned long long)f->hash, (unsigned long long)f->want_hash);
+    }
+    fprintf(out, "{\"files\":%llu,\"ok\":%llu,\"failed\":%llu,\"malformed_lines\":%llu}\n",
+            (unsigned long long)nfiles, (unsigned long long)(nfiles - failed),
+            (unsigned long long)failed, (unsigned long long)malformed);
+    return failed + malformed;
+}
+
+static int verify(const char *in_path, const char *manifest, const char *root, FILE *out,
+                  int nthreads, char **only, int nonly) {
+    FILE *in = strcmp(in_path,"-")==0 ? stdin : fopen(in_path,"rb");
+    if (!in) { fprintf(stderr,"Failed to open %s: %s\n", in_path, strerror(errno)); exit(1); }
+    VFileTab t;
+    memset(&t, 0, sizeof(t));
+    long mine = manifest ? verify_load_manifest(manifest, in_path, &t) : -1;
+    uint64_t malformed = 0;
+    int codec = CZ_NONE;
+    if (in != stdin) {
+        unsigned char magic[4];
+        size_t m = fread(magic, 1, sizeof(magic), in);
+        codec = cz_sniff(magic, m);
+        rewind(in);
+    }
+    if (codec != CZ_NONE) verify_framed(in, in_path, codec, &t, nthreads, only, nonly, &malformed);
+    else verify_plain(in, &t, nthreads, only, nonly, &malformed);
+    if (in != stdin) fclose(in);
+    if (!manifest) {
+        SourceCtx s = { &t, root };
+        par_for(t.n, nthreads, verify_source_worker, &s);
+    }
+    uint64_t bad = verify_report(out, &t, manifest != NULL, mine, malformed, only, nonly);
+    for (size_t i=0;i<t.n;++i) { free(t.v[i]->name); free(t.v[i]); }
+    free(t.v); free(t.slot);
+    return bad ? 1 : 0;
+}
+
+/* ---------- Inverted identifier index (index / query) ----------
+ * Layout (all integers u64 little-endian):
+ *   header    "CTIDX1\n\0", nfiles, nterms, files_off, terms_off,
+ *             strings_off, postings_off, total_size            (64 bytes)
+ *   files     nfiles x name offset into strings
+ *   terms     nterms x { str_off, str_len, post_off, post_len, count },
+ *             sorted by lexeme bytes (binary searchable in place)
+ *   strings   NUL-terminated file names, then NUL-terminated terms
+ *   postings  per term, one (file delta, offset) varint pair per occurrence
+ *             in (file, offset) order; the offset is a delta from the
+ *             previous occurrence in the same file, absolute otherwise.
+ * Files are lexed ahead in parallel batches and folded into the term table
+ * in input order, so postings are append-only and the index is
+ * deterministic for a given file list. Only IDENT tokens are indexed. */
+#define IX_MAGIC "CTIDX1\n"
+#define IX_HEADER 64
+#define IX_TERM 40
+
+typedef struct IxTerm {
+    uint64_t h;
+    char *s; size_t len;
+    uint64_t count;
+    uint64_t last_file, last_off;
+    unsigned char *post; size_t npost, cap;
+    struct IxTerm *next;
+} IxTerm;
+
+typedef struct {
+    IxTerm **bkt; size_t nbkt;
+    size_t nitem;
+} IxTab;
+
+static void ix_put_varint(IxTerm *t, uint64_t v) {
+    if (t->npost + 20 > t->cap) {
+        t->cap = t->cap ? t->cap*2 : 32;
+        t->post = (unsigned char*)realloc(t->post, t->cap);
+        if (!t->post) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    while (v >= 0x80) { t->post[t->npost++] = (unsigned char)(v | 0x80); v >>= 7; }
+    t->post[t->npost++] = (unsigned char)v;
+}
+
+static uint64_t ix_get_varint(const unsigned char **p, const unsigned char *end) {
+    uint64_t v = 0;
+    for (int sh=0; *p < end && sh < 64; sh += 7) {
+        unsigned char b = *(*p)++;
+        v |= (uint64_t)(b & 0x7F) << sh;
+        if (!(b & 0x80)) break;
+    }
+    return v;
+}
+
+static void ix_add(IxTab *tab, const char *s, size_t len, uint64_t file, uint64_t off) {
+    uint64_t h = fnv1a64(s, len);
+    IxTerm *t = tab->bkt[h & (tab->nbkt-1)];
+    while (t && !(t->h == h && t->len == len && memcmp(t->s, s, len) == 0)) t = t->next;
+    if (!t) {
+        if (tab->nitem >= tab->nbkt) {  /* keep chains short: double and rehash */
+            size_t nb = tab->nbkt * 2;
+            IxTerm **b = (IxTerm**)calloc(nb, sizeof(IxTerm*));
+            if (!b) { fprintf(stderr,"OOM\n"); exit(1); }
+            for (size_t i=0;i<tab->nbkt;++i)
+                for (IxTerm *e=tab->bkt[i], *n; e; e=n) { n = e->next; e->next = b[e->h & (nb-1)]; b[e->h & (nb-1)] = e; }
+            free(tab->bkt); tab->bkt = b; tab->nbkt = nb;
+        }
+        t = (IxTerm*)calloc(1, sizeof(IxTerm));
+        if (!t) { fprintf(stderr,"OOM\n"); exit(1); }
+        t->s = (char*)malloc(len+1);
+        if (!t->s) { fprintf(stderr,"OOM\n"); exit(1); }
+        memcpy(t->s, s, len); t->s[len] = 0;
+        t->h = h; t->len = len;
+        t->next = tab->bkt[h & (tab->nbkt-1)]; tab->bkt[h & (tab->nbkt-1)] = t;
+        tab->nitem++;
+    }
+    uint64_t fd = t->count ? file - t->last_file : file;
+    ix_put_varint(t, fd);
+    ix_put_varint(t, (t->count && fd == 0) ? off - t->last_off : off);
+    t->last_file = file; t->last_off = off;
+    t->count++;
+}
+
+/* One lexed-ahead file: its bytes and the IDENT token spans. */
+typedef struct {
+    Buf b;
+    uint64_t *offs; uint32_t *lens; size_t n, cap;
+} IxFile;
+
+typedef struct { char **files; size_t base; IxFile *slots; } IxCtx;
+
+static void ix_lex_worker(void *ctx, size_t i, int tid) {
+    IxCtx *c = (IxCtx*)ctx;
+    IxFile *f = &c->slots[i];
+    CtLexer lx; CtToken t;
+    (void)tid;
+    f->n = 0;
+    if (read_file(c->files[c->base + i], &f->b) != 0) exit(1);
+    ct_lexer_init(&lx, f->b.p, f->b.n);
+    while (ct_next(&lx, &t)) {
+        if (t.kind != CT_IDENT) continue;
+        if (f->n == f->cap) {
+            f->cap = f->cap ? f->cap*2 : 1024;
+            f->offs = (uint64_t*)realloc(f->offs, f->cap*sizeof(uint64_t));
+            f->lens = (uint32_t*)realloc(f->lens, f->cap*sizeof(uint32_t));
+            if (!f->offs || !f->lens) { fprintf(stderr,"OOM\n"); exit(1); }
+        }
+        f->offs[f->n] = t.off; f->lens[f->n] = (uint32_t)t.len; f->n++;
+    }
+}
+
+static void put_u64le(unsigned char *p, uint64_t v) {
+    for (int i=0;i<8;++i) p[i] = (unsigned char)(v >> (8*i));
+}
+static uint64_t get_u64le(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i=7;i>=0;--i) v = (v << 8) | p[i];
+    return v;
+}
+
+static int cmp_ixterm(const void *a, const void *b) {
+    const IxTerm *x = *(const IxTerm* const*)a, *y = *(const IxTerm* const*)b;
+    return cmp_lexeme(x->s, x->len, y->s, y->len);
+}
+
+static void ix_fwrite(FILE *f, const void *p, size_t n) {
+    if (n && fwrite(p, 1, n, f) != n) { fprintf(stderr,"Write failed: %s\n", strerror(errno)); exit(1); }
+}
+
+static void index_build(char **files, int nfiles, FILE *out, int nthreads) {
+    IxTab tab = { NULL, 1<<15, 0 };
+    tab.bkt = (IxTerm**)calloc(tab.nbkt, sizeof(IxTerm*));
+    size_t batch = (size_t)nthreads * 4;
+    IxFile *slots = (IxFile*)calloc(batch, sizeof(IxFile));
+    if (!tab.bkt || !slots) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t base=0; base<(size_t)nfiles; base+=batch) {
+        size_t n = MIN(batch, (size_t)nfiles - base);
+        IxCtx c = { files, base, slots };
+        par_for(n, nthreads, ix_lex_worker, &c);
+        for (size_t i=0;i<n;++i) {
+            IxFile *f = &slots[i];
+            for (size_t k=0;k<f->n;++k)
+                ix_add(&tab, (const char*)f->b.p + f->offs[k], f->lens[k], base + i, f->offs[k]);
+            free(f->b.p); f->b.p = NULL;
+        }
+    }
+    for (size_t i=0;i<batch;++i) { free(slots[i].offs); free(slots[i].lens); }
+    free(slots);
+
+    IxTerm **terms = (IxTerm**)malloc((tab.nitem + 1) * sizeof(IxTerm*));
+    if (!terms) { fprintf(stderr,"OOM\n"); exit(1); }
+    size_t nt = 0;
+    for (size_t i=0;i<tab.nbkt;++i) for (IxTerm *t=tab.bkt[i]; t; t=t->next) terms[nt++] = t;
+    qsort(terms, nt, sizeof(IxTerm*), cmp_ixterm);
+
+    /* Section sizes first, so every table can be written in one pass */
+    uint64_t files_off = IX_HEADER, terms_off = files_off + 8*(uint64_t)nfiles;
+    uint64_t strings_off = terms_off + IX_TERM*(uint64_t)nt, slen = 0, plen = 0;
+    for (int i=0;i<nfiles;++i) slen += strlen(files[i]) + 1;
+    for (size_t i=0;i<nt;++i) { slen += terms[i]->len + 1; plen += terms[i]->npost; }
+    uint64_t postings_off = strings_off + slen;
+    unsigned char hdr[IX_HEADER], rec[IX_TERM];
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, IX_MAGIC, 8);
+    put_u64le(hdr+8, (uint64_t)nfiles); put_u64le(hdr+16, nt);
+    put_u64le(hdr+24, files_off); put_u64le(hdr+32, terms_off);
+    put_u64le(hdr+40, strings_off); put_u64le(hdr+48, postings_off);
+    put_u64le(hdr+56, postings_off + plen);
+    ix_fwrite(out, hdr, sizeof(hdr));
+    uint64_t so = 0, po = 0;
+    for (int i=0;i<nfiles;++i) { put_u64le(rec, so); ix_fwrite(out, rec, 8); so += strlen(files[i]) + 1; }
+    for (size_t i=0;i<nt;++i) {
+        put_u64le(rec, so); put_u64le(rec+8, terms[i]->len);
+        put_u64le(rec+16, po); put_u64le(rec+24, terms[i]->npost); put_u64le(rec+32, terms[i]->count);
+        ix_fwrite(out, rec, IX_TERM);
+        so += terms[i]->len + 1; po += terms[i]->npost;
+    }
+    for (int i=0;i<nfiles;++i) ix_fwrite(out, files[i], strlen(files[i]) + 1);
+    for (size_t i=0;i<nt;++i) ix_fwrite(out, terms[i]->s, terms[i]->len + 1);
+    for (size_t i=0;i<nt;++i) ix_fwrite(out, terms[i]->post, terms[i]->npost);
+
+    for (size_t i=0;i<nt;++i) { free(terms[i]->s); free(terms[i]->post); free(terms[i]); }
+    free(terms); free(tab.bkt);
+}
+
+/* Read-only view of an index file: mmap where available, else read into memory. */
+typedef struct {
+    const unsigned char *p; size_t n;
+    uint64_t nfiles, nterms, files_off, terms_off, strings_off, postings_off;
+    int mapped;
+} IxView;
+
+static int index_open(const char *path, IxView *v) {
+    memset(v, 0, sizeof(*v));
+#ifdef _WIN32
+    Buf b = {0};
+    if (read_whole_file(path, &b, NULL) != 0) return -1;
+    v->p = b.p; v->n = b.n;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { fprintf(stderr,"Failed to open %s: %s\n", path, strerror(errno)); return -1; }
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); return -1; }
+    v->n = (size_t)st.st_size;
+    void *m = v->n ? mmap(NULL, v->n, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (m == MAP_FAILED) { fprintf(stderr,"Failed to map %s: %s\n", path, strerror(errno)); return -1; }
+    v->p = (const unsigned char*)m; v->mapped = 1;
+#endif
+    if (v->n < IX_HEADER || memcmp(v->p, IX_MAGIC, 8) != 0) { fprintf(stderr,"Not an index: %s\n", path); return -1; }
+    v->nfiles = get_u64le(v->p+8); v->nterms = get_u64le(v->p+16);
+    v->files_off = get_u64le(v->p+24); v->terms_off = get_u64le(v->p+32);
+    v->strings_off = get_u64le(v->p+40); v->postings_off = get_u64le(v->p+48);
+    if (get_u64le(v->p+56) != v->n || v->files_off + 8*v->nfiles > v->n ||
+        v->terms_off + IX_TERM*v->nterms > v->n || v->strings_off > v->n || v->postings_off > v->n) {
+        fprintf(stderr,"Corrupt index: %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void index_close(IxView *v) {
+#ifndef _WIN32
+    if (v->mapped) { munmap((void*)v->p, v->n); return; }
+#endif
+    free((void*)v->p);
+}
+
+/* Binary search over the sorted term table; returns the record or NULL. */
+static const unsigned char *index_find(const IxView *v, const char *s, size_t len) {
+    uint64_t lo = 0, hi = v->nterms;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const unsigned char *r = v->p + v->terms_off + IX_TERM*mid;
+        int c = cmp_lexeme((const char*)v->p + v->strings_off + get_u64le(r), (size_t)get_u64le(r+8), s, len);
+        if (c == 0) return r;
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    return NULL;
+}
+
+/* "NAME<TAB>FILE<TAB>OFFSET" per occurrence, or "NAME<TAB>COUNT" with count_only. */
+static void index_query(const IxView *v, const char *name, int count_only, FILE *out) {
+    const unsigned char *r = index_find(v, name, strlen(name));
+    if (count_only) {
+        fprintf(out, "%s\t%llu\n", name, (unsigned long long)(r ? get_u64le(r+32) : 0));
+        return;
+    }
+    if (!r) return;
+    const unsigned char *p = v->p + v->postings_off + get_u64le(r+16);
+    const unsigned char *end = p + get_u64le(r+24);
+    if (end > v->p + v->n) { fprintf(stderr,"Corrupt index postings for %s\n", name); exit(1); }
+    uint64_t file = 0, off = 0;
+    for (uint64_t k=0; p < end; ++k) {
+        uint64_t fd = ix_get_varint(&p, end), od = ix_get_varint(&p, end);
+        file += fd;
+        off = (k && fd == 0) ? off + od : od;
+        if (file >= v->nfiles) { fprintf(stderr,"Corrupt index postings for %s\n", name); exit(1); }
+        fprintf(out, "%s\t%s\t%llu\n", name,
+                (const char*)v->p + v->strings_off + get_u64le(v->p + v->files_off + 8*file),
+                (unsigned long long)off);
+    }
+}
+
+/* ---------- Near-duplicate detection (MinHash / LSH) ----------
+ * Each file's code tokens (no whitespace, newlines or comments) are hashed
+ * with fnv1a64 and joined into k-token shingles; identifiers can be folded to
+ * one symbol so renamed copies still match. A MinHash signature of nperm
+ * 32-bit minima (h_i(x) = (a_i*x + b_i) >> 32) is computed per file on the
+ * thread pool. Signatures go to a temp file indexed by file id, and each of
+ * the nbands band hashes becomes a (hash, file) record in one of several
+ * temp partitions. Each partition is then sorted alone, and files sharing a
+ * band hash are unioned when their estimated Jaccard similarity (the fraction
+ * of equal minima) reaches the threshold. Memory is a fixed batch of
+ * signatures, one partition (~64 MiB) and four bytes per file for union-find. */
+#define DEDUP_MAX_SHINGLE 64
+#define DEDUP_PART_BYTES ((uint64_t)64<<20)
+
+typedef struct {
+    int shingle, nperm, nbands, normalize;
+    double threshold;
+    uint64_t *a, *b;                 /* per-permutation multiplier (odd) and offset */
+} DedupParams;
+
+typedef struct { uint64_t h; uint32_t file; } BandRec;
+
+static uint64_t splitmix64(uint64_t *s) {
+    uint64_t z = (*s += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void dedup_params_init(DedupParams *dp) {
+    uint64_t seed = 0x5EEDC0DEULL;
+    dp->a = (uint64_t*)malloc((size_t)dp->nperm * sizeof(uint64_t));
+    dp->b = (uint64_t*)malloc((size_t)dp->nperm * sizeof(uint64_t));
+    if (!dp->a || !dp->b) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (int i=0;i<dp->nperm;++i) { dp->a[i] = splitmix64(&seed) | 1; dp->b[i] = splitmix64(&seed); }
+}
+
+static void minhash_update(const DedupParams *dp, uint32_t *sig, uint64_t x) {
+    for (int i=0;i<dp->nperm;++i) {
+        uint32_t v = (uint32_t)((dp->a[i] * x + dp->b[i]) >> 32);
+        if (v < sig[i]) sig[i] = v;
+    }
+}
+
+/* Fills sig; returns the number of code tokens (0: nothing to compare). */
+static uint64_t dedup_signature(const DedupParams *dp, const Buf *b, uint32_t *sig) {
+    uint64_t ring[DEDUP_MAX_SHINGLE];
+    uint64_t ntok = 0;
+    int k = dp->shingle;
+    CtLexer lx; CtToken t;
+    for (int i=0;i<dp->nperm;++i) sig[i] = UINT32_MAX;
+    ct_lexer_init(&lx, b->p, b->n);
+    while (ct_next(&lx, &t)) {
+        if (t.kind==CT_WS || t.kind==CT_NEWLINE || t.kind==CT_LINE_COMMENT || t.kind==CT_BLOCK_COMMENT) continue;
+        uint64_t h = (dp->normalize && t.kind==CT_IDENT) ? 0x1D ^ FNV1A64_INIT : fnv1a64(b->p + t.off, t.len);
+        ring[ntok % (uint64_t)k] = h ^ (uint64_t)t.kind;
+        ntok++;
+        if (ntok < (uint64_t)k) continue;
+        uint64_t s = FNV1A64_INIT;
+        for (int j=0;j<k;++j) s = (s ^ ring[(ntok + (uint64_t)j) % (uint64_t)k]) * 1099511628211ULL;
+        minhash_update(dp, sig, s);
+    }
+    if (ntok && ntok < (uint64_t)k) {  /* shorter than one shingle: use what there is */
+        uint64_t s = FNV1A64_INIT;
+        for (uint64_t j=0;j<ntok;++j) s = (s ^ ring[j]) * 1099511628211ULL;
+        minhash_update(dp, sig, s);
+    }
+    return ntok;
+}
+
+typedef struct {
+    const DedupParams *dp;
+    char **files;
+    size_t base;
+    uint32_t *sigs;                  /* batch x nperm */
+    unsigned char *has;
+} DedupCtx;
+
+static void dedup_sig_worker(void *ctx, size_t i, int tid) {
+    DedupCtx *c = (DedupCtx*)ctx;
+    Buf b = {0};
+    (void)tid;
+    if (read_file_scratch(c->files[c->base + i], &b) != 0) exit(1);
+    c->has[i] = dedup_signature(c->dp, &b, c->sigs + i * (size_t)c->dp->nperm) > 0;
+    arena_reset(&tls_scratch);
+}
+
+static uint32_t uf_find(uint32_t *parent, uint32_t x) {
+    while (parent[x] != x) { parent[x] = parent[parent[x]]; x = parent[x]; }
+    return x;
+}
+
+static int cmp_bandrec(const void *a, const void *b) {
+    const BandRec *x = (const BandRec*)a, *y = (const BandRec*)b;
+    if (x->h != y->h) return x->h < y->h ? -1 : 1;
+    return x->file < y->file ? -1 : (x->file > y->file);
+}
+
+static void sig_read(FILE *f, int nperm, uint32_t file, uint32_t *sig) {
+    size_t n = (size_t)nperm * sizeof(uint32_t);
+    if (FSEEK64(f, (uint64_t)file * n) != 0 || fread(sig, 1, n, f) != n) {
+        fprintf(stderr,"Failed to read signature temp file\n"); exit(1);
+    }
+}
+
+static FILE *tmpfile_or_die(void) {
+    FILE *f = tmpfile();
+    if (!f) { fprintf(stderr,"tmpfile failed: %s\n", strerror(errno)); exit(1); }
+    return f;
+}
+
+static void dedup(char **files, int nfiles, const DedupParams *dp, int nthreads, FILE *out) {
+    int rows = dp->nperm / dp->nbands;
+    size_t nparts = (size_t)((uint64_t)nfiles * (uint64_t)dp->nbands * sizeof(BandRec) / DEDUP_PART_BYTES) + 1;
+    if (nparts > 256) nparts = 256;
+    FILE *sigf = tmpfile_or_die();
+    FILE **parts = (FILE**)malloc(nparts * sizeof(FILE*));
+    uint32_t *parent = (uint32_t*)malloc(((size_t)nfiles + 1) * sizeof(uint32_t));
+    if (!parts || !parent) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t p=0;p<nparts;++p) parts[p] = tmpfile_or_die();
+    for (int i=0;i<nfiles;++i) parent[i] = (uint32_t)i;
+
+    /* Pass 1: signatures in parallel batches, spilled in file order */
+    size_t batch = (size_t)nthreads * 64;
+    DedupCtx c = { dp, files, 0, NULL, NULL };
+    c.sigs = (uint32_t*)malloc(batch * (size_t)dp->nperm * sizeof(uint32_t));
+    c.has = (unsigned char*)malloc(batch);
+    if (!c.sigs || !c.has) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t base=0; base<(size_t)nfiles; base+=batch) {
+        size_t n = MIN(batch, (size_t)nfiles - base);
+        c.base = base;
+        par_for(n, nthreads, dedup_sig_worker, &c);
+        ix_fwrite(sigf, c.sigs, n * (size_t)dp->nperm * sizeof(uint32_t));
+        for (size_t i=0;i<n;++i) {
+            if (!c.has[i]) continue;
+            const uint32_t *sig = c.sigs + i * (size_t)dp->nperm;
+            for (int band=0; band<dp->nbands; ++band) {
+                BandRec r;
+                r.h = fnv1a64_update(fnv1a64(&band, sizeof(band)), sig + band*rows, (size_t)rows * sizeof(uint32_t));
+                r.file = (uint32_t)(base + i);
+                ix_fwrite(parts[r.h % nparts], &r, sizeof(r));
+            }
+        }
+    }
+    free(c.sigs); free(c.has);
+    fflush(sigf);
+
+    /* Pass 2: per partition, verify files sharing a band against the run's first file */
+    uint32_t *s0 = (uint32_t*)malloc((size_t)dp->nperm * sizeof(uint32_t));
+    uint32_t *s1 = (uint32_t*)malloc((size_t)dp->nperm * sizeof(uint32_t));
+    if (!s0 || !s1) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t p=0;p<nparts;++p) {
+        long sz;
+        if (fseek(parts[p], 0, SEEK_END) != 0 || (sz = ftell(parts[p])) < 0) { fprintf(stderr,"tmpfile seek failed\n"); exit(1); }
+        size_t nrec = (size_t)sz / sizeof(BandRec);
+        BandRec *recs = (BandRec*)malloc((nrec + 1) * sizeof(BandRec));
+        if (!recs) { fprintf(stderr,"OOM\n"); exit(1); }
+        rewind(parts[p]);
+        if (fread(recs, sizeof(BandRec), nrec, parts[p]) != nrec) { fprintf(stderr,"tmpfile read failed\n"); exit(1); }
+        fclose(parts[p]);
+        qsort(recs, nrec, sizeof(BandRec), cmp_bandrec);
+        for (size_t s=0; s<nrec; ) {
+            size_t e = s + 1;
+            while (e < nrec && recs[e].h == recs[s].h) e++;
+            if (e - s > 1) {
+                sig_read(sigf, dp->nperm, recs[s].file, s0);
+                for (size_t j=s+1;j<e;++j) {
+                    uint32_t ra = uf_find(parent, recs[s].file), rb = uf_find(parent, recs[j].file);
+                    if (ra == rb) continue;
+                    sig_read(sigf, dp->nperm, recs[j].file, s1);
+                    int eq = 0;
+                    for (int i=0;i<dp->nperm;++i) eq += s0[i] == s1[i];
+                    if ((double)eq >= dp->threshold * (double)dp->nperm) {
+                        if (ra < rb) parent[rb] = ra; else parent[ra] = rb;  /* root = smallest id */
+                    }
+                }
+            }
+            s = e;
+        }
+        free(recs);
+    }
+    free(s0); free(s1); free(parts);
+    fclose(sigf);
+
+    /* Clusters of two or more, ordered by their first file */
+    uint32_t *size = (uint32_t*)calloc((size_t)nfiles + 1, sizeof(uint32_t));
+    uint32_t *next = (uint32_t*)malloc(((size_t)nfiles + 1) * sizeof(uint32_t));
+    uint32_t *last = (uint32_t*)malloc(((size_t)nfiles + 1) * sizeof(uint32_t));
+    if (!size || !next || !last) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (int i=0;i<nfiles;++i) {
+        uint32_t r = uf_find(parent, (uint32_t)i);
+        next[i] = UINT32_MAX;
+        if (size[r]++) next[last[r]] = (uint32_t)i;
+        last[r] = (uint32_t)i;
+    }
+    uint64_t ncl = 0, ndup = 0;
+    for (int i=0;i<nfiles;++i) {
+        if (parent[i] != (uint32_t)i || size[i] < 2) continue;
+        fprintf(out, "{\"cluster\":%llu,\"size\":%u,\"files\":[", (unsigned long long)ncl++, size[i]);
+        for (uint32_t f=(uint32_t)i; f!=UINT32_MAX; f=next[f])
+            fprintf(out, "%s\"%s\"", f==(uint32_t)i ? "" : ",", files[f]);
+        fprintf(out, "]}\n");
+        ndup += size[i] - 1;
+    }
+    fprintf(stderr, "dedup: %d files, %llu clusters, %llu redundant copies\n",
+            nfiles, (unsigned long long)ncl, (unsigned long long)ndup);
+    free(size); free(next); free(last); free(parent);
+}
+
+/* ---------- Clone detection (Rabin-Karp over code tokens) ----------
+ * Every file is reduced to its code tokens (whitespace, newlines and
+ * comments dropped), each mapped to a 64-bit symbol: fnv1a64 of the lexeme
+ * mixed with the kind, or with --normalize just the kind for identifiers and
+ * literals. A Rabin-Karp rolling hash over each window of W symbols yields
+ * one (hash, file, token) record per position. Records go to a hash-sharded
+ * table: threads fill private per-shard buffers and append them under the
+ * shard's lock. Each shard is then sorted on its own thread. Windows seen at
+ * two or more non-overlapping places form a group. Groups whose occurrences
+ * all advance by one token (same files, same relative positions, consecutive
+ * start) are chained into a single clone of W+k tokens. Token positions are
+ * mapped back to byte ranges by re-lexing only the files involved. */
+#define CLONE_SHARDS 256
+#define CLONE_LOCAL 256
+#define CLONE_BASE 0x100000001B3ULL      /* odd multiplier, arithmetic mod 2^64 */
+
+typedef struct { uint64_t h; uint32_t file, tok; } CloneRec;
+typedef struct { uint32_t file, tok; } CloneOcc;
+
+typedef struct {
+    CloneRec *v; size_t n, cap;
+    ct_mutex mu;
+    CloneOcc *occ; size_t nocc, cap_occ;  /* occurrences of this shard's groups */
+    struct CloneGroup *g; size_t ng, cap_g;
+} CloneShard;
+
+typedef struct CloneGroup {
+    uint64_t key;                     /* files and relative positions of the occurrences */
+    uint32_t tok0, nocc;
+    CloneShard *sh; size_t occ;       /* occurrences: sh->occ[occ .. occ+nocc) */
+} CloneGroup;
+
+typedef struct {
+    char **files;
+    int window, normalize;
+    CloneShard *shards;
+    CloneRec **local;                 /* per thread: CLONE_SHARDS x CLONE_LOCAL staging */
+} CloneCtx;
+
+static uint64_t clone_symbol(const CtToken *t, const unsigned char *p, int normalize) {
+    if (normalize && (t->kind==CT_IDENT || t->kind==CT_NUMBER || t->kind==CT_STRING || t->kind==CT_CHAR))
+        return fnv1a64_update(FNV1A64_INIT, &t->kind, sizeof(t->kind));
+    return fnv1a64(p + t->off, t->len) * 31 + (uint64_t)t->kind;
+}
+
+static void clone_push(CloneShard *sh, const CloneRec *r, size_t n) {
+    ct_mutex_lock(&sh->mu);
+    if (sh->n + n > sh->cap) {
+        while (sh->n + n > sh->cap) sh->cap = sh->cap ? sh->cap*2 : 4096;
+        sh->v = (CloneRec*)realloc(sh->v, sh->cap*sizeof(CloneRec));
+        if (!sh->v) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    memcpy(sh->v + sh->n, r, n*sizeof(CloneRec));
+    sh->n += n;
+    ct_mutex_unlock(&sh->mu);
+}
+
+static void clone_hash_worker(void *ctx, size_t fi, int tid) {
+    CloneCtx *c = (CloneCtx*)ctx;
+    int w = c->window;
+    Buf b = {0};
+    if (read_file_scratch(c->files[fi], &b) != 0) exit(1);
+    if (!c->local[tid]) {
+        c->local[tid] = (CloneRec*)malloc((size_t)CLONE_SHARDS * CLONE_LOCAL * sizeof(CloneRec));
+        if (!c->local[tid]) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    CloneRec *local = c->local[tid];
+    size_t nlocal[CLONE_SHARDS];
+    uint64_t *ring = (uint64_t*)malloc((size_t)w * sizeof(uint64_t));
+    if (!ring) { fprintf(stderr,"OOM\n"); exit(1); }
+    memset(nlocal, 0, sizeof(nlocal));
+    uint64_t top = 1;                 /* CLONE_BASE^(w-1) */
+    for (int i=1;i<w;++i) top *= CLONE_BASE;
+    uint64_t h = 0;
+    uint32_t ntok = 0;
+    CtLexer lx; CtToken t;
+    ct_lexer_init(&lx, b.p, b.n);
+    while (ct_next(&lx, &t)) {
+        if (!is_code_token(t.kind)) continue;
+        uint64_t s = clone_symbol(&t, b.p, c->normalize);
+        if (ntok >= (uint32_t)w) h -= ring[ntok % (uint32_t)w] * top;
+        h = h * CLONE_BASE + s;
+        ring[ntok % (uint32_t)w] = s;
+        ntok++;
+        if (ntok < (uint32_t)w) continue;
+        size_t k = (size_t)((h >> 56) % CLONE_SHARDS);
+        CloneRec *r = &local[k*CLONE_LOCAL + nlocal[k]++];
+        r->h = h; r->file = (uint32_t)fi; r->tok = ntok - (uint32_t)w;
+        if (nlocal[k] == CLONE_LOCAL) { clone_push(&c->shards[k], &local[k*CLONE_LOCAL], CLONE_LOCAL); nlocal[k] = 0; }
+    }
+    for (size_t k=0;k<CLONE_SHARDS;++k) if (nlocal[k]) clone_push(&c->shards[k], &local[k*CLONE_LOCAL], nlocal[k]);
+    free(ring); arena_reset(&tls_scratch);
+}
+
+static int cmp_clonerec(const void *a, const void *b) {
+    const CloneRec *x = (const CloneRec*)a, *y = (const CloneRec*)b;
+    if (x->h != y->h) return x->h < y->h ? -1 : 1;
+    if (x->file != y->file) return x->file < y->file ? -1 : 1;
+    return x->tok < y->tok ? -1 : (x->tok > y->tok);
+}
+
+/* Sort one shard and turn repeated windows into groups. */
+static void clone_group_worker(void *ctx, size_t k, int tid) {
+    CloneCtx *c = (CloneCtx*)ctx;
+    CloneShard *sh = &c->shards[k];
+    (void)tid;
+    qsort(sh->v, sh->n, sizeof(CloneRec), cmp_clonerec);
+    for (size_t s=0; s<sh->n; ) {
+        size_t e = s + 1;
+        while (e < sh->n && sh->v[e].h == sh->v[s].h) e++;
+        if (e - s > 1) {
+            size_t start = sh->nocc;
+            for (size_t i=s;i<e;++i) {
+                /* drop windows overlapping the previous kept one in the same file */
+                if (sh->nocc > start && sh->occ[sh->nocc-1].file == sh->v[i].file &&
+                    sh->v[i].tok < sh->occ[sh->nocc-1].tok + (uint32_t)c->window) continue;
+                if (sh->nocc == sh->cap_occ) {
+                    sh->cap_occ = sh->cap_occ ? sh->cap_occ*2 : 1024;
+                    sh->occ = (CloneOcc*)realloc(sh->occ, sh->cap_occ*sizeof(CloneOcc));
+                    if (!sh->occ) { fprintf(stderr,"OOM\n"); exit(1); }
+                }
+                sh->occ[sh->nocc].file = sh->v[i].file; sh->occ[sh->nocc].tok = sh->v[i].tok;
+                sh->nocc++;
+            }
+            if (sh->nocc - start < 2) { sh->nocc = start; s = e; continue; }
+            if (sh->ng == sh->cap_g) {
+                sh->cap_g = sh->cap_g ? sh->cap_g*2 : 256;
+                sh->g = (CloneGroup*)realloc(sh->g, sh->cap_g*sizeof(CloneGroup));
+                if (!sh->g) { fprintf(stderr,"OOM\n"); exit(1); }
+            }
+            CloneGroup *g = &sh->g[sh->ng++];
+            g->sh = sh; g->occ = start; g->nocc = (uint32_t)(sh->nocc - start);
+            g->tok0 = sh->occ[start].tok;
+            uint64_t key = FNV1A64_INIT;
+            for (size_t i=start;i<sh->nocc;++i) {
+                uint32_t rel[2] = { sh->occ[i].file, sh->occ[i].tok - g->tok0 };
+                key = fnv1a64_update(key, rel, sizeof(rel));
+            }
+            g->key = key;
+        }
+        s = e;
+    }
+    free(sh->v); sh->v = NULL; sh->n = sh->cap = 0;
+}
+
+static int cmp_clonegroup(const void *a, const void *b) {
+    const CloneGroup *x = *(const CloneGroup* const*)a, *y = *(const CloneGroup* const*)b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->tok0 < y->tok0 ? -1 : (x->tok0 > y->tok0);
+}
+
+/* A maximal clone: the first group of a chain plus its length in tokens. */
+typedef struct { const CloneGroup *g; uint32_t ntok; uint64_t *bytes; } Clone;
+
+/* Token index -> byte position, filled per file by re-lexing it. */
+typedef struct { uint32_t file, tok; int end; uint64_t *dst; } ByteReq;
+
+static int cmp_bytereq(const void *a, const void *b) {
+    const ByteReq *x = (const ByteReq*)a, *y = (const ByteReq*)b;
+    if (x->file != y->file) return x->file < y->file ? -1 : 1;
+    return x->tok < y->tok ? -1 : (x->tok > y->tok);
+}
+
+typedef struct { char **files; ByteReq *req; size_t *starts; } ByteCtx;
+
+static void clone_bytes_worker(void *ctx, size_t i, int tid) {
+    ByteCtx *c = (ByteCtx*)ctx;
+    ByteReq *r = c->req + c->starts[i], *end = c->req + c->starts[i+1];
+    Buf b = {0};
+    (void)tid;
+    if (read_file_scratch(c->files[r->file], &b) != 0) exit(1);
+    CtLexer lx; CtToken t;
+    uint32_t ntok = 0;
+    ct_lexer_init(&lx, b.p, b.n);
+    while (r < end && ct_next(&lx, &t)) {
+        if (!is_code_token(t.kind)) continue;
+        for (; r < end && r->tok == ntok; ++r) *r->dst = r->end ? t.off + t.len : t.off;
+        ntok++;
+    }
+    arena_reset(&tls_scratch);
+}
+
+static int cmp_clone_pos(const void *a, const void *b) {
+    const Clone *x = (const Clone*)a, *y = (const Clone*)b;
+    const CloneOcc *ox = &x->g->sh->occ[x->g->occ], *oy = &y->g->sh->occ[y->g->occ];
+    if (ox->file != oy->file) return ox->file < oy->file ? -1 : 1;
+    if (ox->tok != oy->tok) return ox->tok < oy->tok ? -1 : 1;
+    return x->ntok > y->ntok ? -1 : (x->ntok < y->ntok);
+}
+
+static void clones(char **files, int nfiles, int window, int normalize, int nthreads, FILE *out) {
+    CloneCtx c = { files, window, normalize, (CloneShard*)calloc(CLONE_SHARDS, sizeof(CloneShard)),
+                   (CloneRec**)calloc((size_t)nthreads, sizeof(CloneRec*)) };
+    if (!c.shards || !c.local) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t k=0;k<CLONE_SHARDS;++k) ct_mutex_init(&c.shards[k].mu);
+    par_for((size_t)nfiles, nthreads, clone_hash_worker, &c);
+    for (int t=0;t<nthreads;++t) free(c.local[t]);
+    free(c.local);
+    par_for(CLONE_SHARDS, nthreads, clone_group_worker, &c);
+
+    /* Chain groups that shift by one token into maximal clones */
+    size_t ng = 0;
+    for (size_t k=0;k<CLONE_SHARDS;++k) ng += c.shards[k].ng;
+    CloneGroup **gs = (CloneGroup**)malloc((ng + 1) * sizeof(CloneGroup*));
+    Clone *cl = (Clone*)malloc((ng + 1) * sizeof(Clone));
+    if (!gs || !cl) { fprintf(stderr,"OOM\n"); exit(1); }
+    ng = 0;
+    for (size_t k=0;k<CLONE_SHARDS;++k) for (size_t i=0;i<c.shards[k].ng;++i) gs[ng++] = &c.shards[k].g[i];
+    qsort(gs, ng, sizeof(CloneGroup*), cmp_clonegroup);
+    size_t ncl = 0, nreq = 0;
+    for (size_t s=0; s<ng; ) {
+        size_t e = s + 1;
+        while (e < ng && gs[e]->key == gs[s]->key && gs[e]->tok0 == gs[e-1]->tok0 + 1) e++;
+        cl[ncl].g = gs[s];
+        cl[ncl].ntok = (uint32_t)window + (gs[e-1]->tok0 - gs[s]->tok0);
+        nreq += 2 * (size_t)gs[s]->nocc;
+        ncl++;
+        s = e;
+    }
+    free(gs);
+    qsort(cl, ncl, sizeof(Clone), cmp_clone_pos);
+
+    /* Byte ranges: two requests (first token start, last token end) per occurrence */
+    ByteReq *req = (ByteReq*)malloc((nreq + 1) * sizeof(ByteReq));
+    uint64_t *bytes = (uint64_t*)malloc((nreq + 1) * sizeof(uint64_t));
+    size_t *starts = (size_t*)malloc(((size_t)nfiles + 2) * sizeof(size_t));
+    if (!req || !bytes || !starts) { fprintf(stderr,"OOM\n"); exit(1); }
+    nreq = 0;
+    for (size_t i=0;i<ncl;++i) {
+        const CloneOcc *o = &cl[i].g->sh->occ[cl[i].g->occ];
+        cl[i].bytes = bytes + nreq;
+        for (uint32_t j=0;j<cl[i].g->nocc;++j) {
+            ByteReq *r = &req[nreq];
+            r[0].file = r[1].file = o[j].file;
+            r[0].tok = o[j].tok; r[0].end = 0; r[0].dst = &bytes[nreq];
+            r[1].tok = o[j].tok + cl[i].ntok - 1; r[1].end = 1; r[1].dst = &bytes[nreq+1];
+            nreq += 2;
+        }
+    }
+    qsort(req, nreq, sizeof(ByteReq), cmp_bytereq);
+    size_t nf = 0;
+    for (size_t i=0;i<nreq;++i) if (i==0 || req[i].file != req[i-1].file) starts[nf++] = i;
+    starts[nf] = nreq;
+    ByteCtx bc = { files, req, starts };
+    par_for(nf, nthreads, clone_bytes_worker, &bc);
+
+    for (size_t i=0;i<ncl;++i) {
+        const CloneOcc *o = &cl[i].g->sh->occ[cl[i].g->occ];
+        fprintf(out, "{\"clone\":%zu,\"tokens\":%u,\"occurrences\":[", i, cl[i].ntok);
+        for (uint32_t j=0;j<cl[i].g->nocc;++j)
+            fprintf(out, "%s{\"file\":\"%s\",\"start\":%llu,\"end\":%llu}", j ? "," : "", files[o[j].file],
+                    (unsigned long long)cl[i].bytes[2*j], (unsigned long long)cl[i].bytes[2*j+1]);
+        fprintf(out, "]}\n");
+    }
+    fprintf(stderr, "clones: %d files, %zu clone groups\n", nfiles, ncl);
+    free(req); free(bytes); free(starts); free(cl);
+    for (size_t k=0;k<CLONE_SHARDS;++k) {
+        ct_mutex_destroy(&c.shards[k].mu);
+        free(c.shards[k].occ); free(c.shards[k].g);
+    }
+    free(c.shards);
+}
+
+/* ---------- BPE training (bpe-train) ----------
+ * Every lexeme is a word, weighted by its exact corpus frequency from
+ * per-thread VMaps merged with vmap_merge. Words start as byte symbols
+ * (ids 0..255), and merges only join symbols inside one word, so no merge
+ * ever spans a token boundary. Pair counts live in an open-addressing table
+ * and an indexed max-heap (count desc, then pair ids asc, so ties break
+ * deterministically). Each pair keeps the list of words it occurs in, so a
+ * merge rewrites only those words and updates only the pairs around each
+ * merged position.
+ * Output:
+ *   merges  "ctbpe 1 merges N", then "A B" per merge; merge i creates id 256+i
+ *           (ids in rank order)
+ *   vocab   "ctbpe 1 vocab N", then "ID<TAB>bytes" with the bytes escaped as in
+ *           the stream's JSON strings (so tabs and newlines never appear raw) */
+typedef struct {
+    uint32_t a, b;
+    int64_t count;
+    size_t heap;                      /* position in the heap, or SIZE_MAX */
+    uint32_t *words; size_t nw, cap;  /* words that may contain the pair */
+} BpePair;
+
+typedef struct {
+    BpePair *p; size_t n, cap;
+    size_t *slot; size_t nslot;       /* open addressing: index+1, 0 = empty */
+    size_t *heap; size_t nheap;
+} BpePairs;
+
+static uint64_t bpe_key_hash(uint32_t a, uint32_t b) {
+    uint64_t x = ((uint64_t)a << 32) | b;
+    return splitmix64(&x);
+}
+
+static size_t bpe_pair(BpePairs *t, uint32_t a, uint32_t b) {
+    if (t->n * 2 >= t->nslot) {
+        size_t ns = t->nslot ? t->nslot*2 : 1<<16;
+        size_t *sl = (size_t*)calloc(ns, sizeof(size_t));
+        if (!sl) { fprintf(stderr,"OOM\n"); exit(1); }
+        for (size_t i=0;i<t->n;++i) {
+            size_t k = (size_t)(bpe_key_hash(t->p[i].a, t->p[i].b) & (ns-1));
+            while (sl[k]) k = (k+1) & (ns-1);
+            sl[k] = i+1;
+        }
+        free(t->slot); t->slot = sl; t->nslot = ns;
+    }
+    size_t k = (size_t)(bpe_key_hash(a, b) & (t->nslot-1));
+    for (; t->slot[k]; k = (k+1) & (t->nslot-1)) {
+        BpePair *p = &t->p[t->slot[k]-1];
+        if (p->a == a && p->b == b) return t->slot[k]-1;
+    }
+    if (t->n == t->cap) {
+        t->cap = t->cap ? t->cap*2 : 1<<15;
+        t->p = (BpePair*)realloc(t->p, t->cap*sizeof(BpePair));
+        t->heap = (size_t*)realloc(t->heap, t->cap*sizeof(size_t));
+        if (!t->p || !t->heap) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    BpePair *p = &t->p[t->n];
+    memset(p, 0, sizeof(*p));
+    p->a = a; p->b = b; p->heap = SIZE_MAX;
+    t->slot[k] = ++t->n;
+    return t->n - 1;
+}
+
+static int bpe_better(const BpePairs *t, size_t x, size_t y) {
+    const BpePair *p = &t->p[x], *q = &t->p[y];
+    if (p->count != q->count) return p->count > q->count;
+    if (p->a != q->a) return p->a < q->a;
+    return p->b < q->b;
+}
+static void bpe_heap_swap(BpePairs *t, size_t i, size_t j) {
+    size_t x = t->heap[i]; t->heap[i] = t->heap[j]; t->heap[j] = x;
+    t->p[t->heap[i]].heap = i; t->p[t->heap[j]].heap = j;
+}
+static void bpe_heap_fix(BpePairs *t, size_t i) {
+    while (i > 0 && bpe_better(t, t->heap[i], t->heap[(i-1)/2])) { bpe_heap_swap(t, i, (i-1)/2); i = (i-1)/2; }
+    for (;;) {
+        size_t l = 2*i+1, r = l+1, m = i;
+        if (l < t->nheap && bpe_better(t, t->heap[l], t->heap[m])) m = l;
+        if (r < t->nheap && bpe_better(t, t->heap[r], t->heap[m])) m = r;
+        if (m == i) break;
+        bpe_heap_swap(t, i, m); i = m;
+    }
+}
+static void bpe_heap_remove(BpePairs *t, size_t pi) {
+    size_t i = t->p[pi].heap;
+    if (i == SIZE_MAX) return;
+    bpe_heap_swap(t, i, --t->nheap);
+    t->p[pi].heap = SIZE_MAX;
+    if (i < t->nheap) bpe_heap_fix(t, i);
+}
+
+/* Add delta to pair (a,b); with note_word, w is recorded as containing it. */
+static void bpe_count(BpePairs *t, uint32_t a, uint32_t b, int64_t delta, uint32_t w, int note_word) {
+    size_t pi = bpe_pair(t, a, b);
+    BpePair *p = &t->p[pi];
+    p->count += delta;
+    if (note_word && !(p->nw && p->words[p->nw-1] == w)) {
+        if (p->nw == p->cap) {
+            p->cap = p->cap ? p->cap*2 : 4;
+            p->words = (uint32_t*)realloc(p->words, p->cap*sizeof(uint32_t));
+            if (!p->words) { fprintf(stderr,"OOM\n"); exit(1); }
+        }
+        p->words[p->nw++] = w;
+    }
+    if (p->heap == SIZE_MAX) {
+        if (p->count <= 0) return;
+        p->heap = t->nheap; t->heap[t->nheap++] = pi;
+    }
+    if (p->count <= 0) bpe_heap_remove(t, pi);
+    else bpe_heap_fix(t, p->heap);
+}
+
+typedef struct { char **files; VMap *vmaps; } BpeCountCtx;
+
+static void bpe_count_worker(void *ctx, size_t fi, int tid) {
+    BpeCountCtx *c = (BpeCountCtx*)ctx;
+    Buf b = {0};
+    CtLexer lx; CtToken t;
+    if (read_file_scratch(c->files[fi], &b) != 0) exit(1);
+    ct_lexer_init(&lx, b.p, b.n);
+    while (ct_next(&lx, &t)) vmap_add(&c->vmaps[tid], (const char*)b.p + t.off, t.len);
+    arena_reset(&tls_scratch);
+}
+
+static void bpe_write_token(FILE *f, OBuf *tmp, const unsigned char *s, size_t n) {
+    tmp->n = 0;
+    json_escape_write(s, n, tmp);
+    ix_fwrite(f, tmp->p, tmp->n);
+}
+
+static void bpe_train(char **files, int nfiles, int nthreads, uint32_t vocab_size, int64_t min_freq,
+                      FILE *merges_out, FILE *vocab_out) {
+    /* Exact lexeme frequencies */
+    int nt = nthreads < nfiles ? nthreads : (nfiles ? nfiles : 1);
+    BpeCountCtx cc = { files, (VMap*)calloc((size_t)nt, sizeof(VMap)) };
+    if (!cc.vmaps) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (int t=0;t<nt;++t) vmap_init(&cc.vmaps[t], 1<<15);
+    par_for((size_t)nfiles, nt, bpe_count_worker, &cc);
+    for (int t=1;t<nt;++t) { vmap_merge(&cc.vmaps[0], &cc.vmaps[t]); vmap_free(&cc.vmaps[t]); }
+    VMap *vm = &cc.vmaps[0];
+
+    /* Words in lexeme order, so training is independent of hash layout */
+    VEntry **ent = (VEntry**)malloc((size_t)(vm->nitem + 1) * sizeof(VEntry*));
+    if (!ent) { fprintf(stderr,"OOM\n"); exit(1); }
+    size_t nwords = 0, nsym = 0;
+    for (size_t i=0;i<vm->nbkt;++i)
+        for (VEntry *e=vm->bkt[i]; e; e=e->next) { ent[nwords++] = e; nsym += e->len; }
+    qsort(ent, nwords, sizeof(VEntry*), cmp_ventry);
+    uint32_t *sym = (uint32_t*)malloc((nsym + 1) * sizeof(uint32_t));
+    size_t *wstart = (size_t*)malloc((nwords + 1) * sizeof(size_t));
+    uint32_t *wlen = (uint32_t*)malloc((nwords + 1) * sizeof(uint32_t));
+    int64_t *wcount = (int64_t*)malloc((nwords + 1) * sizeof(int64_t));
+    if (!sym || !wstart || !wlen || !wcount) { fprintf(stderr,"OOM\n"); exit(1); }
+    BpePairs pt;
+    memset(&pt, 0, sizeof(pt));
+    nsym = 0;
+    for (size_t w=0; w<nwords; ++w) {
+        wstart[w] = nsym; wlen[w] = (uint32_t)ent[w]->len; wcount[w] = (int64_t)ent[w]->count;
+        for (size_t i=0;i<ent[w]->len;++i) sym[nsym++] = (unsigned char)ent[w]->s[i];
+        for (size_t i=0;i+1<ent[w]->len;++i)
+            bpe_count(&pt, sym[wstart[w]+i], sym[wstart[w]+i+1], wcount[w], (uint32_t)w, 1);
+    }
+
+    /* Token bytes, for the vocab file */
+    uint32_t cap_tok = vocab_size > 256 ? vocab_size : 256;
+    OBuf *tok = (OBuf*)calloc(cap_tok, sizeof(OBuf));
+    if (!tok) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (uint32_t i=0;i<256;++i) ob_putc(&tok[i], (int)i);
+    uint32_t nid = 256;
+
+    uint32_t *merge = (uint32_t*)malloc((size_t)(cap_tok - 256 + 1) * 2 * sizeof(uint32_t));
+    if (!merge) { fprintf(stderr,"OOM\n"); exit(1); }
+    while (nid < vocab_size && pt.nheap > 0) {
+        size_t best = pt.heap[0];
+        if (pt.p[best].count < min_freq) break;
+        uint32_t a = pt.p[best].a, b = pt.p[best].b, n = nid++;
+        merge[2*(n-256)] = a; merge[2*(n-256)+1] = b;
+        ob_write(&tok[n], tok[a].p, tok[a].n);
+        ob_write(&tok[n], tok[b].p, tok[b].n);
+        /* Detach the word list: words re-register under pairs they gain */
+        uint32_t *words = pt.p[best].words; size_t nw = pt.p[best].nw;
+        pt.p[best].words = NULL; pt.p[best].nw = pt.p[best].cap = 0;
+        for (size_t k=0;k<nw;++k) {
+            uint32_t w = words[k];
+            if (k && words[k-1] == w) continue;
+            uint32_t *s = sym + wstart[w], len = wlen[w];
+            int64_t c = wcount[w];
+            uint32_t i;
+            for (i=0;i+1<len;++i) if (s[i]==a && s[i+1]==b) break;
+            if (i+1 >= len) continue;  /* stale entry */
+            /* Only pairs touching a merged position change: drop those (the
+               left neighbour of every merge, the right one unless another
+               merge starts there), then add every pair holding the fresh n. */
+            uint32_t o = 0, prev = 0;
+            for (i=0;i<len;) {
+                if (i+1<len && s[i]==a && s[i+1]==b) {
+                    bpe_count(&pt, a, b, -c, w, 0);
+                    if (i > 0) bpe_count(&pt, prev, a, -c, w, 0);
+                    if (i+2 < len && !(i+3 < len && s[i+2]==a && s[i+3]==b)) bpe_count(&pt, b, s[i+2], -c, w, 0);
+                    prev = b; s[o++] = n; i += 2;
+                } else { prev = s[i]; s[o++] = s[i++]; }
+            }
+            wlen[w] = len = o;
+            for (i=0;i+1<len;++i) if (s[i]==n || s[i+1]==n) bpe_count(&pt, s[i], s[i+1], c, w, 1);
+        }
+        free(words);
+    }
+    fprintf(merges_out, "ctbpe 1 merges %u\n", nid - 256);
+    for (uint32_t i=256;i<nid;++i) fprintf(merges_out, "%u %u\n", merge[2*(i-256)], merge[2*(i-256)+1]);
+    OBuf esc = {0};
+    fprintf(vocab_out, "ctbpe 1 vocab %u\n", nid);
+    for (uint32_t i=0;i<nid;++i) {
+        fprintf(vocab_out, "%u\t", i);
+        bpe_write_token(vocab_out, &esc, tok[i].p, tok[i].n);
+        fputc('\n', vocab_out);
+    }
+    fprintf(stderr, "bpe-train: %zu distinct lexemes, %u merges\n", nwords, nid - 256);
+    ob_free(&esc);
+    for (uint32_t i=0;i<cap_tok;++i) ob_free(&tok[i]);
+    free(tok); free(merge);
+    for (size_t i=0;i<pt.n;++i) free(pt.p[i].words);
+    free(pt.p); free(pt.slot); free(pt.heap);
+    free(sym); free(wstart); free(wlen); free(wcount); free(ent);
+    vmap_free(vm); free(cc.vmaps);
+}
+
+/* ---------- BPE encoding (encode) ----------
+ * Applies the merges from bpe-train to every lexeme: lowest rank first, ties
+ * left to right, which reproduces training's segmentation exactly. Ranks are
+ * looked up in a flat open-addressing table keyed by the packed pair. Each
+ * lexeme is encoded with a min-heap of (rank, position) over a linked symbol
+ * list, so long comments cost O(n log n). Short identifiers, keywords,
+ * punctuators and whitespace runs go through a per-thread 4-way
+ * set-associative LRU cache first.
+ * Files are encoded ahead in parallel batches and appended in input order.
+ * OUT holds the ids as packed little-endian u16 or u32; OUT.idx holds nfiles+1
+ * little-endian u64 token offsets (document i is ids [idx[i], idx[i+1])).
+ * --shard-size caps the id bytes per shard (OUT-00000.ext, ...); files are
+ * never split across shards. */
+typedef struct { uint64_t key; uint32_t rank; } BpeSlot;
+
+typedef struct {
+    uint32_t nmerge;
+    uint32_t *ma, *mb;              /* merge i: (ma[i], mb[i]) -> id 256+i */
+    BpeSlot *slot;                  /* rank table, Fibonacci-hashed; key 0 = empty */
+    size_t mask;
+    int shift;
+} BpeModel;
+
+static size_t bpe_slot(const BpeModel *m, uint64_t key) {
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> m->shift);
+}
+/* Rank of merge (a,b), or UINT32_MAX. Keys are the packed pair plus one. */
+static uint32_t bpe_rank(const BpeModel *m, uint32_t a, uint32_t b) {
+    uint64_t key = (((uint64_t)a << 32) | b) + 1;
+    for (size_t k = bpe_slot(m, key); m->slot[k].key; k = (k+1) & m->mask)
+        if (m->slot[k].key == key) return m->slot[k].rank;
+    return UINT32_MAX;
+}
+
+static void bpe_model_load(const char *path, BpeModel *m) {
+    FILE *f = fopen(path, "rb");
+    if (!f) { fprintf(stderr,"Failed to open %s: %s\n", path, strerror(errno)); exit(1); }
+    char *line = NULL; size_t cap = 0; long r;
+    unsigned n = 0;
+    if (read_line(f, &line, &cap) < 0 || sscanf(line, "ctbpe 1 merges %u", &n) != 1) {
+        fprintf(stderr,"%s: not a bpe-train merges file\n", path); exit(1);
+    }
+    memset(m, 0, sizeof(*m));
+    size_t nslot = 16;
+    m->shift = 60;
+    while (nslot < (size_t)n * 2 + 2) { nslot <<= 1; m->shift--; }
+    m->mask = nslot - 1;
+    m->ma = (uint32_t*)malloc(((size_t)n + 1) * sizeof(uint32_t));
+    m->mb = (uint32_t*)malloc(((size_t)n + 1) * sizeof(uint32_t));
+    m->slot = (BpeSlot*)calloc(nslot, sizeof(BpeSlot));
+    if (!m->ma || !m->mb || !m->slot) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (uint32_t i=0;i<n;++i) {
+        unsigned a, b;
+        if ((r = read_line(f, &line, &cap)) < 0 || sscanf(line, "%u %u", &a, &b) != 2 || a >= 256+i || b >= 256+i) {
+            fprintf(stderr,"%s: bad merge on line %u\n", path, i+2); exit(1);
+        }
+        uint64_t key = (((uint64_t)a << 32) | b) + 1;
+        size_t k = bpe_slot(m, key);
+        while (m->slot[k].key && m->slot[k].key != key) k = (k+1) & m->mask;
+        if (m->slot[k].key) { fprintf(stderr,"%s: duplicate merge on line %u\n", path, i+2); exit(1); }
+        m->slot[k].key = key; m->slot[k].rank = i;
+        m->ma[i] = a; m->mb[i] = b;
+    }
+    m->nmerge = n;
+    free(line);
+    fclose(f);
+}
+static void bpe_model_free(BpeModel *m) { free(m->ma); free(m->mb); free(m->slot); }
+
+#define BPE_CACHE_SETS 1024
+#define BPE_CACHE_WAYS 4
+#define BPE_CACHE_LEN 32
+#define BPE_CACHE_IDS 8
+typedef struct {
+    uint64_t h;
+    uint32_t stamp;
+    uint8_t len, nids;
+    char s[BPE_CACHE_LEN];
+    uint32_t ids[BPE_CACHE_IDS];
+} BpeCacheEnt;
+
+typedef struct {
+    BpeCacheEnt *cache;          /* BPE_CACHE_SETS * BPE_CACHE_WAYS */
+    uint32_t clock;
+    uint64_t hits, lookups;
+    uint32_t *sym; size_t *nxt, *prv; size_t cap;
+    uint64_t *heap; size_t hcap;
+} BpeThread;
+
+static void bpe_heap_push(BpeThread *bt, size_t *nh, uint64_t v) {
+    if (*nh == bt->hcap) {
+        bt->hcap = bt->hcap ? bt->hcap*2 : 256;
+        bt->heap = (uint64_t*)realloc(bt->heap, bt->hcap*sizeof(uint64_t));
+        if (!bt->heap) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    size_t i = (*nh)++;
+    while (i > 0 && bt->heap[(i-1)/2] > v) { bt->heap[i] = bt->heap[(i-1)/2]; i = (i-1)/2; }
+    bt->heap[i] = v;
+}
+static uint64_t bpe_heap_pop(BpeThread *bt, size_t *nh) {
+    uint64_t top = bt->heap[0], v = bt->heap[--*nh];
+    size_t i = 0, n = *nh;
+    for (;;) {
+        size_t l = 2*i+1, m = i;
+        uint64_t mv = v;
+        if (l < n && bt->heap[l] < mv) { m = l; mv = bt->heap[l]; }
+        if (l+1 < n && bt->heap[l+1] < mv) m = l+1;
+        if (m == i) break;
+        bt->heap[i] = bt->heap[m]; i = m;
+    }
+    if (n) bt->heap[i] = v;
+    return top;
+}
+
+/* Encode one lexeme into out (ids of width bytes). Returns the id count. */
+static size_t bpe_encode_lexeme(const BpeModel *m, BpeThread *bt, const unsigned char *p, size_t n,
+                                int cacheable, OBuf *out, int width) {
+    BpeCacheEnt *set = NULL;
+    uint64_t h = 0;
+    size_t nid = 0;
+    if (cacheable && n >= 2 && n <= BPE_CACHE_LEN) {
+        h = fnv1a64(p, n);
+        set = &bt->cache[(h >> 20) & (BPE_CACHE_SETS-1)];
+        bt->lookups++;
+        for (int w=0; w<BPE_CACHE_WAYS; ++w) {
+            BpeCacheEnt *e = &set[w];
+            if (e->h == h && e->len == n && memcmp(e->s, p, n) == 0) {
+                e->stamp = ++bt->clock;
+                bt->hits++;
+                ob_reserve(out, (size_t)e->nids * 4);
+                for (int k=0;k<e->nids;++k) {
+                    uint32_t id = e->ids[k];
+                    out->p[out->n++] = (unsigned char)id;
+                    out->p[out->n++] = (unsigned char)(id >> 8);
+                    if (width == 4) { out->p[out->n++] = (unsigned char)(id >> 16); out->p[out->n++] = (unsigned char)(id >> 24); }
+                }
+                return e->nids;
+            }
+        }
+    }
+    if (n > bt->cap) {
+        bt->cap = n > 1024 ? n : 1024;
+        bt->sym = (uint32_t*)realloc(bt->sym, bt->cap*sizeof(uint32_t));
+        bt->nxt = (size_t*)realloc(bt->nxt, bt->cap*sizeof(size_t));
+        bt->prv = (size_t*)realloc(bt->prv, bt->cap*sizeof(size_t));
+        if (!bt->sym || !bt->nxt || !bt->prv) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    uint32_t *sym = bt->sym;
+    size_t *nxt = bt->nxt, *prv = bt->prv, nh = 0;
+    for (size_t i=0;i<n;++i) { sym[i] = p[i]; nxt[i] = i+1; prv[i] = i ? i-1 : SIZE_MAX; }
+    for (size_t i=0;i+1<n;++i) {
+        uint32_t r = bpe_rank(m, sym[i], sym[i+1]);
+        if (r != UINT32_MAX) bpe_heap_push(bt, &nh, ((uint64_t)r << 32) | i);
+    }
+    while (nh) {
+        uint64_t top = bpe_heap_pop(bt, &nh);
+        uint32_t r = (uint32_t)(top >> 32);
+        size_t i = (size_t)(uint32_t)top, j = nxt[i];
+        /* Stale: i was absorbed, or its right neighbour changed */
+        if (sym[i] != m->ma[r] || j >= n || sym[j] != m->mb[r]) continue;
+        sym[i] = 256 + r;
+        sym[j] = UINT32_MAX;
+        nxt[i] = nxt[j];
+        if (nxt[j] < n) prv[nxt[j]] = i;
+        uint32_t r2;
+        if (prv[i] != SIZE_MAX && (r2 = bpe_rank(m, sym[prv[i]], sym[i])) != UINT32_MAX)
+            bpe_heap_push(bt, &nh, ((uint64_t)r2 << 32) | prv[i]);
+        if (nxt[i] < n && (r2 = bpe_rank(m, sym[i], sym[nxt[i]])) != UINT32_MAX)
+            bpe_heap_push(bt, &nh, ((uint64_t)r2 << 32) | i);
+    }
+    ob_reserve(out, n * (size_t)width);
+    for (size_t i=0; i<n; i=nxt[i]) {
+        uint32_t id = sym[i];
+        out->p[out->n++] = (unsigned char)id;
+        out->p[out->n++] = (unsigned char)(id >> 8);
+        if (width == 4) { out->p[out->n++] = (unsigned char)(id >> 16); out->p[out->n++] = (unsigned char)(id >> 24); }
+        nid++;
+    }
+    if (set && nid <= BPE_CACHE_IDS) {
+        BpeCacheEnt *e = &set[0];
+        for (int w=1; w<BPE_CACHE_WAYS; ++w) if (set[w].stamp < e->stamp) e = &set[w];
+        e->h = h; e->stamp = ++bt->clock; e->len = (uint8_t)n; e->nids = (uint8_t)nid;
+        memcpy(e->s, p, n);
+        size_t k = 0;
+        for (size_t i=0; i<n; i=nxt[i]) e->ids[k++] = sym[i];
+    }
+    return nid;
+}
+
+typedef struct {
+    const BpeModel *m;
+    BpeThread *th;
+    char **files;
+    size_t base;
+    OBuf *bufs;
+    uint64_t *ntok;
+    int width;
+} EncCtx;
+
+static void encode_worker(void *ctx, size_t i, int tid) {
+    EncCtx *c = (EncCtx*)ctx;
+    BpeThread *bt = &c->th[tid];
+    Buf b = {0};
+    CtLexer lx; CtToken t;
+    uint64_t nt = 0;
+    if (read_file_scratch(c->files[c->base + i], &b) != 0) exit(1);
+    c->bufs[i].n = 0;
+    ct_lexer_init(&lx, b.p, b.n);
+    while (ct_next(&lx, &t)) {
+        int cacheable = t.kind == CT_IDENT || t.kind == CT_KEYWORD || t.kind == CT_PUNCT || t.kind == CT_WS;
+        nt += bpe_encode_lexeme(c->m, bt, b.p + t.off, t.len, cacheable, &c->bufs[i], c->width);
+    }
+    c->ntok[i] = nt;
+    arena_reset(&tls_scratch);
+}
+
+typedef struct {
+    char *path, *idx_path;
+    FILE *f, *fi;
+    uint64_t tokens, files;
+} EncShard;
+
+static void enc_shard_open(EncShard *s, const char *path) {
+    size_t n = strlen(path);
+    s->path = str_dup(path);
+    s->idx_path = (char*)malloc(n + 5);
+    if (!s->idx_path) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(s->idx_path, path, n); memcpy(s->idx_path + n, ".idx", 5);
+    s->f = open_out(s->path);
+    s->fi = open_out(s->idx_path);
+    s->tokens = s->files = 0;
+    unsigned char z[8];
+    put_u64le(z, 0);
+    ix_fwrite(s->fi, z, 8);
+}
+static void enc_shard_close(EncShard *s) {
+    if (fclose(s->f) != 0 || fclose(s->fi) != 0) { fprintf(stderr,"Write failed: %s\n", strerror(errno)); exit(1); }
+    free(s->path); free(s->idx_path);
+}
+
+static void encode(char **files, int nfiles, const char *merges_path, const char *out_path,
+                   uint64_t shard_size, int width, int nthreads) {
+    BpeModel m;
+    bpe_model_load(merges_path, &m);
+    uint64_t nvocab = 256 + (uint64_t)m.nmerge;
+    if (!width) width = nvocab <= 65536 ? 2 : 4;
+    if (width == 2 && nvocab > 65536) { fprintf(stderr,"encode: %llu ids do not fit in u16\n", (unsigned long long)nvocab); exit(2); }
+    size_t batch = (size_t)nthreads * 4;
+    EncCtx c;
+    c.m = &m; c.files = files; c.width = width;
+    c.th = (BpeThread*)calloc((size_t)nthreads, sizeof(BpeThread));
+    c.bufs = (OBuf*)calloc(batch, sizeof(OBuf));
+    c.ntok = (uint64_t*)calloc(batch, sizeof(uint64_t));
+    if (!c.th || !c.bufs || !c.ntok) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (int t=0;t<nthreads;++t) {
+        c.th[t].cache = (BpeCacheEnt*)calloc(BPE_CACHE_SETS * BPE_CACHE_WAYS, sizeof(BpeCacheEnt));
+        if (!c.th[t].cache) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    EncShard sh;
+    size_t nshard = 0;
+    uint64_t total = 0;
+    int open = 0;
+    if (!shard_size) { enc_shard_open(&sh, out_path); open = 1; nshard = 1; }
+    for (size_t base=0; base<(size_t)nfiles; base+=batch) {
+        size_t n = MIN(batch, (size_t)nfiles - base);
+        c.base = base;
+        par_for(n, nthreads, encode_worker, &c);
+        for (size_t i=0;i<n;++i) {
+            if (shard_size && (!open || (sh.files && (sh.tokens + c.ntok[i]) * (uint64_t)width > shard_size))) {
+                if (open) enc_shard_close(&sh);
+                char *p = shard_path(out_path, nshard++);
+                enc_shard_open(&sh, p);
+                free(p);
+                open = 1;
+            }
+            ix_fwrite(sh.f, c.bufs[i].p, c.bufs[i].n);
+            sh.tokens += c.ntok[i]; sh.files++;
+            total += c.ntok[i];
+            unsigned char off[8];
+            put_u64le(off, sh.tokens);
+            ix_fwrite(sh.fi, off, 8);
+        }
+    }
+    if (open) enc_shard_close(&sh);
+    uint64_t hits = 0, lookups = 0;
+    for (int t=0;t<nthreads;++t) {
+        hits += c.th[t].hits; lookups += c.th[t].lookups;
+        free(c.th[t].cache); free(c.th[t].sym); free(c.th[t].nxt); free(c.th[t].prv); free(c.th[t].heap);
+    }
+    fprintf(stderr, "encode: %d files, %llu ids (u%d), %zu shard(s), cache hit rate %.3f\n",
+            nfiles, (unsigned long long)total, width * 8, nshard, lookups ? (double)hits / (double)lookups : 0.0);
+    for (size_t i=0;i<batch;++i) ob_free(&c.bufs[i]);
+    free(c.bufs); free(c.ntok); free(c.th);
+    bpe_model_free(&m);
+}
+
+/* ---------- Normalization (normalize) ----------
+ * Rewrites each file in one pass over its tokens:
+ *   - comments are dropped;
+ *   - a run of whitespace and/or comments between two tokens becomes one space;
+ *     it disappears at the start or end of a line;
+ *   - line ends become "\n" and lines left empty are dropped;
+ *   - preprocessor lines get the same treatment on their own tokens, with
+ *     backslash continuations joined into one line;
+ *   - with --rename-idents, identifiers become v0, v1, ... in the order they
+ *     first appear in the file (keywords are kept), also inside #define,
+ *     #undef and conditional directives so macros stay consistent with
+ *     their uses; the directive name and "defined" are kept, and other
+ *     directives (#include, #pragma, #error, ...) keep their identifiers.
+ * DIR/<file> gets the normalized source. DIR/<file>.map gets little-endian
+ * u64 pairs (out_off, src_off), one per stretch where out and source advance
+ * together; byte x of the output comes from src_off + (x - out_off) of the
+ * greatest out_off <= x. Synthesized spaces and line ends map to the start of
+ * the source run they replace. */
+typedef struct { uint64_t h; size_t off; uint32_t len, id; } NormName;
+
+typedef struct {
+    char **files;
+    const char *outdir;
+    int rename;
+    uint64_t *in_bytes, *out_bytes;  /* per thread */
+} NormCtx;
+
+typedef struct {
+    OBuf out, map;
+    uint64_t delta;   /* src_off - out_off of the last map pair */
+    int any;
+} NormOut;
+
+static void norm_put(NormOut *o, const void *p, size_t n, size_t src_off) {
+    uint64_t d = (uint64_t)src_off - (uint64_t)o->out.n;
+    if (!o->any || d != o->delta) {
+        unsigned char pair[16];
+        put_u64le(pair, o->out.n);
+        put_u64le(pair + 8, src_off);
+        ob_write(&o->map, pair, 16);
+        o->delta = d; o->any = 1;
+    }
+    ob_write(&o->out, p, n);
+}
+
+/* Per-file identifier numbering: open addressing into the source buffer. */
+static uint32_t norm_name_id(NormName **tab, size_t *cap, uint32_t *n, const unsigned char *src,
+                             size_t off, size_t len) {
+    if ((size_t)*n * 2 >= *cap) {
+        size_t nc = *cap ? *cap*2 : 256;
+        NormName *t = (NormName*)calloc(nc, sizeof(NormName));
+        if (!t) { fprintf(stderr,"OOM\n"); exit(1); }
+        for (size_t i=0;i<*cap;++i) {
+            if (!(*tab)[i].len) continue;
+            size_t k = (size_t)((*tab)[i].h & (nc-1));
+            while (t[k].len) k = (k+1) & (nc-1);
+            t[k] = (*tab)[i];
+        }
+        free(*tab); *tab = t; *cap = nc;
+    }
+    uint64_t h = fnv1a64(src + off, len);
+    size_t k = (size_t)(h & (*cap-1));
+    for (; (*tab)[k].len; k = (k+1) & (*cap-1)) {
+        NormName *e = &(*tab)[k];
+        if (e->h == h && e->len == len && memcmp(src + e->off, src + off, len) == 0) return e->id;
+    }
+    (*tab)[k].h = h; (*tab)[k].off = off; (*tab)[k].len = (uint32_t)len; (*tab)[k].id = (*n)++;
+    return (*tab)[k].id;
+}
+
+static void norm_write(const char *path, const OBuf *b) {
+    FILE *f = fopen(path, "wb");
+    if (!f) { fprintf(stderr,"Failed to open %s for write: %s\n", path, strerror(errno)); exit(1); }
+    ix_fwrite(f, b->p, b->n);
+    if (fclose(f) != 0) { fprintf(stderr,"Write failed: %s\n", strerror(errno)); exit(1); }
+}
+
+typedef struct {
+    NormName *names; size_t ncap; uint32_t nnames;
+    int rename;
+} NormIds;
+
+static void norm_ident(NormOut *o, NormIds *ids, const unsigned char *src, size_t off, size_t len) {
+    char nm[16];
+    int n = snprintf(nm, sizeof(nm), "v%u", norm_name_id(&ids->names, &ids->ncap, &ids->nnames, src, off, len));
+    /* a longer name maps its extra bytes onto the identifier's last byte */
+    for (size_t i=0;i<(size_t)n;++i) norm_put(o, nm + i, 1, off + MIN(i, len-1));
+}
+
+/* Directives whose identifiers are macro names or expressions over them. */
+static int norm_renames_in(const unsigned char *s, size_t n) {
+    static const char *dirs[] = { "define", "undef", "if", "elif", "ifdef", "ifndef", "elifdef", "elifndef" };
+    for (size_t i=0;i<sizeof(dirs)/sizeof(dirs[0]);++i)
+        if (strlen(dirs[i]) == n && memcmp(dirs[i], s, n) == 0) return 1;
+    return 0;
+}
+
+/* One PREPROC token src[off, off+len): '#' and the directive's own tokens,
+   comments dropped and gaps collapsed. A backslash-newline is a gap; the line
+   after it may lex as another PREPROC token, which continues the same
+   directive. *rename is -1 until the directive name has been seen. */
+static void norm_directive(NormOut *o, NormIds *ids, const unsigned char *src, size_t off, size_t len,
+                           int *rename) {
+    CtLexer lx; CtToken t;
+    size_t gap = SIZE_MAX;
+    norm_put(o, "#", 1, off);
+    ct_lexer_init(&lx, src + off + 1, len - 1);
+    while (ct_next(&lx, &t)) {
+        size_t at = off + 1 + t.off;
+        if (t.kind == CT_WS || t.kind == CT_NEWLINE || t.kind == CT_LINE_COMMENT || t.kind == CT_BLOCK_COMMENT ||
+            (t.kind == CT_PUNCT && t.len == 1 && src[at] == '\\')) {
+            if (gap == SIZE_MAX) gap = at;
+            continue;
+        }
+        if (gap != SIZE_MAX) { norm_put(o, " ", 1, gap); gap = SIZE_MAX; }
+        if (t.kind == CT_PREPROC) { norm_directive(o, ids, src, at, t.len, rename); continue; }
+        if (*rename < 0 && (t.kind == CT_IDENT || t.kind == CT_KEYWORD)) {
+            *rename = ids->rename && norm_renames_in(src + at, t.len);
+            norm_put(o, src + at, t.len, at);
+        } else if (t.kind == CT_IDENT && *rename > 0 && !(t.len == 7 && memcmp(src + at, "defined", 7) == 0)) {
+            norm_ident(o, ids, src, at, t.len);
+        } else {
+            norm_put(o, src + at, t.len, at);
+        }
+    }
+}
+
+static void normalize_worker(void *ctx, size_t fi, int tid) {
+    NormCtx *c = (NormCtx*)ctx;
+    const char *fname = c->files[fi];
+    Buf b = {0};
+    if (read_file_scratch(fname, &b) != 0) exit(1);
+    NormOut o;
+    memset(&o, 0, sizeof(o));
+    NormIds ids;
+    memset(&ids, 0, sizeof(ids));
+    ids.rename = c->rename;
+    CtLexer lx; CtToken t;
+    int line_start = 1;
+    size_t gap = SIZE_MAX;   /* source offset of a pending whitespace/comment run */
+    ct_lexer_init(&lx, b.p, b.n);
+    while (ct_next(&lx, &t)) {
+        switch (t.kind) {
+        case CT_NEWLINE:
+            if (!line_start) norm_put(&o, "\n", 1, t.off);
+            line_start = 1; gap = SIZE_MAX;
+            break;
+        case CT_WS: case CT_LINE_COMMENT: case CT_BLOCK_COMMENT:
+            if (!line_start && gap == SIZE_MAX) gap = t.off;
+            break;
+        default:
+            if (gap != SIZE_MAX) norm_put(&o, " ", 1, gap);
+            if (t.kind == CT_PREPROC) {
+                int rename = -1;
+                norm_directive(&o, &ids, b.p, t.off, t.len, &rename);
+            } else if (t.kind == CT_IDENT && c->rename) {
+                norm_ident(&o, &ids, b.p, t.off, t.len);
+            } else {
+                norm_put(&o, b.p + t.off, t.len, t.off);
+            }
+            line_start = 0; gap = SIZE_MAX;
+            break;
+        }
+    }
+    char *rel = sanitize_relpath(fname);
+    size_t nd = strlen(c->outdir), nr = strlen(rel);
+    char *path = (char*)malloc(nd + nr + 6);
+    if (!path) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(path, c->outdir, nd); path[nd] = '/';
+    memcpy(path + nd + 1, rel, nr + 1);
+    mkdir_p_for_file(path);
+    norm_write(path, &o.out);
+    memcpy(path + nd + 1 + nr, ".map", 5);
+    norm_write(path, &o.map);
+    c->in_bytes[tid] += b.n;
+    c->out_bytes[tid] += o.out.n;
+    free(path); free(rel); free(ids.names);
+    ob_free(&o.out); ob_free(&o.map);
+    arena_reset(&tls_scratch);
+}
+
+static void normalize(char **files, int nfiles, const char *outdir, int rename, int nthreads) {
+    NormCtx c;
+    c.files = files; c.outdir = outdir; c.rename = rename;
+    c.in_bytes = (uint64_t*)calloc((size_t)nthreads, sizeof(uint64_t));
+    c.out_bytes = (uint64_t*)calloc((size_t)nthreads, sizeof(uint64_t));
+    if (!c.in_bytes || !c.out_bytes) { fprintf(stderr,"OOM\n"); exit(1); }
+    par_for((size_t)nfiles, nthreads, normalize_worker, &c);
+    uint64_t in = 0, out = 0;
+    for (int t=0;t<nthreads;++t) { in += c.in_bytes[t]; out += c.out_bytes[t]; }
+    fprintf(stderr, "normalize: %d files, %llu -> %llu bytes\n", nfiles,
+            (unsigned long long)in, (unsigned long long)out);
+    free(c.in_bytes); free(c.out_bytes);
+}
+
+/* ---------- Include graph (includes) ----------
+ * Every CT_PREPROC token of the form #include "x" / <x> (also include_next)
+ * is resolved the way a compiler would: quoted names first against the
+ * including file's directory, then against the -I directories in order;
+ * angle names against the -I directories only. Files are scanned in rounds:
+ * the inputs first, then every header discovered by the previous round, each
+ * round in parallel. The stat() results are shared by all workers through a
+ * cache split into mutex-guarded shards. Node ids are assigned serially after
+ * each round, in file order and then include order, so the graph does not
+ * depend on --threads.
+ * Output: one JSONL line per node, in id order:
+ *   {"id","file","includes":[ids],"unresolved":[names],"closure","dependents"}
+ * closure counts the nodes reachable from the node and dependents the nodes
+ * that reach it (self excluded); both come from a BFS per node, in parallel. */
+#define INC_SHARDS 256
+typedef struct IncPath { uint64_t h; char *path; int exists; struct IncPath *next; } IncPath;
+typedef struct { ct_mutex mu; IncPath *bkt[1024]; } IncShard;
+
+typedef struct { char *name; char *resolved; } IncRef;   /* name is NULL once resolved */
+
+typedef struct {
+    char *path;
+    IncRef *refs; size_t nref, cap;
+    uint32_t *adj; size_t nadj;       /* distinct targets, in first-include order */
+    uint64_t closure, dependents;
+} IncNode;
+
+typedef struct {
+    IncNode *nodes; size_t n, cap;
+    uint32_t *slot; size_t nslot;     /* path -> id+1 */
+} IncGraph;
+
+typedef struct {
+    IncGraph *g;
+    size_t base;
+    char **dirs; int ndirs;
+    IncShard *cache;
+    uint32_t **rev; size_t *nrev;     /* reverse adjacency, for dependents */
+    uint32_t **stamp; uint32_t **queue;  /* per thread BFS state */
+} IncCtx;
+
+/* Lexically normalize a '/'-separated path in place ("a/./b/../c" -> "a/c"). */
+static void inc_norm_path(char *p) {
+    char *w = p;
+    const char *r = p;
+    if (*r == '/') { *w++ = '/'; while (*r == '/') r++; }
+    char *root = w;
+    while (*r) {
+        const char *e = r;
+        while (*e && *e != '/') e++;
+        size_t n = (size_t)(e - r);
+        int dotdot = n == 2 && r[0] == '.' && r[1] == '.';
+        if (dotdot) {
+            char *ls = w;
+            while (ls > root && ls[-1] != '/') ls--;
+            if (w > root && !(w - ls == 2 && ls[0] == '.' && ls[1] == '.')) {
+                w = ls > root ? ls - 1 : root;   /* pop the last segment */
+                dotdot = -1;
+            } else if (root > p) {
+                dotdot = -1;                      /* "/.." is "/" */
+            }
+        }
+        if (dotdot >= 0 && !(n == 1 && r[0] == '.')) {
+            if (w > root) *w++ = '/';
+            memmove(w, r, n); w += n;
+        }
+        r = e;
+        while (*r == '/') r++;
+    }
+    *w = 0;
+    if (!*p) { p[0] = '.'; p[1] = 0; }
+}
+
+static int inc_exists(IncShard *cache, const char *path) {
+    uint64_t h = fnv1a64(path, strlen(path));
+    IncShard *sh = &cache[h % INC_SHARDS];
+    size_t b = (size_t)((h / INC_SHARDS) % 1024);
+    ct_mutex_lock(&sh->mu);
+    for (IncPath *e = sh->bkt[b]; e; e = e->next)
+        if (e->h == h && strcmp(e->path, path) == 0) { int r = e->exists; ct_mutex_unlock(&sh->mu); return r; }
+    ct_mutex_unlock(&sh->mu);
+    /* stat() outside the lock; a racing duplicate entry is harmless */
+    struct stat st;
+    int ex = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+    IncPath *e = (IncPath*)malloc(sizeof(IncPath));
+    if (!e) { fprintf(stderr,"OOM\n"); exit(1); }
+    e->h = h; e->path = str_dup(path); e->exists = ex;
+    ct_mutex_lock(&sh->mu);
+    e->next = sh->bkt[b]; sh->bkt[b] = e;
+    ct_mutex_unlock(&sh->mu);
+    return ex;
+}
+
+static char *inc_join(const char *dir, size_t ndir, const char *name) {
+    size_t nn = strlen(name);
+    char *p = (char*)malloc(ndir + nn + 3);
+    if (!p) { fprintf(stderr,"OOM\n"); exit(1); }
+    if (name[0] == '/' || !ndir) memcpy(p, name, nn + 1);
+    else { memcpy(p, dir, ndir); p[ndir] = '/'; memcpy(p + ndir + 1, name, nn + 1); }
+    inc_norm_path(p);
+    return p;
+}
+
+static char *inc_resolve(IncCtx *c, const char *from, const char *name, int angle) {
+    if (!angle || name[0] == '/') {
+        const char *base = basename_pos(from);
+        char *p = inc_join(from, base > from ? (size_t)(base - from - 1) : 0, name);
+        if (inc_exists(c->cache, p)) return p;
+        free(p);
+        if (name[0] == '/') return NULL;
+    }
+    for (int d=0; d<c->ndirs; ++d) {
+        char *p = inc_join(c->dirs[d], strlen(c->dirs[d]), name);
+        if (inc_exists(c->cache, p)) return p;
+        free(p);
+    }
+    return NULL;
+}
+
+/* "#  include <x>" -> name "x", angle 1; 0 if the line is not an include. */
+static int inc_parse(const unsigned char *s, size_t n, char **name, int *angle) {
+    size_t i = 1;
+    while (i < n && (s[i]==' ' || s[i]=='\t')) i++;
+    if (n - i < 7 || memcmp(s + i, "include", 7) != 0) return 0;
+    i += 7;
+    if (n - i >= 5 && memcmp(s + i, "_next", 5) == 0) i += 5;
+    while (i < n && (s[i]==' ' || s[i]=='\t')) i++;
+    if (i >= n || (s[i] != '"' && s[i] != '<')) return 0;
+    unsigned char close = s[i] == '"' ? '"' : '>';
+    size_t b = ++i;
+    while (i < n && s[i] != close && s[i] != '\n' && s[i] != '\r') i++;
+    if (i >= n || s[i] != close || i == b) return 0;
+    *name = (char*)malloc(i - b + 1);
+    if (!*name) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(*name, s + b, i - b); (*name)[i - b] = 0;
+    *angle = close == '>';
+    return 1;
+}
+
+static void inc_scan_worker(void *ctx, size_t i, int tid) {
+    IncCtx *c = (IncCtx*)ctx;
+    IncNode *nd = &c->g->nodes[c->base + i];
+    Buf b = {0};
+    CtLexer lx; CtToken t;
+    (void)tid;
+    if (read_file_scratch(nd->path, &b) != 0) exit(1);
+    ct_lexer_init(&lx, b.p, b.n);
+    while (ct_next(&lx, &t)) {
+        char *name; int angle;
+        if (t.kind != CT_PREPROC || !inc_parse(b.p + t.off, t.len, &name, &angle)) continue;
+        if (nd->nref == nd->cap) {
+            nd->cap = nd->cap ? nd->cap*2 : 8;
+            nd->refs = (IncRef*)realloc(nd->refs, nd->cap*sizeof(IncRef));
+            if (!nd->refs) { fprintf(stderr,"OOM\n"); exit(1); }
+        }
+        nd->refs[nd->nref].name = name;
+        nd->refs[nd->nref].resolved = inc_resolve(c, nd->path, name, angle);
+        nd->nref++;
+    }
+    arena_reset(&tls_scratch);
+}
+
+/* Node id for path, adding it if new (takes ownership of path). */
+static uint32_t inc_node(IncGraph *g, char *path) {
+    if (g->n * 2 >= g->nslot) {
+        size_t ns = g->nslot ? g->nslot*2 : 1024;
+        uint32_t *sl = (uint32_t*)calloc(ns, sizeof(uint32_t));
+        if (!sl) { fprintf(stderr,"OOM\n"); exit(1); }
+        for (size_t i=0;i<g->n;++i) {
+            size_t k = (size_t)(fnv1a64(g->nodes[i].path, strlen(g->nodes[i].path)) & (ns-1));
+            while (sl[k]) k = (k+1) & (ns-1);
+            sl[k] = (uint32_t)i + 1;
+        }
+        free(g->slot); g->slot = sl; g->nslot = ns;
+    }
+    size_t k = (size_t)(fnv1a64(path, strlen(path)) & (g->nslot-1));
+    for (; g->slot[k]; k = (k+1) & (g->nslot-1))
+        if (strcmp(g->nodes[g->slot[k]-1].path, path) == 0) { free(path); return g->slot[k]-1; }
+    if (g->n == g->cap) {
+        g->cap = g->cap ? g->cap*2 : 1024;
+        g->nodes = (IncNode*)realloc(g->nodes, g->cap*sizeof(IncNode));
+        if (!g->nodes) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    memset(&g->nodes[g->n], 0, sizeof(IncNode));
+    g->nodes[g->n].path = path;
+    g->slot[k] = (uint32_t)g->n + 1;
+    return (uint32_t)g->n++;
+}
+
+static uint64_t inc_bfs(uint32_t *const *adj, const size_t *nadj, size_t start, uint32_t *stamp, uint32_t *queue) {
+    uint32_t mark = (uint32_t)start + 1;
+    size_t qh = 0, qt = 0;
+    stamp[start] = mark; queue[qt++] = (uint32_t)start;
+    while (qh < qt) {
+        uint32_t v = queue[qh++];
+        for (size_t k=0;k<nadj[v];++k) {
+            uint32_t w = adj[v][k];
+            if (stamp[w] != mark) { stamp[w] = mark; queue[qt++] = w; }
+        }
+    }
+    return qt - 1;
+}
+
+static void inc_closure_worker(void *ctx, size_t i, int tid) {
+    IncCtx *c = (IncCtx*)ctx;
+    IncGraph *g = c->g;
+    size_t n = g->n;
+    if (!c->stamp[tid]) {
+        /* Two stamp arrays (forward, reverse) and one queue per thread */
+        c->stamp[tid] = (uint32_t*)calloc(2 * n, sizeof(uint32_t));
+        c->queue[tid] = (uint32_t*)malloc(n * sizeof(uint32_t));
+        if (!c->stamp[tid] || !c->queue[tid]) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    IncNode *nd = &g->nodes[i];
+    uint32_t **adj = c->rev + n;     /* forward lists parked after the reverse ones */
+    size_t *nadj = c->nrev + n;
+    nd->closure = inc_bfs(adj, nadj, i, c->stamp[tid], c->queue[tid]);
+    nd->dependents = inc_bfs(c->rev, c->nrev, i, c->stamp[tid] + n, c->queue[tid]);
+}
+
+static void includes(char **files, int nfiles, char **dirs, int ndirs, int nthreads, FILE *out) {
+    IncGraph g;
+    memset(&g, 0, sizeof(g));
+    IncCtx c;
+    memset(&c, 0, sizeof(c));
+    c.g = &g; c.dirs = dirs; c.ndirs = ndirs;
+    c.cache = (IncShard*)calloc(INC_SHARDS, sizeof(IncShard));
+    if (!c.cache) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t k=0;k<INC_SHARDS;++k) ct_mutex_init(&c.cache[k].mu);
+    for (int i=0;i<nfiles;++i) {
+        char *p = str_dup(files[i]);
+        for (char *q=p; *q; ++q) if (*q=='\\') *q='/';
+        inc_norm_path(p);
+        inc_node(&g, p);
+    }
+    size_t rounds = 0;
+    for (size_t lo=0; lo<g.n; ++rounds) {
+        size_t hi = g.n;
+        c.base = lo;
+        par_for(hi - lo, nthreads, inc_scan_worker, &c);
+        for (size_t i=lo;i<hi;++i) {
+            for (size_t r=0;r<g.nodes[i].nref;++r) {
+                IncRef *ref = &g.nodes[i].refs[r];
+                if (!ref->resolved) continue;
+                uint32_t to = inc_node(&g, ref->resolved);   /* may move g.nodes */
+                ref->resolved = NULL;
+                free(ref->name); ref->name = NULL;           /* only unresolved names are kept */
+                IncNode *nd = &g.nodes[i];
+                size_t k;
+                for (k=0;k<nd->nadj && nd->adj[k]!=to;++k) {}
+                if (k < nd->nadj) continue;
+                nd->adj = (uint32_t*)realloc(nd->adj, (nd->nadj+1)*sizeof(uint32_t));
+                if (!nd->adj) { fprintf(stderr,"OOM\n"); exit(1); }
+                nd->adj[nd->nadj++] = to;
+            }
+        }
+        lo = hi;
+    }
+
+    /* Reverse lists in [0,n), forward lists (aliases) in [n,2n) */
+    size_t n = g.n;
+    c.rev = (uint32_t**)calloc(2*n + 1, sizeof(uint32_t*));
+    c.nrev = (size_t*)calloc(2*n + 1, sizeof(size_t));
+    size_t *fill = (size_t*)calloc(n + 1, sizeof(size_t));
+    if (!c.rev || !c.nrev || !fill) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t i=0;i<n;++i) for (size_t k=0;k<g.nodes[i].nadj;++k) c.nrev[g.nodes[i].adj[k]]++;
+    for (size_t i=0;i<n;++i) {
+        c.rev[i] = (uint32_t*)malloc((c.nrev[i] + 1) * sizeof(uint32_t));
+        if (!c.rev[i]) { fprintf(stderr,"OOM\n"); exit(1); }
+        c.rev[n+i] = g.nodes[i].adj; c.nrev[n+i] = g.nodes[i].nadj;
+    }
+    for (size_t i=0;i<n;++i)
+        for (size_t k=0;k<g.nodes[i].nadj;++k) { uint32_t t = g.nodes[i].adj[k]; c.rev[t][fill[t]++] = (uint32_t)i; }
+    c.stamp = (uint32_t**)calloc((size_t)nthreads, sizeof(uint32_t*));
+    c.queue = (uint32_t**)calloc((size_t)nthreads, sizeof(uint32_t*));
+    if (!c.stamp || !c.queue) { fprintf(stderr,"OOM\n"); exit(1); }
+    par_for(n, nthreads, inc_closure_worker, &c);
+
+    OBuf ob = {0};
+    uint64_t nedge = 0, nunres = 0;
+    for (size_t i=0;i<n;++i) {
+        IncNode *nd = &g.nodes[i];
+        ob_puts(&ob, "{\"id\":"); ob_u64(&ob, i);
+        ob_puts(&ob, ",\"file\":\""); json_escape_write((const unsigned char*)nd->path, strlen(nd->path), &ob);
+        ob_puts(&ob, "\",\"includes\":[");
+        for (size_t k=0;k<nd->nadj;++k) { if (k) ob_putc(&ob, ','); ob_u64(&ob, nd->adj[k]); }
+        ob_puts(&ob, "],\"unresolved\":[");
+        int first = 1;
+        for (size_t r=0;r<nd->nref;++r) {
+            if (!nd->refs[r].name) continue;
+            if (!first) ob_putc(&ob, ',');
+            first = 0;
+            ob_putc(&ob, '"');
+            json_escape_write((const unsigned char*)nd->refs[r].name, strlen(nd->refs[r].name), &ob);
+            ob_putc(&ob, '"');
+            nunres++;
+        }
+        ob_puts(&ob, "],\"closure\":"); ob_u64(&ob, nd->closure);
+        ob_puts(&ob, ",\"dependents\":"); ob_u64(&ob, nd->dependents);
+        ob_puts(&ob, "}\n");
+        nedge += nd->nadj;
+        if (ob.n >= (1u<<20)) { ix_fwrite(out, ob.p, ob.n); ob.n = 0; }
+    }
+    ix_fwrite(out, ob.p, ob.n);
+    fprintf(stderr, "includes: %zu nodes (%d inputs), %llu edges, %llu unresolved, %zu rounds\n",
+            n, nfiles, (unsigned long long)nedge, (unsigned long long)nunres, rounds);
+    ob_free(&ob);
+    for (int t=0;t<nthreads;++t) { free(c.stamp[t]); free(c.queue[t]); }
+    free(c.stamp); free(c.queue);
+    for (size_t i=0;i<n;++i) {
+        IncNode *nd = &g.nodes[i];
+        for (size_t r=0;r<nd->nref;++r) free(nd->refs[r].name);
+        free(nd->refs); free(nd->adj); free(nd->path); free(c.rev[i]);
+    }
+    free(c.rev); free(c.nrev); free(fill);
+    free(g.nodes); free(g.slot);
+    for (size_t k=0;k<INC_SHARDS;++k) {
+        for (size_t b=0;b<1024;++b) {
+            IncPath *e = c.cache[k].bkt[b];
+            while (e) { IncPath *nx = e->next; free(e->path); free(e); e = nx; }
+        }
+        ct_mutex_destroy(&c.cache[k].mu);
+    }
+    free(c.cache);
+}
+
+/* ---------- Token diff between two trees (diff) ----------
+ * Files are paired by relative path. A pair with equal size and bytes is
+ * skipped. Otherwise both sides are lexed and diffed over per-token FNV-1a
+ * hashes (the bytes are compared on a hash match): common prefix and suffix
+ * first, then Myers' O((N+M)D) search on the rest. Past DIFF_MAX_D edits the
+ * remaining middle is replaced as a whole. Unpaired files are matched by size
+ * and content hash into renames; the rest are deletes and adds. Pairs are
+ * diffed in parallel and the records are written in path order (see "Token
+ * patches" for the format). */
+#define DIFF_MAX_D 2048
+
+typedef struct { char **v; size_t n, cap; } StrVec;
+
+static void sv_push(StrVec *sv, char *s) {
+    if (sv->n == sv->cap) {
+        sv->cap = sv->cap ? sv->cap*2 : 256;
+        sv->v = (char**)realloc(sv->v, sv->cap*sizeof(char*));
+        if (!sv->v) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    sv->v[sv->n++] = s;
+}
+static int cmp_cstr(const void *a, const void *b) { return strcmp(*(char* const*)a, *(char* const*)b); }
+
+/* Regular files under root/rel, as paths relative to root. */
+static void diff_walk(const char *root, const char *rel, StrVec *out) {
+    char *dir = rel ? path_join(root, rel) : str_dup(root);
+#ifdef _WIN32
+    char *pat = path_join(dir, "*");
+    WIN32_FIND_DATAA fd;
+    HANDLE h = FindFirstFileA(pat, &fd);
+    free(pat);
+    if (h == INVALID_HANDLE_VALUE) { fprintf(stderr,"Failed to list %s\n", dir); exit(1); }
+    do {
+        const char *name = fd.cFileName;
+        if (strcmp(name,".")==0 || strcmp(name,"..")==0) continue;
+        char *r = rel ? path_join(rel, name) : str_dup(name);
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) { diff_walk(root, r, out); free(r); }
+        else sv_push(out, r);
+    } while (FindNextFileA(h, &fd));
+    FindClose(h);
+#else
+    DIR *d = opendir(dir);
+    if (!d) { fprintf(stderr,"Failed to list %s: %s\n", dir, strerror(errno)); exit(1); }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        const char *name = de->d_name;
+        if (strcmp(name,".")==0 || strcmp(name,"..")==0) continue;
+        char *r = rel ? path_join(rel, name) : str_dup(name);
+        char *full = path_join(root, r);
+        struct stat st;
+        if (stat(full, &st) != 0) { fprintf(stderr,"Failed to stat %s: %s\n", full, strerror(errno)); exit(1); }
+        free(full);
+        if (S_ISDIR(st.st_mode)) { diff_walk(root, r, out); free(r); }
+        else if (S_ISREG(st.st_mode)) sv_push(out, r);
+        else free(r);
+    }
+    closedir(d);
+#endif
+    free(dir);
+}
+
+static void ob_varint(OBuf *b, uint64_t v) {
+    ob_reserve(b, 10);
+    while (v >= 0x80) { b->p[b->n++] = (unsigned char)(v | 0x80); v >>= 7; }
+    b->p[b->n++] = (unsigned char)v;
+}
+static void ob_str(OBuf *b, const char *s) { size_t n = strlen(s); ob_varint(b, n); ob_write(b, s, n); }
+
+typedef struct {
+    Buf b;
+    size_t *off, *len; uint64_t *h;
+    size_t n, cap;
+} DiffToks;
+
+static void diff_lex(const char *path, DiffToks *t) {
+    memset(t, 0, sizeof(*t));
+    if (read_file(path, &t->b) != 0) exit(1);
+    CtLexer lx; CtToken k;
+    ct_lexer_init(&lx, t->b.p, t->b.n);
+    while (ct_next(&lx, &k)) {
+        if (t->n == t->cap) {
+            t->cap = t->cap ? t->cap*2 : 4096;
+            t->off = (size_t*)realloc(t->off, t->cap*sizeof(size_t));
+            t->len = (size_t*)realloc(t->len, t->cap*sizeof(size_t));
+            t->h = (uint64_t*)realloc(t->h, t->cap*sizeof(uint64_t));
+            if (!t->off || !t->len || !t->h) { fprintf(stderr,"OOM\n"); exit(1); }
+        }
+        t->off[t->n] = k.off; t->len[t->n] = k.len;
+        t->h[t->n] = fnv1a64(t->b.p + k.off, k.len);
+        t->n++;
+    }
+}
+static void diff_toks_free(DiffToks *t) { free(t->b.p); free(t->off); free(t->len); free(t->h); }
+
+static int diff_eq(const DiffToks *a, size_t i, const DiffToks *b, size_t j) {
+    return a->h[i] == b->h[j] && a->len[i] == b->len[j] &&
+           memcmp(a->b.p + a->off[i], b->b.p + b->off[j], a->len[i]) == 0;
+}
+
+/* Edit script runs: 'K'eep / 'D'elete n old tokens, 'I'nsert new tokens [pos, pos+n) */
+typedef struct { char t; size_t n, pos; } DiffRun;
+typedef struct { DiffRun *v; size_t n, cap; } DiffRuns;
+
+static void diff_run(DiffRuns *r, char t, size_t n, size_t pos) {
+    if (!n) return;
+    if (r->n && r->v[r->n-1].t == t) {
+        /* runs arrive back to front: extend the last one downwards */
+        r->v[r->n-1].n += n;
+        r->v[r->n-1].pos = pos;
+        return;
+    }
+    if (r->n == r->cap) {
+        r->cap = r->cap ? r->cap*2 : 64;
+        r->v = (DiffRun*)realloc(r->v, r->cap*sizeof(DiffRun));
+        if (!r->v) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    r->v[r->n].t = t; r->v[r->n].n = n; r->v[r->n].pos = pos;
+    r->n++;
+}
+
+/* Myers over a[a0,a1) x b[b0,b1); appends runs back to front. 0 if D > DIFF_MAX_D. */
+static int diff_myers(const DiffToks *a, size_t a0, size_t a1, const DiffToks *b, size_t b0, size_t b1,
+                      DiffRuns *runs) {
+    long N = (long)(a1 - a0), M = (long)(b1 - b0);
+    long maxd = N + M < DIFF_MAX_D ? N + M : DIFF_MAX_D;
+    long off = maxd + 1;
+    long *V = (long*)malloc((size_t)(2*maxd + 3) * sizeof(long));
+    long *trace = NULL;                      /* V[-d..d] after each step d */
+    size_t tcap = 0;
+    if (!V) { fprintf(stderr,"OOM\n"); exit(1); }
+    size_t *tpos = (size_t*)malloc((size_t)(maxd + 2) * sizeof(size_t));
+    if (!tpos) { fprintf(stderr,"OOM\n"); exit(1); }
+    V[off + 1] = 0;
+    long D = -1;
+    size_t tn = 0;
+    for (long d=0; d<=maxd && D<0; ++d) {
+        for (long k=-d; k<=d; k+=2) {
+            long x = (k == -d || (k != d && V[off+k-1] < V[off+k+1])) ? V[off+k+1] : V[off+k-1] + 1;
+            long y = x - k;
+            while (x < N && y < M && diff_eq(a, a0 + (size_t)x, b, b0 + (size_t)y)) { x++; y++; }
+            V[off+k] = x;
+            if (x >= N && y >= M) { D = d; }
+        }
+        tpos[d] = tn;
+        if (tn + (size_t)(2*d + 1) > tcap) {
+            tcap = tcap ? tcap*2 : 4096;
+            while (tn + (size_t)(2*d + 1) > tcap) tcap *= 2;
+            trace = (long*)realloc(trace, tcap * sizeof(long));
+            if (!trace) { fprintf(stderr,"OOM\n"); exit(1); }
+        }
+        memcpy(trace + tn, V + off - d, (size_t)(2*d + 1) * sizeof(long));
+        tn += (size_t)(2*d + 1);
+    }
+    if (D < 0) { free(V); free(trace); free(tpos); return 0; }
+    long x = N, y = M;
+    for (long d=D; d>0; --d) {
+        const long *Vp = trace + tpos[d-1] + (d-1);   /* Vp[k] for k in [-(d-1), d-1] */
+        long k = x - y;
+        int down = k == -d || (k != d && Vp[k-1] < Vp[k+1]);
+        long pk = down ? k + 1 : k - 1;
+        long px = Vp[pk], py = px - pk;
+        long mx = down ? px : px + 1;                 /* start of the snake */
+        diff_run(runs, 'K', (size_t)(x - mx), a0 + (size_t)mx);
+        if (down) diff_run(runs, 'I', 1, b0 + (size_t)py);
+        else diff_run(runs, 'D', 1, a0 + (size_t)px);
+        x = px; y = py;
+    }
+    diff_run(runs, 'K', (size_t)x, a0);
+    free(V); free(trace); free(tpos);
+    return 1;
+}
+
+static void diff_flush_edit(OBuf *rec, const DiffToks *nb, size_t keep, size_t del, size_t ins0, size_t nins,
+                            uint64_t *nedit) {
+    ob_varint(rec, keep); ob_varint(rec, del); ob_varint(rec, nins);
+    for (size_t i=ins0;i<ins0+nins;++i) { ob_varint(rec, nb->len[i]); ob_write(rec, nb->b.p + nb->off[i], nb->len[i]); }
+    (*nedit)++;
+}
+
+/* Encode the edits turning a into b; returns the number of edits. */
+static uint64_t diff_files(const DiffToks *a, const DiffToks *b, OBuf *edits, uint64_t *ins, uint64_t *del) {
+    size_t pre = 0, suf = 0;
+    while (pre < a->n && pre < b->n && diff_eq(a, pre, b, pre)) pre++;
+    while (suf < a->n - pre && suf < b->n - pre && diff_eq(a, a->n - 1 - suf, b, b->n - 1 - suf)) suf++;
+    DiffRuns runs = {0};
+    diff_run(&runs, 'K', suf, a->n - suf);
+    if (!diff_myers(a, pre, a->n - suf, b, pre, b->n - suf, &runs)) {
+        diff_run(&runs, 'I', b->n - suf - pre, pre);
+        diff_run(&runs, 'D', a->n - suf - pre, pre);
+    }
+    diff_run(&runs, 'K', pre, 0);
+    /* Runs are back to front; fold them into (keep, del, inserts) edits */
+    uint64_t nedit = 0;
+    size_t keep = 0, ndel = 0, ins0 = 0, nins = 0;
+    for (size_t r=runs.n; r-- > 0; ) {
+        const DiffRun *u = &runs.v[r];
+        if (u->t == 'K') {
+            if (ndel || nins) { diff_flush_edit(edits, b, keep, ndel, ins0, nins, &nedit); keep = ndel = nins = 0; }
+            keep += u->n;
+        } else if (u->t == 'D') {
+            ndel += u->n; *del += u->n;
+        } else {
+            if (!nins) ins0 = u->pos;
+            nins += u->n; *ins += u->n;
+        }
+    }
+    if (keep || ndel || nins) diff_flush_edit(edits, b, keep, ndel, ins0, nins, &nedit);
+    free(runs.v);
+    return nedit;
+}
+
+typedef struct {
+    int op;                 /* PATCH_*, or 0 for identical */
+    char *old_rel, *new_rel;
+    uint64_t size, hash;
+    OBuf rec;
+} DiffItem;
+
+typedef struct {
+    const char *old_root, *new_root;
+    DiffItem *items;
+    uint64_t *ins, *del;    /* per thread token counts */
+} DiffCtx;
+
+static void diff_hash_worker(void *ctx, size_t i, int tid) {
+    DiffCtx *c = (DiffCtx*)ctx;
+    DiffItem *it = &c->items[i];
+    char *path = it->op == PATCH_ADD ? path_join(c->new_root, it->new_rel) : path_join(c->old_root, it->old_rel);
+    Buf b = {0};
+    (void)tid;
+    if (read_file_scratch(path, &b) != 0) exit(1);
+    it->size = b.n;
+    it->hash = fnv1a64(b.p, b.n);
+    arena_reset(&tls_scratch); free(path);
+}
+
+static void diff_item_worker(void *ctx, size_t i, int tid) {
+    DiffCtx *c = (DiffCtx*)ctx;
+    DiffItem *it = &c->items[i];
+    OBuf *r = &it->rec;
+    if (it->op == PATCH_MODIFY) {
+        char *po = path_join(c->old_root, it->old_rel), *pn = path_join(c->new_root, it->new_rel);
+        struct stat so, sn;
+        int same = 0;
+        if (stat(po, &so) == 0 && stat(pn, &sn) == 0 && so.st_size == sn.st_size) {
+            Buf a = {0}, b = {0};
+            if (read_file_scratch(po, &a) != 0 || read_file_scratch(pn, &b) != 0) exit(1);
+            same = a.n == b.n && memcmp(a.p, b.p, a.n) == 0;
+            arena_reset(&tls_scratch);
+        }
+        if (same) {
+            it->op = 0;
+        } else {
+            DiffToks a, b;
+            OBuf edits = {0};
+            diff_lex(po, &a); diff_lex(pn, &b);
+            uint64_t nedit = diff_files(&a, &b, &edits, &c->ins[tid], &c->del[tid]);
+            ob_putc(r, PATCH_MODIFY); ob_str(r, it->old_rel);
+            ob_varint(r, a.n); ob_varint(r, nedit);
+            ob_write(r, edits.p, edits.n);
+            ob_free(&edits);
+            diff_toks_free(&a); diff_toks_free(&b);
+        }
+        free(po); free(pn);
+    } else if (it->op == PATCH_RENAME) {
+        ob_putc(r, PATCH_RENAME); ob_str(r, it->old_rel); ob_str(r, it->new_rel);
+    } else if (it->op == PATCH_DELETE) {
+        ob_putc(r, PATCH_DELETE); ob_str(r, it->old_rel);
+    } else if (it->op == PATCH_ADD) {
+        char *pn = path_join(c->new_root, it->new_rel);
+        Buf b = {0};
+        if (read_file_scratch(pn, &b) != 0) exit(1);
+        ob_putc(r, PATCH_ADD); ob_str(r, it->new_rel);
+        ob_varint(r, b.n); ob_write(r, b.p, b.n);
+        arena_reset(&tls_scratch); free(pn);
+    }
+}
+
+static int cmp_diffitem(const void *a, const void *b) {
+    const DiffItem *x = (const DiffItem*)a, *y = (const DiffItem*)b;
+    const char *p = x->old_rel ? x->old_rel : x->new_rel, *q = y->old_rel ? y->old_rel : y->new_rel;
+    int c = strcmp(p, q);
+    return c ? c : x->op - y->op;
+}
+
+/* Deleted files by content, ties in path order */
+static int cmp_diffitem_content(const void *a, const void *b) {
+    const DiffItem *x = *(const DiffItem* const*)a, *y = *(const DiffItem* const*)b;
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return strcmp(x->old_rel, y->old_rel);
+}
+
+static void diff_trees(const char *old_root, const char *new_root, int nthreads, FILE *out) {
+    StrVec ov = {0}, nv = {0};
+    diff_walk(old_root, NULL, &ov);
+    diff_walk(new_root, NULL, &nv);
+    qsort(ov.v, ov.n, sizeof(char*), cmp_cstr);
+    qsort(nv.v, nv.n, sizeof(char*), cmp_cstr);
+    DiffItem *items = (DiffItem*)calloc(ov.n + nv.n + 1, sizeof(DiffItem));
+    if (!items) { fprintf(stderr,"OOM\n"); exit(1); }
+    size_t n = 0, i = 0, j = 0;
+    /* Unpaired files first (deletes, then adds), so they can be hashed as one range */
+    while (i < ov.n || j < nv.n) {
+        int c = i >= ov.n ? 1 : j >= nv.n ? -1 : strcmp(ov.v[i], nv.v[j]);
+        if (c < 0) { items[n].op = PATCH_DELETE; items[n].old_rel = ov.v[i++]; n++; }
+        else if (c > 0) j++;
+        else { i++; j++; }
+    }
+    size_t ndel = n;
+    for (i = j = 0; i < ov.n || j < nv.n; ) {
+        int c = i >= ov.n ? 1 : j >= nv.n ? -1 : strcmp(ov.v[i], nv.v[j]);
+        if (c > 0) { items[n].op = PATCH_ADD; items[n].new_rel = nv.v[j++]; n++; }
+        else if (c < 0) i++;
+        else { i++; j++; }
+    }
+    size_t nunpaired = n;
+    for (i = j = 0; i < ov.n && j < nv.n; ) {
+        int c = strcmp(ov.v[i], nv.v[j]);
+        if (c == 0) { items[n].op = PATCH_MODIFY; items[n].old_rel = ov.v[i]; items[n].new_rel = nv.v[j]; n++; }
+        if (c <= 0) i++;
+        if (c >= 0) j++;
+    }
+    DiffCtx c = { old_root, new_root, items,
+                  (uint64_t*)calloc((size_t)nthreads, sizeof(uint64_t)), (uint64_t*)calloc((size_t)nthreads, sizeof(uint64_t)) };
+    if (!c.ins || !c.del) { fprintf(stderr,"OOM\n"); exit(1); }
+
+    /* Renames: an added file with the size and hash of a deleted one (first unused, in path order) */
+    par_for(nunpaired, nthreads, diff_hash_worker, &c);
+    DiffItem **dels = (DiffItem**)malloc((ndel + 1) * sizeof(DiffItem*));
+    if (!dels) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t d=0; d<ndel; ++d) dels[d] = &items[d];
+    qsort(dels, ndel, sizeof(DiffItem*), cmp_diffitem_content);
+    uint64_t nrename = 0;
+    for (size_t a=ndel; a<nunpaired; ++a) {
+        size_t lo = 0, hi = ndel;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            const DiffItem *x = dels[mid];
+            if (x->size < items[a].size || (x->size == items[a].size && x->hash < items[a].hash)) lo = mid + 1;
+            else hi = mid;
+        }
+        for (; lo < ndel && dels[lo]->size == items[a].size && dels[lo]->hash == items[a].hash; ++lo) {
+            DiffItem *x = dels[lo];
+            if (x->op != PATCH_DELETE) continue;
+            x->op = PATCH_RENAME; x->new_rel = items[a].new_rel;
+            items[a].op = 0;
+            nrename++;
+            break;
+        }
+    }
+    free(dels);
+    par_for(n, nthreads, diff_item_worker, &c);
+    qsort(items, n, sizeof(DiffItem), cmp_diffitem);
+
+    uint64_t nrec = 0, nmod = 0, nadd = 0, ndelete = 0;
+    for (size_t k=0;k<n;++k) {
+        if (!items[k].rec.n) continue;
+        nrec++;
+        nmod += items[k].op == PATCH_MODIFY;
+        nadd += items[k].op == PATCH_ADD;
+        ndelete += items[k].op == PATCH_DELETE;
+    }
+    OBuf hdr = {0};
+    ob_write(&hdr, "CTPATCH1", 8);
+    ob_str(&hdr, old_root); ob_str(&hdr, new_root);
+    ob_varint(&hdr, nrec);
+    ix_fwrite(out, hdr.p, hdr.n);
+    for (size_t k=0;k<n;++k) { ix_fwrite(out, items[k].rec.p, items[k].rec.n); ob_free(&items[k].rec); }
+    uint64_t ins = 0, del = 0;
+    for (int t=0;t<nthreads;++t) { ins += c.ins[t]; del += c.del[t]; }
+    fprintf(stderr, "diff: %zu old, %zu new files: %llu modified (+%llu/-%llu tokens), %llu renamed, "
+            "%llu added, %llu deleted\n", ov.n, nv.n, (unsigned long long)nmod, (unsigned long long)ins,
+            (unsigned long long)del, (unsigned long long)nrename, (unsigned long long)nadd, (unsigned long long)ndelete);
+    ob_free(&hdr);
+    for (i=0;i<ov.n;++i) free(ov.v[i]);
+    for (j=0;j<nv.n;++j) free(nv.v[j]);
+    free(ov.v); free(nv.v); free(items); free(c.ins); free(c.del);
+}
+
+/* ---------- Tokenizer daemon (serve) and load generator (loadgen) ----------
+ * Framed requests over a Unix domain socket, all integers little-endian:
+ *   request   "CTQ1", u32 mode, u32 id, u32 len, then len source bytes
+ *   response  "CTR1", u32 status, u32 id, u32 len, then len payload bytes
+ * Modes: SERVE_TOKENS answers u32 n, n u8 kinds, zero padding to 4 bytes,
+ * n u32 offsets and n u32 lengths (the columns of runtime/ctokenize.py);
+ * SERVE_STATS answers the stats JSON for the bytes as one file.
+ * One event-loop thread accepts connections and polls all of them with
+ * nonblocking reads and writes; a connection holding at least one complete
+ * request is queued for the worker pool, and the worker that takes it
+ * answers every complete request it holds, in order, then hands it back.
+ * A connection is with at most one worker at a time, so replies keep request
+ * order, and idle connections never tie up a worker. Requests may be
+ * pipelined; the loop stops reading from a client that has more than
+ * SERVE_OUT_HIGH bytes of replies unread. A request over --max-request gets
+ * SERVE_ETOOBIG and the connection is closed, as does a frame with a bad
+ * magic. */
+#ifndef _WIN32
+#include <poll.h>
+enum { SERVE_TOKENS = 1, SERVE_STATS = 2 };
+enum { SERVE_OK = 0, SERVE_EMODE = 1, SERVE_ETOOBIG = 2 };
+
+static int io_write_full(int fd, const void *p, size_t n) {
+    const unsigned char *s = (const unsigned char*)p;
+    while (n) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        s += w; n -= (size_t)w;
+    }
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    unsigned char *p; size_t off, n, cap;
+} ConnIn;
+
+/* Make need bytes available at c->p + c->off, flushing pending replies in
+   out before blocking. -1 on EOF or error. */
+static int conn_fill(ConnIn *c, size_t need, OBuf *out) {
+    if (c->n - c->off >= need) return 0;
+    if (out->n) { if (io_write_full(c->fd, out->p, out->n) != 0) return -1; out->n = 0; }
+    if (c->off) { memmove(c->p, c->p + c->off, c->n - c->off); c->n -= c->off; c->off = 0; }
+    if (need > c->cap) {
+        c->cap = need > 65536 ? need : 65536;
+        c->p = (unsigned char*)realloc(c->p, c->cap);
+        if (!c->p) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    while (c->n < need) {
+        ssize_t r = read(c->fd, c->p + c->n, c->cap - c->n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        c->n += (size_t)r;
+    }
+    return 0;
+}
+
+static void put_u32le(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); p[2] = (unsigned char)(v >> 16); p[3] = (unsigned char)(v >> 24);
+}
+static uint32_t get_u32le(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Append a response for one request to out. */
+static void serve_answer(uint32_t mode, uint32_t id, const unsigned char *src, size_t n, OBuf *out, OBuf *scratch) {
+    size_t h = out->n;
+    ob_reserve(out, 16);
+    memcpy(out->p + h, "CTR1", 4);
+    out->n += 16;
+    uint32_t status = SERVE_OK;
+    if (mode == SERVE_TOKENS) {
+        CtLexer lx; CtToken t;
+        size_t at = out->n, ntok = 0;
+        /* Every token is at least one byte, so n bounds the token count;
+           offsets and lengths go to scratch until the kinds are laid out */
+        ob_reserve(out, 4 + n + 3 + 8*n);
+        ob_reserve(scratch, 8*n);
+        unsigned char *kinds = out->p + at + 4, *ol = scratch->p;
+        ct_lexer_init(&lx, src, n);
+        while (ct_next(&lx, &t)) {
+            kinds[ntok] = (unsigned char)t.kind;
+            put_u32le(ol + 8*ntok, (uint32_t)t.off);
+            put_u32le(ol + 8*ntok + 4, (uint32_t)t.len);
+            ntok++;
+        }
+        size_t pad = (4 - ntok % 4) % 4;
+        memset(kinds + ntok, 0, pad);
+        unsigned char *offs = kinds + ntok + pad, *lens = offs + 4*ntok;
+        for (size_t i=0;i<ntok;++i) { memcpy(offs + 4*i, ol + 8*i, 4); memcpy(lens + 4*i, ol + 8*i + 4, 4); }
+        put_u32le(out->p + at, (uint32_t)ntok);
+        out->n = at + 4 + ntok + pad + 8*ntok;
+    } else if (mode == SERVE_STATS) {
+        Metrics mx = {0};
+        Agg agg;
+        Buf b = { (unsigned char*)src, n };
+        memset(&agg, 0, sizeof(agg));
+        mx.bytes_total = n;     /* as scan_worker, so answers match the stats mode */
+        lex_file(&b, "request", NULL, &mx, NULL, NULL, NULL);
+        agg_add(&agg, &mx);
+        agg.total_files = 1;
+        char *js = NULL; size_t jn = 0;
+        FILE *f = open_memstream(&js, &jn);
+        if (!f) { fprintf(stderr,"OOM\n"); exit(1); }
+        write_stats_json(f, &agg, NULL);
+        fclose(f);
+        ob_write(out, js, jn);
+        free(js);
+    } else {
+        status = SERVE_EMODE;
+    }
+    put_u32le(out->p + h + 4, status);
+    put_u32le(out->p + h + 8, id);
+    put_u32le(out->p + h + 12, (uint32_t)(out->n - h - 16));
+}
+
+/* One client connection. The event loop owns in and out, except while busy:
+   then one worker owns them until it hands the connection back. */
+typedef struct ServeConn {
+    int fd;
+    ConnIn in;                  /* in.fd unused: the loop reads nonblocking */
+    OBuf out;                   /* replies, written from out_off on */
+    size_t out_off;
+    int busy, eof, closing;     /* closing: write out, then close */
+    struct ServeConn *next;     /* job or done queue */
+} ServeConn;
+
+typedef struct {
+    uint64_t max_request;
+    ct_mutex mu; ct_cond cv;
+    ServeConn *jobs, *jobs_tail;   /* FIFO for the workers */
+    ServeConn *done;               /* handed back to the loop */
+    int wake[2];                   /* pipe: a worker finished a connection */
+} ServeCtx;
+
+/* Replies queued on a connection before the loop stops reading from it. */
+#define SERVE_OUT_HIGH ((size_t)4 << 20)
+
+/* 1 if the next frame can be acted on: complete, or bad enough to end the
+   connection. */
+static int serve_frame_ready(const ServeCtx *s, const ServeConn *c) {
+    const ConnIn *in = &c->in;
+    if (in->n - in->off < 16) return 0;
+    const unsigned char *h = in->p + in->off;
+    uint32_t len = get_u32le(h + 12);
+    return memcmp(h, "CTQ1", 4) != 0 || len > s->max_request || in->n - in->off >= 16 + (size_t)len;
+}
+
+/* Worker side: answer every complete frame in c->in, in order. */
+static void serve_frames(ServeCtx *s, ServeConn *c, OBuf *scratch) {
+    ConnIn *in = &c->in;
+    while (in->n - in->off >= 16) {
+        const unsigned char *h = in->p + in->off;
+        if (memcmp(h, "CTQ1", 4) != 0) { c->closing = 1; break; }
+        uint32_t mode = get_u32le(h + 4), id = get_u32le(h + 8), len = get_u32le(h + 12);
+        if (len > s->max_request) {
+            OBuf *out = &c->out;
+            ob_reserve(out, 16);
+            memcpy(out->p + out->n, "CTR1", 4);
+            put_u32le(out->p + out->n + 4, SERVE_ETOOBIG); put_u32le(out->p + out->n + 8, id); put_u32le(out->p + out->n + 12, 0);
+            out->n += 16;
+            c->closing = 1;
+            break;
+        }
+        if (in->n - in->off < 16 + (size_t)len) break;
+        serve_answer(mode, id, h + 16, len, &c->out, scratch);
+        in->off += 16 + (size_t)len;
+    }
+}
+
+static void *serve_worker(void *arg) {
+    ServeCtx *s = (ServeCtx*)arg;
+    OBuf scratch = {0};
+    for (;;) {
+        ct_mutex_lock(&s->mu);
+        while (!s->jobs) ct_cond_wait(&s->cv, &s->mu);
+        ServeConn *c = s->jobs;
+        s->jobs = c->next;
+        if (!s->jobs) s->jobs_tail = NULL;
+        ct_mutex_unlock(&s->mu);
+        serve_frames(s, c, &scratch);
+        ct_mutex_lock(&s->mu);
+        c->next = s->done;
+        s->done = c;
+        ct_mutex_unlock(&s->mu);
+        /* a full pipe already has a wakeup pending */
+        while (write(s->wake[1], "", 1) < 0 && errno == EINTR) {}
+    }
+    return NULL;
+}
+
+/* Read what the socket has. -1 on a read error. */
+static int serve_read(const ServeCtx *s, ServeConn *c) {
+    ConnIn *in = &c->in;
+    if (in->off) { memmove(in->p, in->p + in->off, in->n - in->off); in->n -= in->off; in->off = 0; }
+    size_t need = in->n + 65536;
+    if (in->n >= 16) {
+        uint32_t len = get_u32le(in->p + 12);
+        if (len <= s->max_request && 16 + (size_t)len > need) need = 16 + (size_t)len;
+    }
+    if (need > in->cap) {
+        in->cap = need;
+        in->p = (unsigned char*)realloc(in->p, in->cap);
+        if (!in->p) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    while (in->n < in->cap) {
+        ssize_t r = read(c->fd, in->p + in->n, in->cap - in->n);
+        if (r > 0) { in->n += (size_t)r; continue; }
+        if (r == 0) { c->eof = 1; break; }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return -1;
+    }
+    return 0;
+}
+
+/* Write what the socket takes. -1 on a write error (peer gone). */
+static int serve_flush(ServeConn *c) {
+    while (c->out_off < c->out.n) {
+        ssize_t w = write(c->fd, c->out.p + c->out_off, c->out.n - c->out_off);
+        if (w > 0) { c->out_off += (size_t)w; continue; }
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;
+    }
+    c->out.n = c->out_off = 0;
+    return 0;
+}
+
+static void serve_close(ServeConn *c) {
+    close(c->fd);
+    free(c->in.p); ob_free(&c->out);
+    free(c);
+}
+
+static int set_nonblock(int fd) {
+    int fl = fcntl(fd, F_GETFL, 0);
+    return fl < 0 ? -1 : fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+/* The event loop: accepts, reads and writes every connection without
+   blocking, and hands a connection to the workers once it holds a complete
+   request. Idle connections cost a pollfd and nothing else. */
+static void serve_loop(ServeCtx *s, int lfd) {
+    ServeConn **conns = NULL;
+    struct pollfd *pf = NULL;
+    size_t nconn = 0, cap = 0;
+    for (;;) {
+        if (nconn + 2 > cap) {
+            cap = cap ? cap * 2 : 64;
+            conns = (ServeConn**)realloc(conns, cap * sizeof(ServeConn*));
+            pf = (struct pollfd*)realloc(pf, cap * sizeof(struct pollfd));
+            if (!conns || !pf) { fprintf(stderr,"OOM\n"); exit(1); }
+        }
+        pf[0].fd = lfd; pf[0].events = POLLIN;
+        pf[1].fd = s->wake[0]; pf[1].events = POLLIN;
+        for (size_t i=0;i<nconn;++i) {
+            ServeConn *c = conns[i];
+            short ev = 0;
+            if (!c->busy) {
+                if (!c->eof && !c->closing && c->out.n - c->out_off < SERVE_OUT_HIGH) ev |= POLLIN;
+                if (c->out_off < c->out.n) ev |= POLLOUT;
+            }
+            /* a busy or stalled connection is left out, not polled for hangups */
+            pf[2 + i].fd = ev ? c->fd : -1;
+            pf[2 + i].events = ev;
+            pf[2 + i].revents = 0;
+        }
+        if (poll(pf, (nfds_t)(2 + nconn), -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr,"poll: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (size_t i=0;i<nconn;++i) {
+            ServeConn *c = conns[i];
+            short re = pf[2 + i].revents;
+            if (!re) continue;
+            if ((re & POLLOUT) && serve_flush(c) != 0) { c->closing = 1; c->out.n = c->out_off = 0; c->eof = 1; continue; }
+            if ((re & (POLLIN | POLLHUP | POLLERR)) && (pf[2 + i].events & POLLIN) && serve_read(s, c) != 0) {
+                c->closing = 1; c->out.n = c->out_off = 0; c->eof = 1;
+            }
+        }
+        if (pf[1].revents & POLLIN) {
+            char drain[256];
+            while (read(s->wake[0], drain, sizeof(drain)) > 0) {}
+            ct_mutex_lock(&s->mu);
+            ServeConn *d = s->done;
+            s->done = NULL;
+            ct_mutex_unlock(&s->mu);
+            for (; d; d = d->next) d->busy = 0;
+        }
+        /* dispatch, flush eagerly, and retire finished connections */
+        for (size_t i=0;i<nconn;) {
+            ServeConn *c = conns[i];
+            if (c->busy) { ++i; continue; }
+            if (c->out_off < c->out.n && serve_flush(c) != 0) { c->closing = 1; c->eof = 1; c->out.n = c->out_off = 0; }
+            if (!c->closing && serve_frame_ready(s, c)) {
+                c->busy = 1;
+                c->next = NULL;
+                ct_mutex_lock(&s->mu);
+                if (s->jobs_tail) s->jobs_tail->next = c; else s->jobs = c;
+                s->jobs_tail = c;
+                ct_cond_broadcast(&s->cv);
+                ct_mutex_unlock(&s->mu);
+                ++i;
+                continue;
+            }
+            if ((c->eof || c->closing) && c->out_off == c->out.n) {
+                serve_close(c);
+                conns[i] = conns[--nconn];
+                continue;
+            }
+            ++i;
+        }
+        if (pf[0].revents & POLLIN) {
+            for (;;) {
+                int fd = accept(lfd, NULL, NULL);
+                if (fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    /* out of descriptors: retry once a connection closes */
+                    if (errno == EMFILE || errno == ENFILE) break;
+                    fprintf(stderr,"accept: %s\n", strerror(errno));
+                    exit(1);
+                }
+                ServeConn *c = (ServeConn*)calloc(1, sizeof(ServeConn));
+                if (!c) { fprintf(stderr,"OOM\n"); exit(1); }
+                c->fd = fd;
+                c->in.fd = -1;
+                if (set_nonblock(fd) != 0) { serve_close(c); continue; }
+                if (nconn + 2 > cap) {
+                    cap *= 2;
+                    conns = (ServeConn**)realloc(conns, cap * sizeof(ServeConn*));
+                    pf = (struct pollfd*)realloc(pf, cap * sizeof(struct pollfd));
+                    if (!conns || !pf) { fprintf(stderr,"OOM\n"); exit(1); }
+                }
+                conns[nconn++] = c;
+            }
+        }
+    }
+}
+
+static const char *g_serve_path;
+static void serve_on_signal(int sig) {
+    (void)sig;
+    if (g_serve_path) unlink(g_serve_path);
+    _exit(0);
+}
+
+static int unix_socket_addr(const char *path, struct sockaddr_un *sa) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa->sun_path)) { fprintf(stderr,"Socket path too long: %s\n", path); return -1; }
+    memcpy(sa->sun_path, path, strlen(path) + 1);
+    return 0;
+}
+
+static int serve(const char *path, int nthreads, uint64_t max_request) {
+    struct sockaddr_un sa;
+    if (unix_socket_addr(path, &sa) != 0) return 2;
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) { fprintf(stderr,"socket: %s\n", strerror(errno)); return 1; }
+    unlink(path);   /* stale socket from an earlier run */
+    if (bind(lfd, (struct sockaddr*)&sa, sizeof(sa)) != 0 || listen(lfd, 128) != 0) {
+        fprintf(stderr,"Failed to listen on %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    g_serve_path = path;
+    signal(SIGINT, serve_on_signal);
+    signal(SIGTERM, serve_on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    ServeCtx s;
+    memset(&s, 0, sizeof(s));
+    s.max_request = max_request;
+    ct_mutex_init(&s.mu); ct_cond_init(&s.cv);
+    if (pipe(s.wake) != 0 || set_nonblock(s.wake[0]) != 0 || set_nonblock(s.wake[1]) != 0 || set_nonblock(lfd) != 0) {
+        fprintf(stderr,"serve: %s\n", strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "serve: listening on %s with %d workers\n", path, nthreads);
+    ct_thread *th = (ct_thread*)calloc((size_t)nthreads, sizeof(ct_thread));
+    if (!th) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (int t=0;t<nthreads;++t)
+        if (ct_thread_start(&th[t], serve_worker, &s) != 0) { fprintf(stderr,"Failed to start thread\n"); exit(1); }
+    serve_loop(&s, lfd);      /* only a signal ends the daemon */
+    return 0;
+}
+
+/* loadgen: C connections, each with a sender and a receiver thread keeping up
+   to D requests in flight; latency is send start to full response. */
+typedef struct {
+    const char *path;
+    Buf *docs; size_t ndocs;
+    uint32_t mode;
+    uint64_t nreq, first;       /* this connection sends requests [first, first+nreq) */
+    int depth;
+    int fd;
+    uint64_t *lat;              /* ns per request, shared array indexed by request */
+    uint64_t *sent_at;
+    uint64_t inflight, errors, bytes;
+    ct_mutex mu; ct_cond cv;
+} LoadConn;
+
+static void *loadgen_sender(void *arg) {
+    LoadConn *lc = (LoadConn*)arg;
+    unsigned char h[16];
+    for (uint64_t i=0;i<lc->nreq;++i) {
+        uint64_t r = lc->first + i;
+        const Buf *d = &lc->docs[r % lc->ndocs];
+        memcpy(h, "CTQ1", 4);
+        put_u32le(h + 4, lc->mode); put_u32le(h + 8, (uint32_t)r); put_u32le(h + 12, (uint32_t)d->n);
+        /* sent_at is published under mu; the receiver reads it under mu */
+        ct_mutex_lock(&lc->mu);
+        while (lc->inflight >= (uint64_t)lc->depth) ct_cond_wait(&lc->cv, &lc->mu);
+        lc->inflight++;
+        lc->sent_at[r] = prof_ns();
+        ct_mutex_unlock(&lc->mu);
+        if (io_write_full(lc->fd, h, 16) != 0 || io_write_full(lc->fd, d->p, d->n) != 0) {
+            fprintf(stderr,"loadgen: write failed: %s\n", strerror(errno)); exit(1);
+        }
+    }
+    return NULL;
+}
+
+static void *loadgen_receiver(void *arg) {
+    LoadConn *lc = (LoadConn*)arg;
+    ConnIn c = { lc->fd, NULL, 0, 0, 0 };
+    OBuf none = {0};
+    for (uint64_t i=0;i<lc->nreq;++i) {
+        if (conn_fill(&c, 16, &none) != 0) { fprintf(stderr,"loadgen: connection closed\n"); exit(1); }
+        const unsigned char *h = c.p + c.off;
+        uint32_t status = get_u32le(h + 4), id = get_u32le(h + 8), len = get_u32le(h + 12);
+        if (memcmp(h, "CTR1", 4) != 0 || id != (uint32_t)(lc->first + i)) { fprintf(stderr,"loadgen: bad response\n"); exit(1); }
+        if (conn_fill(&c, 16 + (size_t)len, &none) != 0) { fprintf(stderr,"loadgen: connection closed\n"); exit(1); }
+        c.off += 16 + (size_t)len;
+        uint64_t now = prof_ns();
+        if (status != SERVE_OK) lc->errors++;
+        lc->bytes += len;
+        ct_mutex_lock(&lc->mu);
+        lc->lat[lc->first + i] = now - lc->sent_at[lc->first + i];
+        lc->inflight--;
+        ct_cond_broadcast(&lc->cv);
+        ct_mutex_unlock(&lc->mu);
+    }
+    free(c.p);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int loadgen(const char *path, char **files, int nfiles, uint32_t mode, int nconn, int depth,
+                   uint64_t nreq, FILE *out) {
+    struct sockaddr_un sa;
+    if (unix_socket_addr(path, &sa) != 0) return 2;
+    if (nfiles == 0) { fprintf(stderr,"loadgen: no input files\n"); return 2; }
+    signal(SIGPIPE, SIG_IGN);
+    Buf *docs = (Buf*)calloc((size_t)nfiles, sizeof(Buf));
+    uint64_t *lat = (uint64_t*)calloc(nreq + 1, sizeof(uint64_t));
+    uint64_t *sent = (uint64_t*)calloc(nreq + 1, sizeof(uint64_t));
+    LoadConn *lc = (LoadConn*)calloc((size_t)nconn, sizeof(LoadConn));
+    ct_thread *th = (ct_thread*)calloc((size_t)nconn * 2, sizeof(ct_thread));
+    if (!docs || !lat || !sent || !lc || !th) { fprintf(stderr,"OOM\n"); exit(1); }
+    uint64_t src_bytes = 0;
+    for (int i=0;i<nfiles;++i) if (read_file(files[i], &docs[i]) != 0) exit(1);
+    for (int k=0;k<nconn;++k) {
+        LoadConn *l = &lc[k];
+        l->path = path; l->docs = docs; l->ndocs = (size_t)nfiles; l->mode = mode; l->depth = depth;
+        l->first = nreq * (uint64_t)k / (uint64_t)nconn;
+        l->nreq = nreq * (uint64_t)(k + 1) / (uint64_t)nconn - l->first;
+        l->lat = lat; l->sent_at = sent;
+        ct_mutex_init(&l->mu); ct_cond_init(&l->cv);
+        l->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (l->fd < 0 || connect(l->fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+            fprintf(stderr,"Failed to connect to %s: %s\n", path, strerror(errno)); return 1;
+        }
+        for (uint64_t r=l->first; r<l->first+l->nreq; ++r) src_bytes += docs[r % (uint64_t)nfiles].n;
+    }
+    uint64_t t0 = prof_ns();
+    for (int k=0;k<nconn;++k) {
+        if (ct_thread_start(&th[2*k], loadgen_sender, &lc[k]) != 0 ||
+            ct_thread_start(&th[2*k+1], loadgen_receiver, &lc[k]) != 0) { fprintf(stderr,"Failed to start thread\n"); exit(1); }
+    }
+    for (int k=0;k<2*nconn;++k) ct_thread_join(th[k]);
+    double secs = (double)(prof_ns() - t0) / 1e9;
+    uint64_t errors = 0, resp_bytes = 0;
+    for (int k=0;k<nconn;++k) {
+        errors += lc[k].errors; resp_bytes += lc[k].bytes;
+        close(lc[k].fd); ct_mutex_destroy(&lc[k].mu); ct_cond_destroy(&lc[k].cv);
+    }
+    qsort(lat, nreq, sizeof(uint64_t), cmp_u64);
+    uint64_t p50 = nreq ? lat[(nreq - 1) * 50 / 100] : 0, p99 = nreq ? lat[(nreq - 1) * 99 / 100] : 0;
+    uint64_t mx = nreq ? lat[nreq - 1] : 0;
+    fprintf(out, "{\"requests\":%llu,\"errors\":%llu,\"connections\":%d,\"depth\":%d,\"seconds\":%.3f,"
+            "\"requests_per_s\":%.1f,\"source_mb_per_s\":%.1f,\"response_bytes\":%llu,"
+            "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+            (unsigned long long)nreq, (unsigned long long)errors, nconn, depth, secs,
+            secs > 0 ? (double)nreq / secs : 0.0, secs > 0 ? (double)src_bytes / secs / 1e6 : 0.0,
+            (unsigned long long)resp_bytes, (double)p50 / 1e3, (double)p99 / 1e3, (double)mx / 1e3);
+    for (int i=0;i<nfiles;++i) free(docs[i].p);
+    free(docs); free(lat); free(sent); free(lc); free(th);
+    return errors ? 1 : 0;
+}
+#endif
+
+/* ---------- Continuous incremental tokenization (watch) ----------
+ * Keeps OUTDIR/streams/<file>.jsonl, OUTDIR/stats.json and OUTDIR/vocab.tsv
+ * up to date for every regular file under ROOT. Each file's Metrics and
+ * identifier/keyword counts are kept, so a change subtracts the old
+ * contribution from the aggregates (agg_sub, vmap_sub) and adds the new one:
+ * the cost of an update follows the edit volume, not the corpus size.
+ * On Linux every directory gets an inotify watch; events are collected until
+ * the tree has been quiet for --debounce ms, the changed files are re-lexed
+ * in parallel, and the aggregates are republished once per batch. Every
+ * output is written to a .tmp file and renamed into place, so readers never
+ * see a partial file. An event queue overflow re-walks the whole tree. */
+#ifndef _WIN32
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+typedef struct WatchFile {
+    char *rel;
+    uint64_t h;
+    Metrics mx;
+    VMap vocab;             /* this file's identifier/keyword counts */
+    int live;               /* counted in the aggregates */
+    int dirty;              /* queued for the next batch */
+    struct WatchFile *next;
+} WatchFile;
+
+typedef struct {
+    WatchFile *f;
+    Metrics mx;
+    VMap vocab;
+    int gone;
+} WatchJob;
+
+typedef struct {
+    const char *root, *outdir;
+    char *skip_rel;         /* OUTDIR relative to ROOT when nested in it */
+    WatchFile **bkt; size_t nbkt, nfile;
+    Agg agg;
+    VMap vocab;
+    WatchFile **dirty; size_t ndirty, cap_dirty;
+    int fd;                 /* inotify descriptor, -1 without */
+    char **wd_rel; size_t nwd;   /* directory (relative to ROOT, "" for ROOT) per watch */
+} WatchState;
+
+static WatchFile *watch_file(WatchState *w, const char *rel, int create) {
+    uint64_t h = fnv1a64(rel, strlen(rel));
+    size_t idx = (size_t)(h & (w->nbkt - 1));
+    for (WatchFile *f = w->bkt[idx]; f; f = f->next)
+        if (f->h == h && strcmp(f->rel, rel) == 0) return f;
+    if (!create) return NULL;
+    WatchFile *f = (WatchFile*)calloc(1, sizeof(WatchFile));
+    if (!f) { fprintf(stderr,"OOM\n"); exit(1); }
+    f->rel = str_dup(rel); f->h = h;
+    f->next = w->bkt[idx]; w->bkt[idx] = f;
+    if (++w->nfile > w->nbkt) {
+        size_t nb = w->nbkt * 2;
+        WatchFile **bk = (WatchFile**)calloc(nb, sizeof(WatchFile*));
+        if (!bk) { fprintf(stderr,"OOM\n"); exit(1); }
+        for (size_t i=0;i<w->nbkt;++i)
+            for (WatchFile *e = w->bkt[i], *n; e; e = n) {
+                n = e->next;
+                e->next = bk[e->h & (nb - 1)]; bk[e->h & (nb - 1)] = e;
+            }
+        free(w->bkt); w->bkt = bk; w->nbkt = nb;
+    }
+    return f;
+}
+
+static void watch_unlink_file(WatchState *w, WatchFile *f) {
+    WatchFile **pp = &w->bkt[f->h & (w->nbkt - 1)];
+    while (*pp != f) pp = &(*pp)->next;
+    *pp = f->next;
+    w->nfile--;
+    free(f->rel); free(f);
+}
+
+static int watch_skipped(const WatchState *w, const char *rel) {
+    if (!w->skip_rel) return 0;
+    size_t n = strlen(w->skip_rel);
+    return strncmp(rel, w->skip_rel, n) == 0 && (rel[n] == 0 || rel[n] == '/');
+}
+
+static void watch_touch(WatchState *w, const char *rel) {
+    if (watch_skipped(w, rel)) return;
+    WatchFile *f = watch_file(w, rel, 1);
+    if (f->dirty) return;
+    f->dirty = 1;
+    if (w->ndirty == w->cap_dirty) {
+        w->cap_dirty = w->cap_dirty ? w->cap_dirty*2 : 256;
+        w->dirty = (WatchFile**)realloc(w->dirty, w->cap_dirty*sizeof(WatchFile*));
+        if (!w->dirty) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    w->dirty[w->ndirty++] = f;
+}
+
+/* Queue every known file at or below rel ("" for all). */
+static void watch_touch_prefix(WatchState *w, const char *rel) {
+    size_t n = strlen(rel);
+    for (size_t i=0;i<w->nbkt;++i)
+        for (WatchFile *f = w->bkt[i]; f; f = f->next)
+            if (n == 0 || (strncmp(f->rel, rel, n) == 0 && (f->rel[n] == 0 || f->rel[n] == '/')))
+                watch_touch(w, f->rel);
+}
+
+/* Watch root/rel and queue every regular file below it. Entries that vanish
+   while we walk are skipped: their events arrive later anyway. */
+static void watch_dir(WatchState *w, const char *rel) {
+    if (rel[0] && watch_skipped(w, rel)) return;
+    char *dir = rel[0] ? path_join(w->root, rel) : str_dup(w->root);
+#ifdef __linux__
+    if (w->fd >= 0) {
+        int wd = inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE |
+                                                IN_DELETE | IN_ONLYDIR);
+        if (wd < 0) {
+            if (errno != ENOENT && errno != ENOTDIR) { fprintf(stderr,"inotify_add_watch %s: %s\n", dir, strerror(errno)); exit(1); }
+            free(dir);
+            return;
+        }
+        if ((size_t)wd >= w->nwd) {
+            size_t nw = w->nwd ? w->nwd : 64;
+            while (nw <= (size_t)wd) nw *= 2;
+            w->wd_rel = (char**)realloc(w->wd_rel, nw*sizeof(char*));
+            if (!w->wd_rel) { fprintf(stderr,"OOM\n"); exit(1); }
+            memset(w->wd_rel + w->nwd, 0, (nw - w->nwd)*sizeof(char*));
+            w->nwd = nw;
+        }
+        free(w->wd_rel[wd]);
+        w->wd_rel[wd] = str_dup(rel);
+    }
+#endif
+    DIR *d = opendir(dir);
+    if (!d) {
+        if (errno != ENOENT && errno != ENOTDIR) { fprintf(stderr,"Failed to list %s: %s\n", dir, strerror(errno)); exit(1); }
+        free(dir);
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        const char *name = de->d_name;
+        if (strcmp(name,".")==0 || strcmp(name,"..")==0) continue;
+        char *r = rel[0] ? path_join(rel, name) : str_dup(name);
+        char *full = path_join(w->root, r);
+        struct stat st;
+        if (stat(full, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) watch_dir(w, r);
+            else if (S_ISREG(st.st_mode)) watch_touch(w, r);
+        }
+        free(full); free(r);
+    }
+    closedir(d);
+    free(dir);
+}
+
+static char *watch_out_path(const WatchState *w, const char *rel, const char *ext) {
+    char *s = sanitize_relpath(rel);
+    size_t no = strlen(w->outdir), ns = strlen(s), ne = strlen(ext);
+    char *p = (char*)malloc(no + ns + ne + 10);
+    if (!p) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(p, w->outdir, no); memcpy(p + no, "/streams/", 9);
+    memcpy(p + no + 9, s, ns); memcpy(p + no + 9 + ns, ext, ne + 1);
+    free(s);
+    return p;
+}
+
+/* Move tmp over path; rename() replaces atomically on POSIX. */
+static void watch_commit(const char *tmp, const char *path) {
+    if (rename(tmp, path) != 0) { fprintf(stderr,"Failed to rename %s: %s\n", tmp, strerror(errno)); exit(1); }
+}
+
+static void watch_worker(void *ctx, size_t i, int tid) {
+    WatchState *w = (WatchState*)((void**)ctx)[0];
+    WatchJob *j = &((WatchJob*)((void**)ctx)[1])[i];
+    (void)tid;
+    char *full = path_join(w->root, j->f->rel);
+    char *out = watch_out_path(w, j->f->rel, ".jsonl");
+    struct stat st;
+    Buf b = {0};
+    if (stat(full, &st) != 0 || !S_ISREG(st.st_mode) || read_whole_file(full, &b, &tls_scratch) != 0) {
+        j->gone = 1;
+        remove(out);
+        free(full); free(out);
+        return;
+    }
+    size_t nb = 16;
+    while (nb < b.n / 32 && nb < ((size_t)1 << 15)) nb *= 2;
+    vmap_init(&j->vocab, nb);
+    j->mx.bytes_total = b.n;
+    size_t no = strlen(out);
+    char *tmp = (char*)malloc(no + 5);
+    if (!tmp) { fprintf(stderr,"OOM\n"); exit(1); }
+    memcpy(tmp, out, no); memcpy(tmp + no, ".tmp", 5);
+    mkdir_p_for_file(tmp);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) { fprintf(stderr,"Failed to open %s for write: %s\n", tmp, strerror(errno)); exit(1); }
+    StreamWriter sw;
+    sw_init(&sw, f, tmp, CZ_NONE, 0, 0, 1);
+    sw_begin_file(&sw, full);
+    lex_file(&b, full, &sw, &j->mx, &j->vocab, NULL, NULL);
+    sw_end_file(&sw);
+    sw_close(&sw);
+    if (fclose(f) != 0) { fprintf(stderr,"Write failed: %s\n", tmp); exit(1); }
+    watch_commit(tmp, out);
+    arena_reset(&tls_scratch);
+    free(tmp); free(full); free(out);
+}
+
+static void watch_publish(WatchState *w) {
+    size_t no = strlen(w->outdir);
+    char *path = (char*)malloc(no + 32), *tmp = (char*)malloc(no + 32);
+    if (!path || !tmp) { fprintf(stderr,"OOM\n"); exit(1); }
+
+    snprintf(path, no + 32, "%s/stats.json", w->outdir);
+    snprintf(tmp, no + 32, "%s/stats.json.tmp", w->outdir);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) { fprintf(stderr,"Failed to open %s for write: %s\n", tmp, strerror(errno)); exit(1); }
+    write_stats_json(f, &w->agg, NULL);
+    if (fclose(f) != 0) { fprintf(stderr,"Write failed: %s\n", tmp); exit(1); }
+    watch_commit(tmp, path);
+
+    snprintf(path, no + 32, "%s/vocab.tsv", w->outdir);
+    snprintf(tmp, no + 32, "%s/vocab.tsv.tmp", w->outdir);
+    f = fopen(tmp, "wb");
+    if (!f) { fprintf(stderr,"Failed to open %s for write: %s\n", tmp, strerror(errno)); exit(1); }
+    VEntry **v = (VEntry**)malloc((size_t)(w->vocab.nitem + 1) * sizeof(VEntry*));
+    if (!v) { fprintf(stderr,"OOM\n"); exit(1); }
+    size_t n = 0;
+    for (size_t i=0;i<w->vocab.nbkt;++i)
+        for (VEntry *e=w->vocab.bkt[i]; e; e=e->next) v[n++] = e;
+    qsort(v, n, sizeof(VEntry*), cmp_ventry);
+    for (size_t i=0;i<n;++i) fprintf(f, "%s\t%llu\n", v[i]->s, (unsigned long long)v[i]->count);
+    free(v);
+    if (fclose(f) != 0) { fprintf(stderr,"Write failed: %s\n", tmp); exit(1); }
+    watch_commit(tmp, path);
+    free(path); free(tmp);
+}
+
+/* Re-lex the queued files and swap their contributions in the aggregates. */
+static void watch_batch(WatchState *w, int nthreads) {
+    if (w->ndirty == 0) return;
+    uint64_t t0 = prof_ns();
+    size_t n = w->ndirty, updated = 0, removed = 0;
+    WatchJob *jobs = (WatchJob*)calloc(n, sizeof(WatchJob));
+    if (!jobs) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (size_t i=0;i<n;++i) jobs[i].f = w->dirty[i];
+    void *ctx[2] = { w, jobs };
+    par_for(n, nthreads, watch_worker, ctx);
+    for (size_t i=0;i<n;++i) {
+        WatchFile *f = jobs[i].f;
+        int was_live = f->live;
+        if (f->live) {
+            agg_sub(&w->agg, &f->mx);
+            w->agg.total_files--;
+            vmap_sub(&w->vocab, &f->vocab);
+            vmap_free(&f->vocab);
+            f->live = 0;
+        }
+        f->dirty = 0;
+        if (jobs[i].gone) {
+            removed += was_live;
+            watch_unlink_file(w, f);
+            continue;
+        }
+        f->mx = jobs[i].mx;
+        f->vocab = jobs[i].vocab;
+        f->live = 1;
+        agg_add(&w->agg, &f->mx);
+        w->agg.total_files++;
+        vmap_add_all(&w->vocab, &f->vocab);
+        updated++;
+    }
+    free(jobs);
+    w->ndirty = 0;
+    watch_publish(w);
+    fprintf(stderr, "watch: %zu updated, %zu removed; %llu files, %llu tokens (%.1f ms)\n",
+            updated, removed, (unsigned long long)w->agg.total_files,
+            (unsigned long long)w->agg.m.tokens_total, (double)(prof_ns() - t0) / 1e6);
+}
+
+#ifdef __linux__
+/* Drop the watches of rel and every directory below it. */
+static void watch_forget_dir(WatchState *w, const char *rel) {
+    size_t n = strlen(rel);
+    for (size_t wd=0; wd<w->nwd; ++wd) {
+        char *r = w->wd_rel[wd];
+        if (r && strncmp(r, rel, n) == 0 && (r[n] == 0 || r[n] == '/')) {
+            inotify_rm_watch(w->fd, (int)wd);
+            free(r); w->wd_rel[wd] = NULL;
+        }
+    }
+}
+
+/* Drain the inotify queue; returns without blocking once it is empty. */
+static void watch_read_events(WatchState *w) {
+    uint64_t ev_buf[8192];     /* aligned for struct inotify_event */
+    char *buf = (char*)ev_buf;
+    for (;;) {
+        ssize_t r = read(w->fd, buf, sizeof(ev_buf));
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && errno == EAGAIN) return;
+        if (r <= 0) { fprintf(stderr,"inotify read: %s\n", strerror(errno)); exit(1); }
+        for (char *p = buf; p < buf + r; ) {
+            const struct inotify_event *ev = (const struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                fprintf(stderr, "watch: event queue overflow, rescanning\n");
+                watch_touch_prefix(w, "");
+                watch_dir(w, "");
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                if (ev->wd >= 0 && (size_t)ev->wd < w->nwd) { free(w->wd_rel[ev->wd]); w->wd_rel[ev->wd] = NULL; }
+                continue;
+            }
+            if (ev->wd < 0 || (size_t)ev->wd >= w->nwd || !w->wd_rel[ev->wd] || !ev->len) continue;
+            const char *dir = w->wd_rel[ev->wd];
+            char *rel = dir[0] ? path_join(dir, ev->name) : str_dup(ev->name);
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) watch_dir(w, rel);
+                else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) { watch_forget_dir(w, rel); watch_touch_prefix(w, rel); }
+            } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)) {
+                watch_touch(w, rel);
+            }
+            free(rel);
+        }
+    }
+}
+#endif
+
+static int watch(const char *root, const char *outdir, int nthreads, int debounce_ms, int once) {
+    WatchState w;
+    memset(&w, 0, sizeof(w));
+    w.root = root; w.outdir = outdir; w.fd = -1;
+    w.nbkt = 1024;
+    w.bkt = (WatchFile**)calloc(w.nbkt, sizeof(WatchFile*));
+    if (!w.bkt) { fprintf(stderr,"OOM\n"); exit(1); }
+    vmap_init(&w.vocab, 1<<15);
+    MKDIR(outdir);
+    /* Our own outputs must not feed back as changes when OUTDIR is inside ROOT */
+    char *rroot = realpath(root, NULL), *rout = realpath(outdir, NULL);
+    if (!rroot || !rout) { fprintf(stderr,"Failed to resolve %s: %s\n", rroot ? outdir : root, strerror(errno)); return 1; }
+    size_t nr = strlen(rroot);
+    if (strcmp(rout, rroot) == 0) { fprintf(stderr,"watch: --outdir must not be ROOT itself\n"); return 2; }
+    if (strncmp(rout, rroot, nr) == 0 && (rout[nr] == '/' || nr == 1)) w.skip_rel = str_dup(rout + nr + (nr > 1));
+    free(rroot); free(rout);
+#ifdef __linux__
+    if (!once) {
+        w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (w.fd < 0) { fprintf(stderr,"inotify_init1: %s\n", strerror(errno)); return 1; }
+    }
+#else
+    if (!once) { fprintf(stderr,"watch: inotify is not available on this platform; use --once\n"); return 2; }
+#endif
+    watch_dir(&w, "");
+    watch_batch(&w, nthreads);
+    if (w.agg.total_files == 0) watch_publish(&w);
+#ifdef __linux__
+    while (!once) {
+        struct pollfd pfd = { w.fd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) { fprintf(stderr,"poll: %s\n", strerror(errno)); exit(1); }
+        watch_read_events(&w);
+        /* Debounce: an editor save or a checkout arrives as a burst */
+        for (;;) {
+            int r = poll(&pfd, 1, debounce_ms);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            watch_read_events(&w);
+        }
+        watch_batch(&w, nthreads);
+    }
+#else
+    (void)debounce_ms;
+#endif
+    return 0;
+}
+#endif
 
-    /* Make sure list doesn't already have this path */
-    for (OutFile *p=*head; p; p=p->next) if (strcmp(p->name,full)==0) { free(rel); free(full); return p; }
+/* ---------- Isomorphic forms (classify) ----------
+ * Every token kind maps to an object/relation type or is skipped. A window
+ * of W mapped tokens slides over each file (never across files), and each
+ * window is counted by its form: the multiset of types plus the window's
+ * rank among all orderings of that multiset in lexicographic type order.
+ * Rank r is form E<r+1> of generate_E.c for the same type counts. Types are
+ * ordered by name. The rank is computed per window from the counts: at each
+ * position, every smaller type t still available adds M * c_t / r orderings
+ * (M orderings of the r remaining items). W <= CLS_MAX_WINDOW keeps
+ * M * c_t within 64 bits. Forms are counted in a VMap per thread, keyed by
+ * (packed counts, rank), and merged afterwards. */
+#define CLS_MAX_WINDOW 19
+#define CLS_COUNT_BITS 5            /* per type in the packed multiset */
 
-    OutFile *n = (OutFile*)malloc(sizeof(OutFile));
-    if (!n) { fprintf(stderr,"OOM\n"); exit(1); }
-    n->name = full;
-    n->f = fopen(n->name, "wb");
-    if (!n->f) { fprintf(stderr,"Failed to open %s: %s\n", n->name, strerror(errno)); exit(1); }
-    n->next = *head; *head = n;
-    free(rel);
-    return n;
+static const char *CLS_DEFAULT_TYPE[CT_NKINDS] = {
+    NULL, NULL, NULL, NULL,          /* WS, NEWLINE, comments: skipped */
+    "relation_6",                    /* PREPROC */
+    "object_1",                      /* IDENT */
+    "relation_5",                    /* KEYWORD */
+    "object_2",                      /* NUMBER */
+    "object_3", "object_3",          /* STRING, CHAR */
+    "relation_4"                     /* PUNCT */
+};
+
+typedef struct {
+    int window, ntypes;
+    const char *type_name[CT_NKINDS];  /* sorted */
+    int kind_type[CT_NKINDS];          /* type index, -1 = skipped */
+} ClsMap;
+
+typedef struct {
+    char **files;
+    const ClsMap *map;
+    VMap *forms;                       /* one per thread */
+    uint64_t *windows;                 /* per thread */
+} ClsCtx;
+
+/* Apply "KIND=TYPE" (TYPE "-" skips the kind) to names[]; 0 on success. */
+static int cls_map_option(const char *spec, const char **names) {
+    const char *eq = strchr(spec, '=');
+    if (!eq) return -1;
+    char kind[32];
+    size_t n = (size_t)(eq - spec);
+    if (n >= sizeof(kind)) return -1;
+    memcpy(kind, spec, n); kind[n] = 0;
+    int k = kind_from_name(kind);
+    if (k < 0 || !eq[1]) return -1;
+    names[k] = strcmp(eq + 1, "-") == 0 ? NULL : eq + 1;
+    return 0;
 }
 
-static void reassemble(const char *in_path, const char *outdir) {
-    FILE *in = strcmp(in_path,"-")==0 ? stdin : fopen(in_path,"rb");
-    if (!in) { fprintf(stderr,"Failed to open %s: %s\n", in_path, strerror(errno)); exit(1); }
-    OutFile *files = NULL;
-    char *line = NULL; size_t cap=0;
-    while (1) {
-        long r = read_line(in, &line, &cap);
-        if (r < 0) break;
-        /* Find "file":"..."," and "lexeme":"..." */
-        const char *p = strstr(line, "\"file\":\"");
-        if (!p) continue;
-        p += 8;
-        const char *q = strchr(p, '\"');
-        if (!q) continue;
-        size_t fname_len = (size_t)(q - p);
-        char *fname = (char*)malloc(fname_len+1); memcpy(fname,p,fname_len); fname[fname_len]=0;
-
-        const char *lx = strstr(q, "\"lexeme\":\"");
-        if (!lx) { free(fname); continue; }
-        lx += 10;
-        /* Extract JSON string until closing quote not escaped */
-        size_t bufcap = r; char *raw = (char*)malloc(bufcap);
-        size_t j=0;
-        for (const char *s=lx; *s; ++s) {
-            char ch = *s;
-            if (ch=='\"') {
-                /* Check if escaped */
-                size_t back=0; const char *t=s-1;
-                while (t>=lx && *t=='\\') { back++; t--; }
-                if ((back % 2)==0) { /* not escaped */
-                    break;
-                }
+static void cls_map_build(ClsMap *m, const char **names) {
+    m->ntypes = 0;
+    for (int k=0;k<CT_NKINDS;++k) {
+        if (!names[k]) continue;
+        int t = 0;
+        while (t < m->ntypes && strcmp(m->type_name[t], names[k]) != 0) t++;
+        if (t == m->ntypes) m->type_name[m->ntypes++] = names[k];
+    }
+    qsort(m->type_name, (size_t)m->ntypes, sizeof(char*), cmp_cstr);
+    for (int k=0;k<CT_NKINDS;++k) {
+        m->kind_type[k] = -1;
+        for (int t=0;names[k] && t<m->ntypes;++t) if (strcmp(m->type_name[t], names[k]) == 0) m->kind_type[k] = t;
+    }
+}
+
+/* Rank of seq[0..w) among the orderings of its multiset cnt[]. */
+static uint64_t cls_rank(const unsigned char *seq, int w, const int *cnt, int ntypes) {
+    int c[CT_NKINDS];
+    uint64_t m = 1, rank = 0;
+    memcpy(c, cnt, sizeof(int) * (size_t)ntypes);
+    /* m = w! / prod(c_t!), built up one item at a time */
+    for (int t=0, r=0;t<ntypes;++t)
+        for (int j=1;j<=c[t];++j) { r++; m = m * (uint64_t)r / (uint64_t)j; }
+    for (int i=0, r=w;i<w;++i, --r) {
+        int s = seq[i];
+        for (int t=0;t<s;++t) if (c[t]) rank += m * (uint64_t)c[t] / (uint64_t)r;
+        m = m * (uint64_t)c[s] / (uint64_t)r;
+        c[s]--;
+    }
+    return rank;
+}
+
+static void cls_worker(void *ctx, size_t fi, int tid) {
+    ClsCtx *c = (ClsCtx*)ctx;
+    const ClsMap *map = c->map;
+    int w = map->window;
+    Buf b = {0};
+    if (read_file_scratch(c->files[fi], &b) != 0) exit(1);
+    unsigned char ring[CLS_MAX_WINDOW], seq[CLS_MAX_WINDOW];
+    int cnt[CT_NKINDS];
+    uint64_t seen = 0;
+    memset(cnt, 0, sizeof(cnt));
+    CtLexer lx; CtToken t;
+    ct_lexer_init(&lx, b.p, b.n);
+    VMap *forms = &c->forms[tid];
+    while (ct_next(&lx, &t)) {
+        int ty = map->kind_type[t.kind];
+        if (ty < 0) continue;
+        if (seen >= (uint64_t)w) cnt[ring[seen % (uint64_t)w]]--;
+        ring[seen % (uint64_t)w] = (unsigned char)ty;
+        cnt[ty]++;
+        seen++;
+        if (seen < (uint64_t)w) continue;
+        for (int i=0;i<w;++i) seq[i] = ring[(seen + (uint64_t)i) % (uint64_t)w];
+        uint64_t key[2] = { 0, cls_rank(seq, w, cnt, map->ntypes) };
+        for (int k=0;k<map->ntypes;++k) key[0] |= (uint64_t)cnt[k] << (CLS_COUNT_BITS * k);
+        vmap_add(forms, (const char*)key, sizeof(key));
+        if (forms->nitem > 2 * (uint64_t)forms->nbkt) vmap_rehash(forms, forms->nbkt * 4);
+        c->windows[tid]++;
+    }
+    arena_reset(&tls_scratch);
+}
+
+/* Inverse of cls_rank: the ordering of rank r. */
+static void cls_unrank(uint64_t r, int w, const int *cnt, int ntypes, unsigned char *seq) {
+    int c[CT_NKINDS];
+    uint64_t m = 1;
+    memcpy(c, cnt, sizeof(int) * (size_t)ntypes);
+    for (int t=0, n=0;t<ntypes;++t)
+        for (int j=1;j<=c[t];++j) { n++; m = m * (uint64_t)n / (uint64_t)j; }
+    for (int i=0, left=w;i<w;++i, --left) {
+        for (int t=0;t<ntypes;++t) {
+            if (!c[t]) continue;
+            uint64_t k = m * (uint64_t)c[t] / (uint64_t)left;
+            if (r < k) { seq[i] = (unsigned char)t; m = k; c[t]--; break; }
+            r -= k;
+        }
+    }
+}
+
+/* One {"form","counts","rank","sequence","count"} line per distinct form,
+   most frequent first. */
+static void classify(char **files, int nfiles, const ClsMap *map, int nthreads, size_t top, FILE *out) {
+    int nt = nthreads < nfiles ? nthreads : (nfiles ? nfiles : 1);
+    ClsCtx c = { files, map, (VMap*)calloc((size_t)nt, sizeof(VMap)), (uint64_t*)calloc((size_t)nt, sizeof(uint64_t)) };
+    if (!c.forms || !c.windows) { fprintf(stderr,"OOM\n"); exit(1); }
+    for (int t=0;t<nt;++t) vmap_init(&c.forms[t], 1<<12);
+    par_for((size_t)nfiles, nt, cls_worker, &c);
+    uint64_t windows = c.windows[0];
+    for (int t=1;t<nt;++t) { vmap_merge(&c.forms[0], &c.forms[t]); vmap_free(&c.forms[t]); windows += c.windows[t]; }
+    VMap *f = &c.forms[0];
+    VEntry **v = (VEntry**)malloc((size_t)(f->nitem + 1) * sizeof(VEntry*));
+    if (!v) { fprintf(stderr,"OOM\n"); exit(1); }
+    size_t nv = 0;
+    for (size_t i=0;i<f->nbkt;++i)
+        for (VEntry *e=f->bkt[i]; e; e=e->next) v[nv++] = e;
+    qsort(v, nv, sizeof(VEntry*), cmp_ngram);
+    OBuf o = {0};
+    size_t nout = top && top < nv ? top : nv;
+    for (size_t i=0;i<nout;++i) {
+        uint64_t key[2];
+        int cnt[CT_NKINDS];
+        unsigned char seq[CLS_MAX_WINDOW];
+        memcpy(key, v[i]->s, sizeof(key));
+        for (int k=0;k<map->ntypes;++k) cnt[k] = (int)((key[0] >> (CLS_COUNT_BITS * k)) & ((1u << CLS_COUNT_BITS) - 1));
+        cls_unrank(key[1], map->window, cnt, map->ntypes, seq);
+        ob_puts(&o, "{\"form\":\"E"); ob_u64(&o, key[1] + 1);
+        ob_puts(&o, "\",\"counts\":{");
+        for (int k=0, first=1;k<map->ntypes;++k) {
+            if (!cnt[k]) continue;
+            if (!first) ob_putc(&o, ',');
+            first = 0;
+            const char *tn = map->type_name[k];
+            ob_putc(&o, '"'); json_escape_write((const unsigned char*)tn, strlen(tn), &o);
+            ob_puts(&o, "\":"); ob_u64(&o, (uint64_t)cnt[k]);
+        }
+        ob_puts(&o, "},\"rank\":"); ob_u64(&o, key[1]);
+        ob_puts(&o, ",\"sequence\":[");
+        for (int k=0;k<map->window;++k) {
+            const char *tn = map->type_name[seq[k]];
+            if (k) ob_putc(&o, ',');
+            ob_putc(&o, '"'); json_escape_write((const unsigned char*)tn, strlen(tn), &o); ob_putc(&o, '"');
+        }
+        ob_puts(&o, "],\"count\":"); ob_u64(&o, v[i]->count); ob_puts(&o, "}\n");
+        if (o.n >= ((size_t)1<<20)) { fwrite(o.p, 1, o.n, out); o.n = 0; }
+    }
+    fwrite(o.p, 1, o.n, out);
+    fprintf(stderr, "classify: %d files, %llu windows, %llu distinct forms\n",
+            nfiles, (unsigned long long)windows, (unsigned long long)f->nitem);
+    ob_free(&o);
+    free(v);
+    vmap_free(f);
+    free(c.forms); free(c.windows);
+}
+
+/* ---------- Multi-pattern matching (match) ----------
+ * A pattern is a sequence of symbols: token kinds, or with --types/--map the
+ * object/relation types of classify's ClsMap (so generate_E output is a
+ * pattern file as it stands). Either way a ClsMap turns each token into a
+ * symbol or skips it; in kind mode every kind is its own symbol. All
+ * patterns are compiled into one Aho-Corasick automaton whose goto function
+ * is completed into a dense DFA, next[s * CT_NKINDS + sym] (there are never
+ * more symbols than kinds), so each token costs one table load however
+ * many patterns there are. term[s] is the first pattern ending at state s
+ * (further ones via pat_next when a pattern is listed twice) and dict[s] is
+ * the nearest proper suffix state that ends a pattern, so all matches ending
+ * at a token are found by walking dict from the current state. In kind mode
+ * whitespace, newlines and comments are skipped unless --all-kinds. */
+typedef struct {
+    const char *name;                  /* NULL: reported by id only */
+    const unsigned char *syms;
+    int len;
+} AcPattern;
+
+typedef struct {
+    AcPattern *pat;
+    int npat, maxlen;
+    int32_t *next;                     /* nstate * CT_NKINDS, -1 = no edge until ac_build */
+    int32_t *term, *dict, *pat_next;
+    int nstate, cap, pcap;
+    Arena mem;                         /* pattern names and kinds */
+} AcAuto;
+
+typedef struct {
+    char **files;
+    const AcAuto *ac;
+    const ClsMap *map;                 /* token kind -> symbol */
+    int base;                          /* index of files[0] in the whole list */
+    uint64_t *counts;                  /* per thread * npat */
+    uint64_t *nfiles;                  /* per thread * npat: files with a match */
+    int *last;                         /* per thread * npat: 1 + last file counted */
+    uint64_t *tokens;                  /* per thread */
+    OBuf *recs;                        /* --positions: one per file of the round, or NULL */
+} MatchCtx;
+
+typedef struct { size_t off; int32_t id; } MatchHit;
+
+static int cmp_match_hit(const void *a, const void *b) {
+    const MatchHit *x = (const MatchHit*)a, *y = (const MatchHit*)b;
+    if (x->off != y->off) return x->off < y->off ? -1 : 1;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static int ac_new_state(AcAuto *ac) {
+    if (ac->nstate == ac->cap) {
+        ac->cap = ac->cap ? ac->cap * 2 : 256;
+        ac->next = (int32_t*)realloc(ac->next, (size_t)ac->cap * CT_NKINDS * sizeof(int32_t));
+        ac->term = (int32_t*)realloc(ac->term, (size_t)ac->cap * sizeof(int32_t));
+        ac->dict = (int32_t*)realloc(ac->dict, (size_t)ac->cap * sizeof(int32_t));
+        if (!ac->next || !ac->term || !ac->dict) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    int s = ac->nstate++;
+    for (int k=0;k<CT_NKINDS;++k) ac->next[(size_t)s * CT_NKINDS + k] = -1;
+    ac->term[s] = ac->dict[s] = -1;
+    return s;
+}
+
+static void ac_add(AcAuto *ac, const char *name, const unsigned char *syms, int len) {
+    if (ac->npat == ac->pcap) {
+        ac->pcap = ac->pcap ? ac->pcap * 2 : 256;
+        ac->pat = (AcPattern*)realloc(ac->pat, (size_t)ac->pcap * sizeof(AcPattern));
+        ac->pat_next = (int32_t*)realloc(ac->pat_next, (size_t)ac->pcap * sizeof(int32_t));
+        if (!ac->pat || !ac->pat_next) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    int p = ac->npat++;
+    unsigned char *k = (unsigned char*)arena_alloc(&ac->mem, (size_t)len);
+    memcpy(k, syms, (size_t)len);
+    ac->pat[p].name = name ? arena_strndup(&ac->mem, name, strlen(name)) : NULL;
+    ac->pat[p].syms = k;
+    ac->pat[p].len = len;
+    if (len > ac->maxlen) ac->maxlen = len;
+    int s = 0;
+    for (int i=0;i<len;++i) {
+        int32_t *e = &ac->next[(size_t)s * CT_NKINDS + syms[i]];
+        if (*e < 0) { int t = ac_new_state(ac); e = &ac->next[(size_t)s * CT_NKINDS + syms[i]]; *e = t; }
+        s = *e;
+    }
+    /* keep duplicates in file order */
+    ac->pat_next[p] = -1;
+    if (ac->term[s] < 0) ac->term[s] = p;
+    else { int q = ac->term[s]; while (ac->pat_next[q] >= 0) q = ac->pat_next[q]; ac->pat_next[q] = p; }
+}
+
+/* Pattern file: one pattern per line, "[NAME:] SYM SYM ...", each SYM one
+   of map's type names. Blank lines and lines starting with '#' are skipped.
+   Returns 0, or -1 after reporting the offending line. */
+static int ac_load(AcAuto *ac, const char *path, const ClsMap *map) {
+    FILE *f = fopen(path, "rb");
+    if (!f) { fprintf(stderr,"Failed to open %s: %s\n", path, strerror(errno)); return -1; }
+    char *line = NULL; size_t cap = 0; long r;
+    unsigned char *syms = NULL; size_t kcap = 0;
+    int lineno = 0, rc = 0;
+    if (ac->nstate == 0) ac_new_state(ac);     /* root */
+    while (rc == 0 && (r = read_line(f, &line, &cap)) >= 0) {
+        lineno++;
+        char *p = line, *name = NULL;
+        int len = 0;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#') continue;
+        for (char *tok = strtok(p, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+            size_t tl = strlen(tok);
+            if (len == 0 && !name && tok[tl-1] == ':') { tok[tl-1] = 0; name = tok; continue; }
+            int k = 0;
+            while (k < map->ntypes && strcmp(map->type_name[k], tok) != 0) k++;
+            if (k == map->ntypes) { fprintf(stderr,"%s:%d: unknown symbol %s\n", path, lineno, tok); rc = -1; break; }
+            if ((size_t)len == kcap) {
+                kcap = kcap ? kcap * 2 : 64;
+                syms = (unsigned char*)realloc(syms, kcap);
+                if (!syms) { fprintf(stderr,"OOM\n"); exit(1); }
             }
-            raw[j++] = ch;
+            syms[len++] = (unsigned char)k;
         }
-        raw[j]=0;
-        size_t lex_len=0;
-        unsigned char *lex = json_unescape_alloc(raw, &lex_len);
-        free(raw);
+        if (rc == 0 && len == 0 && name) { fprintf(stderr,"%s:%d: pattern %s has no symbols\n", path, lineno, name); rc = -1; }
+        if (rc == 0 && len > 0) ac_add(ac, name, syms, len);
+    }
+    free(line); free(syms);
+    fclose(f);
+    if (rc == 0 && ac->npat == 0) { fprintf(stderr,"%s: no patterns\n", path); rc = -1; }
+    return rc;
+}
 
-        OutFile *of = of_find_or_open(&files, fname, outdir);
-        fwrite(lex, 1, lex_len, of->f);
+/* Fail links by BFS, completing next[] into a DFA on the way: a missing edge
+   of s takes the (already complete) edge of fail(s). */
+static void ac_build(AcAuto *ac) {
+    int32_t *fail = (int32_t*)malloc((size_t)ac->nstate * sizeof(int32_t));
+    int32_t *queue = (int32_t*)malloc((size_t)ac->nstate * sizeof(int32_t));
+    if (!fail || !queue) { fprintf(stderr,"OOM\n"); exit(1); }
+    size_t qh = 0, qt = 0;
+    fail[0] = 0;
+    for (int k=0;k<CT_NKINDS;++k) {
+        int32_t v = ac->next[k];
+        if (v < 0) { ac->next[k] = 0; continue; }
+        fail[v] = 0;
+        queue[qt++] = v;
+    }
+    while (qh < qt) {
+        int32_t u = queue[qh++];
+        for (int k=0;k<CT_NKINDS;++k) {
+            int32_t *e = &ac->next[(size_t)u * CT_NKINDS + k];
+            int32_t via = ac->next[(size_t)fail[u] * CT_NKINDS + k];
+            if (*e < 0) { *e = via; continue; }
+            fail[*e] = via;
+            ac->dict[*e] = ac->term[via] >= 0 ? via : ac->dict[via];
+            queue[qt++] = *e;
+        }
+    }
+    free(fail); free(queue);
+}
 
-        free(lex);
-        free(fname);
+static void ac_free(AcAuto *ac) {
+    free(ac->pat); free(ac->pat_next);
+    free(ac->next); free(ac->term); free(ac->dict);
+    arena_free(&ac->mem);
+}
+
+static void match_worker(void *ctx, size_t fi, int tid) {
+    MatchCtx *c = (MatchCtx*)ctx;
+    const AcAuto *ac = c->ac;
+    int gfi = c->base + (int)fi + 1;
+    Buf b = {0};
+    if (read_file_scratch(c->files[fi], &b) != 0) exit(1);
+    size_t nlines = c->recs ? line_table(&b) : 0;
+    /* start offsets of the last maxlen tokens fed to the automaton */
+    size_t *ring = (size_t*)arena_alloc(&tls_scratch, (size_t)ac->maxlen * sizeof(size_t));
+    uint64_t *counts = c->counts + (size_t)tid * (size_t)ac->npat;
+    uint64_t *nfiles = c->nfiles + (size_t)tid * (size_t)ac->npat;
+    int *last = c->last + (size_t)tid * (size_t)ac->npat;
+    uint64_t seen = 0;
+    int32_t s = 0;
+    OBuf hits = {0};                    /* MatchHit per match, for --positions */
+    CtLexer lx; CtToken t;
+    ct_lexer_init(&lx, b.p, b.n);
+    while (ct_next(&lx, &t)) {
+        int sym = c->map->kind_type[t.kind];
+        if (sym < 0) continue;
+        ring[seen % (uint64_t)ac->maxlen] = t.off;
+        seen++;
+        s = ac->next[(size_t)s * CT_NKINDS + sym];
+        for (int32_t u = ac->term[s] >= 0 ? s : ac->dict[s]; u >= 0; u = ac->dict[u]) {
+            for (int32_t p = ac->term[u]; p >= 0; p = ac->pat_next[p]) {
+                counts[p]++;
+                if (last[p] != gfi) { last[p] = gfi; nfiles[p]++; }
+                if (!c->recs) continue;
+                MatchHit h = { ring[(seen - (uint64_t)ac->pat[p].len) % (uint64_t)ac->maxlen], p };
+                ob_write(&hits, &h, sizeof(h));
+            }
+        }
     }
-    /* close */
-    for (OutFile *p=files; p;) { fclose(p->f); OutFile *n=p->next; free(p->name); free(p); p=n; }
-    if (in!=stdin) fclose(in);
+    if (c->recs) {
+        /* matches are found by end token; report them by start */
+        MatchHit *h = (MatchHit*)hits.p;
+        size_t nh = hits.n / sizeof(MatchHit);
+        qsort(h, nh, sizeof(MatchHit), cmp_match_hit);
+        OBuf *o = &c->recs[fi];
+        for (size_t i=0;i<nh;++i) {
+            size_t line, col;
+            ct_line_col(tls_line_starts, nlines, h[i].off, &line, &col);
+            ob_puts(o, "{\"id\":"); ob_u64(o, (uint64_t)h[i].id);
+            ob_puts(o, ",\"file\":\""); json_escape_write((const unsigned char*)c->files[fi], strlen(c->files[fi]), o);
+            ob_puts(o, "\",\"off\":"); ob_u64(o, h[i].off);
+            ob_puts(o, ",\"line\":"); ob_u64(o, line);
+            ob_puts(o, ",\"col\":"); ob_u64(o, col);
+            ob_puts(o, "}\n");
+        }
+        ob_free(&hits);
+    }
+    c->tokens[tid] += seen;
+    arena_reset(&tls_scratch);
+}
+
+/* One {"id","name","symbols","count","files"} line per pattern, in pattern
+   file order; with positions, one {"id","file","off","line","col"} line per
+   match, in file order and by start offset (then id) within a file. */
+static void match_files(char **files, int nfiles, const AcAuto *ac, const ClsMap *map, int nthreads,
+                        FILE *out, FILE *positions) {
+    int nt = nthreads < nfiles ? nthreads : (nfiles ? nfiles : 1);
+    size_t np = (size_t)ac->npat;
+    MatchCtx c = { files, ac, map, 0, NULL, NULL, NULL, NULL, NULL };
+    c.counts = (uint64_t*)calloc((size_t)nt * np, sizeof(uint64_t));
+    c.nfiles = (uint64_t*)calloc((size_t)nt * np, sizeof(uint64_t));
+    c.last = (int*)calloc((size_t)nt * np, sizeof(int));
+    c.tokens = (uint64_t*)calloc((size_t)nt, sizeof(uint64_t));
+    if (!c.counts || !c.nfiles || !c.last || !c.tokens) { fprintf(stderr,"OOM\n"); exit(1); }
+    if (positions) {
+        /* positions are kept per round and written in input order */
+        c.recs = (OBuf*)calloc((size_t)nt * CKPT_CHUNK, sizeof(OBuf));
+        if (!c.recs) { fprintf(stderr,"OOM\n"); exit(1); }
+    }
+    for (int lo=0, hi; lo<nfiles; lo=hi) {
+        hi = positions && nfiles - lo > nt * CKPT_CHUNK ? lo + nt * CKPT_CHUNK : nfiles;
+        c.files = files + lo;
+        c.base = lo;
+        par_for((size_t)(hi - lo), nt, match_worker, &c);
+        if (positions)
+            for (int k=0;k<hi-lo;++k) { fwrite(c.recs[k].p, 1, c.recs[k].n, positions); c.recs[k].n = 0; }
+    }
+    uint64_t tokens = c.tokens[0], matches = 0;
+    for (int t=1;t<nt;++t) {
+        tokens += c.tokens[t];
+        for (size_t p=0;p<np;++p) { c.counts[p] += c.counts[(size_t)t * np + p]; c.nfiles[p] += c.nfiles[(size_t)t * np + p]; }
+    }
+    OBuf o = {0};
+    for (size_t p=0;p<np;++p) {
+        const AcPattern *pt = &ac->pat[p];
+        matches += c.counts[p];
+        ob_puts(&o, "{\"id\":"); ob_u64(&o, (uint64_t)p);
+        if (pt->name) { ob_puts(&o, ",\"name\":\""); json_escape_write((const unsigned char*)pt->name, strlen(pt->name), &o); ob_putc(&o, '"'); }
+        ob_puts(&o, ",\"symbols\":[");
+        for (int i=0;i<pt->len;++i) {
+            const char *tn = map->type_name[pt->syms[i]];
+            if (i) ob_putc(&o, ',');
+            ob_putc(&o, '"'); json_escape_write((const unsigned char*)tn, strlen(tn), &o); ob_putc(&o, '"');
+        }
+        ob_puts(&o, "],\"count\":"); ob_u64(&o, c.counts[p]);
+        ob_puts(&o, ",\"files\":"); ob_u64(&o, c.nfiles[p]);
+        ob_puts(&o, "}\n");
+        if (o.n >= ((size_t)1<<20)) { fwrite(o.p, 1, o.n, out); o.n = 0; }
+    }
+    fwrite(o.p, 1, o.n, out);
+    fprintf(stderr, "match: %d files, %llu tokens, %d patterns, %d states, %llu matches\n",
+            nfiles, (unsigned long long)tokens, ac->npat, ac->nstate, (unsigned long long)matches);
+    ob_free(&o);
+    if (positions) for (int k=0;k<nt * CKPT_CHUNK;++k) ob_free(&c.recs[k]);
+    free(c.recs);
+    free(c.counts); free(c.nfiles); free(c.last); free(c.tokens);
 }
 
 /* ---------- main ---------- */
 int main(int argc, char **argv) {
     if (argc < 2) die_usage();
     const char *cmd = argv[1];
+#ifdef CT_ALLOC_STATS
+    atexit(ct_alloc_report);
+#endif
 
     if (strcmp(cmd,"stream")==0) {
         const char *out_path = NULL;
         const char *stdin_name = NULL;
+        const char *list_path = NULL;
+        int compress = CZ_NONE, level = -1, nthreads = ct_ncpu();
+        size_t frame_size = 0, nshards = 0;
+        Ckpt ck_opt = CKPT_DEFAULT("stream");
+        uint64_t shard_size = 0;
         int i=2;
         /* parse options */
         for (; i<argc; ++i) {
             if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
             if (strcmp(argv[i],"--stdin")==0 && i+1<argc) { stdin_name = argv[++i]; continue; }
+            if (strcmp(argv[i],"--compress")==0 && i+1<argc) {
+                compress = cz_parse(argv[++i]);
+                if (compress < 0) { fprintf(stderr,"Unknown codec: %s\n", argv[i]); die_usage(); }
+                continue;
+            }
+            if (strcmp(argv[i],"--level")==0 && i+1<argc) { level = atoi(argv[++i]); continue; }
+            if (strcmp(argv[i],"--frame-size")==0 && i+1<argc) { frame_size = (size_t)parse_size(argv[++i]); continue; }
+            if (strcmp(argv[i],"--shards")==0 && i+1<argc) { nshards = (size_t)strtoull(argv[++i], NULL, 10); continue; }
+            if (strcmp(argv[i],"--shard-size")==0 && i+1<argc) { shard_size = parse_size(argv[++i]); continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (ckpt_option(argc, argv, &i, &ck_opt)) continue;
             if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
             break;
         }
-        FILE *out = open_out(out_path);
-        char **files = NULL; int nfiles = argc - i;
-        if (nfiles>0) files = &argv[i];
-        process_files_stream_stats_vocab(files, nfiles, stdin_name, out, 0, NULL, 0, NULL);
-        if (out && out!=stdout) fclose(out);
+        if (!cz_available(compress)) { fprintf(stderr,"Built without %s support\n", cz_name(compress)); return 1; }
+        if (compress != CZ_NONE && (!out_path || strcmp(out_path,"-")==0)) {
+            fprintf(stderr,"--compress requires --out (the seek table is written next to it)\n");
+            return 2;
+        }
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        Ckpt *ck = ckpt_check(&ck_opt, out_path, nfiles);
+        if (ck) ck->codec = compress;
+        if (nshards || shard_size) {
+            if (ck) { fprintf(stderr,"--checkpoint is not supported with sharded output\n"); return 2; }
+            if (nshards && shard_size) { fprintf(stderr,"--shards and --shard-size are exclusive\n"); return 2; }
+            if (!out_path || strcmp(out_path,"-")==0 || nfiles==0) {
+                fprintf(stderr,"Sharded output requires --out and input files\n");
+                return 2;
+            }
+            process_files_sharded(files, nfiles, out_path, nshards, shard_size, compress, level, frame_size, nthreads);
+            prof_report_stderr();
+            return 0;
+        }
+        /* Resuming continues the existing output in place */
+        FILE *out = ck && ck->resume ? fopen(out_path, "r+b") : NULL;
+        if (!out) out = open_out(out_path);
+        StreamWriter sw;
+        sw_init(&sw, out, out_path, compress, level, frame_size, nthreads);
+        process_files_stream_stats_vocab(files, nfiles, stdin_name, &sw, 0, NULL, 0, NULL, 1, 0, ck, NULL, NULL);
+        sw_close(&sw);
+        if (out && out!=stdout && fclose(out) != 0) { fprintf(stderr,"Write failed: %s\n", out_path); return 1; }
+        ckpt_finish(ck);
+        prof_report_stderr();
         return 0;
     } else if (strcmp(cmd,"stats")==0) {
         const char *out_path = NULL;
+        const char *list_path = NULL;
+        const char *per_file_path = NULL;
+        int nthreads = ct_ncpu(), partial = 0, ngrams = 0;
+        size_t ngram_top = 100;
+        Ckpt ck_opt = CKPT_DEFAULT("stats");
         int i=2;
         for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--ngrams")==0 && i+1<argc) { ngrams = atoi(argv[++i]); continue; }
+            if (strcmp(argv[i],"--ngram-top")==0 && i+1<argc) { ngram_top = (size_t)strtoull(argv[++i], NULL, 10); continue; }
+            if (strcmp(argv[i],"--per-file")==0 && i+1<argc) { per_file_path = argv[++i]; continue; }
             if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (strcmp(argv[i],"--partial")==0) { partial = 1; continue; }
+            if (ckpt_option(argc, argv, &i, &ck_opt)) continue;
             if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
             break;
         }
+        if (ngrams && (ngrams < 2 || ngrams > NGRAM_MAX)) {
+            fprintf(stderr,"--ngrams must be between 2 and %d\n", NGRAM_MAX);
+            return 2;
+        }
+        if (ngrams && (partial || ck_opt.path)) {
+            fprintf(stderr,"--ngrams is not supported with --partial or --checkpoint\n");
+            return 2;
+        }
+        if (per_file_path && ck_opt.path) {
+            fprintf(stderr,"--per-file is not supported with --checkpoint\n");
+            return 2;
+        }
         FILE *out = open_out(out_path);
-        char **files = NULL; int nfiles = argc - i;
-        if (nfiles>0) files = &argv[i];
-        process_files_stream_stats_vocab(files, nfiles, NULL, NULL, 1, out, 0, NULL);
-        if (out && out!=stdout) fclose(out);
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        Ckpt *ck = ckpt_check(&ck_opt, out_path, nfiles);
+        NGrams ng;
+        if (ngrams) ngram_init(&ng, ngrams, ngram_top);
+        FILE *per_file = per_file_path ? open_out(per_file_path) : NULL;
+        process_files_stream_stats_vocab(files, nfiles, NULL, NULL, 1, out, 0, NULL, nthreads, partial, ck,
+                                         ngrams ? &ng : NULL, per_file);
+        if (ngrams) ngram_free(&ng);
+        if (per_file && per_file != stdout && fclose(per_file) != 0) {
+            fprintf(stderr,"Write failed: %s\n", per_file_path);
+            return 1;
+        }
+        if (out && out!=stdout && fclose(out) != 0) { fprintf(stderr,"Write failed: %s\n", out_path); return 1; }
+        ckpt_finish(ck);
+        if (partial) prof_report_stderr();  /* otherwise embedded in the stats JSON */
         return 0;
     } else if (strcmp(cmd,"vocab")==0) {
         const char *out_path = NULL;
+        const char *list_path = NULL;
+        int nthreads = ct_ncpu(), partial = 0;
+        Ckpt ck_opt = CKPT_DEFAULT("vocab");
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (strcmp(argv[i],"--partial")==0) { partial = 1; continue; }
+            if (ckpt_option(argc, argv, &i, &ck_opt)) continue;
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        FILE *out = open_out(out_path);
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        Ckpt *ck = ckpt_check(&ck_opt, out_path, nfiles);
+        process_files_stream_stats_vocab(files, nfiles, NULL, NULL, 0, NULL, 1, out, nthreads, partial, ck, NULL, NULL);
+        if (out && out!=stdout && fclose(out) != 0) { fprintf(stderr,"Write failed: %s\n", out_path); return 1; }
+        ckpt_finish(ck);
+        prof_report_stderr();
+        return 0;
+    } else if (strcmp(cmd,"merge")==0) {
+        const char *out_path = NULL;
+        int partial = 0;
         int i=2;
         for (; i<argc; ++i) {
             if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--partial")==0) { partial = 1; continue; }
             if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
             break;
         }
+        if (i >= argc) die_usage();
         FILE *out = open_out(out_path);
-        char **files = NULL; int nfiles = argc - i;
-        if (nfiles>0) files = &argv[i];
-        process_files_stream_stats_vocab(files, nfiles, NULL, NULL, 0, NULL, 1, out);
+        merge_partials(&argv[i], argc - i, out, partial);
         if (out && out!=stdout) fclose(out);
         return 0;
     } else if (strcmp(cmd,"reassemble")==0) {
         const char *in_path = NULL;
-        const char *outdir = NULL;
+        const char *outdir = NULL, *patch_path = NULL;
+        char **only = (char**)calloc((size_t)argc, sizeof(char*)); int nonly = 0;
+        if (!only) { fprintf(stderr,"OOM\n"); return 1; }
         int i=2;
         for (; i<argc; ++i) {
             if (strcmp(argv[i],"--in")==0 && i+1<argc) { in_path = argv[++i]; continue; }
             if (strcmp(argv[i],"--outdir")==0 && i+1<argc) { outdir = argv[++i]; continue; }
+            if (strcmp(argv[i],"--patch")==0 && i+1<argc) { patch_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--file")==0 && i+1<argc) { only[nonly++] = argv[++i]; continue; }
             if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
         }
         if (!in_path) die_usage();
-        reassemble(in_path, outdir);
+        reassemble(in_path, outdir, only, nonly, patch_path);
+        free(only);
+        return 0;
+    } else if (strcmp(cmd,"index")==0) {
+        const char *out_path = NULL;
+        const char *list_path = NULL;
+        int nthreads = ct_ncpu();
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        if (!out_path || strcmp(out_path,"-")==0 || nfiles == 0) {
+            fprintf(stderr,"index requires --out and input files\n");
+            return 2;
+        }
+        FILE *out = open_out(out_path);
+        index_build(files, nfiles, out, nthreads);
+        fclose(out);
+        prof_report_stderr();
         return 0;
+    } else if (strcmp(cmd,"query")==0) {
+        const char *index_path = NULL, *out_path = NULL;
+        int count_only = 0;
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--index")==0 && i+1<argc) { index_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--count")==0) { count_only = 1; continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        if (!index_path || i >= argc) die_usage();
+        IxView v;
+        if (index_open(index_path, &v) != 0) return 1;
+        FILE *out = open_out(out_path);
+        for (; i<argc; ++i) index_query(&v, argv[i], count_only, out);
+        if (out && out!=stdout) fclose(out);
+        index_close(&v);
+        return 0;
+    } else if (strcmp(cmd,"dedup")==0) {
+        const char *out_path = NULL;
+        const char *list_path = NULL;
+        int nthreads = ct_ncpu();
+        DedupParams dp;
+        memset(&dp, 0, sizeof(dp));
+        dp.shingle = 5; dp.nperm = 128; dp.nbands = 16; dp.threshold = 0.8;
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--shingle")==0 && i+1<argc) { dp.shingle = atoi(argv[++i]); continue; }
+            if (strcmp(argv[i],"--perms")==0 && i+1<argc) { dp.nperm = atoi(argv[++i]); continue; }
+            if (strcmp(argv[i],"--bands")==0 && i+1<argc) { dp.nbands = atoi(argv[++i]); continue; }
+            if (strcmp(argv[i],"--threshold")==0 && i+1<argc) { dp.threshold = atof(argv[++i]); continue; }
+            if (strcmp(argv[i],"--normalize-idents")==0) { dp.normalize = 1; continue; }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        if (dp.shingle < 1 || dp.shingle > DEDUP_MAX_SHINGLE || dp.nperm < 1 || dp.nbands < 1 || dp.nperm % dp.nbands) {
+            fprintf(stderr,"dedup needs 1 <= --shingle <= %d and --bands dividing --perms\n", DEDUP_MAX_SHINGLE);
+            return 2;
+        }
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        FILE *out = open_out(out_path);
+        dedup_params_init(&dp);
+        dedup(files, nfiles, &dp, nthreads, out);
+        free(dp.a); free(dp.b);
+        if (out && out!=stdout) fclose(out);
+        prof_report_stderr();
+        return 0;
+    } else if (strcmp(cmd,"clones")==0) {
+        const char *out_path = NULL;
+        const char *list_path = NULL;
+        int nthreads = ct_ncpu(), window = 50, normalize = 0;
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--window")==0 && i+1<argc) { window = atoi(argv[++i]); continue; }
+            if (strcmp(argv[i],"--normalize")==0) { normalize = 1; continue; }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        if (window < 2) { fprintf(stderr,"--window must be at least 2\n"); return 2; }
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        FILE *out = open_out(out_path);
+        clones(files, nfiles, window, normalize, nthreads, out);
+        if (out && out!=stdout) fclose(out);
+        prof_report_stderr();
+        return 0;
+    } else if (strcmp(cmd,"bpe-train")==0) {
+        const char *merges_path = NULL, *vocab_path = NULL;
+        const char *list_path = NULL;
+        int nthreads = ct_ncpu();
+        long vocab_size = 8192, min_freq = 2;
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--merges")==0 && i+1<argc) { merges_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--vocab")==0 && i+1<argc) { vocab_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--vocab-size")==0 && i+1<argc) { vocab_size = atol(argv[++i]); continue; }
+            if (strcmp(argv[i],"--min-frequency")==0 && i+1<argc) { min_freq = atol(argv[++i]); continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        if (!merges_path || !vocab_path) die_usage();
+        if (vocab_size < 256 || vocab_size > 0x7fffffffL) { fprintf(stderr,"--vocab-size must be at least 256\n"); return 2; }
+        if (min_freq < 1) min_freq = 1;
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        FILE *mo = open_out(merges_path);
+        FILE *vo = open_out(vocab_path);
+        bpe_train(files, nfiles, nthreads, (uint32_t)vocab_size, (int64_t)min_freq, mo, vo);
+        if (mo!=stdout) fclose(mo);
+        if (vo!=stdout) fclose(vo);
+        prof_report_stderr();
+        return 0;
+    } else if (strcmp(cmd,"encode")==0) {
+        const char *merges_path = NULL, *out_path = NULL;
+        const char *list_path = NULL;
+        int nthreads = ct_ncpu(), width = 0;
+        uint64_t shard_size = 0;
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--merges")==0 && i+1<argc) { merges_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--dtype")==0 && i+1<argc) {
+                ++i;
+                if (strcmp(argv[i],"u16")==0) width = 2;
+                else if (strcmp(argv[i],"u32")==0) width = 4;
+                else { fprintf(stderr,"--dtype must be u16 or u32\n"); return 2; }
+                continue;
+            }
+            if (strcmp(argv[i],"--shard-size")==0 && i+1<argc) { shard_size = parse_size(argv[++i]); continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        if (!merges_path || !out_path || strcmp(out_path,"-")==0) die_usage();
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        encode(files, nfiles, merges_path, out_path, shard_size, width, nthreads);
+        prof_report_stderr();
+        return 0;
+    } else if (strcmp(cmd,"normalize")==0) {
+        const char *outdir = NULL;
+        const char *list_path = NULL;
+        int nthreads = ct_ncpu(), rename = 0;
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--outdir")==0 && i+1<argc) { outdir = argv[++i]; continue; }
+            if (strcmp(argv[i],"--rename-idents")==0) { rename = 1; continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        if (!outdir || !outdir[0]) die_usage();
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        normalize(files, nfiles, outdir, rename, nthreads);
+        prof_report_stderr();
+        return 0;
+    } else if (strcmp(cmd,"includes")==0) {
+        const char *out_path = NULL;
+        const char *list_path = NULL;
+        int nthreads = ct_ncpu();
+        char **dirs = (char**)calloc((size_t)argc, sizeof(char*)); int ndirs = 0;
+        if (!dirs) { fprintf(stderr,"OOM\n"); return 1; }
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"-I")==0 && i+1<argc) { dirs[ndirs++] = argv[++i]; continue; }
+            if (strncmp(argv[i],"-I",2)==0 && argv[i][2]) { dirs[ndirs++] = argv[i] + 2; continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        FILE *out = open_out(out_path);
+        includes(files, nfiles, dirs, ndirs, nthreads, out);
+        if (out && out!=stdout) fclose(out);
+        free(dirs);
+        prof_report_stderr();
+        return 0;
+    } else if (strcmp(cmd,"diff")==0) {
+        const char *out_path = NULL;
+        int nthreads = ct_ncpu();
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        if (argc - i != 2) die_usage();
+        char *roots[2];
+        for (int k=0;k<2;++k) {
+            roots[k] = str_dup(argv[i+k]);
+            size_t n = strlen(roots[k]);
+            while (n > 1 && (roots[k][n-1]=='/' || roots[k][n-1]=='\\')) roots[k][--n] = 0;
+        }
+        FILE *out = open_out(out_path);
+        diff_trees(roots[0], roots[1], nthreads, out);
+        if (out && out!=stdout) fclose(out);
+        free(roots[0]); free(roots[1]);
+        return 0;
+    } else if (strcmp(cmd,"serve")==0 || strcmp(cmd,"loadgen")==0) {
+#ifdef _WIN32
+        fprintf(stderr,"%s: Unix domain sockets are not supported on this platform\n", cmd);
+        return 2;
+#else
+        const char *sock = NULL, *out_path = NULL, *list_path = NULL;
+        int nthreads = ct_ncpu(), nconn = 4, depth = 8;
+        uint64_t max_request = 64ull << 20, nreq = 10000;
+        uint32_t mode = SERVE_TOKENS;
+        int is_serve = strcmp(cmd,"serve")==0;
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--socket")==0 && i+1<argc) { sock = argv[++i]; continue; }
+            if (is_serve && strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (is_serve && strcmp(argv[i],"--max-request")==0 && i+1<argc) {
+                max_request = parse_size(argv[++i]);
+                if (max_request == 0 || max_request > 0xFFFFFFFFull) { fprintf(stderr,"Bad --max-request: %s\n", argv[i]); return 2; }
+                continue;
+            }
+            if (!is_serve && strcmp(argv[i],"--connections")==0 && i+1<argc) { nconn = atoi(argv[++i]); if (nconn < 1) nconn = 1; continue; }
+            if (!is_serve && strcmp(argv[i],"--depth")==0 && i+1<argc) { depth = atoi(argv[++i]); if (depth < 1) depth = 1; continue; }
+            if (!is_serve && strcmp(argv[i],"--requests")==0 && i+1<argc) { nreq = strtoull(argv[++i], NULL, 10); continue; }
+            if (!is_serve && strcmp(argv[i],"--mode")==0 && i+1<argc) {
+                ++i;
+                if (strcmp(argv[i],"tokens")==0) mode = SERVE_TOKENS;
+                else if (strcmp(argv[i],"stats")==0) mode = SERVE_STATS;
+                else { fprintf(stderr,"Unknown mode: %s\n", argv[i]); return 2; }
+                continue;
+            }
+            if (!is_serve && strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (!is_serve && strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        if (!sock || !sock[0]) die_usage();
+        if (is_serve) {
+            if (i < argc) die_usage();
+            return serve(sock, nthreads, max_request);
+        }
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        FILE *out = open_out(out_path);
+        int rc = loadgen(sock, files, nfiles, mode, nconn, depth, nreq, out);
+        if (out && out!=stdout) fclose(out);
+        return rc;
+#endif
+    } else if (strcmp(cmd,"watch")==0) {
+#ifdef _WIN32
+        fprintf(stderr,"watch: not supported on this platform\n");
+        return 2;
+#else
+        const char *outdir = NULL;
+        int nthreads = ct_ncpu(), debounce_ms = 200, once = 0;
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--outdir")==0 && i+1<argc) { outdir = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--debounce")==0 && i+1<argc) { debounce_ms = atoi(argv[++i]); if (debounce_ms < 0) debounce_ms = 0; continue; }
+            if (strcmp(argv[i],"--once")==0) { once = 1; continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        if (!outdir || !outdir[0] || argc - i != 1) die_usage();
+        char *root = str_dup(argv[i]);
+        size_t n = strlen(root);
+        while (n > 1 && root[n-1]=='/') root[--n] = 0;
+        int rc = watch(root, outdir, nthreads, debounce_ms, once);
+        free(root);
+        return rc;
+#endif
+    } else if (strcmp(cmd,"classify")==0) {
+        const char *out_path = NULL;
+        const char *list_path = NULL;
+        const char *names[CT_NKINDS];
+        int nthreads = ct_ncpu();
+        size_t top = 0;
+        ClsMap map;
+        memcpy(names, CLS_DEFAULT_TYPE, sizeof(names));
+        map.window = 11;
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--window")==0 && i+1<argc) { map.window = atoi(argv[++i]); continue; }
+            if (strcmp(argv[i],"--top")==0 && i+1<argc) { top = (size_t)strtoull(argv[++i], NULL, 10); continue; }
+            if (strcmp(argv[i],"--map")==0 && i+1<argc) {
+                if (cls_map_option(argv[++i], names) != 0) { fprintf(stderr,"Bad --map %s (want KIND=TYPE or KIND=-)\n", argv[i]); return 2; }
+                continue;
+            }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        cls_map_build(&map, names);
+        if (map.window < 1 || map.window > CLS_MAX_WINDOW || map.ntypes == 0) {
+            fprintf(stderr,"classify needs 1 <= --window <= %d and at least one mapped kind\n", CLS_MAX_WINDOW);
+            return 2;
+        }
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        FILE *out = open_out(out_path);
+        classify(files, nfiles, &map, nthreads, top, out);
+        if (out && out!=stdout && fclose(out) != 0) { fprintf(stderr,"Write failed: %s\n", out_path); return 1; }
+        prof_report_stderr();
+        return 0;
+    } else if (strcmp(cmd,"match")==0) {
+        const char *out_path = NULL;
+        const char *list_path = NULL;
+        const char *pat_path = NULL;
+        const char *pos_path = NULL;
+        int nthreads = ct_ncpu(), all_kinds = 0, types = 0;
+        const char *names[CT_NKINDS];
+        ClsMap map;
+        memcpy(names, CLS_DEFAULT_TYPE, sizeof(names));
+        int i=2;
+        for (; i<argc; ++i) {
+            if (strcmp(argv[i],"--patterns")==0 && i+1<argc) { pat_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--types")==0) { types = 1; continue; }
+            if (strcmp(argv[i],"--map")==0 && i+1<argc) {
+                if (cls_map_option(argv[++i], names) != 0) { fprintf(stderr,"Bad --map %s (want KIND=TYPE or KIND=-)\n", argv[i]); return 2; }
+                types = 1;
+                continue;
+            }
+            if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--positions")==0 && i+1<argc) { pos_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--files-from")==0 && i+1<argc) { list_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            if (strcmp(argv[i],"--all-kinds")==0) { all_kinds = 1; continue; }
+            if (strcmp(argv[i],"--profile")==0) { prof_start(); continue; }
+            if (argv[i][0]=='-') { fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage(); }
+            break;
+        }
+        if (!pat_path) { fprintf(stderr,"match needs --patterns FILE\n"); die_usage(); }
+        if (types && all_kinds) { fprintf(stderr,"--all-kinds applies to kind patterns; use --map KIND=TYPE\n"); return 2; }
+        if (!types)
+            for (int k=0;k<CT_NKINDS;++k) names[k] = all_kinds || is_code_token((CtKind)k) ? ct_kind_name((CtKind)k) : NULL;
+        cls_map_build(&map, names);
+        AcAuto ac;
+        memset(&ac, 0, sizeof(ac));
+        if (ac_load(&ac, pat_path, &map) != 0) return 2;
+        ac_build(&ac);
+        int nfiles = 0;
+        char **files = collect_files(&argv[i], argc - i, list_path, &nfiles);
+        FILE *out = open_out(out_path);
+        FILE *positions = pos_path ? open_out(pos_path) : NULL;
+        match_files(files, nfiles, &ac, &map, nthreads, out, positions);
+        if (positions && positions!=stdout && fclose(positions) != 0) { fprintf(stderr,"Write failed: %s\n", pos_path); return 1; }
+        if (out && out!=stdout && fclose(out) != 0) { fprintf(stderr,"Write failed: %s\n", out_path); return 1; }
+        ac_free(&ac);
+        prof_report_stderr();
+        return 0;
+    } else if (strcmp(cmd,"verify")==0) {
+        const char *in_path = NULL, *manifest = NULL, *root = NULL, *out_path = NULL;
+        int nthreads = ct_ncpu();
+        char **only = (char**)calloc((size_t)argc, sizeof(char*)); int nonly = 0;
+        if (!only) { fprintf(stderr,"OOM\n"); return 1; }
+        for (int i=2; i<argc; ++i) {
+            if (strcmp(argv[i],"--in")==0 && i+1<argc) { in_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--manifest")==0 && i+1<argc) { manifest = argv[++i]; continue; }
+            if (strcmp(argv[i],"--root")==0 && i+1<argc) { root = argv[++i]; continue; }
+            if (strcmp(argv[i],"--out")==0 && i+1<argc) { out_path = argv[++i]; continue; }
+            if (strcmp(argv[i],"--file")==0 && i+1<argc) { only[nonly++] = argv[++i]; continue; }
+            if (strcmp(argv[i],"--threads")==0 && i+1<argc) { nthreads = atoi(argv[++i]); if (nthreads < 1) nthreads = 1; continue; }
+            fprintf(stderr,"Unknown option: %s\n", argv[i]); die_usage();
+        }
+        if (!in_path) die_usage();
+        FILE *out = open_out(out_path);
+        int rc = verify(in_path, manifest, root, out, nthreads, only, nonly);
+        if (out && out!=stdout) fclose(out);
+        free(only);
+        return rc;
     } else {
         die_usage();
     }
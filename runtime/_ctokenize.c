@@ -0,0 +1,171 @@
+/*
+ * runtime/_ctokenize.c
+ *
+ * CPython binding for libctokenize (../ctokenize.c).
+ *
+ *   kinds, offsets, lengths = _ctokenize.lex(data)
+ *
+ * data is any object exposing a contiguous buffer (bytes, bytearray,
+ * memoryview, mmap, numpy array). It is read in place, never copied, and the
+ * GIL is released while lexing so several Python threads can tokenize at once.
+ * The three results are Column objects that own their memory and export it
+ * through the buffer protocol (formats "B", "Q", "Q"), so numpy.frombuffer()
+ * and memoryview() wrap them without copying. Offsets and lengths are byte
+ * ranges into data; kinds index KIND_NAMES.
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ctokenize.h"
+
+/* ---------- Column: owned 1-D array exported via the buffer protocol ---------- */
+typedef struct {
+    PyObject_HEAD
+    void *data;
+    Py_ssize_t n;
+    Py_ssize_t itemsize;
+    const char *format;
+    Py_ssize_t shape[1], strides[1];
+} Column;
+
+static void column_dealloc(Column *self) {
+    free(self->data);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int column_getbuffer(Column *self, Py_buffer *view, int flags) {
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "Column is read-only");
+        return -1;
+    }
+    self->shape[0] = self->n;
+    self->strides[0] = self->itemsize;
+    view->obj = (PyObject*)self; Py_INCREF(self);
+    view->buf = self->data;
+    view->len = self->n * self->itemsize;
+    view->readonly = 1;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char*)self->format : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static Py_ssize_t column_len(Column *self) { return self->n; }
+
+static PyBufferProcs column_as_buffer = {
+    (getbufferproc)column_getbuffer,
+    NULL,
+};
+
+static PySequenceMethods column_as_sequence = {
+    .sq_length = (lenfunc)column_len,
+};
+
+static PyTypeObject ColumnType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "runtime._ctokenize.Column",
+    .tp_basicsize = sizeof(Column),
+    .tp_dealloc = (destructor)column_dealloc,
+    .tp_as_sequence = &column_as_sequence,
+    .tp_as_buffer = &column_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Read-only token column (buffer protocol).",
+};
+
+static PyObject *column_new(void *data, Py_ssize_t n, Py_ssize_t itemsize, const char *format) {
+    Column *c = PyObject_New(Column, &ColumnType);
+    if (!c) { free(data); return NULL; }
+    c->data = data; c->n = n; c->itemsize = itemsize; c->format = format;
+    return (PyObject*)c;
+}
+
+/* ---------- lex ---------- */
+typedef struct {
+    uint8_t *kinds;
+    uint64_t *offs, *lens;
+    size_t n, cap;
+    int oom;
+} Cols;
+
+/* Runs without the GIL: plain malloc/realloc only. */
+static int cols_push(void *ud, const CtToken *toks, size_t n) {
+    Cols *c = (Cols*)ud;
+    if (c->n + n > c->cap) {
+        size_t cap = c->cap ? c->cap : 4096;
+        while (cap < c->n + n) cap *= 2;
+        uint8_t *k = (uint8_t*)realloc(c->kinds, cap);
+        if (k) c->kinds = k;
+        uint64_t *o = (uint64_t*)realloc(c->offs, cap * sizeof(uint64_t));
+        if (o) c->offs = o;
+        uint64_t *l = (uint64_t*)realloc(c->lens, cap * sizeof(uint64_t));
+        if (l) c->lens = l;
+        if (!k || !o || !l) { c->oom = 1; return 1; }
+        c->cap = cap;
+    }
+    for (size_t i=0;i<n;++i) {
+        c->kinds[c->n] = (uint8_t)toks[i].kind;
+        c->offs[c->n] = toks[i].off;
+        c->lens[c->n] = toks[i].len;
+        c->n++;
+    }
+    return 0;
+}
+
+static PyObject *py_lex(PyObject *self, PyObject *arg) {
+    Py_buffer view;
+    (void)self;
+    if (PyObject_GetBuffer(arg, &view, PyBUF_C_CONTIGUOUS) != 0) return NULL;
+    Cols c = {0};
+    Py_BEGIN_ALLOW_THREADS
+    ct_lex_batch(view.buf, (size_t)view.len, cols_push, &c);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    if (c.oom) {
+        free(c.kinds); free(c.offs); free(c.lens);
+        return PyErr_NoMemory();
+    }
+    /* column_new takes ownership of data, even on failure */
+    PyObject *kinds = column_new(c.kinds, (Py_ssize_t)c.n, 1, "B");
+    if (!kinds) { free(c.offs); free(c.lens); return NULL; }
+    PyObject *offs = column_new(c.offs, (Py_ssize_t)c.n, 8, "Q");
+    if (!offs) { Py_DECREF(kinds); free(c.lens); return NULL; }
+    PyObject *lens = column_new(c.lens, (Py_ssize_t)c.n, 8, "Q");
+    if (!lens) { Py_DECREF(kinds); Py_DECREF(offs); return NULL; }
+    return Py_BuildValue("(NNN)", kinds, offs, lens);
+}
+
+static PyMethodDef methods[] = {
+    {"lex", py_lex, METH_O,
+     "lex(data) -> (kinds, offsets, lengths)\n\n"
+     "Tokenize a bytes-like object without copying it. Returns three Column\n"
+     "buffers (uint8 kinds, uint64 offsets, uint64 lengths)."},
+    {NULL, NULL, 0, NULL},
+};
+
+static struct PyModuleDef module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_ctokenize",
+    .m_doc = "libctokenize binding.",
+    .m_size = -1,
+    .m_methods = methods,
+};
+
+PyMODINIT_FUNC PyInit__ctokenize(void) {
+    if (PyType_Ready(&ColumnType) < 0) return NULL;
+    PyObject *m = PyModule_Create(&module);
+    if (!m) return NULL;
+    PyObject *names = PyTuple_New(CT_NKINDS);
+    if (!names) { Py_DECREF(m); return NULL; }
+    for (int k=0;k<CT_NKINDS;++k) PyTuple_SET_ITEM(names, k, PyUnicode_FromString(ct_kind_name((CtKind)k)));
+    if (PyModule_AddObject(m, "KIND_NAMES", names) < 0) { Py_DECREF(names); Py_DECREF(m); return NULL; }
+    Py_INCREF(&ColumnType);
+    if (PyModule_AddObject(m, "Column", (PyObject*)&ColumnType) < 0) { Py_DECREF(&ColumnType); Py_DECREF(m); return NULL; }
+    return m;
+}
@@ -0,0 +1,13 @@
+from setuptools import Extension, setup
+
+# Project metadata lives in pyproject.toml; this only declares the C extension.
+setup(
+    ext_modules=[
+        Extension(
+            "runtime._ctokenize",
+            sources=["runtime/_ctokenize.c", "ctokenize.c"],
+            include_dirs=["."],
+            depends=["ctokenize.h"],
+        ),
+    ],
+)